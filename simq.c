@@ -4,8 +4,8 @@
    Program:    simq
    \file       simq.c
    
-   \version    V1.0 
-   \date       19.10.15   
+   \version    V1.25
+   \date       17.10.26   
    \brief      A very simple batch queuing program
    
    \copyright  (c) UCL / Dr. Andrew C. R. Martin 2015
@@ -47,34 +47,222 @@
    Revision History:
    =================
 -  V1.0    16.10.15  Original   By: ACRM
+-  V1.1    17.10.26  Runner waits on inotify events rather than
+                     polling the queue directory   By: agent
+-  V1.2    17.10.26  Runs up to -j jobs at once within a -M memory
+                     budget; jobs declare memory with -m   By: agent
+-  V1.3    17.10.26  Job IDs and queue depth kept in a counters file
+                     rather than scanning the directory   By: agent
+-  V1.4    17.10.26  Jobs are submitted without a lock file by writing
+                     a temporary file and linking it into place   
+                     By: agent
+-  V1.5    17.10.26  Jobs are started directly with fork/exec rather
+                     than through su; -L keeps the login shell   
+                     By: agent
+-  V1.6    17.10.26  Runner accepts submissions, status requests and
+                     waits over a Unix domain socket   By: agent
+-  V1.7    17.10.26  Added -b to submit many jobs at once   By: agent
+-  V1.8    17.10.26  Runner publishes a snapshot of the queue which is
+                     used by -i and -l -v   By: agent
+-  V1.9    17.10.26  Added -R to keep the queue in a single memory 
+                     mapped ring file   By: agent
+-  V1.10   17.10.26  Added -P job priorities and -A priority aging. The
+                     runner keeps the waiting jobs in a heap   By: agent
+-  V1.11   17.10.26  Added -C and -c to run each job in its own cgroup
+                     with memory, CPU and I/O limits   By: agent
+-  V1.12   17.10.26  Finished jobs are recorded in an accounting log,
+                     shown by -l -v and summarized by -s   By: agent
+-  V1.13   17.10.26  The runner writes metrics for Prometheus to 
+                     .metrics.prom   By: agent
+-  V1.14   17.10.26  The owner of a queue directory may run a runner 
+                     for their own jobs without root. Added simqbench
+                     and 'make bench'   By: agent
+-  V1.15   17.10.26  Added -H to hold jobs while the host is under 
+                     memory or CPU pressure or heavily loaded   By: agent
+-  V1.16   17.10.26  Added -a to submit a job array: one queue entry 
+                     that runs a task for each index   By: agent
+-  V1.17   17.10.26  Added -S to keep job files in subdirectories, each
+                     holding a range of job IDs   By: agent
+-  V1.18   17.10.26  Added -F to share the job slots fairly between 
+                     users by their recent use   By: agent
+-  V1.19   17.10.26  Added -o to list the jobs as JSON or TSV. -l -v
+                     reads the queue directory once and lists the jobs
+                     in the order they will run   By: agent
+-  V1.20   17.10.26  Keeps a journal of jobs submitted, started and
+                     finished, fsynced in groups (-D). Jobs that were
+                     running when the host or the queue manager died
+                     are not run again   By: agent
+-  V1.21   17.10.26  Each job's output goes to its own log in the queue
+                     directory. Added -f to follow it with -i   By: agent
+-  V1.22   17.10.26  Added -U to suspend running jobs while urgent jobs
+                     run   By: agent
+-  V1.23   17.10.26  Added -t to give a job's run time and -B to 
+                     backfill jobs while the next job waits for memory
+                     By: agent
+-  V1.24   17.10.26  Learns the run times of jobs from their commands 
+                     and owners, and predicts when jobs will start and
+                     finish for -i and -l   By: agent
+-  V1.25   17.10.26  Added -d and -I to give the ID of an identical job
+                     instead of running it again   By: agent
 
 *************************************************************************/
 /* Includes
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <pwd.h>
+#include <grp.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <math.h>
 
 /************************************************************************/
 /* Defines and macros
 */
 #define PROGNAME "simq"
 #define MAXBUFF 240
-#define LOCKFILE ".lock"
-#define JOB_NEWEST 1
-#define JOB_OLDEST 2
+#define COUNTERFILE ".counters"
+#define COUNTERMAGIC 0x73696d71 /* Marks the counters as initialized    */
+#define COUNTERLOCKTRIES 1000 /* Tries (1ms apart) to lock the counters */
+#define TMPPREFIX ".tmp."   /* Job files being written by submitters    */
+#define MAXTMPAGE 3600      /* Age (s) of temporary files to clean up   */
+#define MAXIDTRIES 1000     /* Give up if we can't find a free job ID   */
 #define MSG_INFO    0
 #define MSG_WARNING 1
 #define MSG_ERROR   2
 #define MSG_FATAL   3
 #define DEF_POLLTIME 10
 #define DEF_WAITTIME 60
+#define FALLBACK_FACTOR 6   /* With inotify, rescan every 6*polltime    */
+#define EVENTBUFF (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define RUNSUFFIX ".run"    /* Job files are renamed to this when run   */
+#define BADPREFIX ".bad."   /* Job files that can't be run are moved to
+                               this with their job ID                   */
+#define MAXSLOTS 64         /* Maximum number of concurrent jobs        */
+#define DEF_SLOTS 1
+#define JOBPATH "/usr/local/bin:/usr/bin:/bin"  /* PATH given to jobs   */
+#define MAXJOBARGS 128      /* Max arguments when run without a shell   */
+#define MAXJOBENV 16        /* Max environment variables given to a job */
+#define SOCKETFILE ".socket"
+#define MAXCLIENTS 128      /* Max connections to the runner's socket   */
+#define SOCKBUFF 4096       /* Max length of a request line             */
+#define SOCKTIMEOUT 30      /* Time (s) to wait for a reply             */
+#define MAXSUBMITARGS 256   /* Max program arguments in a SUBMIT request*/
+#define CLIENT_IDLE 0       /* Client states                            */
+#define CLIENT_WAITING 1
+#define CLIENT_RUNNING 2
+#define SNAPFILE ".snapshot"
+#define SNAPTMPFILE ".snapshot.new"
+#define SNAPMAGIC 0x736e6172 /* Changed whenever the layout changes    */
+#define MINSNAPJOBS 1024    /* Initial size of the snapshot (jobs)      */
+#define SNAPRETRIES 1000    /* Attempts to read a consistent snapshot   */
+#define RINGFILE ".queue"
+#define RINGMAGIC 0x72696e67
+#define RINGINITSIZE 1048576 /* Initial size of the ring's data area     */
+#define RINGALIGN 8         /* Records start on this boundary           */
+#define RING_PAD 0          /* Record states                            */
+#define RING_WAITING 1
+#define RING_RUNNING 2
+#define RING_DONE 3
+#define RINGDATA(h) ((char *)(h) + sizeof(RINGHEADER))
+#define JOBHASH(id, size) (((unsigned int)(id) * 2654435761U) &         \
+                           ((unsigned int)(size) - 1))
+#define MAXPRIORITY 100     /* -P may be from -MAXPRIORITY to this      */
+#define DEF_AGETIME 600     /* Wait (s) for a job to gain a priority    */
+#define CGROUPRUNNER "simq-runner" /* The runner's own cgroup           */
+#define CGROUPPREFIX "simq-" /* Runner cgroups made at the cgroup root  */
+#define MAXWEIGHT 10000     /* Maximum cpu.weight and io.weight         */
+#define ACCTFILE ".accounting"
+#define ACCTOLDFILE ".accounting.old"
+#define ACCTMAXSIZE 16777216 /* The log is rotated when it reaches this  */
+#define RECENTJOBS 10       /* Finished jobs listed by -l -v            */
+#define METRICSFILE ".metrics.prom"
+#define METRICSTMPFILE ".metrics.prom.new"
+#define METRICSTIME 15      /* Interval (s) between writing metrics     */
+#define RUNTIMESFILE ".runtimes" /* Learned run times of commands       */
+#define RUNTIMESTMPFILE ".runtimes.new"
+#define MAXMODELS 4096      /* Commands whose run times are kept        */
+#define MAXSHAPE 80         /* Longest normalized command               */
+#define RUNBUCKETS 24       /* Run time histogram buckets (powers of 2s)*/
+#define RUNALPHA 0.2        /* Weight of each new run time              */
+#define RUNLATE 0.9         /* Quantile for when a job should be done   */
+#define ALLUSERS ((uid_t)(-1)) /* Owner of run times for all users      */
+#define MAXSIMTASKS 1000    /* Tasks of a job array predicted one by one*/
+#define MAXWAITTEXT 32      /* Space for FormatWait()                   */
+#define MAXDEDUP 4096       /* Jobs remembered for -d                   */
+#define NBUCKETS 10         /* Histogram buckets, not counting +Inf     */
+#define PSIMEMORY "/proc/pressure/memory"
+#define PSICPU "/proc/pressure/cpu"
+#define PSIWINDOW 2000000   /* PSI trigger window (us)                  */
+#define HOSTCHECKMS 250     /* Least time (ms) between reading the load */
+#define HOLDCHECK 2         /* Re-check (s) while jobs are held         */
+#define TASKSPREFIX ".tasks." /* Progress of a job array's tasks        */
+#define TASKMAGIC 0x7461736b
+#define MAXTASKS 1000000    /* Most tasks in a job array                */
+#define SHARDPREFIX ".jobs." /* Subdirectory of job files (-S)          */
+#define SHARDJOBS 1000      /* Job IDs in each subdirectory             */
+#define SHARDSETTLE 2       /* Age (s) of a subdirectory's time before
+                               the runner trusts it not to change       */
+#define WATCHEVENTS (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO)
+#define FAIRHALFLIFE 3600   /* Half-life (s) of a user's past use (-F)  */
+#define FAIRWINDOW 8        /* Half-lives of the accounting log read    */
+#define FAIRDEFCOST 60      /* Run time (s) assumed for a user's jobs   */
+#define FAIRCHUNK 1024      /* Accounting records read at a time        */
+#define NAMECACHE 64        /* User names remembered by UserName()      */
+#define MAXNAME 64          /* Longest user name kept                   */
+#define LIST_TEXT 0         /* Formats for listing the jobs (-o)        */
+#define LIST_JSON 1
+#define LIST_TSV 2
+#define JOURNALFILE ".journal"
+#define JOURNALTMPFILE ".journal.new"
+#define JOURNALMAGIC 0x6a726e6c
+#define JOURNALALIGN 8      /* Journal records are padded to this       */
+#define JOURNALMAXSIZE 4194304 /* Journal size that triggers a 
+                               checkpoint                               */
+#define DEF_COMMITMS 100    /* Longest wait (ms) to fsync the journal   */
+#define JOURNAL_NONE (-1)   /* -D none: the journal is never fsynced    */
+#define JOURNAL_SUBMITTED 1 /* Types of journal record                  */
+#define JOURNAL_STARTED 2
+#define JOURNAL_FINISHED 3
+#define JOURNAL_REMOVED 4
+#define INTERRUPTEDPREFIX ".interrupted." /* Jobs that were running 
+                               when the queue manager stopped           */
+#define LOGDIR ".logs"      /* Output of each job                       */
+#define DEF_URGENT 50       /* Least priority of an urgent job (-U)     */
+#define DEF_MAXSTOPS 3      /* Times a job may be suspended (-U)        */
+#define DEF_MAXSTOPTIME 3600 /* Total time (s) a job may be suspended   */
+#define OVERRUNGRACE 30     /* Time (s) after SIGTERM that a job which
+                               overran its run time is killed (-B)      */
+#define RINGLOGIN 1         /* Flags of a ring record                   */
+#define RINGESTIMATE 2
+#define RINGDEDUP 4
+#define FOLLOWCHECK 1       /* Re-check (s) that a followed job is still
+                               in the queue                             */
+#define SHELLCHARS "|&;<>()$`\\\"'*?[]#~=%{}!\n" /* Need a shell to run */
+#define STATEDIR ".state"   /* Files that only the runner writes        */
+#define COUNTERTMPFILE ".counters.new" /* Replaces counters the runner
+                               doesn't own (made in STATEDIR)           */
 
 typedef short BOOL;
 #ifndef TRUE
@@ -89,7 +277,7 @@ typedef short BOOL;
       sprintf(car_msg,"Invalid Job file (%d)", jobID);                   \
       Message(PROGNAME, MSG_WARNING, car_msg);                           \
       fclose(fp);                                                        \
-      return;                                                            \
+      return(FALSE);                                                     \
    }
 
 /* From bioplib/macros.h                                                */
@@ -103,35 +291,786 @@ typedef short BOOL;
                      }  }  }  while(0)
 
 
+typedef struct
+{
+   int  jobID,
+        mem;                /* Declared memory need (MB), 0 if none     */
+   BOOL login;              /* Run through su and a login shell         */
+   uid_t uid;               /* Owner when submitted by the runner       */
+   int  priority,           /* Higher runs sooner                       */
+        estimate;           /* Declared run time (s), 0 if none         */
+   time_t queued;           /* When it was submitted                    */
+   int  nTasks,             /* Tasks in a job array (0 if not an array) */
+        first,              /* Index of the first task                  */
+        task;               /* Index of the task being run              */
+   unsigned long dedup;     /* Hash of what the job does (-d), 0 if none*/
+   char pwd[MAXBUFF],
+        cmd[MAXBUFF];
+}  JOBINFO;
+
+typedef struct
+{
+   int    jobID,
+          mem;              /* Memory charged against the budget (MB)   */
+   pid_t  pid;
+   uid_t  uid;              /* Owner                                    */
+   int    offset;           /* Of its record in the ring (-1 if none)   */
+   int    task;             /* Index of a job array's task (-1 if none) */
+   time_t queued,
+          started;
+   struct timespec clock;   /* When it started, for its run time        */
+   int    priority;
+   BOOL   stopped;          /* Suspended for an urgent job (-U)         */
+   int    nStops,           /* Times it has been suspended              */
+          stoppedMem;       /* Charged to the budget while suspended    */
+   time_t stoppedAt;
+   long   stoppedTime;      /* Total time (s) spent suspended before    */
+   int    estimate,         /* Declared run time (s), 0 if none         */
+          overrun;          /* Signal sent when it overran (0 if none)  */
+   time_t overrunAt;
+   unsigned long shape;     /* Its normalized command, for learning its */
+   char   shapeText[MAXSHAPE]; /* run time                              */
+   unsigned long dedup;     /* Hash of what it does (-d), 0 if none     */
+}  RUNNING;
+
+/* A waiting job in the runner's heap                                   */
+typedef struct
+{
+   int    jobID,
+          priority,
+          offset,           /* Of its record in the ring (-1 if none)   */
+          mem,              /* Declared memory and run time, for        */
+          estimate;         /* backfilling (-B)                         */
+   unsigned long shape;     /* Hash of its normalized command           */
+   uid_t  uid;
+   time_t queued;
+   double start;            /* Time queued, or its fair share time (-F) */
+   int    nTasks;           /* Tasks if it is a job array               */
+   BOOL   listed;           /* In the snapshot                          */
+}  WAITING;
+
+typedef struct
+{
+   int    fd,
+          state,            /* CLIENT_IDLE or waiting for a job         */
+          waitJobID,        /* Job the client is waiting for            */
+          lastPosition,     /* Last position sent to the client         */
+          nBuff;
+   uid_t  uid;              /* From SO_PEERCRED                         */
+   char   buffer[SOCKBUFF];
+}  CLIENT;
+
+/* running is the number of tasks running for a job array, which may
+   still be waiting. nTasks and nDone are 0 if the job isn't an array.
+   The predicted times are 0 if they aren't known
+*/
+typedef struct
+{
+   int    jobID;
+   uid_t  uid;
+   int    running,
+          nTasks,
+          nDone,
+          priority;
+   time_t queued,           /* When it was submitted                    */
+          start,            /* Predicted (or actual) start              */
+          finish,           /* Predicted finish                         */
+          finishBy;         /* ...at the RUNLATE quantile               */
+}  SNAPJOB;
+
+/* A job being listed with -l. order is its place in the runner's 
+   snapshot or the ring (-1 if it isn't known) and position its place
+   among the waiting jobs (0 if it is running). pwd and cmd are empty 
+   (and fromFile is FALSE) for jobs in a ring.
+*/
+typedef struct
+{
+   int    jobID,
+          order,
+          position,
+          running,
+          nTasks,
+          nDone,
+          priority;
+   BOOL   started,          /* Running rather than waiting              */
+          fromFile;         /* Read from a job file, so pwd and cmd are
+                               known                                    */
+   uid_t  uid;
+   time_t queued,
+          start,            /* Predicted times from the snapshot (0 if  */
+          finish,           /* not known)                               */
+          finishBy;
+   char   pwd[MAXBUFF],
+          cmd[MAXBUFF];
+}  LISTJOB;
+
+typedef struct
+{
+   uid_t uid;
+   char  name[MAXNAME];
+}  USERNAME;
+
+/* The runner's view of the queue, shared with other processes through a
+   memory mapped file. version is odd while the runner is updating it.
+   Running jobs come first, then waiting jobs in the order they will run.
+*/
+typedef struct
+{
+   int     magic,
+           version,
+           moved,           /* Replaced by a new file - map it again    */
+           capacity,        /* Space for this many jobs                 */
+           nRunning,
+           nWaiting;
+   pid_t   pid;             /* Runner                                   */
+   time_t  newStart;        /* Predicted start of a job submitted now  
+                               (0 if not known)                         */
+   SNAPJOB jobs[1];
+}  SNAPSHOT;
+
+/* The header of the ring file. The data area follows it and holds the
+   records from head to tail, wrapping round at the end. used includes
+   any padding. version is odd while the runner is changing the ring.
+*/
+typedef struct
+{
+   int   magic,
+         version,
+         dataSize,
+         head,
+         tail,
+         used,
+         nWaiting,
+         nRunning;
+}  RINGHEADER;
+
+/* A job in the ring. It is followed by the working directory and the
+   command, each terminated by a '\0', then for a job array the index of
+   its first task and with RINGESTIMATE the job's run time (ints, not 
+   aligned), with RINGDEDUP the hash for -d (an unsigned long, not
+   aligned), and padded to RINGALIGN. nTasks takes what was padding 
+   before queued, so it is 0 in older queues.
+*/
+typedef struct
+{
+   int   size,              /* Of the whole record                      */
+         jobID,
+         state,             /* RING_WAITING etc.                        */
+         mem,
+         flags;             /* RINGLOGIN, RINGESTIMATE, RINGDEDUP       */
+   uid_t uid;
+   int   pwdLen,
+         cmdLen,
+         priority,
+         nTasks;            /* Tasks in a job array (0 if not an array) */
+   time_t queued;
+}  RINGRECORD;
+
+typedef struct
+{
+   RINGHEADER *header;
+   size_t     size;         /* Size of the mapping                      */
+   int        fh;
+   BOOL       compacted;    /* Records have moved                       */
+}  RING;
+
+/* A record in the journal. A JOURNAL_SUBMITTED record is followed by 
+   the working directory and the command, each terminated by a '\0', 
+   and padded to JOURNALALIGN. seq counts up from 1 in each journal, so
+   the records for a job can be put back in order.
+*/
+typedef struct
+{
+   int    magic,
+          size,             /* Of the whole record                      */
+          type,             /* JOURNAL_SUBMITTED etc.                   */
+          seq,
+          jobID,
+          task,             /* Task of a job array (-1 for the job)     */
+          status,           /* Exit status when finished                */
+          mem,
+          login,
+          priority,
+          nTasks,
+          first,
+          estimate;         /* Takes what was padding before queued     */
+   uid_t  uid;
+   time_t queued;
+}  JOURNALRECORD;
+
+/* Settings for running each job in its own cgroup (cgroup v2)         */
+typedef struct
+{
+   BOOL use;                /* Run jobs in cgroups                      */
+   char dir[MAXBUFF],       /* Where job cgroups are made               */
+        memMax[MAXBUFF],    /* memory.max (size, N% of job memory, max) */
+        memHigh[MAXBUFF];   /* memory.high ("" to leave alone)          */
+   int  cpuWeight,          /* cpu.weight (0 to leave alone)            */
+        ioWeight;           /* io.weight (0 to leave alone)             */
+   BOOL memory,             /* Controllers that could be enabled        */
+        cpu,
+        io;
+}  CGROUPS;
+
+/* Limits on the load of the host beyond which jobs are held (-H)      */
+typedef struct
+{
+   BOOL   use,
+          held,             /* Jobs are being held                      */
+          triggered;        /* A PSI trigger has fired                  */
+   double memPressure,      /* Limits on PSI memory and cpu 'some' avg10*/
+          cpuPressure,      /* (%) and the 1 minute load average. 0 for */
+          load;             /* no limit                                 */
+   int    memAvailable,     /* Least MemAvailable (MB), 0 for no limit  */
+          memTrigger,       /* PSI trigger file handles (-1 if none)    */
+          cpuTrigger;
+   double memPressureNow,   /* Last values read                         */
+          cpuPressureNow,
+          loadNow;
+   int    memAvailableNow;
+   struct timespec checked; /* When they were read                      */
+}  HOSTLIMITS;
+
+/* Suspending running jobs so that urgent jobs can run at once (-U)     */
+typedef struct
+{
+   BOOL   use;
+   int    priority,         /* Jobs of at least this priority are urgent*/
+          maxStops,         /* Times a job may be suspended             */
+          maxStopTime;      /* Total time (s) a job may be suspended    */
+}  PREEMPT;
+
+/* The progress of a job array. The progress file (TASKSPREFIX and the
+   job ID) holds a TASKHEADER followed by a bitmap of the finished tasks,
+   so that a restarted runner only runs the tasks that didn't finish.
+*/
+typedef struct
+{
+   int    magic,
+          jobID,
+          first,
+          nTasks,
+          nDone,
+          nFailed;
+   time_t queued;           /* To recognise a file left by an old job   */
+}  TASKHEADER;
+
+typedef struct
+{
+   int    jobID,
+          first,
+          nTasks,
+          next,             /* Next task to start (from 0)              */
+          nDone,
+          nFailed,
+          nRunning,
+          fh;               /* Progress file (-1 if it can't be kept)   */
+   time_t queued;
+   unsigned char *finished; /* Bitmap of finished tasks                 */
+}  TASKARRAY;
+
+/* A user's recent use of the job slots for fair share (-F). usage and
+   jobs decay with a half-life of FAIRHALFLIFE. finish is the fair share
+   time after the user's last waiting job.
+*/
+typedef struct
+{
+   uid_t  uid;
+   double usage,            /* Slot time used (s)                       */
+          jobs,             /* Jobs finished                            */
+          finish;
+   time_t decayed;          /* When usage and jobs were last decayed    */
+}  FAIRUSER;
+
+/* The learned run times of a normalized command (see CommandShape()) 
+   for one owner, or for all owners (ALLUSERS). shape 0 is every job. 
+   Both the mean and the histogram weight each new run time by 
+   RUNALPHA, so they follow changes in the jobs. hist[i] is the share 
+   of run times from 2^i to 2^(i+1) s (from 0 for hist[0]).
+*/
+typedef struct
+{
+   unsigned long shape;
+   uid_t  uid;
+   long   n;                /* Run times seen                           */
+   double mean,             /* Exponentially weighted mean (s)          */
+          hist[RUNBUCKETS];
+   time_t used;             /* When last updated                        */
+   char   text[MAXSHAPE];   /* The normalized command                   */
+}  RUNMODEL;
+
+/* A job submitted with -d, so that the same job submitted again can be
+   given its ID. A job that succeeded is kept (done) until it is the 
+   least recently used of MAXDEDUP jobs.
+*/
+typedef struct
+{
+   unsigned long key;       /* Hash from DedupKey()                     */
+   uid_t  uid;
+   int    jobID;
+   BOOL   done;             /* Finished successfully                    */
+   time_t used;             /* When last submitted or finished          */
+}  DEDUPJOB;
+
+/* A subdirectory of job files (-S) known to the runner. The runner only
+   reads it again when its modification time changes
+*/
+typedef struct
+{
+   int    shard;            /* Its job IDs / SHARDJOBS                  */
+   BOOL   seen,             /* Found by the last scan                   */
+          skipped;          /* Not read by the last scan                */
+   struct timespec mtime;   /* When last read (0 to read it again)      */
+}  SHARD;
+
+/* Reads the job files in the queue directory and in its subdirectories
+   of job files as if they were all in one directory
+*/
+typedef struct
+{
+   DIR    *top,
+          *shard;           /* Subdirectory being read (NULL if none)   */
+   char   *queueDir,
+          dir[MAXBUFF];     /* Directory of the entry last read         */
+}  JOBDIR;
+
+/* A finished job in the accounting log                                 */
+typedef struct
+{
+   int    jobID,
+          status,           /* From wait4()                             */
+          mem;              /* Memory asked for (MB)                    */
+   uid_t  uid;
+   time_t queued,
+          started;
+   long   runMs,            /* Run time (ms)                            */
+          userMs,           /* CPU time (ms)                            */
+          systemMs,
+          maxRSS,           /* Largest resident set (kB)                */
+          inBlocks,         /* Block I/O operations                     */
+          outBlocks;
+}  ACCTRECORD;
+
+/* A latency histogram. count[NBUCKETS] is for values beyond the last
+   bucket in gBuckets[]
+*/
+typedef struct
+{
+   long   count[NBUCKETS+1];
+   double sum;
+}  HISTOGRAM;
+
+/* What the runner has done, for the metrics file                       */
+typedef struct
+{
+   time_t    startTime,
+             nextWrite,     /* When the metrics file is next written    */
+             finishTime[60];/* Second counted in each of finished[]     */
+   long      started,
+             succeeded,
+             failed,
+             suspended,     /* Times jobs were suspended (-U)           */
+             backfilled,    /* Jobs started ahead of their turn (-B)    */
+             overran,       /* Jobs stopped for overrunning (-B)        */
+             deduplicated;  /* Submissions given an existing job (-d)   */
+   int       finished[60];  /* Jobs finished in each of the last 60s    */
+   HISTOGRAM wait,          /* Submission to start                      */
+             run;
+}  METRICS;
+
+/* Totals of finished jobs for -s, overall and for each user            */
+typedef struct
+{
+   uid_t  uid;
+   int    nJobs,
+          nFailed,
+          nOverMem;         /* Used more memory than they were charged  */
+   double wait,             /* Total and longest wait in the queue (s)  */
+          maxWait,
+          run,              /* Total and longest run time (s)           */
+          maxRun,
+          user,             /* Total CPU time (s)                       */
+          system,
+          rss;              /* Total and largest max RSS (MB)           */
+   long   maxRSS,
+          inBlocks,
+          outBlocks;
+}  ACCTSUMMARY;
+
+typedef struct
+{
+   char    *queueDir;
+   int     sleepTime,
+           verbose,
+           nSlots,
+           memBudget,       /* Total memory for running jobs (MB), 0=any*/
+           memUsed,
+           nRunning,
+           watchFd,
+           listenFd,        /* Socket for requests (-1 if none)         */
+           nClients,
+           nWaiting,        /* Jobs in the heap                         */
+           maxWaiting,      /* Space in the heap                        */
+           indexSize,       /* Slots in the index (a power of 2)        */
+           acctFd,          /* Accounting log (-1 if it can't be used)  */
+           logDirFd;        /* LOGDIR (-1 if it can't be used)          */
+   long    acctSize;
+   BOOL    changed;         /* Jobs have started or finished            */
+   SNAPSHOT *snapshot;      /* Published view of the queue (or NULL)    */
+   RING    *ring;           /* Queue file (NULL if job files are used)  */
+   BOOL    newFiles;        /* There may be job files we don't know of  */
+   WAITING *waiting;        /* Heap of waiting jobs, next to run first  */
+   int     *index;          /* Hash of job ID to heap position + 1      */
+   TASKARRAY *arrays;       /* Job arrays with tasks started            */
+   int     nArrays,
+           maxArrays;
+   BOOL    useShards;       /* Make subdirectories for job files (-S)   */
+   SHARD   *shards;         /* Subdirectories, in order                 */
+   int     nShards,
+           maxShards,
+           topShard;        /* Highest subdirectory made or found       */
+   BOOL    fairShare;       /* Share the slots between users (-F)       */
+   double  fairClock;       /* Fair share time of the last job started  */
+   FAIRUSER *users;         /* Recent use by each user (-F)             */
+   int     nUsers,
+           maxUsers;
+   int     journalFd,       /* Journal of changes to the jobs           */
+           commitMs,        /* Longest wait (ms) to fsync it. 0 for 
+                               every record, JOURNAL_NONE for never     */
+           journalSeq,
+           gate[2];         /* Started jobs wait to read from this pipe
+                               until their records are committed        */
+   off_t   journalSize,
+           checkpointSize;  /* Journal size for the next checkpoint     */
+   BOOL    journalDirty;    /* Records written but not fsynced          */
+   struct timespec dirtySince;
+   PREEMPT preempt;
+   int     nStopped;        /* Running jobs that are suspended          */
+   BOOL    backfill;        /* Start later jobs that won't delay the
+                               next job, and stop jobs that overrun (-B)*/
+   RUNMODEL *models;        /* Learned run times, sorted by shape and 
+                               owner                                    */
+   int     nModels,
+           maxModels;
+   BOOL    modelsChanged;   /* Not yet saved                            */
+   time_t  newStart;        /* Predicted start of a job submitted now   */
+   DEDUPJOB *dedups;        /* Jobs submitted with -d, sorted by key    */
+   int     nDedups,
+           maxDedups;
+   CGROUPS cgroups;
+   METRICS metrics;
+   HOSTLIMITS host;
+   RUNNING running[MAXSLOTS];
+   CLIENT  clients[MAXCLIENTS];
+}  RUNNER;
+
+/* The counters file is read and written with pread() and pwrite()
+   while holding an flock() on it (see ChangeCounters())
+*/
+typedef struct
+{
+   int  magic,              /* COUNTERMAGIC once initialized            */
+        seq,                /* Last job ID allocated                    */
+        depth,              /* Number of jobs waiting                   */
+        running;            /* Number of jobs running                   */
+}  COUNTERS;
+
+typedef struct
+{
+   BOOL runDaemon,
+        listJobs,
+        summary,
+        useRing,
+        useShards,
+        fairShare,
+        follow,             /* -f                                       */
+        backfill,           /* -B                                       */
+        dedup;              /* -d                                       */
+   int  progArg,
+        sleepTime,
+        verbose,
+        maxWait,
+        jobInfoID,
+        jobInfoTask,        /* Task given with -i (-1 if none)          */
+        nSlots,
+        memBudget,
+        ageTime,
+        listFormat,         /* LIST_TEXT, LIST_JSON or LIST_TSV (-o)    */
+        commitMs;           /* -D                                       */
+   CGROUPS cgroups;         /* -C and -c                                */
+   HOSTLIMITS host;         /* -H                                       */
+   PREEMPT preempt;         /* -U                                       */
+   char queueDir[MAXBUFF],
+        bulkFile[MAXBUFF],  /* Manifest of jobs to submit ("-"=stdin)   */
+        inputs[MAXBUFF];    /* Input files of the job (-I)              */
+   JOBINFO job;             /* Options for a job being submitted        */
+}  OPTIONS;
+
 /************************************************************************/
 /* Globals
 */
+int gSignalPipe[2] = {-1, -1};  /* Written by the SIGCHLD handler       */
+int gAgeTime       = DEF_AGETIME;  /* Wait (s) to gain a priority level */
+BOOL gFairShare    = FALSE;        /* Order jobs by fair share time     */
+double gBuckets[NBUCKETS] =        /* Upper bounds of histogram buckets */
+   {1, 5, 15, 60, 300, 900, 3600, 14400, 43200, 86400};
 
 /************************************************************************/
 /* Prototypes
 */
-BOOL ParseCmdLine(int argc, char **argv, BOOL *runDaemon, int *progArg, 
-                  int *sleepTime, int *verbose, char *queueDir,
-                  int *maxWait, BOOL *listJobs, int *jobInfoID);
+BOOL ParseCmdLine(int argc, char **argv, OPTIONS *opts);
 int main(int argc, char **argv);
 void MakeDirectory(char *dirname);
 void UsageDie(void);
-int QueueJob(char *queueDir, char *lockFullFile, char **progArgs, 
-             int nProgArgs, int maxWait, int *nJobsWaiting);
-void SpawnJobRunner(char *queueDir, int sleepTime, int verbose);
-BOOL RunNextJob(char *queueDir, int verbose);
-void RunJob(char *queueDir, int jobID, int verbose);
-int FindJobs(char *queueDir, int oldNew, int *jobID);
-int FlockFile(char *filename);
-void FunlockFile(int fh, char *lockFileFull);
-void WriteJobFile(char *queueDir, int jobID, char **progArgs, 
-                  int nProgArgs);
+int QueueJob(char *queueDir, char **progArgs, int nProgArgs, 
+             JOBINFO *job, int *nJobsWaiting);
+int QueueJobs(char *queueDir, char **cmds, int nCmds, JOBINFO *job,
+              int *jobIDs, int *nJobsWaiting);
+BOOL ClaimJobID(char *queueDir, int fh, char *tmpFile, int *jobID,
+                int nPending);
+int ReadManifest(char *bulkFile, char ***cmds);
+void SubmitBulk(char *queueDir, char *bulkFile, JOBINFO *job, 
+                int verbose);
+void SpawnJobRunner(char *queueDir, int sleepTime, int nSlots, 
+                    int memBudget, int verbose, BOOL useRing, 
+                    BOOL useShards, BOOL fairShare, int ageTime, 
+                    int commitMs, CGROUPS *cgroups, HOSTLIMITS *host,
+                    PREEMPT *preempt, BOOL backfill);
+BOOL RunNextJob(RUNNER *runner);
+BOOL RunJob(RUNNER *runner, JOBINFO *job, int mem);
+int WriteJobFile(char *queueDir, char *tmpFile, char **progArgs, 
+                 int nProgArgs, JOBINFO *job);
+BOOL PublishJobFile(char *queueDir, int fh, char *tmpFile, int jobID);
 BOOL FileExists(char *filename);
 BOOL IsRootUser(uid_t *uid, gid_t *gid);
 void Message(char *progname, int level, char *message);
 void ListJobs(char *queueDir, int verbose);
 void CountdownJob(char *queueDir, int jobInfoID, int sleepTime);
-char *GetOwner(char *queueDir, int thisJobID);
+int WatchQueue(char *queueDir, int verbose);
+BOOL WaitForJobs(RUNNER *runner);
+BOOL IsJobFileName(char *name);
+BOOL IsRunningFileName(char *name);
+BOOL ReadJobFile(char *queueDir, int jobID, JOBINFO *job);
+BOOL ReadJobStream(FILE *fp, JOBINFO *job);
+BOOL ParseMemory(char *string, int *mb);
+void ReapJobs(RUNNER *runner);
+void RequeueRunningJobs(char *queueDir);
+void HandleSigchld(int signum);
+int OpenCounters(char *queueDir);
+BOOL LockCounters(int fh);
+BOOL ReadCounters(char *queueDir, COUNTERS *counters);
+BOOL ChangeCounters(char *queueDir, int dSeq, int dDepth, int dRunning,
+                    COUNTERS *counters);
+void CountJobs(char *queueDir, COUNTERS *counters);
+void UpdateCounters(char *queueDir, int dDepth, int dRunning);
+void CheckCounters(char *queueDir, int verbose);
+void RemoveStaleTempFiles(char *queueDir);
+void ExecJob(char *queueDir, JOBINFO *job, struct passwd *pwd);
+void ExecSearchPath(char *file, char **argv, char **envp);
+BOOL MakeSocketAddress(char *queueDir, struct sockaddr_un *addr);
+int OpenServerSocket(char *queueDir, int verbose);
+int ConnectDaemon(char *queueDir);
+void AcceptClient(RUNNER *runner);
+BOOL ReadClient(RUNNER *runner, int clientNum);
+BOOL HandleRequest(RUNNER *runner, CLIENT *client, char *request);
+BOOL SendToClient(CLIENT *client, char *reply);
+void DropClient(RUNNER *runner, int clientNum);
+void NotifyWaiters(RUNNER *runner);
+BOOL TellWaiter(RUNNER *runner, CLIENT *client);
+void NotifyJobDone(RUNNER *runner, int jobID, int status);
+int ListJobFiles(char *queueDir, int **jobIDs);
+int CompareInts(const void *a, const void *b);
+void EscapeString(char *in, char *out, int outSize);
+void UnescapeString(char *string);
+BOOL ReadReply(int sock, char *reply, int size, int timeout);
+BOOL SendRequest(int sock, char *request, char *reply);
+BOOL SubmitViaDaemon(char *queueDir, char **progArgs, int nProgArgs,
+                     JOBINFO *job, int *jobID, int *nJobsWaiting);
+BOOL CountdownViaDaemon(char *queueDir, int jobInfoID);
+void PublishQueue(RUNNER *runner);
+SNAPSHOT *CreateSnapshot(char *queueDir, int capacity);
+void UpdateSnapshot(RUNNER *runner);
+size_t SnapshotSize(int capacity);
+SNAPSHOT *MapSnapshot(char *queueDir, size_t *size);
+BOOL RunnerAlive(SNAPSHOT *snapshot);
+int CopySnapshot(SNAPSHOT *snapshot, SNAPJOB **jobs, int *nRunning,
+                 int *version);
+BOOL CountdownFromSnapshot(char *queueDir, int jobInfoID, 
+                           int sleepTime);
+BOOL ListJobsFromSnapshot(char *queueDir);
+BOOL IsRingQueue(char *queueDir);
+BOOL RingStep(char *data, int dataSize, int *offset, int *remaining,
+              RINGRECORD **record);
+RING *OpenRing(char *queueDir);
+void RingBeginWrite(RINGHEADER *header);
+void RingEndWrite(RINGHEADER *header);
+BOOL GrowRing(RING *ring, int needed);
+int RingAppend(RING *ring, JOBINFO *job);
+RINGRECORD *RingFindJob(RING *ring, int jobID, int offset);
+void RingRecordJob(RINGRECORD *rec, JOBINFO *job);
+BOOL RingSetState(RING *ring, int jobID, int offset, int state);
+int CopyRingJobs(RINGHEADER *header, int dataSize, SNAPJOB **jobs, 
+                 int *nRunning);
+int ReadRing(char *queueDir, SNAPJOB **jobs, int *nRunning);
+int RingQueueJob(RUNNER *runner, char **progArgs, int nProgArgs, 
+                 JOBINFO *job, int *nJobsWaiting);
+void ImportJobFiles(RUNNER *runner);
+BOOL RunsBefore(WAITING *a, WAITING *b);
+int CompareWaiting(const void *a, const void *b);
+int IndexSlot(RUNNER *runner, int jobID);
+BOOL BuildIndex(RUNNER *runner, int indexSize);
+void SwapWaiting(RUNNER *runner, int a, int b);
+void SiftWaiting(RUNNER *runner, int pos);
+BOOL AddWaiting(RUNNER *runner, JOBINFO *job, int offset);
+int FindWaiting(RUNNER *runner, int jobID);
+void RemoveWaiting(RUNNER *runner, int jobID);
+int WaitingPosition(RUNNER *runner, int jobID);
+BOOL AddJobFile(RUNNER *runner, int jobID);
+void ScanJobFiles(RUNNER *runner);
+void LoadRingJobs(RUNNER *runner);
+BOOL ParseCgroupSettings(char *settings, CGROUPS *cgroups);
+BOOL CgroupMemory(char *spec, int jobMem, char *value);
+BOOL SetupCgroups(CGROUPS *cgroups, int verbose);
+BOOL FindCgroupMount(char *mount);
+BOOL EnableControllers(CGROUPS *cgroups, char *dir);
+BOOL WriteCgroupFile(char *dir, char *file, char *value);
+BOOL ReadCgroupValue(char *dir, char *file, char *key, long *value);
+void RemoveStaleCgroups(char *dir, BOOL jobs);
+int CreateJobCgroup(RUNNER *runner, int jobID, int task, int mem);
+void RemoveJobCgroup(RUNNER *runner, int jobID, int task);
+int OpenAccounting(char *queueDir, long *size);
+void RecordJob(RUNNER *runner, RUNNING *job, int status, 
+               struct rusage *usage);
+void ListRecentJobs(char *queueDir, int nJobs);
+void SummarizeJobs(char *queueDir);
+void PrintStatus(int status);
+void AddToSummary(ACCTSUMMARY *summary, ACCTRECORD *rec);
+long RunTime(RUNNING *job);
+long MsSince(struct timespec *when);
+void ObserveHistogram(HISTOGRAM *histogram, double value);
+void CountFinishedJob(RUNNER *runner, RUNNING *job, int status);
+void WriteMetrics(RUNNER *runner);
+void WriteHistogram(FILE *fp, char *name, char *help, char *label,
+                    HISTOGRAM *histogram);
+BOOL ParseHostLimits(char *limits, HOSTLIMITS *host);
+void SetupHostLimits(HOSTLIMITS *host, int verbose);
+int OpenPressureTrigger(char *file, double percent);
+BOOL HostBusy(RUNNER *runner, int jobMem);
+BOOL ReadPressure(char *file, double *avg10);
+BOOL ReadMemAvailable(int *mb);
+BOOL ParseTaskRange(char *range, JOBINFO *job);
+TASKARRAY *StartArray(RUNNER *runner, JOBINFO *job);
+TASKARRAY *FindArray(RUNNER *runner, int jobID);
+int NextTask(TASKARRAY *array, int task);
+void SaveArray(TASKARRAY *array, int task);
+BOOL FinishTask(RUNNER *runner, RUNNING *job, int status);
+void EndArray(RUNNER *runner, int jobID, BOOL finished);
+int TasksDone(char *queueDir, int jobID);
+void PrintJob(SNAPJOB *job, char *username);
+void ShardDir(char *queueDir, int shard, char *dir);
+BOOL IsShardName(char *name, int *shard);
+BOOL ShardJobFile(char *queueDir, int jobID, char *jobFile);
+BOOL FindJobFile(char *queueDir, int jobID, char *suffix, char *jobFile);
+BOOL OpenJobDir(char *queueDir, JOBDIR *jobDir);
+struct dirent *ReadJobDir(JOBDIR *jobDir);
+void CloseJobDir(JOBDIR *jobDir);
+BOOL AddJobID(int **jobIDs, int *nJobs, int *maxJobs, int jobID);
+int CompareShards(const void *a, const void *b);
+SHARD *FindShard(RUNNER *runner, int shard);
+SHARD *AddShard(RUNNER *runner, int shard);
+BOOL ReadShard(RUNNER *runner, SHARD *shard, int **jobIDs, int *nJobs,
+               int *maxJobs);
+void MakeShards(RUNNER *runner, int jobID);
+void RemoveShard(RUNNER *runner, int jobID);
+FAIRUSER *FindUser(FAIRUSER **users, int *nUsers, int *maxUsers, 
+                   uid_t uid);
+void DecayUsage(FAIRUSER *user, time_t now);
+double UserCost(FAIRUSER *user);
+double SlotTime(long runMs, long cpuMs);
+void ReadUsage(char *queueDir, FAIRUSER **users, int *nUsers, 
+               int *maxUsers);
+double FairStart(RUNNER *runner, JOBINFO *job);
+void FairStarted(RUNNER *runner, int jobID, double start);
+void ChargeUser(RUNNER *runner, RUNNING *job, struct rusage *usage);
+void ListUsage(char *queueDir);
+char *UserName(uid_t uid);
+int JobDirFd(JOBDIR *jobDir);
+int ReadJobList(char *queueDir, LISTJOB **jobs, int *nRunning);
+BOOL AddListJob(LISTJOB **jobs, int *nJobs, int *maxJobs, int jobID);
+int CompareListJobIDs(const void *a, const void *b);
+int CompareListJobs(const void *a, const void *b);
+void ListJobDetails(char *queueDir, int format);
+void PrintEscaped(char *string, int format);
+BOOL ParseDurability(char *string, int *commitMs);
+int OpenJournal(char *queueDir, char *name);
+void JournalJob(RUNNER *runner, int type, int jobID, int task, 
+                int status, JOBINFO *job);
+void CommitJournal(RUNNER *runner);
+void CheckpointJournal(RUNNER *runner);
+void ReleaseStartedJobs(RUNNER *runner);
+int ReadJournal(char *queueDir, char **buffer, 
+                JOURNALRECORD ***records);
+int CompareJournalRecords(const void *a, const void *b);
+void ReplayJournal(char *queueDir, int verbose);
+BOOL RestoreJob(char *queueDir, RING *ring, JOURNALRECORD *rec);
+void KeepInterruptedJob(char *queueDir, int jobID, char *jobFile, 
+                        JOBINFO *job);
+void MarkTaskDone(char *queueDir, int jobID, int task, BOOL failed);
+void SyncQueue(char *queueDir);
+void JobLogName(char *queueDir, int jobID, int task, char *logFile);
+int OpenJobLog(RUNNER *runner, JOBINFO *job, int task);
+BOOL JobInQueue(char *queueDir, int jobID);
+void FollowJobOutput(char *queueDir, int jobID, int task);
+BOOL ParsePreempt(char *settings, PREEMPT *preempt);
+BOOL SuspendForJob(RUNNER *runner, JOBINFO *job, int mem);
+void ResumeJobs(RUNNER *runner);
+time_t ResumeDeadline(RUNNER *runner);
+int JobResidentMB(pid_t pgrp);
+BOOL ParseDuration(char *string, int *seconds);
+BOOL BackfillJob(RUNNER *runner, int headMem);
+time_t ReservedStart(RUNNER *runner, int headMem, int *extraMem, 
+                     int *extraSlots);
+long TimeRunning(RUNNING *slot, time_t now);
+unsigned long CommandShape(char *cmd, char *text);
+int CompareModels(const void *a, const void *b);
+RUNMODEL *FindModel(RUNNER *runner, unsigned long shape, uid_t uid, 
+                    char *text);
+void LearnRunTime(RUNNER *runner, RUNNING *job, int status);
+void UpdateModel(RUNMODEL *model, double run, time_t now);
+double ModelQuantile(RUNMODEL *model, double q);
+double PredictRunTime(RUNNER *runner, unsigned long shape, uid_t uid, 
+                      int estimate, double *late);
+void PredictSnapshot(RUNNER *runner, SNAPSHOT *snapshot, 
+                     WAITING *waiting, int nJobs);
+void ReplaceEarliest(double *heap, int n, double when);
+int CompareTimes(const void *a, const void *b);
+void SaveRunTimes(RUNNER *runner);
+void LoadRunTimes(RUNNER *runner);
+long ExpectedStart(RUNNER *runner);
+long ExpectedWait(char *queueDir);
+void FormatClock(time_t when, char *buffer);
+void FormatWait(long seconds, char *buffer);
+void StopOverrunJobs(RUNNER *runner);
+time_t OverrunDeadline(RUNNER *runner);
+unsigned long HashString(unsigned long hash, char *string);
+BOOL DedupKey(JOBINFO *job, char **progArgs, int nProgArgs, 
+              char *inputs);
+int CompareDedups(const void *a, const void *b);
+DEDUPJOB *FindDedup(RUNNER *runner, unsigned long key, uid_t uid, 
+                    BOOL add);
+int SameJob(RUNNER *runner, JOBINFO *job);
+void RememberJob(RUNNER *runner, JOBINFO *job);
+void DedupFinished(RUNNER *runner, RUNNING *job, BOOL succeeded);
+void DropDedup(RUNNER *runner, DEDUPJOB *dedup);
+void StateFile(char *queueDir, char *name, char *file);
+void TasksFile(char *queueDir, int jobID, char *tasksFile);
+BOOL OwnDirectory(char *dir, mode_t mode);
+void MakeStateDir(char *queueDir);
+void OwnCounters(char *queueDir);
+BOOL CanRunJob(uid_t uid);
+BOOL QueueOwner(char *queueDir, uid_t uid);
+int  OpenLogDir(char *queueDir);
+void DropJob(RUNNER *runner, int jobID);
 
 
 
@@ -142,46 +1081,148 @@ char *GetOwner(char *queueDir, int thisJobID);
    Main program
 
    - 16.10.15   Original   By: ACRM
+   - 17.10.26   Options now held in an OPTIONS structure. Added -j, -M
+                and -m   By: agent
+   - 17.10.26   Runner checks the queue counters when it starts  By: agent
+   - 17.10.26   No longer uses a lock file   By: agent
+   - 17.10.26   Added -L   By: agent
+   - 17.10.26   Submits and waits through the runner's socket when it
+                is available   By: agent
+   - 17.10.26   Added -b   By: agent
+   - 17.10.26   -i uses the runner's snapshot of the queue   By: agent
+   - 17.10.26   Added -R   By: agent
+   - 17.10.26   Added -P and -A   By: agent
+   - 17.10.26   Added -C and -c   By: agent
+   - 17.10.26   Added -s. -l -v lists recently finished jobs   By: agent
+   - 17.10.26   The owner of the queue directory may use -run without
+                being root   By: agent
+   - 17.10.26   Added -H   By: agent
+   - 17.10.26   Added -a   By: agent
+   - 17.10.26   Added -S   By: agent
+   - 17.10.26   Added -F. -l -v lists each user's share   By: agent
+   - 17.10.26   Added -o   By: agent
+   - 17.10.26   Added -D. The runner replays the journal before 
+                requeueing running jobs   By: agent
+   - 17.10.26   Added -f   By: agent
+   - 17.10.26   Added -U   By: agent
+   - 17.10.26   Added -t and -B   By: agent
+   - 17.10.26   Gives the expected wait for a new job   By: agent
+   - 17.10.26   Added -d and -I   By: agent
+   - 17.10.26   The runner makes its state directory and takes over
+                the counters file before starting   By: agent
 */
 int main(int argc, char **argv)
 {
-   BOOL  runDaemon = FALSE, 
-         listJobs  = FALSE;
-   int   progArg   = (-1),
-         verbose   = 0,
-         jobInfoID = 0,
-         sleepTime = DEF_POLLTIME,
-         maxWait   = DEF_WAITTIME;
-   char  queueDir[MAXBUFF];
-   uid_t uid;
-   gid_t gid;
+   OPTIONS     opts;
+   uid_t       uid;
+   gid_t       gid;
+   struct stat statBuf;
+
+   opts.runDaemon = FALSE;
+   opts.listJobs  = FALSE;
+   opts.summary   = FALSE;
+   opts.useRing   = FALSE;
+   opts.useShards = FALSE;
+   opts.fairShare = FALSE;
+   opts.follow    = FALSE;
+   opts.backfill  = FALSE;
+   opts.dedup     = FALSE;
+   opts.progArg   = (-1);
+   opts.verbose   = 0;
+   opts.jobInfoID = 0;
+   opts.jobInfoTask = (-1);
+   opts.sleepTime = DEF_POLLTIME;
+   opts.maxWait   = DEF_WAITTIME;
+   opts.nSlots    = DEF_SLOTS;
+   opts.memBudget = 0;
+   opts.ageTime   = DEF_AGETIME;
+   opts.listFormat = LIST_TEXT;
+   opts.commitMs   = DEF_COMMITMS;
+   opts.job.mem   = 0;
+   opts.job.login = FALSE;
+   opts.job.uid   = getuid();
+   opts.job.priority = 0;
+   opts.job.estimate = 0;
+   opts.job.queued   = 0;
+   opts.job.nTasks   = 0;
+   opts.job.first    = 0;
+   opts.job.task     = 0;
+   opts.job.dedup    = 0;
+   opts.cgroups.use  = FALSE;
+   opts.cgroups.dir[0]     = '\0';
+   opts.cgroups.memHigh[0] = '\0';
+   opts.cgroups.cpuWeight  = 0;
+   opts.cgroups.ioWeight   = 0;
+   strcpy(opts.cgroups.memMax, "100%");
+   memset(&(opts.host), 0, sizeof(HOSTLIMITS));
+   opts.preempt.use         = FALSE;
+   opts.preempt.priority    = DEF_URGENT;
+   opts.preempt.maxStops    = DEF_MAXSTOPS;
+   opts.preempt.maxStopTime = DEF_MAXSTOPTIME;
+   opts.bulkFile[0] = '\0';
+   opts.inputs[0]   = '\0';
     
-   if(ParseCmdLine(argc, argv, &runDaemon, &progArg, &sleepTime, 
-                   &verbose, queueDir, &maxWait, &listJobs,
-                   &jobInfoID))
+   if(ParseCmdLine(argc, argv, &opts))
    {
-      char lockFullFile[MAXBUFF];
+      MakeDirectory(opts.queueDir);
       
-      sprintf(lockFullFile, "%s/%s", queueDir, LOCKFILE);
-      MakeDirectory(queueDir);
-      
-      if(runDaemon)
+      if(opts.runDaemon)
       {
-         if(!IsRootUser(&uid, &gid))
+         /* Without root, only the owner's own jobs can be run         */
+         if(!IsRootUser(&uid, &gid) &&
+            ((stat(opts.queueDir, &statBuf) != 0) || 
+             (statBuf.st_uid != uid)))
          {
             Message(PROGNAME, MSG_FATAL, 
-                    "With -run, the program must be run as root.");
+                    "With -run, the program must be run as root or by \
+the owner of the queue directory.");
+         }
+         MakeStateDir(opts.queueDir);
+         OwnCounters(opts.queueDir);
+         RemoveStaleTempFiles(opts.queueDir);
+         ReplayJournal(opts.queueDir, opts.verbose);
+         RequeueRunningJobs(opts.queueDir);
+         CheckCounters(opts.queueDir, opts.verbose);
+         SpawnJobRunner(opts.queueDir, opts.sleepTime, opts.nSlots,
+                        opts.memBudget, opts.verbose, opts.useRing,
+                        opts.useShards, opts.fairShare, opts.ageTime,
+                        opts.commitMs, &(opts.cgroups), &(opts.host),
+                        &(opts.preempt), opts.backfill);
+      }
+      else if (opts.listJobs)
+      {
+         if(opts.listFormat != LIST_TEXT)
+         {
+            ListJobDetails(opts.queueDir, opts.listFormat);
+         }
+         else
+         {
+            ListJobs(opts.queueDir, opts.verbose);
+            if(opts.verbose)
+            {
+               ListUsage(opts.queueDir);
+               ListRecentJobs(opts.queueDir, RECENTJOBS);
+            }
          }
-         unlink(lockFullFile);
-         SpawnJobRunner(queueDir, sleepTime, verbose);
       }
-      else if (listJobs)
+      else if(opts.summary)
       {
-         ListJobs(queueDir, verbose);
+         SummarizeJobs(opts.queueDir);
       }
-      else if(jobInfoID)
+      else if(opts.jobInfoID)
       {
-         CountdownJob(queueDir, jobInfoID, sleepTime);
+         if(!CountdownFromSnapshot(opts.queueDir, opts.jobInfoID,
+                                   opts.sleepTime) &&
+            !CountdownViaDaemon(opts.queueDir, opts.jobInfoID))
+         {
+            CountdownJob(opts.queueDir, opts.jobInfoID, opts.sleepTime);
+         }
+         if(opts.follow)
+         {
+            fflush(stdout);
+            FollowJobOutput(opts.queueDir, opts.jobInfoID, 
+                            opts.jobInfoTask);
+         }
       }
       else
       {
@@ -195,15 +1236,58 @@ int main(int argc, char **argv)
                     "Jobs may not be submitted by root");
          }
          
-         jobID = QueueJob(queueDir, lockFullFile, argv+progArg, 
-                          argc-progArg, maxWait, &nJobs);
+         if(getcwd(opts.job.pwd, MAXBUFF) == NULL)
+         {
+            Message(PROGNAME, MSG_FATAL, 
+                    "Unable to find the current directory");
+         }
+         TERMINATE(opts.job.pwd);
+
+         if(opts.bulkFile[0])
+         {
+            SubmitBulk(opts.queueDir, opts.bulkFile, &(opts.job), 
+                       opts.verbose);
+            return(0);
+         }
+
+         if(opts.dedup && 
+            !DedupKey(&(opts.job), argv+opts.progArg, 
+                      argc-opts.progArg, opts.inputs))
+         {
+            Message(PROGNAME, MSG_FATAL, "Job was not submitted");
+         }
+
+         /* Hand the job to the runner if it is listening; otherwise
+            write the job file ourselves
+         */
+         if(!SubmitViaDaemon(opts.queueDir, argv+opts.progArg, 
+                             argc-opts.progArg, &(opts.job), &jobID,
+                             &nJobs))
+         {
+            jobID = QueueJob(opts.queueDir, argv+opts.progArg, 
+                             argc-opts.progArg, &(opts.job), &nJobs);
+         }
+         if(jobID < 0)
+         {
+            Message(PROGNAME, MSG_FATAL, "Job was not submitted");
+         }
          sprintf(msg, "Submitted job id: %d", jobID);
          Message(PROGNAME, MSG_INFO, msg);
 
-         if(verbose)
+         if(opts.verbose)
          {
+            long wait;
+            
             sprintf(msg, "There are now %d jobs in the queue", nJobs);
             Message(PROGNAME, MSG_INFO, msg);
+            if((wait = ExpectedWait(opts.queueDir)) >= 0)
+            {
+               char waitText[MAXWAITTEXT];
+               FormatWait(wait, waitText);
+               sprintf(msg, "Expected wait for a new job: %s", 
+                       waitText);
+               Message(PROGNAME, MSG_INFO, msg);
+            }
          }
       }
    }
@@ -215,37 +1299,85 @@ int main(int argc, char **argv)
 }
 
 /************************************************************************/
-/*>BOOL ParseCmdLine(int argc, char **argv, BOOL *runDaemon, int *progArg,
-                     int *sleepTime, int *verbose, char *queueDir, 
-                     int *maxWait, BOOL *listJobs, int *jobInfoID)
-   -----------------------------------------------------------------
+/*>BOOL ParseCmdLine(int argc, char **argv, OPTIONS *opts)
+   --------------------------------------------------------
 *//**
    \param[in]  argc          Argument count
    \param[in]  **argv        Argument array
-   \param[out] *runDaemon    Run mode specified
-   \param[out] *progArg      offset into argv of the program to run
-   \param[out] *sleepTime    how long to wait between polls for jobs
-   \param[out] *verbose      verbose information
-   \param[out] *queueDir     the queue directory
-   \param[out] *maxWait      maximum time to wait when submitting job
-   \param[out] *listJobs     -l List the waiting jobs
-   \param[out] *jobInfoID    -i ID of job to monitor
+   \param[out] *opts         Options structure to fill in:
+                             runDaemon  Run mode specified
+                             progArg    offset into argv of the program 
+                                        to run
+                             sleepTime  how long to wait between polls 
+                                        for jobs
+                             verbose    verbose information
+                             queueDir   the queue directory
+                             maxWait    maximum time to wait when 
+                                        submitting job (no longer used)
+                             listJobs   -l List the waiting jobs
+                             summary    -s Summarize finished jobs
+                             jobInfoID  -i ID of job to monitor
+                             jobInfoTask -i Task of a job array to 
+                                        follow
+                             follow     -f Follow the job's output
+                             nSlots     -j Number of concurrent jobs
+                             memBudget  -M Total memory for jobs (MB)
+                             job.mem    -m Memory needed by job (MB)
+                             job.login  -L Run job with a login shell
+                             bulkFile   -b File of jobs to submit
+                             useRing    -R Keep the queue in a ring file
+                             useShards  -S Keep job files in 
+                                        subdirectories
+                             fairShare  -F Share the slots between users
+                             listFormat -o Format for listing the jobs
+                             job.priority -P Priority of the job
+                             ageTime    -A Wait to gain a priority level
+                             commitMs   -D Durability of the journal
+                             cgroups    -C Run jobs in cgroups; -c 
+                                        settings for them
+                             host       -H Limits on the host's load
+                             preempt    -U Suspending jobs for urgent 
+                                        jobs
+                             job.estimate -t Run time of the job (s)
+                             backfill   -B Backfill jobs
+                             job.nTasks -a Tasks in a job array
+                             job.first  -a Index of the first task
    \returns                  OK
 
    Parses the command line
 
 -  16.10.15  Original   By: ACRM
 -  19.10.15  Added -i
+-  17.10.26  Now fills in an OPTIONS structure. Added -j, -M and -m
+             By: agent
+-  17.10.26  Added -L   By: agent
+-  17.10.26  Added -b   By: agent
+-  17.10.26  Added -R   By: agent
+-  17.10.26  Added -P and -A   By: agent
+-  17.10.26  Added -C and -c   By: agent
+-  17.10.26  Added -s   By: agent
+-  17.10.26  Added -H   By: agent
+-  17.10.26  Added -a   By: agent
+-  17.10.26  Added -S   By: agent
+-  17.10.26  Added -F   By: agent
+-  17.10.26  Added -o   By: agent
+-  17.10.26  Added -D   By: agent
+-  17.10.26  Added -f. -i takes an optional task   By: agent
+-  17.10.26  Added -U   By: agent
+-  17.10.26  Added -t and -B   By: agent
+-  17.10.26  Added -d and -I   By: agent
+-  17.10.26  -I is copied with strncpy() and too long a list is 
+             reported   By: agent
+-  17.10.26  Too long a file name for -b or queue directory is 
+             reported   By: agent
 */
-BOOL ParseCmdLine(int argc, char **argv, BOOL *runDaemon, int *progArg, 
-                  int *sleepTime, int *verbose, char *queueDir, 
-                  int *maxWait, BOOL *listJobs, int *jobInfoID)
+BOOL ParseCmdLine(int argc, char **argv, OPTIONS *opts)
 {
     argc--;
     argv++;
 
-    *progArg    = 1;
-    queueDir[0] = '\0';
+    opts->progArg     = 1;
+    opts->queueDir[0] = '\0';
 
     while(argc && (argv[0][0] == '-'))
     {
@@ -255,46 +1387,213 @@ BOOL ParseCmdLine(int argc, char **argv, BOOL *runDaemon, int *progArg,
            return(FALSE);
            break;
         case 'r':
-           *runDaemon = TRUE;
+           opts->runDaemon = TRUE;
            break;
         case 'l':
-           if(*jobInfoID)
+           if(opts->jobInfoID)
+              return(FALSE);
+           opts->listJobs = TRUE;
+           break;
+        case 's':
+           opts->summary = TRUE;
+           break;
+        case 'o':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc)
+              return(FALSE);
+           if(!strcmp(argv[0], "json"))
+              opts->listFormat = LIST_JSON;
+           else if(!strcmp(argv[0], "tsv"))
+              opts->listFormat = LIST_TSV;
+           else
               return(FALSE);
-           *listJobs = TRUE;
            break;
         case 'p':
            argc--;
            argv++;
-           (*progArg)++;
-           if(!argc || !sscanf(argv[0], "%d", sleepTime))
+           opts->progArg++;
+           if(!argc || !sscanf(argv[0], "%d", &(opts->sleepTime)))
               return(FALSE);
            break;
         case 'i':
-           if(*listJobs)
+           if(opts->listJobs)
               return(FALSE);
            argc--;
            argv++;
-           (*progArg)++;
-           if(!argc || !sscanf(argv[0], "%d", jobInfoID))
+           opts->progArg++;
+           if(!argc || !sscanf(argv[0], "%d", &(opts->jobInfoID)))
+              return(FALSE);
+           if((strchr(argv[0], '.') != NULL) &&
+              ((sscanf(strchr(argv[0], '.')+1, "%d", 
+                       &(opts->jobInfoTask)) != 1) ||
+               (opts->jobInfoTask < 0)))
               return(FALSE);
            break;
+        case 'f':
+           opts->follow = TRUE;
+           break;
         case 'w':
            argc--;
            argv++;
-           (*progArg)++;
-           if(!argc || !sscanf(argv[0], "%d", maxWait))
+           opts->progArg++;
+           if(!argc || !sscanf(argv[0], "%d", &(opts->maxWait)))
+              return(FALSE);
+           break;
+        case 'j':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc || !sscanf(argv[0], "%d", &(opts->nSlots)))
+              return(FALSE);
+           if((opts->nSlots < 1) || (opts->nSlots > MAXSLOTS))
+              return(FALSE);
+           break;
+        case 'M':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc || !ParseMemory(argv[0], &(opts->memBudget)))
+              return(FALSE);
+           break;
+        case 'm':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc || !ParseMemory(argv[0], &(opts->job.mem)))
+              return(FALSE);
+           break;
+        case 't':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc || !ParseDuration(argv[0], &(opts->job.estimate)))
+              return(FALSE);
+           break;
+        case 'B':
+           opts->backfill = TRUE;
+           break;
+        case 'd':
+           opts->dedup = TRUE;
+           break;
+        case 'I':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc)
+              return(FALSE);
+           if(strlen(argv[0]) >= MAXBUFF)
+           {
+              Message(PROGNAME, MSG_ERROR, "Too many input files for -I");
+              return(FALSE);
+           }
+           strncpy(opts->inputs, argv[0], MAXBUFF);
+           opts->inputs[MAXBUFF-1] = '\0';
+           opts->dedup = TRUE;
+           break;
+        case 'L':
+           opts->job.login = TRUE;
+           break;
+        case 'R':
+           opts->useRing = TRUE;
+           break;
+        case 'S':
+           opts->useShards = TRUE;
+           break;
+        case 'F':
+           opts->fairShare = TRUE;
+           break;
+        case 'P':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc || !sscanf(argv[0], "%d", &(opts->job.priority)))
+              return(FALSE);
+           if((opts->job.priority < -MAXPRIORITY) ||
+              (opts->job.priority > MAXPRIORITY))
+              return(FALSE);
+           break;
+        case 'A':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc || !sscanf(argv[0], "%d", &(opts->ageTime)))
               return(FALSE);
+           if(opts->ageTime < 0)
+              return(FALSE);
+           break;
+        case 'D':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc || !ParseDurability(argv[0], &(opts->commitMs)))
+              return(FALSE);
+           break;
+        case 'C':
+           opts->cgroups.use = TRUE;
+           break;
+        case 'c':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc || !ParseCgroupSettings(argv[0], &(opts->cgroups)))
+              return(FALSE);
+           opts->cgroups.use = TRUE;
+           break;
+        case 'H':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc || !ParseHostLimits(argv[0], &(opts->host)))
+              return(FALSE);
+           break;
+        case 'U':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc || !ParsePreempt(argv[0], &(opts->preempt)))
+              return(FALSE);
+           break;
+        case 'a':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc || !ParseTaskRange(argv[0], &(opts->job)))
+              return(FALSE);
+           break;
+        case 'b':
+           argc--;
+           argv++;
+           opts->progArg++;
+           if(!argc)
+              return(FALSE);
+           if(strlen(argv[0]) >= MAXBUFF)
+           {
+              Message(PROGNAME, MSG_ERROR, "Manifest file name is too long");
+              return(FALSE);
+           }
+           strncpy(opts->bulkFile, argv[0], MAXBUFF);
+           opts->bulkFile[MAXBUFF-1] = '\0';
            break;
         case 'v':
-           *verbose = strlen(argv[0]) - 1;
+           opts->verbose = strlen(argv[0]) - 1;
            break;
         }
         argc--;
         argv++;
-        (*progArg)++;
+        opts->progArg++;
     }
     
-    if(*runDaemon || *listJobs || *jobInfoID)
+    if((opts->listFormat != LIST_TEXT) && !opts->listJobs)
+       return(FALSE);
+    if(opts->follow && !opts->jobInfoID)
+       return(FALSE);
+    if(opts->dedup && opts->bulkFile[0])
+       return(FALSE);
+    
+    if(opts->runDaemon || opts->listJobs || opts->summary || 
+       opts->jobInfoID || opts->bulkFile[0])
     {
        if(argc != 1)
           return(FALSE);
@@ -305,12 +1604,18 @@ BOOL ParseCmdLine(int argc, char **argv, BOOL *runDaemon, int *progArg,
           return(FALSE);
     }
 
-    strncpy(queueDir, argv[0], MAXBUFF);
+    if(strlen(argv[0]) >= MAXBUFF)
+    {
+       Message(PROGNAME, MSG_ERROR, "Queue directory name is too long");
+       return(FALSE);
+    }
+    strncpy(opts->queueDir, argv[0], MAXBUFF);
+    opts->queueDir[MAXBUFF-1] = '\0';
     argc--;
     argv++;
-    (*progArg)++;
+    opts->progArg++;
 
-    if(queueDir[0] != '/')
+    if(opts->queueDir[0] != '/')
        return(FALSE);
 
     return(TRUE);
@@ -349,363 +1654,1215 @@ void MakeDirectory(char *dirname)
 
 
 /************************************************************************/
-/*>int QueueJob(char *queueDir, char *lockFullFile, char **progArgs,
-                int nProgArgs, int maxWait, int *nJobsWaiting)
-   -----------------------------------------------------------------
+/*>int QueueJob(char *queueDir, char **progArgs, int nProgArgs, 
+                JOBINFO *job, int *nJobsWaiting)
+   ------------------------------------------------------------
 *//**
    \param[in]  *queueDir      The queue directory
-   \param[in]  *lockFullFile  Full path and name of lock file
    \param[in]  **progArgs     The program name and arguments
    \param[in]  nProgArgs      The size of the arguments array
-   \param[in]  maxWait        Max time to wait to create a job
+   \param[in]  *job           Options for the job (memory etc.)
    \param[out] *nJobsWaiting  Number of jobs in the queue
-   \return                    Job ID for this job
+   \return                    Job ID for this job (-1 on error)
 
    Adds a job to the queue and returns the number of jobs now in the 
-   queue.
+   queue. 
+
+   No lock is needed. The job is written to a private temporary file
+   and the job ID is then claimed by linking that file to its job 
+   number. The link fails if another submitter has already taken the 
+   number, so the runner only ever sees complete job files and each ID
+   is used only once. Job numbers come from the sequence number in the 
+   counters file, which is only locked while it is incremented; if it 
+   has fallen behind the queue directory the counters are rebuilt.
 
 -  16.10.15  Original   By: ACRM
 -  19.10.15  Now returns jobID and outputs number of jobs
+-  17.10.26  Added jobMem   By: agent
+-  17.10.26  Uses the counters file rather than FindJobs()   By: agent
+-  17.10.26  Writes a temporary file and links it into place rather
+             than waiting for and taking a lock file. Removed 
+             lockFullFile and maxWait   By: agent
+-  17.10.26  Job options now passed in a JOBINFO   By: agent
+-  17.10.26  Returns -1 on error rather than exiting, as it is also 
+             used by the runner   By: agent
+-  17.10.26  Uses ClaimJobID()   By: agent
+-  17.10.26  Uses ChangeCounters() rather than mapping the counters
+             By: agent
 */
-int QueueJob(char *queueDir, char *lockFullFile, char **progArgs,
-             int nProgArgs, int maxWait, int *nJobsWaiting)
+int QueueJob(char *queueDir, char **progArgs, int nProgArgs, 
+             JOBINFO *job, int *nJobsWaiting)
 {
-   int jobID     = 1,          /* Default JOBID                         */
-       waitCount = 0,
-       fh,
-       nJobs;
+   int      jobID = 0,
+            fh;
+   char     tmpFile[MAXBUFF];
+   COUNTERS counters;
 
    *nJobsWaiting = 0;
    
-   /* Wait while the lock file is present                               */
-   while(FileExists(lockFullFile))
-   { 
-      if(++waitCount > maxWait)
-      {
-         Message(PROGNAME, MSG_FATAL, 
-                 "Cannot submit job - lockfile is not clearing");
-      }
-      
-      sleep(1);
-   }
+   /* Write the job to a temporary file                                 */
+   if((fh = WriteJobFile(queueDir, tmpFile, progArgs, nProgArgs, 
+                         job)) == (-1))
+      return(-1);
    
-   /* Create lock file                                                  */
-   if((fh = FlockFile(lockFullFile)) == (-1))
+   /* Count the job before it appears so the runner can't take the depth
+      below zero
+   */
+   if(!ChangeCounters(queueDir, 0, 1, 0, &counters))
    {
-      Message(PROGNAME, MSG_FATAL, "Cannot create lock file");
+      Message(PROGNAME, MSG_ERROR, "Cannot open queue counters");
+      jobID = (-1);
    }
-   
-   /* Find the latest job and number of jobs queued                     */
-   nJobs = FindJobs(queueDir, JOB_NEWEST, &jobID);
-   if(nJobs) jobID++;
-   
-   /* Write the job file                                                */
-   WriteJobFile(queueDir, jobID, progArgs, nProgArgs);
-   
-   /* Remove the lock file                                              */
-   FunlockFile(fh, lockFullFile);
+   /* Claim the next free job ID                                        */
+   else if(!ClaimJobID(queueDir, fh, tmpFile, &jobID, 1))
+   {
+      ChangeCounters(queueDir, 0, -1, 0, &counters);
+      jobID = (-1);
+   }
+
+   close(fh);
+   if(tmpFile[0])
+      unlink(tmpFile);
 
-   *nJobsWaiting = nJobs+1;
+   if((jobID > 0) && ReadCounters(queueDir, &counters))
+      *nJobsWaiting = counters.depth + counters.running;
    
    return(jobID);
 }
 
 
 /************************************************************************/
-/*>void SpawnJobRunner(char *queueDir, int sleepTime, int verbose)
-   ---------------------------------------------------------------
+/*>BOOL ClaimJobID(char *queueDir, int fh, char *tmpFile, int *jobID,
+                   int nPending)
+   --------------------------------------------------------------------
 *//**
-   \param[in]  queueDir   The queue directory
-   \param[in]  sleepTime  Time to wait between polling for jobs
-   \param[in]  verbose    Verbosity level
-
-   Sits waiting for jobs and runs them when one appears
-
--  16.10.15  Original   By: ACRM
+   \param[in]     queueDir   The queue directory
+   \param[in]     fh         File handle of the temporary job file
+   \param[in]     tmpFile    Name of the temporary file (blank if none)
+   \param[in,out] jobID      Input: job ID to try first (0 for the next
+                             in sequence). Output: job ID claimed
+   \param[in]     nPending   Number of jobs this submitter has counted 
+                             in the queue depth but not yet published
+   \return                   Was a job ID claimed?
+
+   Publishes a job file under a free job ID. If the ID is taken, the 
+   next in sequence is tried. The first time this happens the sequence
+   number is assumed to have fallen behind the queue and the counters
+   are rebuilt; the rebuilt depth doesn't include jobs that haven't
+   been published yet, so they are counted again.
+
+-  17.10.26  Original - split out of QueueJob()   By: agent
+-  17.10.26  Takes job IDs with ChangeCounters()   By: agent
 */
-void SpawnJobRunner(char *queueDir, int sleepTime, int verbose)
+BOOL ClaimJobID(char *queueDir, int fh, char *tmpFile, int *jobID,
+                int nPending)
 {
-   /*** Ideally this should detach itself in the background ***/
-
-   while(1)
+   COUNTERS counters;
+   int      tries;
+   
+   for(tries=0; tries<MAXIDTRIES; tries++)
    {
-      if(!RunNextJob(queueDir, verbose))
+      if((tries > 0) || (*jobID <= 0))
+      {
+         if(!ChangeCounters(queueDir, 1, 0, 0, &counters))
+         {
+            Message(PROGNAME, MSG_ERROR, "Cannot open queue counters");
+            return(FALSE);
+         }
+         *jobID = counters.seq;
+      }
+
+      if(PublishJobFile(queueDir, fh, tmpFile, *jobID))
+         return(TRUE);
+
+      if(errno != EEXIST)
       {
-         sleep(sleepTime);
+         Message(PROGNAME, MSG_ERROR, "Unable to create job file");
+         return(FALSE);
+      }
+
+      if(tries == 0)
+      {
+         CheckCounters(queueDir, 0);
+         ChangeCounters(queueDir, 0, nPending, 0, &counters);
       }
    }
+
+   Message(PROGNAME, MSG_ERROR, "Unable to find a free job ID");
+   return(FALSE);
 }
 
 
 /************************************************************************/
-/*>BOOL RunNextJob(char *queueDir, int verbose)
-   --------------------------------------------
+/*>int QueueJobs(char *queueDir, char **cmds, int nCmds, JOBINFO *job,
+                 int *jobIDs, int *nJobsWaiting)
+   --------------------------------------------------------------------
 *//**
-   \param[in]  queueDir   The queue directory
-   \param[in]  verbose    Verbosty level
-   \return                Were there any jobs to run?
+   \param[in]  *queueDir      The queue directory
+   \param[in]  **cmds         Command for each job
+   \param[in]  nCmds          Number of jobs
+   \param[in]  *job           Options for the jobs (memory etc.)
+   \param[out] *jobIDs        Job ID for each job (-1 if not queued)
+   \param[out] *nJobsWaiting  Number of jobs in the queue
+   \return                    Number of jobs queued
 
-   Find the next job in the queue and run it
+   Adds a batch of jobs to the queue. As QueueJob(), but a contiguous
+   range of job IDs is taken with a single change to the counters. A 
+   job only gets an ID outside the range if one in the range was 
+   already in use.
 
--  16.10.15  Original   By: ACRM
+-  17.10.26  Original   By: agent
+-  17.10.26  Uses ChangeCounters() rather than mapping the counters
+             By: agent
 */
-BOOL RunNextJob(char *queueDir, int verbose)
+int QueueJobs(char *queueDir, char **cmds, int nCmds, JOBINFO *job,
+              int *jobIDs, int *nJobsWaiting)
 {
-   BOOL retVal = FALSE;
-   int  nJobs,
-        jobID;
+   int      firstID,
+            nQueued = 0,
+            i;
+   COUNTERS counters;
 
-   /* List the directory                                                */
-   nJobs = FindJobs(queueDir, JOB_OLDEST, &jobID);
-
-   if(nJobs)
+   *nJobsWaiting = 0;
+   for(i=0; i<nCmds; i++)
+      jobIDs[i] = (-1);
+   
+   /* Count all the jobs and reserve their IDs                          */
+   if(!ChangeCounters(queueDir, nCmds, nCmds, 0, &counters))
    {
-      /* Run the job                                                    */
-      RunJob(queueDir, jobID, verbose);
-      retVal = TRUE;
+      Message(PROGNAME, MSG_ERROR, "Cannot open queue counters");
+      return(0);
    }
-   else if(verbose >= 2)
+   firstID = counters.seq - nCmds + 1;
+
+   for(i=0; i<nCmds; i++)
    {
-      Message(PROGNAME, MSG_INFO, "No jobs waiting");
+      char tmpFile[MAXBUFF];
+      int  fh,
+           jobID = firstID + i;
+
+      if(((fh = WriteJobFile(queueDir, tmpFile, cmds+i, 1, job)) >= 0) &&
+         ClaimJobID(queueDir, fh, tmpFile, &jobID, nCmds-i))
+      {
+         jobIDs[i] = jobID;
+         nQueued++;
+      }
+      else
+      {
+         ChangeCounters(queueDir, 0, -1, 0, &counters);
+      }
+      
+      if(fh >= 0)
+      {
+         close(fh);
+         if(tmpFile[0])
+            unlink(tmpFile);
+      }
    }
-   return(retVal);
+
+   if(ReadCounters(queueDir, &counters))
+      *nJobsWaiting = counters.depth + counters.running;
+   
+   return(nQueued);
 }
 
 
 /************************************************************************/
-/*>void RunJob(char *queueDir, int jobID, int verbose)
-   ---------------------------------------------------
+/*>int ReadManifest(char *bulkFile, char ***cmds)
+   ----------------------------------------------
 *//**
-   \param[in]  queueDir   Queue directory
-   \param[in]  jobID      Job number
-   \param[in]  verbose    Verbosity level
+   \param[in]   bulkFile    File of commands ("-" for standard input)
+   \param[out]  cmds        Array of commands (malloc'd)
+   \return                  Number of commands
 
-   Actually runs a job
+   Reads a file with one job command per line. Blank lines and lines
+   starting with # are skipped. Exits on error.
 
--  16.10.15  Original   By: ACRM
--  19.10.15  Now uses GetOwner()
+-  17.10.26  Original   By: agent
 */
-void RunJob(char *queueDir, int jobID, int verbose)
+int ReadManifest(char *bulkFile, char ***cmds)
 {
-   char jobFile[MAXBUFF],
-        pwd[MAXBUFF],
-        job[MAXBUFF],
-        exe[MAXBUFF],
-        cmd[MAXBUFF];
    FILE *fp;
-   
-
-   sprintf(jobFile, "%s/%d", queueDir, jobID);
+   char buffer[MAXBUFF],
+        msg[MAXBUFF+32];
+   int  nCmds   = 0,
+        maxCmds = 0,
+        lineNum = 0;
 
-   if(verbose)
+   *cmds = NULL;
+   
+   if(!strcmp(bulkFile, "-"))
    {
-      char msg[MAXBUFF];
-      sprintf(msg, "Running job %d", jobID);
-      Message(PROGNAME, MSG_INFO, msg);
+      fp = stdin;
+   }
+   else if((fp = fopen(bulkFile, "r")) == NULL)
+   {
+      sprintf(msg, "Unable to read %s", bulkFile);
+      Message(PROGNAME, MSG_FATAL, msg);
    }
 
-   if((fp=fopen(jobFile, "r"))!=NULL)
+   while(fgets(buffer, MAXBUFF, fp))
    {
-      char *username;
+      char *cmd;
       
-      /* Find the owner of the job file                                 */
-      username = GetOwner(queueDir, jobID);
-      
-      /* Get the working directory for running the job                  */
-      if(!fgets(pwd, MAXBUFF, fp))
-         CLOSE_AND_RETURN(fp, jobID);
-      TERMINATE(pwd);
-
-      /* Get the job itself                                             */
-      if(!fgets(job, MAXBUFF, fp))
-         CLOSE_AND_RETURN(fp, jobID);
-      TERMINATE(job);
-
-      fclose(fp);
+      lineNum++;
+      if(strchr(buffer, '\n') == NULL && !feof(fp))
+      {
+         sprintf(msg, "Line %d of %s is too long", lineNum, bulkFile);
+         Message(PROGNAME, MSG_FATAL, msg);
+      }
+      TERMINATE(buffer);
 
-      /* Run the job as the requested user                              */
-      sprintf(cmd, "(cd %s; %s)", pwd, job);
-      sprintf(exe, "su - %s -c \"%s\"", username, cmd);
+      for(cmd = buffer; isspace((unsigned char)*cmd); cmd++);
+      if((*cmd == '\0') || (*cmd == '#'))
+         continue;
 
-      if(verbose >= 2)
+      if(nCmds == maxCmds)
       {
-         char msg[MAXBUFF];
-         sprintf(msg, "Command is: %s", cmd);         
-         Message(PROGNAME, MSG_INFO, msg);
+         maxCmds = (maxCmds ? 2 * maxCmds : 64);
+         if((*cmds = (char **)realloc(*cmds, 
+                                      maxCmds * sizeof(char *))) == NULL)
+         {
+            Message(PROGNAME, MSG_FATAL, "No memory for job list");
+         }
       }
-      
-      if(verbose >= 3)
+      if(((*cmds)[nCmds++] = strdup(cmd)) == NULL)
       {
-         char msg[MAXBUFF];
-         sprintf(msg, "Expanded command is: %s", exe);         
-         Message(PROGNAME, MSG_INFO, msg);
+         Message(PROGNAME, MSG_FATAL, "No memory for job list");
       }
-      
-      system(exe);
-
-      /* Remove the job from the queue                                  */
-      unlink(jobFile);
    }
+
+   if(fp != stdin)
+      fclose(fp);
+
+   return(nCmds);
 }
 
 
 /************************************************************************/
-/*>int FindJobs(char *queueDir, int oldNew, int *jobID)
-   ----------------------------------------------------
+/*>void SubmitBulk(char *queueDir, char *bulkFile, JOBINFO *job, 
+                   int verbose)
+   -------------------------------------------------------------
 *//**
-   \param[in]  queueDir   Queue directory
-   \param[in]  oldNew     Are we looking for the oldest or newest job
-   \param[in]  *jobID     Job number of the job we found (-1 if no jobs)
-   \return                Number of queued jobs
+   \param[in]   queueDir    The queue directory
+   \param[in]   bulkFile    File of commands ("-" for standard input)
+   \param[in]   job         Options for the jobs
+   \param[in]   verbose     Verbosity level
 
-   Finds the oldest or newest job in the queue. Sets the job ID for that
-   job and also returns the number of jobs in the queue.
+   Submits a job for each line of a file and prints their job IDs.
+   The job files are written directly rather than through the runner.
+   Exits with an error if any job couldn't be queued.
 
--  16.10.15  Original   By: ACRM
+-  17.10.26  Original   By: agent
 */
-int FindJobs(char *queueDir, int oldNew, int *jobID)
+void SubmitBulk(char *queueDir, char *bulkFile, JOBINFO *job, 
+                int verbose)
 {
-   struct dirent *dirp;
-   DIR           *dp;
-   int           thisJobID,
-                 nJobs       = 0,
-                 newestJobID = (-1),
-                 oldestJobID = (-1);
+   char **cmds,
+        msg[MAXBUFF];
+   int  *jobIDs,
+        nCmds,
+        nQueued,
+        nJobs,
+        i;
+   
+   if((nCmds = ReadManifest(bulkFile, &cmds)) == 0)
+   {
+      Message(PROGNAME, MSG_WARNING, "No jobs to submit");
+      return;
+   }
+
+   if((jobIDs = (int *)malloc(nCmds * sizeof(int))) == NULL)
+   {
+      Message(PROGNAME, MSG_FATAL, "No memory for job list");
+   }
 
+   nQueued = QueueJobs(queueDir, cmds, nCmds, job, jobIDs, &nJobs);
 
-   if((dp=opendir(queueDir)) == NULL)
+   for(i=0; i<nCmds; i++)
    {
-      char msg[MAXBUFF];
-      sprintf(msg, "Can't read directory: %s", queueDir);
+      if(jobIDs[i] >= 0)
+      {
+         sprintf(msg, "Submitted job id: %d", jobIDs[i]);
+         Message(PROGNAME, MSG_INFO, msg);
+      }
+      free(cmds[i]);
+   }
+   free(cmds);
+   free(jobIDs);
+
+   if(verbose)
+   {
+      sprintf(msg, "There are now %d jobs in the queue", nJobs);
+      Message(PROGNAME, MSG_INFO, msg);
+   }
+
+   if(nQueued < nCmds)
+   {
+      sprintf(msg, "%d of %d jobs were not submitted", 
+              nCmds - nQueued, nCmds);
       Message(PROGNAME, MSG_FATAL, msg);
    }
+}
 
-   while((dirp = readdir(dp)) != NULL)
+
+/************************************************************************/
+/*>void SpawnJobRunner(char *queueDir, int sleepTime, int nSlots, 
+                       int memBudget, int verbose, BOOL useRing,
+                       BOOL useShards, BOOL fairShare, int ageTime, 
+                       int commitMs, CGROUPS *cgroups, 
+                       HOSTLIMITS *host, PREEMPT *preempt, 
+                       BOOL backfill)
+   --------------------------------------------------------------
+*//**
+   \param[in]  queueDir   The queue directory
+   \param[in]  sleepTime  Time to wait between polling for jobs
+   \param[in]  nSlots     Number of jobs that may run at once
+   \param[in]  memBudget  Total memory (MB) for running jobs (0=no limit)
+   \param[in]  verbose    Verbosity level
+   \param[in]  useRing    Keep the queue in a ring file. This is also
+                          done if the queue already has one
+   \param[in]  useShards  Make subdirectories for the job files
+   \param[in]  fairShare  Share the job slots fairly between users
+   \param[in]  ageTime    Time (s) a job waits to gain a priority level
+                          (0 = never)
+   \param[in]  commitMs   Longest wait (ms) to fsync the journal (0 for
+                          every record, JOURNAL_NONE for never)
+   \param[in]  cgroups    Settings for running jobs in cgroups
+   \param[in]  host       Limits on the host's load for starting jobs
+   \param[in]  preempt    Settings for suspending jobs for urgent jobs
+   \param[in]  backfill   Backfill jobs while the next job waits for 
+                          memory, and stop jobs that overrun
+
+   Sits waiting for jobs and runs them when one appears
+
+-  16.10.15  Original   By: ACRM
+-  17.10.26  Waits on inotify events for new job files, with a slow
+             fallback poll, rather than sleeping for sleepTime   By: agent
+-  17.10.26  Runs up to nSlots jobs in the background within memBudget
+             and reaps them as they finish   By: agent
+-  17.10.26  Listens for requests on the queue's socket. The RUNNER is
+             now static as it holds the client buffers   By: agent
+-  17.10.26  Publishes a snapshot of the queue whenever it changes
+             By: agent
+-  17.10.26  Added useRing   By: agent
+-  17.10.26  Added ageTime. Keeps the waiting jobs in a heap, which is
+             filled from the ring or the job files   By: agent
+-  17.10.26  Added cgroups   By: agent
+-  17.10.26  Opens the accounting log   By: agent
+-  17.10.26  Writes the metrics file every METRICSTIME seconds
+             By: agent
+-  17.10.26  Added host   By: agent
+-  17.10.26  Added useShards   By: agent
+-  17.10.26  Added fairShare. Each user's recent use is taken from the
+             accounting log   By: agent
+-  17.10.26  Added commitMs. Starts a new journal and commits it before
+             waiting, or once commitMs has passed   By: agent
+-  17.10.26  Makes the directory for the jobs' output   By: agent
+-  17.10.26  Added preempt. Resumes suspended jobs before starting 
+             others   By: agent
+-  17.10.26  Added backfill   By: agent
+-  17.10.26  Loads the learned run times   By: agent
+-  17.10.26  The log directory is checked by OpenLogDir()   By: agent
+*/
+void SpawnJobRunner(char *queueDir, int sleepTime, int nSlots, 
+                    int memBudget, int verbose, BOOL useRing, 
+                    BOOL useShards, BOOL fairShare, int ageTime, 
+                    int commitMs, CGROUPS *cgroups, HOSTLIMITS *host,
+                    PREEMPT *preempt, BOOL backfill)
+{
+   static RUNNER    runner;
+   struct sigaction action;
+   
+   /*** Ideally this should detach itself in the background ***/
+
+   runner.queueDir  = queueDir;
+   runner.sleepTime = sleepTime;
+   runner.verbose   = verbose;
+   runner.nSlots    = nSlots;
+   runner.memBudget = memBudget;
+   runner.memUsed   = 0;
+   runner.nRunning  = 0;
+   runner.nClients  = 0;
+   runner.changed   = TRUE;
+   runner.ring      = NULL;
+   runner.newFiles  = TRUE;
+   runner.waiting   = NULL;
+   runner.index     = NULL;
+   runner.nWaiting  = 0;
+   runner.maxWaiting = 0;
+   runner.indexSize = 0;
+   runner.arrays    = NULL;
+   runner.nArrays   = 0;
+   runner.maxArrays = 0;
+   runner.useShards = FALSE;
+   runner.shards    = NULL;
+   runner.nShards   = 0;
+   runner.maxShards = 0;
+   runner.topShard  = (-1);
+   runner.fairShare = fairShare;
+   runner.fairClock = (double)time(NULL);
+   runner.users     = NULL;
+   runner.nUsers    = 0;
+   runner.maxUsers  = 0;
+   gAgeTime         = ageTime;
+   gFairShare       = fairShare;
+   if(fairShare)
+      ReadUsage(queueDir, &(runner.users), &(runner.nUsers), 
+                &(runner.maxUsers));
+   runner.cgroups   = *cgroups;
+   runner.preempt   = *preempt;
+   runner.nStopped  = 0;
+   runner.backfill  = backfill;
+   runner.models    = NULL;
+   runner.nModels   = 0;
+   runner.maxModels = 0;
+   runner.modelsChanged = FALSE;
+   runner.newStart  = 0;
+   runner.dedups    = NULL;
+   runner.nDedups   = 0;
+   runner.maxDedups = 0;
+   LoadRunTimes(&runner);
+   runner.acctFd    = OpenAccounting(queueDir, &(runner.acctSize));
+   runner.commitMs  = commitMs;
+   runner.journalSeq   = 0;
+   runner.journalSize  = 0;
+   runner.checkpointSize = JOURNALMAXSIZE;
+   runner.journalDirty = FALSE;
+   runner.gate[0]   = runner.gate[1] = (-1);
+
+   runner.logDirFd  = OpenLogDir(queueDir);
+
+   /* ReplayJournal() has dealt with everything in the old journal     */
+   if((runner.journalFd = OpenJournal(queueDir, JOURNALFILE)) < 0)
+   {
+      Message(PROGNAME, MSG_WARNING, "Cannot write the journal - jobs \
+running if the host fails will be run again");
+   }
+   memset(&(runner.metrics), 0, sizeof(METRICS));
+   runner.metrics.startTime = time(NULL);
+   runner.host      = *host;
+   runner.host.memTrigger = runner.host.cpuTrigger = (-1);
+   if(runner.host.use)
+      SetupHostLimits(&(runner.host), verbose);
+
+   /* Without cgroups the jobs still run, just without their limits    */
+   if(runner.cgroups.use && !SetupCgroups(&(runner.cgroups), verbose))
+   {
+      Message(PROGNAME, MSG_WARNING, 
+              "Cannot set up cgroups - jobs will run without resource \
+limits");
+      runner.cgroups.use = FALSE;
+   }
+
+   /* Finished jobs are signalled through a pipe so that they wake the
+      runner in the same way as a new job
+   */
+   if(pipe2(gSignalPipe, O_NONBLOCK | O_CLOEXEC) != 0)
+   {
+      Message(PROGNAME, MSG_FATAL, "Cannot create signal pipe");
+   }
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = HandleSigchld;
+   action.sa_flags   = SA_RESTART | SA_NOCLDSTOP;
+   sigemptyset(&action.sa_mask);
+   sigaction(SIGCHLD, &action, NULL);
+
+   /* A client going away must not kill the runner                      */
+   signal(SIGPIPE, SIG_IGN);
+
+   runner.watchFd  = WatchQueue(queueDir, verbose);
+   runner.listenFd = OpenServerSocket(queueDir, verbose);
+   runner.snapshot = CreateSnapshot(queueDir, MINSNAPJOBS);
+
+   if(useRing || IsRingQueue(queueDir))
    {
-      /* Ignore files starting with a .                                 */
-      if(dirp->d_name[0] != '.')
+      if((runner.ring = OpenRing(queueDir)) == NULL)
       {
-         /* Check it's a number                                         */
-         if(sscanf(dirp->d_name, "%d", &thisJobID))
-         {
-            /* Initialize                                               */
-            if(newestJobID == (-1))   newestJobID = thisJobID;
-            if(oldestJobID == (-1))   oldestJobID = thisJobID;
+         Message(PROGNAME, MSG_FATAL, "Cannot open the queue file");
+      }
+      if(verbose >= 2)
+      {
+         Message(PROGNAME, MSG_INFO, "Using the queue file");
+      }
 
-            /* Update                                                   */
-            if(thisJobID > newestJobID) newestJobID = thisJobID;
-            if(thisJobID < oldestJobID) oldestJobID = thisJobID;
+      /* Opening the ring requeues its running jobs                     */
+      CheckCounters(queueDir, verbose);
+      LoadRingJobs(&runner);
 
-            nJobs++;
-         }
+      if(useShards)
+      {
+         Message(PROGNAME, MSG_WARNING, 
+                 "-S is not used with a queue file");
       }
    }
-   
-   closedir(dp);
+   else if(useShards)
+   {
+      COUNTERS counters;
 
-   if(nJobs)
+      /* Make the subdirectories for the next job IDs                   */
+      runner.useShards = TRUE;
+      if(ReadCounters(queueDir, &counters))
+      {
+         runner.topShard = counters.seq / SHARDJOBS - 1;
+         MakeShards(&runner, counters.seq);
+      }
+   }
+
+   while(1)
    {
-      if(oldNew == JOB_NEWEST)
+      ReapJobs(&runner);
+      if(runner.newFiles)
       {
-         *jobID = newestJobID;
+         if(runner.ring)
+            ImportJobFiles(&runner);
+         else
+            ScanJobFiles(&runner);
       }
-      else
+      if(runner.ring && runner.ring->compacted)
+      {
+         LoadRingJobs(&runner);
+      }
+      if(runner.changed)
+      {
+         PublishQueue(&runner);
+      }
+      if(time(NULL) >= runner.metrics.nextWrite)
+      {
+         WriteMetrics(&runner);
+      }
+      if(runner.journalDirty &&
+         (MsSince(&(runner.dirtySince)) >= runner.commitMs))
+      {
+         CommitJournal(&runner);
+      }
+      if(runner.nStopped)
+      {
+         ResumeJobs(&runner);
+      }
+      if(runner.backfill)
+      {
+         StopOverrunJobs(&runner);
+      }
+      if(!RunNextJob(&runner))
       {
-         *jobID = oldestJobID;
+         CommitJournal(&runner);
+         WaitForJobs(&runner);
       }
    }
-
-   return(nJobs);
 }
 
 
 /************************************************************************/
-/*>int FlockFile(char *filename)
-   -----------------------------
+/*>BOOL RunNextJob(RUNNER *runner)
+   -------------------------------
 *//**
-   \param[in]  *filename   File name
-   \return                 File handle
+   \param[in,out] runner   The job runner
+   \return                 Was a job started?
+
+   Find the next job in the queue and start it if there is a free slot
+   and enough of the memory budget to run it. The job at the top of the
+   heap must always run first, so if it does not fit nothing is 
+   started.
 
-   Creates a lock file
+   A job that has not declared its memory needs is assumed to need the
+   whole budget, as is one that asks for more than the budget, so it 
+   runs on its own. With -H, nothing is started while the host is too
+   busy.
+
+   A job array stays at the top of the heap until all its tasks have 
+   been started, each being run as the next task when it comes to the 
+   top. Its tasks are only expanded as they are started.
+
+   With -B, while the job at the top waits for memory, a later job may
+   be started instead if it won't delay it (see BackfillJob()).
 
 -  16.10.15  Original   By: ACRM
+-  17.10.26  Takes a RUNNER. Checks slots and memory budget   By: agent
+-  17.10.26  Checks the counters when the queue is empty   By: agent
+-  17.10.26  Takes the job from the ring if there is one   By: agent
+-  17.10.26  Takes the job from the top of the heap rather than
+             listing the queue   By: agent
+-  17.10.26  Holds the job while the host is busy   By: agent
+-  17.10.26  Runs the next task of a job array   By: agent
+-  17.10.26  Job files may be in subdirectories   By: agent
+-  17.10.26  Moves the fair share clock on   By: agent
+-  17.10.26  Records jobs that are dropped in the journal   By: agent
+-  17.10.26  With -U, suspends a running job for an urgent one
+             By: agent
+-  17.10.26  With -B, backfills while the job waits for memory
+             By: agent
+-  17.10.26  Goes on to the next job if RunJob() dropped one   By: agent
 */
-int FlockFile(char *filename)
+BOOL RunNextJob(RUNNER *runner)
 {
-   int fh = 0;
-   
+   JOBINFO   job;
+   TASKARRAY *array;
+   int       jobID,
+             mem;
+   double    start;
+   BOOL      needSlot;
+
+   /* With -U, an urgent job may still run by suspending another        */
+   if((needSlot = (runner->nRunning - runner->nStopped >= 
+                   runner->nSlots)) &&
+      (!runner->preempt.use || (runner->nRunning >= MAXSLOTS)))
+      return(FALSE);
+
+   /* Drop any jobs that have been removed by hand                      */
+   while(runner->nWaiting)
+   {
+      WAITING *next = &(runner->waiting[0]);
+      
+      jobID = next->jobID;
+      if(runner->ring)
+      {
+         RINGRECORD *rec;
+         
+         if(((rec = RingFindJob(runner->ring, jobID, next->offset)) 
+             != NULL) && (rec->state == RING_WAITING))
+         {
+            RingRecordJob(rec, &job);
+            break;
+         }
+      }
+      else if(ReadJobFile(runner->queueDir, jobID, &job))
+      {
+         break;
+      }
+      
+      JournalJob(runner, JOURNAL_REMOVED, jobID, -1, 0, NULL);
+      RemoveWaiting(runner, jobID);
+      EndArray(runner, jobID, FALSE);
+      runner->changed = TRUE;
+   }
 
-   if((fh = open(filename, O_WRONLY|O_CREAT|O_APPEND))!=(-1))
+   if(!runner->nWaiting)
    {
-      if(flock(fh, LOCK_EX) == (0))
+      COUNTERS counters;
+      
+      if(runner->verbose >= 2)
+      {
+         Message(PROGNAME, MSG_INFO, "No jobs waiting");
+      }
+
+      /* Make sure the counters agree that the queue is empty           */
+      if(ReadCounters(runner->queueDir, &counters) && 
+         (counters.depth != 0))
       {
-         return(fh);
+         CheckCounters(runner->queueDir, runner->verbose);
       }
+      return(FALSE);
    }
-   Message(PROGNAME, MSG_FATAL, "Cannot create lock file");
-   return(-1);
+
+   if(job.nTasks)
+   {
+      if((array = StartArray(runner, &job)) == NULL)
+         return(FALSE);
+
+      /* A restarted runner may find that every task had finished       */
+      if(array->next >= array->nTasks)
+      {
+         if(runner->ring)
+            RingSetState(runner->ring, jobID, runner->waiting[0].offset,
+                         RING_DONE);
+         else
+         {
+            char jobFile[MAXBUFF];
+            FindJobFile(runner->queueDir, jobID, "", jobFile);
+            unlink(jobFile);
+            RemoveShard(runner, jobID);
+         }
+         JournalJob(runner, JOURNAL_FINISHED, jobID, -1, 0, NULL);
+         RemoveWaiting(runner, jobID);
+         UpdateCounters(runner->queueDir, -1, 0);
+         EndArray(runner, jobID, TRUE);
+         runner->changed = TRUE;
+         return(TRUE);
+      }
+      job.task = array->first + array->next;
+   }
+
+   /* Work out how much of the memory budget the job will use           */
+   mem = job.mem;
+   if(runner->memBudget && ((mem == 0) || (mem > runner->memBudget)))
+   {
+      mem = runner->memBudget;
+   }
+
+   if(needSlot &&
+      ((job.priority < runner->preempt.priority) ||
+       (runner->host.use && HostBusy(runner, job.mem)) ||
+       !SuspendForJob(runner, &job, mem)))
+      return(FALSE);
+   
+   if(runner->memBudget && (runner->memUsed + mem > runner->memBudget))
+   {
+      if(runner->verbose >= 2)
+      {
+         char msg[MAXBUFF];
+         sprintf(msg, "Job %d waiting for memory (%d MB free)",
+                 jobID, runner->memBudget - runner->memUsed);
+         Message(PROGNAME, MSG_INFO, msg);
+      }
+      return(runner->backfill && !needSlot && !runner->nStopped &&
+             BackfillJob(runner, mem));
+   }
+
+   if(runner->host.use && HostBusy(runner, job.mem))
+      return(FALSE);
+
+   /* Run the job                                                       */
+   start = runner->waiting[0].start;
+   if(!RunJob(runner, &job, mem))
+   {
+      /* If the job was dropped, the next one can be tried at once      */
+      return(FindWaiting(runner, jobID) < 0);
+   }
+   if(runner->fairShare)
+      FairStarted(runner, jobID, start);
+   return(TRUE);
 }
 
 
 /************************************************************************/
-/*>void FunlockFile(int fh, char *lockFileFull)
-   --------------------------------------------
+/*>BOOL RunJob(RUNNER *runner, JOBINFO *job, int mem)
+   --------------------------------------------------
 *//**
-   \param[in]  fh              File handle of lock file
-   \param[in]  *lockFileFull   Full path to lock file
+   \param[in,out] runner   The job runner
+   \param[in]     job      The job to run
+   \param[in]     mem      Memory (MB) to charge against the budget
+   \return                 Was the job started?
+
+   Actually runs a job. The job file is renamed with RUNSUFFIX to show
+   that it is running and the job is started in the background. It is
+   removed by ReapJobs() when it finishes. Once started, it is taken 
+   out of the heap of waiting jobs.
 
-   Closes and deletes a lock file
+   Normally the job is started directly by ExecJob(). Jobs submitted 
+   with -L are run as before through su and the user's login shell.
+
+   For a job array, job->task is the task to run. The job is only 
+   marked as running and taken out of the heap when its last task is
+   started.
+
+   A job whose owner is unknown or which can't be marked as running 
+   would fail in the same way every time, so it is taken out of the
+   queue by DropJob() rather than blocking the jobs behind it.
 
 -  16.10.15  Original   By: ACRM
+-  19.10.15  Now uses GetOwner()
+-  17.10.26  Runs the job in a child process rather than waiting for
+             it. Takes the job information from ReadJobFile()   By: agent
+-  17.10.26  Updates the queue counters   By: agent
+-  17.10.26  Uses ExecJob() unless the job asked for a login shell
+             By: agent
+-  17.10.26  Flags the change so that waiting clients are told
+             By: agent
+-  17.10.26  Jobs in the ring are marked as running there and their
+             owner is taken from the ring   By: agent
+-  17.10.26  Removes the job from the heap   By: agent
+-  17.10.26  Puts the job in its own cgroup   By: agent
+-  17.10.26  Records when the job was queued and started   By: agent
+-  17.10.26  Counts the job and its wait for the metrics   By: agent
+-  17.10.26  Runs a task of a job array   By: agent
+-  17.10.26  Job files may be in subdirectories   By: agent
+-  17.10.26  Takes the owner from the job information   By: agent
+-  17.10.26  Records the start in the journal. With group commit the 
+             job waits until the record has been committed   By: agent
+-  17.10.26  The job's output goes to its log   By: agent
+-  17.10.26  Jobs run with -L are also in their own process group
+             By: agent
+-  17.10.26  Keeps the shape of the command   By: agent
+-  17.10.26  Keeps the hash for -d   By: agent
+-  17.10.26  The command for -L is only built for jobs run with -L, 
+             and is not cut short. su is run directly rather than 
+             through a shell run as root   By: agent
+-  17.10.26  Restores SIGPIPE for the job   By: agent
+-  17.10.26  Drops a job that can't be run   By: agent
 */
-void FunlockFile(int fh, char *lockFileFull)
+BOOL RunJob(RUNNER *runner, JOBINFO *job, int mem)
 {
-    close(fh);
-    unlink(lockFileFull);
+   char    jobFile[MAXBUFF],
+           runFile[MAXBUFF],
+           cmd[MAXBUFF],
+           *username;
+   pid_t   pid;
+   RUNNING *slot;
+   int     offset = (-1),
+           pos,
+           cgroupFd = (-1),
+           logFd,
+           task     = (-1),
+           len      = 0;
+   struct passwd *pwd;
+   TASKARRAY *array   = NULL;
+   BOOL    lastTask   = TRUE;
+   
+   FindJobFile(runner->queueDir, job->jobID, "", jobFile);
+   snprintf(runFile, MAXBUFF, "%s%s", jobFile, RUNSUFFIX);
+
+   if(job->nTasks && 
+      ((array = FindArray(runner, job->jobID)) != NULL))
+   {
+      task     = job->task;
+      lastTask = (NextTask(array, task - array->first + 1) >= 
+                  array->nTasks);
+   }
+
+   if(runner->verbose)
+   {
+      char msg[MAXBUFF];
+      if(task >= 0)
+         sprintf(msg, "Running job %d task %d", job->jobID, task);
+      else
+         sprintf(msg, "Running job %d", job->jobID);
+      Message(PROGNAME, MSG_INFO, msg);
+   }
+
+   /* Find the owner of the job                                         */
+   if((pwd = getpwuid(job->uid)) == NULL)
+   {
+      char msg[MAXBUFF];
+      sprintf(msg, "Unknown owner for job %d", job->jobID);
+      Message(PROGNAME, MSG_WARNING, msg);
+      DropJob(runner, job->jobID);
+      return(FALSE);
+   }
+   username = pwd->pw_name;
+      
+   /* With -L, su runs the command in the user's login shell          */
+   if(job->login)
+   {
+      if(task >= 0)
+         len = snprintf(cmd, MAXBUFF, 
+                  "(cd %s; SIMQ_TASK_ID=%d; export SIMQ_TASK_ID; %s)", 
+                  job->pwd, task, job->cmd);
+      else
+         len = snprintf(cmd, MAXBUFF, "(cd %s; %s)", job->pwd, job->cmd);
+      if((len < 0) || (len >= MAXBUFF))
+      {
+         char msg[MAXBUFF];
+         sprintf(msg, "Command of job %d is too long to run with -L", 
+                 job->jobID);
+         Message(PROGNAME, MSG_WARNING, msg);
+      }
+   }
+
+   if(runner->verbose >= 2)
+   {
+      char msg[MAXBUFF];
+      snprintf(msg, MAXBUFF, "Command is: %s", job->cmd);
+      Message(PROGNAME, MSG_INFO, msg);
+   }
+      
+   if((runner->verbose >= 3) && job->login)
+   {
+      char msg[MAXBUFF];
+      snprintf(msg, MAXBUFF, "Expanded command is: su - %s -c %s", 
+               username, cmd);
+      Message(PROGNAME, MSG_INFO, msg);
+   }
+
+   /* Mark the job as running. A job array is left waiting until its
+      last task starts
+   */
+   if((pos = FindWaiting(runner, job->jobID)) >= 0)
+      offset = runner->waiting[pos].offset;
+   if(lastTask &&
+      (runner->ring ? !RingSetState(runner->ring, job->jobID, offset,
+                                    RING_RUNNING)
+                    : (rename(jobFile, runFile) != 0)))
+   {
+      char msg[MAXBUFF];
+      sprintf(msg, "Cannot mark job %d as running", job->jobID);
+      Message(PROGNAME, MSG_WARNING, msg);
+      DropJob(runner, job->jobID);
+      return(FALSE);
+   }
+
+   /* The child moves itself into the cgroup so that everything it 
+      starts is limited
+   */
+   if(runner->cgroups.use)
+      cgroupFd = CreateJobCgroup(runner, job->jobID, task, mem);
+
+   /* The job writes its output straight to its log                  */
+   logFd = OpenJobLog(runner, job, task);
+
+   /* Record the start before the job can do anything. With group 
+      commit, the job waits on the gate until the record is on disk
+   */
+   JournalJob(runner, JOURNAL_STARTED, job->jobID, task, 0, job);
+   if(runner->journalDirty && (runner->gate[0] < 0) &&
+      (pipe2(runner->gate, O_CLOEXEC) != 0))
+   {
+      runner->gate[0] = runner->gate[1] = (-1);
+      CommitJournal(runner);
+   }
+
+   if((pid = fork()) == 0)
+   {
+      /* The runner ignores SIGPIPE, but the job must not inherit that  */
+      signal(SIGPIPE, SIG_DFL);
+      if(runner->gate[0] >= 0)
+      {
+         char ch;
+         
+         close(runner->gate[1]);
+         while((read(runner->gate[0], &ch, 1) < 0) && (errno == EINTR))
+            continue;
+         close(runner->gate[0]);
+      }
+      if((cgroupFd >= 0) && (write(cgroupFd, "0", 1) < 0))
+      {
+         /* Run it anyway, unlimited                                    */
+      }
+      if(logFd >= 0)
+      {
+         dup2(logFd, 1);
+         dup2(logFd, 2);
+      }
+      if(job->login)
+      {
+         /* su is run directly so that no shell runs the command as root.
+            A command that didn't fit fails rather than being cut short
+         */
+         if((len < 0) || (len >= MAXBUFF))
+            _exit(126);
+         setsid();
+         execl("/bin/su", "su", "-", username, "-c", cmd, (char *)NULL);
+         _exit(127);
+      }
+      ExecJob(runner->queueDir, job, pwd);
+   }
+
+   if(logFd >= 0)
+      close(logFd);
+   if(pid < 0)
+   {
+      Message(PROGNAME, MSG_WARNING, "Unable to start job - fork failed");
+      if(cgroupFd >= 0)
+      {
+         close(cgroupFd);
+         RemoveJobCgroup(runner, job->jobID, task);
+      }
+      JournalJob(runner, JOURNAL_SUBMITTED, job->jobID, task, 0, job);
+      if(!lastTask)
+         return(FALSE);
+      if(runner->ring)
+         RingSetState(runner->ring, job->jobID, offset, RING_WAITING);
+      else
+         rename(runFile, jobFile);
+      return(FALSE);
+   }
+
+   slot          = &(runner->running[runner->nRunning++]);
+   slot->jobID   = job->jobID;
+   slot->mem     = mem;
+   slot->pid     = pid;
+   slot->uid     = pwd->pw_uid;
+   slot->offset  = offset;
+   slot->task    = task;
+   slot->queued  = job->queued;
+   slot->started = time(NULL);
+   slot->priority    = job->priority;
+   slot->stopped     = FALSE;
+   slot->nStops      = 0;
+   slot->stoppedTime = 0;
+   slot->estimate    = job->estimate;
+   slot->overrun     = 0;
+   slot->shape       = CommandShape(job->cmd, slot->shapeText);
+   slot->dedup       = job->dedup;
+   clock_gettime(CLOCK_MONOTONIC, &(slot->clock));
+   runner->metrics.started++;
+   ObserveHistogram(&(runner->metrics.wait), (job->queued ? 
+                    difftime(slot->started, job->queued) : 0.0));
+   runner->memUsed += mem;
+   runner->changed  = TRUE;
+   if(cgroupFd >= 0)
+      close(cgroupFd);
+
+   if(array != NULL)
+   {
+      array->next = NextTask(array, task - array->first + 1);
+      array->nRunning++;
+   }
+   if(lastTask)
+   {
+      RemoveWaiting(runner, job->jobID);
+      UpdateCounters(runner->queueDir, -1, 1);
+   }
+   
+   return(TRUE);
 }
 
+
 /************************************************************************/
-/*>void WriteJobFile(char *queueDir, int pid, char **progArgs, 
-                     int nProgArgs)
-   -----------------------------------------------------------
+/*>int WriteJobFile(char *queueDir, char *tmpFile, char **progArgs, 
+                    int nProgArgs, JOBINFO *job)
+   ----------------------------------------------------------------
 *//**
    \param[in]  *queueDir    queue directory
-   \param[in]  pid          job number
+   \param[out] *tmpFile     Name of the temporary file (blank if it
+                            has no name)
    \param[in]  **progArgs   Program and arguments in an array
    \param[in]  nProgArgs    Number of items in progArgs
+   \param[in]  *job         Options for the job (memory etc.)
+   \return                  File handle of the temporary job file
+                            (-1 on error)
+
+   Creates a job file. The first line is the working directory and the
+   second is the command. Any following lines are keyword/value pairs
+   giving optional information about the job.
 
-   Creates a job file
+   The file is written as a temporary file which is not seen by the 
+   runner until PublishJobFile() links it into place. Where possible
+   this is an unnamed O_TMPFILE; otherwise it is a file in the queue 
+   directory starting with TMPPREFIX. If the file is written by the
+   runner on behalf of a user, it is given to that user.
 
 -  16.10.15  Original   By: ACRM
+-  17.10.26  Added jobMem   By: agent
+-  17.10.26  Writes a temporary file rather than the job file itself
+             By: agent
+-  17.10.26  Job options now passed in a JOBINFO. Writes login option
+             By: agent
+-  17.10.26  Working directory and owner taken from the JOBINFO. 
+             Returns -1 on error rather than exiting   By: agent
+-  17.10.26  Writes priority   By: agent
+-  17.10.26  Writes the tasks of a job array   By: agent
+-  17.10.26  Writes the run time   By: agent
+-  17.10.26  Writes the hash for -d   By: agent
 */
-void WriteJobFile(char *queueDir, int pid, char **progArgs, int nProgArgs)
+int WriteJobFile(char *queueDir, char *tmpFile, char **progArgs, 
+                 int nProgArgs, JOBINFO *job)
 {
-   char jobFile[MAXBUFF],
-        pwd[MAXBUFF];
-   FILE *fp;
+   FILE *fp = NULL;
+   int  fh = (-1);
 
+   tmpFile[0] = '\0';
+   
+   /* An unnamed file can only be linked through /proc                  */
+   if(access("/proc/self/fd", X_OK) == 0)
+   {
+      fh = open(queueDir, O_TMPFILE|O_WRONLY|O_CLOEXEC, 0644);
+   }
 
-   sprintf(jobFile, "%s/%d", queueDir, pid);
-   getcwd(pwd, MAXBUFF);
-   TERMINATE(pwd);
-
-   if((fp=fopen(jobFile, "w"))!=NULL)
+   if(fh == (-1))
+   {
+      int i;
+      
+      for(i=0; (fh == (-1)) && (i < MAXIDTRIES); i++)
+      {
+         sprintf(tmpFile, "%s/%s%d.%d", queueDir, TMPPREFIX, 
+                 (int)getpid(), i);
+         fh = open(tmpFile, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+      }
+   }
+   
+   if((fh == (-1)) || 
+      ((job->uid != geteuid()) && (fchown(fh, job->uid, -1) != 0)) ||
+      ((fp=fdopen(dup(fh), "w"))==NULL))
+   {
+      char msg[MAXBUFF];
+      sprintf(msg,"Unable to create job file in %s", queueDir);
+      Message(PROGNAME, MSG_ERROR, msg);
+      if(fh != (-1))
+      {
+         close(fh);
+         if(tmpFile[0])
+            unlink(tmpFile);
+      }
+      return(-1);
+   }
+   else
    {
       int i;
-      fprintf(fp, "%s\n", pwd);
+      fprintf(fp, "%s\n", job->pwd);
       for(i=0; i<nProgArgs; i++)
       {
          fprintf(fp, "%s ", progArgs[i]);
       }
       fprintf(fp, "\n");
-      fclose(fp);
+      if(job->mem)
+         fprintf(fp, "mem %d\n", job->mem);
+      if(job->login)
+         fprintf(fp, "login 1\n");
+      if(job->priority)
+         fprintf(fp, "priority %d\n", job->priority);
+      if(job->nTasks)
+         fprintf(fp, "array %d %d\n", job->first, 
+                 job->first + job->nTasks - 1);
+      if(job->estimate)
+         fprintf(fp, "time %d\n", job->estimate);
+      if(job->dedup)
+         fprintf(fp, "dedup %lx\n", job->dedup);
+      if(fclose(fp) != 0)
+      {
+         Message(PROGNAME, MSG_ERROR, "Unable to write job file");
+         close(fh);
+         if(tmpFile[0])
+            unlink(tmpFile);
+         return(-1);
+      }
+   }
+   
+   return(fh);
+}
+
+
+/************************************************************************/
+/*>BOOL PublishJobFile(char *queueDir, int fh, char *tmpFile, int jobID)
+   ---------------------------------------------------------------------
+*//**
+   \param[in]  *queueDir    queue directory
+   \param[in]  fh           File handle of the temporary job file
+   \param[in]  *tmpFile     Name of the temporary file (blank if it
+                            has no name)
+   \param[in]  jobID        Job number to claim
+   \return                  Was the job ID claimed? If not, errno is
+                            EEXIST if the ID is already taken.
+
+   Atomically makes a completed job file visible in the queue under
+   the given job number. This fails if the job number is in use.
+   The file goes in the subdirectory for its job ID if there is one.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Uses the subdirectory for the job ID   By: agent
+*/
+BOOL PublishJobFile(char *queueDir, int fh, char *tmpFile, int jobID)
+{
+   char jobFile[MAXBUFF],
+        runFile[MAXBUFF];
+   int  status;
+   BOOL inShard;
+   
+   inShard = ShardJobFile(queueDir, jobID, jobFile);
+
+   /* Don't reuse the ID of a job that is still running, or of one left
+      in the queue directory itself
+   */
+   if(FindJobFile(queueDir, jobID, RUNSUFFIX, runFile) ||
+      (inShard && FindJobFile(queueDir, jobID, "", runFile)))
+   {
+      errno = EEXIST;
+      return(FALSE);
+   }
+
+   if(tmpFile[0])
+   {
+      status = link(tmpFile, jobFile);
    }
    else
    {
-      char msg[MAXBUFF];
-      sprintf(msg,"Unable to create job file %s", jobFile);
-      Message(PROGNAME, MSG_FATAL, msg);
+      char procFile[MAXBUFF];
+      sprintf(procFile, "/proc/self/fd/%d", fh);
+      status = linkat(AT_FDCWD, procFile, AT_FDCWD, jobFile,
+                      AT_SYMLINK_FOLLOW);
    }
+
+   return(status == 0);
 }
 
 
@@ -797,48 +2954,78 @@ void Message(char *progname, int level, char *message)
    \param[in]   verbose    Amount of information to show
 
    Displays infomation about waiting jobs.
-   Currently just shows the number of jobs
+   Currently just shows the number of jobs. Unless each job is to be
+   listed, the numbers are taken from the counters file without 
+   reading the queue directory. When they are, the runner's snapshot of
+   the queue is used if it is running.
 
 -  16.10.15  Original   By: ACRM
+-  17.10.26  Running jobs are flagged and counted separately   By: agent
+-  17.10.26  Uses the counters file when not verbose   By: agent
+-  17.10.26  Uses the runner's snapshot when verbose   By: agent
+-  17.10.26  Lists jobs in the ring if there is one   By: agent
+-  17.10.26  Shows the tasks of job arrays   By: agent
+-  17.10.26  Reads subdirectories of job files   By: agent
+-  17.10.26  Uses ReadJobList(), so the jobs are listed in the order 
+             they will run, and CountJobs()   By: agent
+-  17.10.26  Gives the expected wait for a new job   By: agent
 */
 void ListJobs(char *queueDir, int verbose)
 {
-   struct dirent *dirp;
-   DIR           *dp;
-   int           nJobs       = 0;
+   LISTJOB *jobs;
+   int     nJobs,
+           nRunning,
+           i;
+   long    wait;
 
-   if((dp=opendir(queueDir)) == NULL)
+   if(!verbose)
    {
-      char msg[MAXBUFF];
-      sprintf(msg, "Can't read directory: %s", queueDir);
+      COUNTERS counted;
+      
+      if(!ReadCounters(queueDir, &counted))
+         CountJobs(queueDir, &counted);
+      printf("Jobs waiting: %d\n", counted.depth);
+      if(counted.running)
+         printf("Jobs running: %d\n", counted.running);
+      if((wait = ExpectedWait(queueDir)) >= 0)
+      {
+         char waitText[MAXWAITTEXT];
+         FormatWait(wait, waitText);
+         printf("Expected wait for a new job: %s\n", waitText);
+      }
+      return;
+   }
+   else if(ListJobsFromSnapshot(queueDir))
+   {
+      return;
+   }
+
+   if((nJobs = ReadJobList(queueDir, &jobs, &nRunning)) < 0)
+   {
+      char msg[MAXBUFF];
+      sprintf(msg, "Can't read directory: %s", queueDir);
       Message(PROGNAME, MSG_FATAL, msg);
    }
 
-   while((dirp = readdir(dp)) != NULL)
+   for(i=0; i<nJobs; i++)
    {
-      int thisJobID;
-      
-      /* Ignore files starting with a .                                 */
-      if(dirp->d_name[0] != '.')
-      {
-         /* Check it's a number                                         */
-         if(sscanf(dirp->d_name, "%d", &thisJobID))
-         {
-            if(verbose)
-            {
-               char *username;
-               username = GetOwner(queueDir, thisJobID);
-               printf("JobID: %d Owner: %s\n", thisJobID, username);
-            }
-            
-            nJobs++;
-         }
-      }
+      SNAPJOB job;
+
+      job.jobID   = jobs[i].jobID;
+      job.uid     = jobs[i].uid;
+      job.running = jobs[i].running;
+      job.nTasks  = jobs[i].nTasks;
+      job.nDone   = jobs[i].nDone;
+      job.start   = 0;
+      PrintJob(&job, UserName(job.uid));
    }
-   
-   closedir(dp);
 
-   printf("Jobs waiting: %d\n", nJobs);
+   printf("Jobs waiting: %d\n", nJobs - nRunning);
+   if(nRunning)
+      printf("Jobs running: %d\n", nRunning);
+
+   if(jobs != NULL)
+      free(jobs);
 }
 
 
@@ -854,29 +3041,65 @@ void ListJobs(char *queueDir, int verbose)
    jobs are waiting before yours, updating each time a job runs.
 
 -  19.10.15  Original   By: ACRM
+-  17.10.26  Only counts waiting jobs and reports the job as running
+             once the runner has actually started it   By: agent
+-  17.10.26  Also looks in the ring if there is one   By: agent
+-  17.10.26  Reads subdirectories of job files   By: agent
 */
 void CountdownJob(char *queueDir, int jobInfoID, int sleepTime)
 {
    struct dirent *dirp;
-   DIR           *dp;
+   JOBDIR        jobDir;
+   BOOL          reading;
    int           nJobs        = 0,
                  prevJobCount = (-1);
-   BOOL          gotJob       = FALSE;
+   BOOL          gotJob       = FALSE,
+                 running      = FALSE;
 
 
    while(TRUE)
    {
       nJobs  = 0;
       gotJob = FALSE;
+
+      /* Jobs in the ring run before any job files not yet moved into 
+         it
+      */
+      if(IsRingQueue(queueDir))
+      {
+         SNAPJOB *jobs;
+         int     nRing,
+                 nRunning,
+                 i;
+         
+         if((nRing = ReadRing(queueDir, &jobs, &nRunning)) > 0)
+         {
+            for(i=0; i<nRing; i++)
+            {
+               if(jobs[i].jobID == jobInfoID)
+               {
+                  gotJob  = TRUE;
+                  running = (i < nRunning);
+                  break;
+               }
+            }
+            nJobs = i - nRunning;
+            free(jobs);
+         }
+      }
       
-      if((dp=opendir(queueDir)) == NULL)
+      if(gotJob)
+      {
+         reading = FALSE;
+      }
+      else if(!(reading = OpenJobDir(queueDir, &jobDir)))
       {
          char msg[MAXBUFF];
          sprintf(msg, "Can't read directory: %s", queueDir);
          Message(PROGNAME, MSG_FATAL, msg);
       }
       
-      while((dirp = readdir(dp)) != NULL)
+      while(reading && ((dirp = ReadJobDir(&jobDir)) != NULL))
       {
          int thisJobID;
          
@@ -886,19 +3109,24 @@ void CountdownJob(char *queueDir, int jobInfoID, int sleepTime)
             /* Check it's a number                                         */
             if(sscanf(dirp->d_name, "%d", &thisJobID))
             {
-               if(thisJobID < jobInfoID)
+               if((thisJobID < jobInfoID) && 
+                  !IsRunningFileName(dirp->d_name))
                   nJobs++;
                if(thisJobID == jobInfoID)
-                  gotJob = TRUE;
+               {
+                  gotJob  = TRUE;
+                  running = IsRunningFileName(dirp->d_name);
+               }
             }
          }
       }
    
-      closedir(dp);
+      if(reading)
+         CloseJobDir(&jobDir);
 
       if(gotJob)
       {
-         if(nJobs == 0)
+         if(running)
          {
             printf("Running your job\n");
             break;
@@ -929,26 +3157,153 @@ void CountdownJob(char *queueDir, int jobInfoID, int sleepTime)
 
 -  16.10.15  Original   By: ACRM
 -  19.10.15  Added -i
+-  17.10.26  Describes inotify fallback polling   By: agent
+-  17.10.26  Added -j, -M and -m   By: agent
+-  17.10.26  -w is no longer used   By: agent
+-  17.10.26  Added -L   By: agent
+-  17.10.26  Added -b   By: agent
+-  17.10.26  Added -R   By: agent
+-  17.10.26  Added -P and -A   By: agent
+-  17.10.26  Added -C and -c   By: agent
+-  17.10.26  Added -s   By: agent
+-  17.10.26  Added -H   By: agent
+-  17.10.26  Added -a   By: agent
+-  17.10.26  Added -S   By: agent
+-  17.10.26  Added -F   By: agent
+-  17.10.26  Added -o   By: agent
+-  17.10.26  Added -D   By: agent
+-  17.10.26  Added -f   By: agent
+-  17.10.26  Added -U   By: agent
+-  17.10.26  Added -t and -B   By: agent
+-  17.10.26  -i, -l and -o give the expected start and finish   
+             By: agent
+-  17.10.26  Added -d and -I   By: agent
 */
 void UsageDie(void)
 {
-   fprintf(stderr,"\n%s V1.0 (c) 2015 UCL, Dr. Andrew C.R. Martin\n", 
+   fprintf(stderr,"\n%s V1.25 (c) 2015 UCL, Dr. Andrew C.R. Martin\n", 
            PROGNAME);
    fprintf(stderr,"\n");
-   fprintf(stderr,"Usage:   %s [-v[v...]] [-p polltime] -run queuedir\n",
+   fprintf(stderr,"Usage:   %s [-v[v...]] [-p polltime] [-j nslots] \
+[-M membudget]\n", PROGNAME);
+   fprintf(stderr,"              [-R] [-S] [-F] [-A agetime] [-C] \
+[-c settings] [-H limits]\n");
+   fprintf(stderr,"              [-D durability] [-U settings] [-B] \
+-run queuedir\n");
+   fprintf(stderr,"         %s [-v[v...]] [-m mem] [-t time] [-L] \
+[-P priority] [-d]\n", PROGNAME);
+   fprintf(stderr,"              [-I inputs] [-a first-last] queuedir \
+program [parameters ...]\n");
+   fprintf(stderr,"         %s [-v[v...]] [-m mem] [-t time] [-L] \
+[-P priority]\n", PROGNAME);
+   fprintf(stderr,"              [-a first-last] -b manifest \
+queuedir\n");
+   fprintf(stderr,"         %s [-v] [-o json|tsv] -l queuedir\n", 
+           PROGNAME);
+   fprintf(stderr,"         %s -s queuedir\n", PROGNAME);
+   fprintf(stderr,"         %s [-f] -i jobID[.task] queuedir\n", 
            PROGNAME);
-   fprintf(stderr,"         %s [-v[v...]] [-w maxwait] queuedir program \
-[parameters ...]\n", PROGNAME);
-   fprintf(stderr,"         %s -l queuedir\n", PROGNAME);
-   fprintf(stderr,"         %s -i jobID queuedir\n", PROGNAME);
    fprintf(stderr,"\n         -v   Verbose mode (-vv, -vvv more info)\n");
    fprintf(stderr,"         -p   Specify the wait in seconds between \
 polling for jobs [%d]\n",  DEF_POLLTIME);
-   fprintf(stderr,"         -w   Specify maximum wait time when trying \
-to submit a job [%d]\n", DEF_WAITTIME);
+   fprintf(stderr,"              (With inotify, new jobs start at once \
+and the queue is\n");
+   fprintf(stderr,"              only re-scanned every %d times this \
+interval)\n", FALLBACK_FACTOR);
+   fprintf(stderr,"         -w   Ignored - jobs are now submitted \
+without waiting for a lock\n");
+   fprintf(stderr,"         -j   Number of jobs the queue manager may \
+run at once [%d]\n", DEF_SLOTS);
+   fprintf(stderr,"         -M   Total memory available to running jobs \
+(e.g. 500M, 16G)\n");
+   fprintf(stderr,"              [Default: no limit]\n");
+   fprintf(stderr,"         -m   Memory needed by a job. With -M, a job \
+that doesn't\n");
+   fprintf(stderr,"              specify this is run on its own\n");
+   fprintf(stderr,"         -t   Run time of a job (e.g. 90, 30m, 2h, \
+1d). With -B, a job\n");
+   fprintf(stderr,"              that runs for longer is stopped\n");
+   fprintf(stderr,"         -L   Run the job through su and a login \
+shell\n");
+   fprintf(stderr,"         -R   Keep the queue in a single memory \
+mapped file (.queue)\n");
+   fprintf(stderr,"         -S   Keep job files in subdirectories of \
+%d job IDs each\n", SHARDJOBS);
+   fprintf(stderr,"              (for queues of many thousands of \
+jobs)\n");
+   fprintf(stderr,"         -F   Share the slots fairly between users \
+by their recent use\n");
+   fprintf(stderr,"         -P   Priority of the job, from %d to %d. \
+Higher priority jobs\n", -MAXPRIORITY, MAXPRIORITY);
+   fprintf(stderr,"              run first [0]\n");
+   fprintf(stderr,"         -A   Seconds a job waits to gain a priority \
+level (0=never) [%d]\n", DEF_AGETIME);
+   fprintf(stderr,"         -D   How soon changes to the jobs are \
+fsynced: sync, none or\n");
+   fprintf(stderr,"              the longest wait in ms, sharing one \
+fsync [%d]\n", DEF_COMMITMS);
+   fprintf(stderr,"         -C   Run each job in its own cgroup (needs \
+cgroup v2)\n");
+   fprintf(stderr,"         -c   Cgroup settings for each job (implies \
+-C). A comma\n");
+   fprintf(stderr,"              separated list of memory.max=, \
+memory.high=, cpu.weight=\n");
+   fprintf(stderr,"              and io.weight=. Memory may be a size, \
+'max' or a\n");
+   fprintf(stderr,"              percentage of the job's -m memory \
+[memory.max=100%%]\n");
+   fprintf(stderr,"         -H   Hold jobs while the host is busy. A \
+comma separated list\n");
+   fprintf(stderr,"              of memory= and cpu= (PSI pressure, \
+%%), memavail= (least\n");
+   fprintf(stderr,"              MemAvailable, e.g. 2G) and load= \
+(1 minute load average)\n");
+   fprintf(stderr,"         -U   Suspend a running job while an urgent \
+job runs. A comma\n");
+   fprintf(stderr,"              separated list of priority= (least \
+priority of an urgent\n");
+   fprintf(stderr,"              job), stops= (times a job may be \
+suspended) and stoptime=\n");
+   fprintf(stderr,"              (total seconds it may be suspended) \
+[%d,%d,%d]\n", DEF_URGENT, DEF_MAXSTOPS, DEF_MAXSTOPTIME);
+   fprintf(stderr,"         -B   While the next job waits for memory, \
+start later jobs\n");
+   fprintf(stderr,"              that won't delay it (backfill). Needs \
+-M and jobs with -t\n");
+   fprintf(stderr,"         -d   If the same job is waiting, running \
+or finished recently,\n");
+   fprintf(stderr,"              give its ID instead of running the \
+job again\n");
+   fprintf(stderr,"         -I   Input files of a job (comma \
+separated). With -d, a job is\n");
+   fprintf(stderr,"              only the same if these haven't \
+changed. Implies -d\n");
+   fprintf(stderr,"         -a   Submit a job array, with a task for \
+each index from first\n");
+   fprintf(stderr,"              to last (e.g. 1-100). Each task is \
+given its index in\n");
+   fprintf(stderr,"              SIMQ_TASK_ID\n");
+   fprintf(stderr,"         -b   Submit a job for each line of a \
+file ('-' for stdin)\n");
    fprintf(stderr,"         -i   Gives a countdown until specified job \
-runs\n");
-   fprintf(stderr,"         -l   List number of waiting jobs\n");
+runs, with when it\n");
+   fprintf(stderr,"              is expected to start and finish\n");
+   fprintf(stderr,"         -f   With -i, then follow the job's output \
+until it finishes\n");
+   fprintf(stderr,"              (give jobID.task for a task of a job \
+array)\n");
+   fprintf(stderr,"         -l   List number of waiting jobs and the \
+expected wait. With -v\n");
+   fprintf(stderr,"              list each job with its expected start \
+and finish, and those\n");
+   fprintf(stderr,"              that finished recently\n");
+   fprintf(stderr,"         -o   With -l, list each job's owner, \
+submit time, directory,\n");
+   fprintf(stderr,"              command, position and expected start \
+and finish as json\n");
+   fprintf(stderr,"              or tsv\n");
+   fprintf(stderr,"         -s   Summarize the jobs that have \
+finished\n");
    fprintf(stderr,"         -run Run in daemon mode to wait for jobs\n");
    fprintf(stderr,"\n");
    fprintf(stderr,"%s is a simple program batch queueing system. It \
@@ -985,33 +3340,10400 @@ directory.\n");
 
 
 /************************************************************************/
-/*>char *GetOwner(char *queueDir, int thisJobID)
-   ---------------------------------------------
+/*>int WatchQueue(char *queueDir, int verbose)
+   -------------------------------------------
 *//**
    \param[in]   queueDir    Queue directory
-   \param[in]   thisJobID   Job identifier
-   \return                  Pointer to username
+   \param[in]   verbose     Verbosity level
+   \return                  inotify file descriptor (-1 if unavailable)
 
-   Gets the owner of a specified job
+   Sets up an inotify watch on the queue directory so that the runner
+   is woken as soon as a job file has been completely written. If
+   inotify is not available, the runner falls back to polling.
 
--  19.10.15  Original   By: ACRM
+-  17.10.26  Original   By: agent
+-  17.10.26  Also watches for job files being linked   By: agent
+*/
+int WatchQueue(char *queueDir, int verbose)
+{
+   int watchFd;
+   
+   if((watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == (-1))
+   {
+      Message(PROGNAME, MSG_WARNING, 
+              "inotify not available - polling for jobs instead");
+      return(-1);
+   }
+   
+   /* A job file is complete once it has been linked or moved into
+      place, or closed after writing by an older version of simq
+   */
+   if(inotify_add_watch(watchFd, queueDir, WATCHEVENTS) == (-1))
+   {
+      char msg[MAXBUFF];
+      sprintf(msg, "Cannot watch directory: %s - polling for jobs \
+instead", queueDir);
+      Message(PROGNAME, MSG_WARNING, msg);
+      close(watchFd);
+      return(-1);
+   }
+   
+   if(verbose >= 2)
+   {
+      Message(PROGNAME, MSG_INFO, "Watching queue directory for jobs");
+   }
+   
+   return(watchFd);
+}
+
+
+/************************************************************************/
+/*>BOOL WaitForJobs(RUNNER *runner)
+   --------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \return                 Was a new job file seen?
+
+   Waits for a new job to appear in the queue or for a running job to
+   finish. Without an inotify watch this waits for up to sleepTime. 
+   With a watch, it returns as soon as a job file is completed, or after
+   FALLBACK_FACTOR*sleepTime seconds in case any events have been lost.
+
+   Requests arriving on the runner's socket are handled while waiting 
+   and also cause it to return.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Also wakes when the SIGCHLD handler writes to gSignalPipe
+             By: agent
+-  17.10.26  Takes a RUNNER. Also serves the socket and its clients
+             By: agent
+-  17.10.26  Flags a new job as a change to the queue   By: agent
+-  17.10.26  Flags new job files to be moved into the ring   By: agent
+-  17.10.26  Adds new job files to the heap as they are seen, and 
+             flags the directory to be scanned if events were lost
+             By: agent
+-  17.10.26  Writes the metrics file when it is due   By: agent
+-  17.10.26  Returns after HOLDCHECK seconds while jobs are held so
+             that the host can be checked again, and notes PSI 
+             triggers   By: agent
+-  17.10.26  Returns when a suspended job has been suspended for as 
+             long as it may be   By: agent
+-  17.10.26  Returns when a job overruns its run time with -B
+             By: agent
+*/
+BOOL WaitForJobs(RUNNER *runner)
+{
+   time_t endTime,
+          holdTime,
+          resumeTime  = ResumeDeadline(runner),
+          overrunTime = (runner->backfill ? OverrunDeadline(runner) : 0);
+   int    watchFd = runner->watchFd;
+   
+   endTime = time(NULL) + (time_t)((watchFd < 0) ? runner->sleepTime :
+                                   FALLBACK_FACTOR * runner->sleepTime);
+   holdTime = time(NULL) + HOLDCHECK;
+   
+   while(TRUE)
+   {
+      struct pollfd pfd[MAXCLIENTS+5];
+      char          buffer[EVENTBUFF];
+      ssize_t       nRead;
+      int           timeLeft,
+                    nClients,
+                    i;
+      time_t        now = time(NULL);
+      
+      if(now >= runner->metrics.nextWrite)
+         WriteMetrics(runner);
+      if((timeLeft = (int)(endTime - now)) <= 0)
+         break;
+      if(timeLeft > (int)(runner->metrics.nextWrite - now))
+         timeLeft = (int)(runner->metrics.nextWrite - now);
+      if(runner->host.held)
+      {
+         if(now >= holdTime)
+            return(FALSE);
+         if(timeLeft > (int)(holdTime - now))
+            timeLeft = (int)(holdTime - now);
+      }
+      if(resumeTime)
+      {
+         if(now >= resumeTime)
+            return(FALSE);
+         if(timeLeft > (int)(resumeTime - now))
+            timeLeft = (int)(resumeTime - now);
+      }
+      if(overrunTime)
+      {
+         if(now >= overrunTime)
+            return(FALSE);
+         if(timeLeft > (int)(overrunTime - now))
+            timeLeft = (int)(overrunTime - now);
+      }
+      
+      pfd[0].fd      = gSignalPipe[0];
+      pfd[1].fd      = watchFd;
+      pfd[2].fd      = runner->listenFd;
+      nClients       = runner->nClients;
+      for(i=0; i<nClients; i++)
+      {
+         pfd[i+3].fd = runner->clients[i].fd;
+      }
+      for(i=0; i<nClients+3; i++)
+      {
+         pfd[i].events  = POLLIN;
+         pfd[i].revents = 0;
+      }
+
+      /* PSI triggers signal POLLPRI                                    */
+      pfd[nClients+3].fd = runner->host.memTrigger;
+      pfd[nClients+4].fd = runner->host.cpuTrigger;
+      for(i=nClients+3; i<nClients+5; i++)
+      {
+         pfd[i].events  = POLLPRI;
+         pfd[i].revents = 0;
+      }
+      
+      /* poll() ignores negative file descriptors                       */
+      if(poll(pfd, nClients+5, timeLeft * 1000) <= 0)
+         continue;
+
+      /* Pressure has risen. This only matters when a job is next 
+         started, so just make sure the host is checked then
+      */
+      if((pfd[nClients+3].revents | pfd[nClients+4].revents) & POLLPRI)
+      {
+         runner->host.triggered = TRUE;
+      }
+      if(pfd[nClients+3].revents & (POLLERR|POLLNVAL))
+      {
+         close(runner->host.memTrigger);
+         runner->host.memTrigger = (-1);
+      }
+      if(pfd[nClients+4].revents & (POLLERR|POLLNVAL))
+      {
+         close(runner->host.cpuTrigger);
+         runner->host.cpuTrigger = (-1);
+      }
+
+      /* A job has finished                                             */
+      if(pfd[0].revents & POLLIN)
+      {
+         while(read(gSignalPipe[0], buffer, sizeof(buffer)) > 0);
+         return(FALSE);
+      }
+
+      /* Requests from clients. Work backwards as a client that goes 
+         away is replaced by the last one
+      */
+      if(nClients || (pfd[2].revents & POLLIN))
+      {
+         BOOL gotRequest = FALSE;
+
+         for(i=nClients-1; i>=0; i--)
+         {
+            if(pfd[i+3].revents)
+            {
+               gotRequest = TRUE;
+               if(!ReadClient(runner, i))
+                  DropClient(runner, i);
+            }
+         }
+         
+         if(pfd[2].revents & POLLIN)
+         {
+            AcceptClient(runner);
+            gotRequest = TRUE;
+         }
+         
+         if(gotRequest)
+            return(FALSE);
+      }
+      
+      /* Read all pending events and see if any are job files           */
+      while((watchFd >= 0) &&
+            ((nRead = read(watchFd, buffer, sizeof(buffer))) > 0))
+      {
+         char *ptr;
+         BOOL gotJob = FALSE;
+         
+         for(ptr = buffer; ptr < buffer + nRead; 
+             ptr += sizeof(struct inotify_event) + 
+                    ((struct inotify_event *)ptr)->len)
+         {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            int                  jobID;
+
+            if(event->mask & IN_Q_OVERFLOW)
+            {
+               runner->newFiles = TRUE;
+               gotJob           = TRUE;
+            }
+            else if(event->len && IsJobFileName(event->name) &&
+                    !IsRunningFileName(event->name))
+            {
+               if(runner->ring)
+                  runner->newFiles = TRUE;
+               else if(sscanf(event->name, "%d", &jobID) == 1)
+                  AddJobFile(runner, jobID);
+               gotJob = TRUE;
+            }
+         }
+         
+         if(gotJob)
+         {
+            if(runner->verbose >= 3)
+            {
+               Message(PROGNAME, MSG_INFO, "New job file seen");
+            }
+            runner->changed  = TRUE;
+            return(TRUE);
+         }
+      }
+   }
+
+   /* Let waiting clients catch up with any jobs removed by hand, and 
+      pick up any job files whose events were lost
+   */
+   runner->changed  = TRUE;
+   runner->newFiles = TRUE;
+   return(FALSE);
+}
+
+
+/************************************************************************/
+/*>BOOL IsJobFileName(char *name)
+   ------------------------------
+*//**
+   \param[in]   name    A file name from the queue directory
+   \return              Is it a job file?
+
+   Tests whether a file name is that of a job - i.e. it doesn't start
+   with a . and it starts with a number
+
+-  17.10.26  Original   By: agent
+*/
+BOOL IsJobFileName(char *name)
+{
+   int jobID;
+   
+   if(name[0] == '.')
+      return(FALSE);
+   if(sscanf(name, "%d", &jobID) != 1)
+      return(FALSE);
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL IsRunningFileName(char *name)
+   ----------------------------------
+*//**
+   \param[in]   name    A file name from the queue directory
+   \return              Is it the file for a running job?
+
+   Tests whether a job file has been marked as running by having
+   RUNSUFFIX appended to it
+
+-  17.10.26  Original   By: agent
+*/
+BOOL IsRunningFileName(char *name)
+{
+   int nameLen   = strlen(name),
+       suffixLen = strlen(RUNSUFFIX);
+   
+   if(nameLen <= suffixLen)
+      return(FALSE);
+   if(strcmp(name + nameLen - suffixLen, RUNSUFFIX))
+      return(FALSE);
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL ReadJobFile(char *queueDir, int jobID, JOBINFO *job)
+   ---------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   jobID       Job number
+   \param[out]  job         The job information
+   \return                  Was the job file read OK?
+
+   Reads a waiting job file with ReadJobStream().
+
+-  17.10.26  Original - split out of RunJob()   By: agent
+-  17.10.26  Reads login option   By: agent
+-  17.10.26  Reads priority. Sets the owner and time queued   By: agent
+-  17.10.26  Reads the tasks of a job array   By: agent
+-  17.10.26  Also looks in the job ID's subdirectory   By: agent
+-  17.10.26  Reading moved to ReadJobStream()   By: agent
+*/
+BOOL ReadJobFile(char *queueDir, int jobID, JOBINFO *job)
+{
+   char jobFile[MAXBUFF];
+   FILE *fp;
+
+   job->jobID = jobID;
+   FindJobFile(queueDir, jobID, "", jobFile);
+   if((fp=fopen(jobFile, "r"))==NULL)
+      return(FALSE);
+   return(ReadJobStream(fp, job));
+}
+
+
+/************************************************************************/
+/*>BOOL ReadJobStream(FILE *fp, JOBINFO *job)
+   ------------------------------------------
+*//**
+   \param[in]   fp          An open job file, which is closed
+   \param[in,out] job       The job information (jobID must be set)
+   \return                  Was the job file read OK?
+
+   Reads a job file. The first line is the working directory, the 
+   second is the command and any other lines are keyword/value pairs. 
+   The owner of the job is the owner of the file, and the time it was
+   queued is when the file was written.
+
+-  17.10.26  Original - split out of ReadJobFile()   By: agent
+-  17.10.26  Reads the run time   By: agent
+-  17.10.26  Reads the hash for -d   By: agent
+-  17.10.26  Ignores a negative memory size   By: agent
+-  17.10.26  Ignores a priority outside the range of -P   By: agent
+*/
+BOOL ReadJobStream(FILE *fp, JOBINFO *job)
+{
+   char        buffer[MAXBUFF];
+   struct stat statBuff;
+   int         jobID = job->jobID;
+
+   job->mem      = 0;
+   job->login    = FALSE;
+   job->priority = 0;
+   job->estimate = 0;
+   job->nTasks   = 0;
+   job->first    = 0;
+   job->task     = 0;
+   job->dedup    = 0;
+   
+   if(fstat(fileno(fp), &statBuff) != 0)
+      CLOSE_AND_RETURN(fp, jobID);
+   job->uid    = statBuff.st_uid;
+   job->queued = statBuff.st_mtime;
+
+   /* Get the working directory for running the job                     */
+   if(!fgets(job->pwd, MAXBUFF, fp))
+      CLOSE_AND_RETURN(fp, jobID);
+   TERMINATE(job->pwd);
+
+   /* Get the job itself                                                */
+   if(!fgets(job->cmd, MAXBUFF, fp))
+      CLOSE_AND_RETURN(fp, jobID);
+   TERMINATE(job->cmd);
+
+   /* Optional information                                              */
+   while(fgets(buffer, MAXBUFF, fp))
+   {
+      char keyword[MAXBUFF];
+      int  value,
+           last;
+      
+      if(!strncmp(buffer, "dedup ", 6))
+      {
+         sscanf(buffer+6, "%lx", &(job->dedup));
+      }
+      else if(sscanf(buffer, "%s %d", keyword, &value) == 2)
+      {
+         if(!strcmp(keyword, "mem") && (value >= 0))
+            job->mem = value;
+         else if(!strcmp(keyword, "login"))
+            job->login = (BOOL)value;
+         else if(!strcmp(keyword, "priority") &&
+                 (value >= -MAXPRIORITY) && (value <= MAXPRIORITY))
+            job->priority = value;
+         else if(!strcmp(keyword, "time") && (value > 0))
+            job->estimate = value;
+         else if(!strcmp(keyword, "array") &&
+                 (sscanf(buffer, "%s %d %d", keyword, &value, &last) 
+                  == 3) &&
+                 (value >= 0) && (last >= value) && 
+                 (last - value < MAXTASKS))
+         {
+            job->first  = value;
+            job->nTasks = last - value + 1;
+         }
+      }
+   }
+
+   fclose(fp);
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL ParseMemory(char *string, int *mb)
+   ---------------------------------------
+*//**
+   \param[in]   string   A memory size, e.g. 500, 500M or 4G
+   \param[out]  mb       The size in MB
+   \return               Was the string valid?
+
+   Parses a memory size. A plain number or one followed by M is in MB; 
+   one followed by G is in GB.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ParseMemory(char *string, int *mb)
+{
+   char unit = 'M';
+   int  nRead;
+   
+   if((nRead = sscanf(string, "%d%c", mb, &unit)) < 1)
+      return(FALSE);
+   if(*mb < 0)
+      return(FALSE);
+
+   switch(unit)
+   {
+   case 'm':
+   case 'M':
+      break;
+   case 'g':
+   case 'G':
+      *mb *= 1024;
+      break;
+   default:
+      return(FALSE);
+   }
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>void ReapJobs(RUNNER *runner)
+   -----------------------------
+*//**
+   \param[in,out] runner   The job runner
+
+   Collects any jobs that have finished, removes them from the queue
+   and releases their slots and memory.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Updates the queue counters   By: agent
+-  17.10.26  Tells any clients waiting for the job   By: agent
+-  17.10.26  Removes the job from the ring if there is one   By: agent
+-  17.10.26  Removes the job's cgroup   By: agent
+-  17.10.26  Uses wait4() and records the job in the accounting log
+             By: agent
+-  17.10.26  Counts the job for the metrics   By: agent
+-  17.10.26  A job array is only removed when its last task finishes
+             By: agent
+-  17.10.26  Job files may be in subdirectories, which are removed
+             once they are empty   By: agent
+-  17.10.26  Charges the job's owner for its use with -F   By: agent
+-  17.10.26  Records the job in the journal before removing it
+             By: agent
+-  17.10.26  Handles jobs that die while suspended   By: agent
+-  17.10.26  Learns the job's run time   By: agent
+-  17.10.26  Remembers jobs submitted with -d that succeeded   
+             By: agent
+*/
+void ReapJobs(RUNNER *runner)
+{
+   pid_t  pid;
+   int    status;
+   struct rusage usage;
+   
+   while((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+   {
+      int i;
+      
+      for(i=0; i<runner->nRunning; i++)
+      {
+         if(runner->running[i].pid == pid)
+         {
+            RUNNING *job = &(runner->running[i]);
+            char    runFile[MAXBUFF];
+            int     exitStatus;
+
+            exitStatus = (WIFEXITED(status)?WEXITSTATUS(status):(-1));
+            
+            if(runner->verbose)
+            {
+               char msg[MAXBUFF];
+               if(job->task >= 0)
+                  sprintf(msg, "Job %d task %d finished (status %d)", 
+                          job->jobID, job->task, exitStatus);
+               else
+                  sprintf(msg, "Job %d finished (status %d)", 
+                          job->jobID, exitStatus);
+               Message(PROGNAME, MSG_INFO, msg);
+            }
+
+            if(runner->cgroups.use)
+               RemoveJobCgroup(runner, job->jobID, job->task);
+            JournalJob(runner, JOURNAL_FINISHED, job->jobID, job->task,
+                       exitStatus, NULL);
+            RecordJob(runner, job, status, &usage);
+            CountFinishedJob(runner, job, status);
+            LearnRunTime(runner, job, status);
+            if(runner->fairShare)
+               ChargeUser(runner, job, &usage);
+            runner->changed = TRUE;
+
+            /* Remove the job from the queue. A job array stays until 
+               its last task has finished
+            */
+            if((job->task < 0) || FinishTask(runner, job, status))
+            {
+               if(runner->ring)
+               {
+                  RingSetState(runner->ring, job->jobID, job->offset, 
+                               RING_DONE);
+               }
+               else
+               {
+                  FindJobFile(runner->queueDir, job->jobID, RUNSUFFIX,
+                              runFile);
+                  unlink(runFile);
+                  RemoveShard(runner, job->jobID);
+               }
+               UpdateCounters(runner->queueDir, 0, -1);
+               if(job->task < 0)
+               {
+                  NotifyJobDone(runner, job->jobID, exitStatus);
+                  if(job->dedup)
+                     DedupFinished(runner, job, (exitStatus == 0));
+               }
+               else
+               {
+                  TASKARRAY *array = FindArray(runner, job->jobID);
+                  JournalJob(runner, JOURNAL_FINISHED, job->jobID, -1,
+                             array->nFailed, NULL);
+                  NotifyJobDone(runner, job->jobID, array->nFailed);
+                  if(job->dedup)
+                     DedupFinished(runner, job, (array->nFailed == 0));
+                  EndArray(runner, job->jobID, TRUE);
+               }
+            }
+
+            if(job->stopped)
+            {
+               runner->memUsed -= job->stoppedMem;
+               runner->nStopped--;
+            }
+            else
+            {
+               runner->memUsed -= job->mem;
+            }
+            runner->running[i] = runner->running[--runner->nRunning];
+            break;
+         }
+      }
+   }
+}
+
+
+/************************************************************************/
+/*>void RequeueRunningJobs(char *queueDir)
+   ---------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+
+   Called when the runner starts. Any jobs marked as running must have
+   been interrupted when a previous runner stopped, so they are put 
+   back into the queue to be run again.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Reads subdirectories of job files   By: agent
 */
-char *GetOwner(char *queueDir, int thisJobID)
+void RequeueRunningJobs(char *queueDir)
 {
-   struct stat   statBuff;
-   struct passwd *pwdBuff;
-   char          jobFile[MAXBUFF];
-   uid_t         uid;
+   struct dirent *dirp;
+   JOBDIR        jobDir;
+
+   if(!OpenJobDir(queueDir, &jobDir))
+      return;
+
+   while((dirp = ReadJobDir(&jobDir)) != NULL)
+   {
+      int thisJobID;
+      
+      if(IsJobFileName(dirp->d_name) && 
+         IsRunningFileName(dirp->d_name) &&
+         sscanf(dirp->d_name, "%d", &thisJobID))
+      {
+         char runFile[MAXBUFF],
+              jobFile[MAXBUFF];
+         
+         snprintf(runFile, MAXBUFF, "%s/%d%s", jobDir.dir, thisJobID, 
+                  RUNSUFFIX);
+         snprintf(jobFile, MAXBUFF, "%s/%d", jobDir.dir, thisJobID);
+         rename(runFile, jobFile);
+      }
+   }
    
+   CloseJobDir(&jobDir);
+}
+
 
-   sprintf(jobFile,"%s/%d", queueDir, thisJobID);
+/************************************************************************/
+/*>void HandleSigchld(int signum)
+   ------------------------------
+*//**
+   \param[in]   signum   Signal number
 
-   /* Find the ownder of the job file                                   */
-   stat(jobFile, &statBuff);
-   uid = statBuff.st_uid;
+   Signal handler for SIGCHLD. Wakes the runner so that it can reap the
+   job.
 
-   /* Get the username from the UID                                     */
-   pwdBuff  = getpwuid(uid);
-   return(pwdBuff->pw_name);
+-  17.10.26  Original   By: agent
+*/
+void HandleSigchld(int signum)
+{
+   int savedErrno = errno;
+   
+   if(write(gSignalPipe[1], "c", 1) < 0)
+   {
+      /* Pipe is full - the runner will be woken anyway                 */
+   }
+   errno = savedErrno;
 }
 
+
+/************************************************************************/
+/*>int OpenCounters(char *queueDir)
+   --------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \return                  File handle (-1 if it can't be opened)
+
+   Opens the counters file, creating it if needed. It must be writable
+   by both the runner and anyone submitting jobs. A link is refused, so
+   that the runner can't be made to change some other file.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Refuses symbolic and hard links. Only the file's owner 
+             changes its permissions   By: agent
+*/
+int OpenCounters(char *queueDir)
+{
+   char        counterFile[MAXBUFF];
+   int         fh;
+   struct stat statBuff;
+   
+   sprintf(counterFile, "%s/%s", queueDir, COUNTERFILE);
+   if((fh = open(counterFile, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 
+                 0666)) != (-1))
+   {
+      if((fstat(fh, &statBuff) != 0) || !S_ISREG(statBuff.st_mode) ||
+         (statBuff.st_nlink != 1))
+      {
+         close(fh);
+         return(-1);
+      }
+      if(statBuff.st_uid == geteuid())
+         fchmod(fh, 0666);
+   }
+   return(fh);
+}
+
+
+/************************************************************************/
+/*>BOOL LockCounters(int fh)
+   -------------------------
+*//**
+   \param[in]   fh          File handle of the counters file
+   \return                  Was the lock taken?
+
+   Takes an flock() on the counters file. Anyone can open the file, so
+   the lock is not waited for indefinitely; if it is held for more than
+   about COUNTERLOCKTRIES ms, the caller goes without.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL LockCounters(int fh)
+{
+   struct timespec pause;
+   int             tries;
+
+   pause.tv_sec  = 0;
+   pause.tv_nsec = 1000000;
+   for(tries=0; tries<COUNTERLOCKTRIES; tries++)
+   {
+      if(flock(fh, LOCK_EX|LOCK_NB) == 0)
+         return(TRUE);
+      if(errno != EWOULDBLOCK)
+         return(FALSE);
+      nanosleep(&pause, NULL);
+   }
+   return(FALSE);
+}
+
+
+/************************************************************************/
+/*>BOOL ReadCounters(char *queueDir, COUNTERS *counters)
+   -----------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[out]  counters    The counters
+   \return                  Were they read? (FALSE if the file is
+                            missing, short or not initialized)
+
+   Reads the counters without locking them, for reporting the number of
+   jobs.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ReadCounters(char *queueDir, COUNTERS *counters)
+{
+   int  fh;
+   BOOL ok;
+   
+   if((fh = OpenCounters(queueDir)) == (-1))
+      return(FALSE);
+   ok = ((pread(fh, counters, sizeof(COUNTERS), 0) == sizeof(COUNTERS)) &&
+         (counters->magic == COUNTERMAGIC));
+   close(fh);
+   return(ok);
+}
+
+
+/************************************************************************/
+/*>BOOL ChangeCounters(char *queueDir, int dSeq, int dDepth, 
+                       int dRunning, COUNTERS *counters)
+   ---------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   dSeq        Number of job IDs to take
+   \param[in]   dDepth      Change in number of waiting jobs
+   \param[in]   dRunning    Change in number of running jobs
+   \param[out]  counters    The counters after the change
+   \return                  Were they changed?
+
+   Changes the counters while holding the lock on them. If the file is 
+   new, short or has not been initialized, the counters are first built
+   from the queue directory.
+
+   The counters are read and written with pread() and pwrite() rather
+   than being memory mapped. The file must be writable by everyone, and
+   anyone who truncated a mapped file would kill the runner with 
+   SIGBUS; a short read is just treated as a missing file.
+
+-  17.10.26  Original - replaces MapCounters()   By: agent
+*/
+BOOL ChangeCounters(char *queueDir, int dSeq, int dDepth, int dRunning,
+                    COUNTERS *counters)
+{
+   int  fh;
+   BOOL ok;
+   
+   if((fh = OpenCounters(queueDir)) == (-1))
+      return(FALSE);
+   if(!LockCounters(fh))
+   {
+      close(fh);
+      return(FALSE);
+   }
+
+   if((pread(fh, counters, sizeof(COUNTERS), 0) != sizeof(COUNTERS)) ||
+      (counters->magic != COUNTERMAGIC))
+   {
+      /* Clears any old text-format counters                            */
+      CountJobs(queueDir, counters);
+      if(ftruncate(fh, sizeof(COUNTERS)) != 0)
+      {
+         /* The write below extends the file anyway                     */
+      }
+   }
+   
+   counters->seq     += dSeq;
+   counters->depth   += dDepth;
+   counters->running += dRunning;
+   ok = (pwrite(fh, counters, sizeof(COUNTERS), 0) == sizeof(COUNTERS));
+
+   flock(fh, LOCK_UN);
+   close(fh);
+   return(ok);
+}
+
+
+/************************************************************************/
+/*>void CountJobs(char *queueDir, COUNTERS *counters)
+   --------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[out]  counters    The counters
+
+   Rebuilds the counters from the queue directory. The sequence number
+   is set to the newest job (running or waiting).
+
+   If the queue has a ring, the jobs in it are counted too. Job files 
+   may still be waiting to be moved into the ring.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Counts jobs in the ring   By: agent
+-  17.10.26  Reads subdirectories of job files   By: agent
+*/
+void CountJobs(char *queueDir, COUNTERS *counters)
+{
+   struct dirent *dirp;
+   JOBDIR        jobDir;
+
+   counters->magic   = COUNTERMAGIC;
+   counters->seq     = 0;
+   counters->depth   = 0;
+   counters->running = 0;
+
+   if(IsRingQueue(queueDir))
+   {
+      SNAPJOB *jobs;
+      int     nJobs,
+              nRunning,
+              i;
+      
+      if((nJobs = ReadRing(queueDir, &jobs, &nRunning)) > 0)
+      {
+         for(i=0; i<nJobs; i++)
+         {
+            if(jobs[i].jobID > counters->seq)
+               counters->seq = jobs[i].jobID;
+         }
+         counters->running = nRunning;
+         counters->depth   = nJobs - nRunning;
+         free(jobs);
+      }
+   }
+
+   if(!OpenJobDir(queueDir, &jobDir))
+   {
+      char msg[MAXBUFF];
+      sprintf(msg, "Can't read directory: %s", queueDir);
+      Message(PROGNAME, MSG_FATAL, msg);
+   }
+
+   while((dirp = ReadJobDir(&jobDir)) != NULL)
+   {
+      int thisJobID;
+      
+      if(IsJobFileName(dirp->d_name) && 
+         sscanf(dirp->d_name, "%d", &thisJobID))
+      {
+         if(thisJobID > counters->seq)
+            counters->seq = thisJobID;
+         if(IsRunningFileName(dirp->d_name))
+            counters->running++;
+         else
+            counters->depth++;
+      }
+   }
+   
+   CloseJobDir(&jobDir);
+}
+
+
+/************************************************************************/
+/*>void UpdateCounters(char *queueDir, int dDepth, int dRunning)
+   -------------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   dDepth      Change in number of waiting jobs
+   \param[in]   dRunning    Change in number of running jobs
+
+   Used by the runner to update the counters as jobs start and finish.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Uses atomic updates rather than the lock file   By: agent
+-  17.10.26  Uses ChangeCounters()   By: agent
+*/
+void UpdateCounters(char *queueDir, int dDepth, int dRunning)
+{
+   COUNTERS counters;
+   
+   if(!ChangeCounters(queueDir, 0, dDepth, dRunning, &counters))
+      return;
+
+   /* Rebuild them if they have gone wrong                              */
+   if((counters.depth < 0) || (counters.running < 0))
+      CheckCounters(queueDir, 0);
+}
+
+
+/************************************************************************/
+/*>void CheckCounters(char *queueDir, int verbose)
+   -----------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   verbose     Verbosity level
+
+   Repair pass for the counters. Counts the jobs in the queue directory
+   and corrects the counters if they don't agree. The sequence number
+   is only ever moved forwards so job IDs are not reused. The jobs are
+   counted before the lock on the counters is taken, so submitters only
+   wait for the counters to be written.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Updates the mapped counters rather than using the lock 
+             file   By: agent
+-  17.10.26  Reads and writes the file rather than mapping it   By: agent
+*/
+void CheckCounters(char *queueDir, int verbose)
+{
+   int      fh;
+   COUNTERS counters,
+            actual;
+   
+   /* Counted before taking the lock so submitters don't wait for it   */
+   CountJobs(queueDir, &actual);
+
+   if((fh = OpenCounters(queueDir)) == (-1))
+      return;
+   if(!LockCounters(fh))
+   {
+      close(fh);
+      return;
+   }
+
+   if((pread(fh, &counters, sizeof(COUNTERS), 0) != sizeof(COUNTERS)) ||
+      (counters.magic   != COUNTERMAGIC) ||
+      (counters.seq     <  actual.seq)   ||
+      (counters.depth   != actual.depth) ||
+      (counters.running != actual.running))
+   {
+      if(verbose)
+      {
+         Message(PROGNAME, MSG_INFO, "Rebuilt queue counters");
+      }
+
+      /* Only move the sequence number forwards                         */
+      if((counters.magic == COUNTERMAGIC) && (counters.seq > actual.seq))
+         actual.seq = counters.seq;
+      if((ftruncate(fh, sizeof(COUNTERS)) != 0) ||
+         (pwrite(fh, &actual, sizeof(COUNTERS), 0) != sizeof(COUNTERS)))
+      {
+         Message(PROGNAME, MSG_WARNING, "Cannot rebuild queue counters");
+      }
+   }
+
+   flock(fh, LOCK_UN);
+   close(fh);
+}
+
+
+/************************************************************************/
+/*>void RemoveStaleTempFiles(char *queueDir)
+   -----------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+
+   Called when the runner starts. Removes any named temporary job files
+   more than MAXTMPAGE seconds old, left behind by submitters that were
+   killed before their job was linked into the queue.
+
+-  17.10.26  Original   By: agent
+*/
+void RemoveStaleTempFiles(char *queueDir)
+{
+   struct dirent *dirp;
+   DIR           *dp;
+   time_t        now = time(NULL);
+   int           prefixLen = strlen(TMPPREFIX);
+
+   if((dp=opendir(queueDir)) == NULL)
+      return;
+
+   while((dirp = readdir(dp)) != NULL)
+   {
+      if(!strncmp(dirp->d_name, TMPPREFIX, prefixLen))
+      {
+         char        tmpFile[MAXBUFF+NAME_MAX];
+         struct stat statBuff;
+         
+         sprintf(tmpFile, "%s/%s", queueDir, dirp->d_name);
+         if((stat(tmpFile, &statBuff) == 0) &&
+            (now - statBuff.st_mtime > MAXTMPAGE))
+         {
+            unlink(tmpFile);
+         }
+      }
+   }
+   
+   closedir(dp);
+}
+
+
+/************************************************************************/
+/*>void ExecJob(char *queueDir, JOBINFO *job, struct passwd *pwd)
+   --------------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   job         The job to run
+   \param[in]   pwd         Password entry for the job's owner
+
+   Called in the child process to start a job without going through
+   su, PAM and a login shell. Switches to the job owner's groups and 
+   IDs, changes to the job's directory and executes the command with a 
+   minimal environment. The command is run directly if it is a simple
+   list of words; if it contains any shell syntax it is given to 
+   /bin/sh. Never returns.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Without root, runs only the runner's owner's jobs
+             By: agent
+-  17.10.26  Sets SIMQ_TASK_ID for a task of a job array   By: agent
+*/
+void ExecJob(char *queueDir, JOBINFO *job, struct passwd *pwd)
+{
+   char *envp[MAXJOBENV],
+        *argv[MAXJOBARGS+1],
+        envBuff[MAXJOBENV][MAXBUFF+NAME_MAX],
+        cmd[MAXBUFF];
+   int  nEnv = 0,
+        fh;
+
+   /* Put the job in its own process group, detached from the runner    */
+   setsid();
+
+   if((fh = open("/dev/null", O_RDONLY)) != (-1))
+   {
+      dup2(fh, 0);
+      if(fh > 2)
+         close(fh);
+   }
+   
+   /* Drop to the job owner. A runner that isn't root can only run its
+      owner's jobs
+   */
+   if(geteuid() != 0)
+   {
+      if(pwd->pw_uid != geteuid())
+      {
+         Message(PROGNAME, MSG_ERROR, 
+                 "Jobs of other users can only be run by root");
+         _exit(126);
+      }
+   }
+   else if((initgroups(pwd->pw_name, pwd->pw_gid) != 0) ||
+      (setgid(pwd->pw_gid) != 0) ||
+      (setuid(pwd->pw_uid) != 0))
+   {
+      Message(PROGNAME, MSG_ERROR, "Unable to switch to job owner");
+      _exit(126);
+   }
+   
+   if(chdir(job->pwd) != 0)
+   {
+      char msg[MAXBUFF+NAME_MAX];
+      sprintf(msg, "Job %d: cannot change directory to %s", 
+              job->jobID, job->pwd);
+      Message(PROGNAME, MSG_ERROR, msg);
+      _exit(126);
+   }
+
+   /* Build the environment                                             */
+   sprintf(envBuff[nEnv], "HOME=%s",        pwd->pw_dir);
+   envp[nEnv] = envBuff[nEnv]; nEnv++;
+   sprintf(envBuff[nEnv], "USER=%s",        pwd->pw_name);
+   envp[nEnv] = envBuff[nEnv]; nEnv++;
+   sprintf(envBuff[nEnv], "LOGNAME=%s",     pwd->pw_name);
+   envp[nEnv] = envBuff[nEnv]; nEnv++;
+   sprintf(envBuff[nEnv], "SHELL=%s",       pwd->pw_shell);
+   envp[nEnv] = envBuff[nEnv]; nEnv++;
+   sprintf(envBuff[nEnv], "PATH=%s",        JOBPATH);
+   envp[nEnv] = envBuff[nEnv]; nEnv++;
+   sprintf(envBuff[nEnv], "PWD=%s",         job->pwd);
+   envp[nEnv] = envBuff[nEnv]; nEnv++;
+   sprintf(envBuff[nEnv], "SIMQ_JOB_ID=%d", job->jobID);
+   envp[nEnv] = envBuff[nEnv]; nEnv++;
+   sprintf(envBuff[nEnv], "SIMQ_QUEUE=%s",  queueDir);
+   envp[nEnv] = envBuff[nEnv]; nEnv++;
+   if(job->nTasks)
+   {
+      sprintf(envBuff[nEnv], "SIMQ_TASK_ID=%d", job->task);
+      envp[nEnv] = envBuff[nEnv]; nEnv++;
+   }
+   envp[nEnv] = NULL;
+
+   /* Anything needing a shell is run with /bin/sh                      */
+   if(strpbrk(job->cmd, SHELLCHARS) != NULL)
+   {
+      argv[0] = "sh";
+      argv[1] = "-c";
+      argv[2] = job->cmd;
+      argv[3] = NULL;
+      execve("/bin/sh", argv, envp);
+   }
+   else
+   {
+      int  nArgs = 0;
+      char *word;
+      
+      strcpy(cmd, job->cmd);
+      for(word = strtok(cmd, " \t"); 
+          (word != NULL) && (nArgs < MAXJOBARGS); 
+          word = strtok(NULL, " \t"))
+      {
+         argv[nArgs++] = word;
+      }
+      argv[nArgs] = NULL;
+
+      if(nArgs)
+      {
+         if(strchr(argv[0], '/') != NULL)
+            execve(argv[0], argv, envp);
+         else
+            ExecSearchPath(argv[0], argv, envp);
+      }
+   }
+   
+   {
+      char msg[MAXBUFF+NAME_MAX];
+      sprintf(msg, "Job %d: unable to run %s", job->jobID, job->cmd);
+      Message(PROGNAME, MSG_ERROR, msg);
+   }
+   _exit(127);
+}
+
+
+/************************************************************************/
+/*>void ExecSearchPath(char *file, char **argv, char **envp)
+   ---------------------------------------------------------
+*//**
+   \param[in]   file        Program name
+   \param[in]   argv        Arguments
+   \param[in]   envp        Environment
+
+   Looks for a program in each directory of JOBPATH and executes it.
+   Only returns if the program can't be run.
+
+-  17.10.26  Original   By: agent
+*/
+void ExecSearchPath(char *file, char **argv, char **envp)
+{
+   char path[MAXBUFF],
+        dirs[MAXBUFF],
+        *dir;
+   
+   strcpy(dirs, JOBPATH);
+   for(dir = strtok(dirs, ":"); dir != NULL; dir = strtok(NULL, ":"))
+   {
+      sprintf(path, "%s/%s", dir, file);
+      execve(path, argv, envp);
+   }
+}
+
+
+/************************************************************************/
+/*>BOOL MakeSocketAddress(char *queueDir, struct sockaddr_un *addr)
+   ----------------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[out]  addr        Address of the queue's socket
+   \return                  Does the path fit in the address?
+
+-  17.10.26  Original   By: agent
+*/
+BOOL MakeSocketAddress(char *queueDir, struct sockaddr_un *addr)
+{
+   memset(addr, 0, sizeof(struct sockaddr_un));
+   addr->sun_family = AF_UNIX;
+   if(strlen(queueDir) + strlen(SOCKETFILE) + 2 > sizeof(addr->sun_path))
+      return(FALSE);
+   sprintf(addr->sun_path, "%s/%s", queueDir, SOCKETFILE);
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>int OpenServerSocket(char *queueDir, int verbose)
+   -------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   verbose     Verbosity level
+   \return                  Listening socket (-1 if none)
+
+   Creates the socket on which the runner accepts requests. Any user may
+   connect; the runner finds out who they are from the connection. If
+   the socket can't be created the runner carries on using job files
+   alone, but if another runner is already answering on it we give up.
+   A socket that someone else is listening on is removed and replaced.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Replaces a socket made by someone else   By: agent
+*/
+int OpenServerSocket(char *queueDir, int verbose)
+{
+   struct sockaddr_un addr;
+   int                sock;
+   
+   if(!MakeSocketAddress(queueDir, &addr))
+   {
+      Message(PROGNAME, MSG_WARNING, 
+              "Queue directory name is too long for a socket");
+      return(-1);
+   }
+
+   if((sock = ConnectDaemon(queueDir)) >= 0)
+   {
+      close(sock);
+      Message(PROGNAME, MSG_FATAL, 
+              "Another runner is already using this queue");
+   }
+
+   /* Remove the socket left by a previous runner or someone else     */
+   unlink(addr.sun_path);
+   
+   if(((sock = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 
+                      0)) < 0) ||
+      (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+      (chmod(addr.sun_path, 0666) != 0) ||
+      (listen(sock, SOMAXCONN) != 0))
+   {
+      Message(PROGNAME, MSG_WARNING, 
+              "Cannot create socket - accepting job files only");
+      if(sock >= 0)
+         close(sock);
+      return(-1);
+   }
+
+   if(verbose >= 2)
+   {
+      Message(PROGNAME, MSG_INFO, "Listening for requests");
+   }
+   
+   return(sock);
+}
+
+
+/************************************************************************/
+/*>int ConnectDaemon(char *queueDir)
+   ---------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \return                  Connection to the runner (-1 if there isn't
+                            one running)
+
+   Anyone can make a socket in the queue directory while the runner 
+   isn't running, so the socket is only used if the process listening
+   on it is root's or the queue directory owner's.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Checks who is listening on the socket   By: agent
+*/
+int ConnectDaemon(char *queueDir)
+{
+   struct sockaddr_un addr;
+   struct ucred       cred;
+   socklen_t          credLen = sizeof(cred);
+   int                sock;
+   
+   if(!MakeSocketAddress(queueDir, &addr))
+      return(-1);
+   if((sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+      return(-1);
+   if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+   {
+      close(sock);
+      return(-1);
+   }
+   if((getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) != 0) ||
+      !QueueOwner(queueDir, cred.uid))
+   {
+      Message(PROGNAME, MSG_WARNING, "The queue's socket was not made \
+by the queue manager - not using it");
+      close(sock);
+      return(-1);
+   }
+   return(sock);
+}
+
+
+/************************************************************************/
+/*>void AcceptClient(RUNNER *runner)
+   ---------------------------------
+*//**
+   \param[in,out] runner   The job runner
+
+   Accepts a new connection and records who has connected.
+
+-  17.10.26  Original   By: agent
+*/
+void AcceptClient(RUNNER *runner)
+{
+   struct ucred cred;
+   socklen_t    credLen = sizeof(cred);
+   CLIENT       *client;
+   int          fd;
+   
+   while((fd = accept4(runner->listenFd, NULL, NULL, 
+                       SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0)
+   {
+      if((runner->nClients >= MAXCLIENTS) ||
+         (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) != 0))
+      {
+         close(fd);
+         continue;
+      }
+      
+      client               = &(runner->clients[runner->nClients++]);
+      client->fd           = fd;
+      client->uid          = cred.uid;
+      client->state        = CLIENT_IDLE;
+      client->waitJobID    = 0;
+      client->lastPosition = (-1);
+      client->nBuff        = 0;
+   }
+}
+
+
+/************************************************************************/
+/*>BOOL ReadClient(RUNNER *runner, int clientNum)
+   ----------------------------------------------
+*//**
+   \param[in,out] runner     The job runner
+   \param[in]     clientNum  Client to read from
+   \return                   Should the connection be kept?
+
+   Reads whatever a client has sent and handles each complete line as
+   a request.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ReadClient(RUNNER *runner, int clientNum)
+{
+   CLIENT  *client = &(runner->clients[clientNum]);
+   ssize_t nRead;
+   char    *start,
+           *end;
+   
+   nRead = recv(client->fd, client->buffer + client->nBuff, 
+                SOCKBUFF - 1 - client->nBuff, 0);
+   if(nRead == 0)
+      return(FALSE);
+   if(nRead < 0)
+      return((errno == EAGAIN) || (errno == EINTR));
+
+   client->nBuff += (int)nRead;
+   client->buffer[client->nBuff] = '\0';
+
+   for(start = client->buffer; 
+       (end = strchr(start, '\n')) != NULL;
+       start = end + 1)
+   {
+      *end = '\0';
+      if(!HandleRequest(runner, client, start))
+         return(FALSE);
+   }
+
+   /* Keep any partial line for next time                               */
+   client->nBuff -= (int)(start - client->buffer);
+   memmove(client->buffer, start, client->nBuff);
+
+   if(client->nBuff >= SOCKBUFF - 1)
+   {
+      SendToClient(client, "ERR Request too long\n");
+      return(FALSE);
+   }
+   
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL HandleRequest(RUNNER *runner, CLIENT *client, char *request)
+   -----------------------------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in,out] client    Client making the request
+   \param[in,out] request   The request (modified)
+   \return                  Should the connection be kept?
+
+   Handles one request. These are:
+
+   SUBMIT pwd=dir [mem=N] [login=1] [pri=N] [tasks=first-last]
+          [time=N] arg=program [arg=parameter ...]
+      Queue a job for the client. Values are escaped with EscapeString().
+      Replies OK jobID jobsInQueue, followed by SAME if dedup is given
+      and the same job is waiting, running or finished
+   STATUS
+      Replies OK jobsWaiting jobsRunning expectedWait (s, -1 if not
+      known)
+   STATUS jobID
+      Replies POS jobsBefore, RUNNING or NOTFOUND
+   WAIT jobID
+      Replies POS jobsBefore each time this changes, then RUNNING when 
+      the job starts and DONE exitStatus when it finishes; or NOTFOUND.
+      A job array is running once its first task starts and DONE gives
+      the number of tasks that failed when the last one finishes
+
+   Errors are replied to with ERR and a message.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Submitted jobs go in the ring if there is one   By: agent
+-  17.10.26  Added pri. Submitted jobs are added to the heap and 
+             positions are taken from it   By: agent
+-  17.10.26  Added tasks   By: agent
+-  17.10.26  Added time   By: agent
+-  17.10.26  STATUS gives the expected wait   By: agent
+-  17.10.26  Added dedup   By: agent
+-  17.10.26  A runner that isn't root refuses other users' jobs
+             By: agent
+*/
+BOOL HandleRequest(RUNNER *runner, CLIENT *client, char *request)
+{
+   char reply[MAXBUFF],
+        *word;
+   int  jobID;
+   
+   if((word = strtok(request, " \t\r")) == NULL)
+      return(TRUE);
+
+   if(!strcmp(word, "SUBMIT"))
+   {
+      char    *progArgs[MAXSUBMITARGS];
+      int     nProgArgs = 0,
+              nJobs;
+      JOBINFO job;
+
+      job.mem      = 0;
+      job.login    = FALSE;
+      job.uid      = client->uid;
+      job.priority = 0;
+      job.estimate = 0;
+      job.queued   = time(NULL);
+      job.nTasks   = 0;
+      job.first    = 0;
+      job.task     = 0;
+      job.dedup    = 0;
+      job.pwd[0]   = '\0';
+      job.cmd[0]   = '\0';
+      
+      if(client->uid == 0)
+      {
+         return(SendToClient(client, 
+                             "ERR Jobs may not be submitted by root\n"));
+      }
+
+      while((word = strtok(NULL, " \t\r")) != NULL)
+      {
+         char *value;
+         
+         if((value = strchr(word, '=')) == NULL)
+            return(SendToClient(client, "ERR Bad request\n"));
+         *(value++) = '\0';
+         UnescapeString(value);
+         
+         if(!strcmp(word, "pwd") && (strlen(value) < MAXBUFF))
+         {
+            strcpy(job.pwd, value);
+         }
+         else if(!strcmp(word, "mem"))
+         {
+            sscanf(value, "%d", &(job.mem));
+         }
+         else if(!strcmp(word, "login"))
+         {
+            job.login = (value[0] == '1');
+         }
+         else if(!strcmp(word, "pri"))
+         {
+            sscanf(value, "%d", &(job.priority));
+         }
+         else if(!strcmp(word, "tasks"))
+         {
+            if(!ParseTaskRange(value, &job))
+               return(SendToClient(client, "ERR Bad task range\n"));
+         }
+         else if(!strcmp(word, "time"))
+         {
+            sscanf(value, "%d", &(job.estimate));
+         }
+         else if(!strcmp(word, "dedup"))
+         {
+            sscanf(value, "%lx", &(job.dedup));
+         }
+         else if(!strcmp(word, "arg") && (nProgArgs < MAXSUBMITARGS))
+         {
+            progArgs[nProgArgs++] = value;
+         }
+      }
+
+      if((job.pwd[0] != '/') || (nProgArgs == 0) || (job.mem < 0) ||
+         (job.priority < -MAXPRIORITY) || (job.priority > MAXPRIORITY) ||
+         (job.estimate < 0))
+         return(SendToClient(client, "ERR Bad request\n"));
+      if(!CanRunJob(client->uid))
+         return(SendToClient(client, "ERR This queue manager only runs \
+its owner's jobs\n"));
+
+      if(job.dedup && ((jobID = SameJob(runner, &job)) >= 0))
+      {
+         if(runner->verbose >= 2)
+         {
+            char msg[MAXBUFF];
+            sprintf(msg, "Job %d resubmitted by uid %d", jobID,
+                    (int)client->uid);
+            Message(PROGNAME, MSG_INFO, msg);
+         }
+         runner->metrics.deduplicated++;
+         sprintf(reply, "OK %d %d SAME\n", jobID, runner->nWaiting);
+         return(SendToClient(client, reply));
+      }
+
+      if(runner->ring)
+      {
+         jobID = RingQueueJob(runner, progArgs, nProgArgs, &job, &nJobs);
+      }
+      else if((jobID = QueueJob(runner->queueDir, progArgs, nProgArgs, 
+                                &job, &nJobs)) >= 0)
+      {
+         int i,
+             length = 0;
+         
+         /* The command as in the job file, for the journal             */
+         for(i=0; i<nProgArgs; i++)
+         {
+            if((length += (int)strlen(progArgs[i]) + 1) >= MAXBUFF)
+               break;
+            strcat(job.cmd, progArgs[i]);
+            strcat(job.cmd, " ");
+         }
+         job.jobID = jobID;
+         AddWaiting(runner, &job, -1);
+      }
+      if(jobID < 0)
+         return(SendToClient(client, "ERR Unable to queue job\n"));
+      
+      if(runner->verbose >= 2)
+      {
+         char msg[MAXBUFF];
+         sprintf(msg, "Job %d submitted by uid %d", jobID, 
+                 (int)client->uid);
+         Message(PROGNAME, MSG_INFO, msg);
+      }
+      
+      runner->changed = TRUE;
+      sprintf(reply, "OK %d %d\n", jobID, nJobs);
+      return(SendToClient(client, reply));
+   }
+   else if(!strcmp(word, "STATUS") || !strcmp(word, "WAIT"))
+   {
+      BOOL wait = !strcmp(word, "WAIT");
+      
+      if((word = strtok(NULL, " \t\r")) == NULL)
+      {
+         COUNTERS counters;
+         
+         if(wait)
+            return(SendToClient(client, "ERR Bad request\n"));
+         if(!ReadCounters(runner->queueDir, &counters))
+            return(SendToClient(client, "ERR Cannot read counters\n"));
+         sprintf(reply, "OK %d %d %ld\n", counters.depth, 
+                 runner->nRunning, 
+                 ExpectedStart(runner));
+         return(SendToClient(client, reply));
+      }
+
+      if(sscanf(word, "%d", &jobID) != 1)
+         return(SendToClient(client, "ERR Bad request\n"));
+
+      {
+         BOOL ok;
+         
+         client->state        = CLIENT_WAITING;
+         client->waitJobID    = jobID;
+         client->lastPosition = (-1);
+
+         ok = TellWaiter(runner, client);
+
+         /* A STATUS client only gets the one reply                     */
+         if(!wait)
+            client->state = CLIENT_IDLE;
+         return(ok);
+      }
+   }
+
+   return(SendToClient(client, "ERR Unknown request\n"));
+}
+
+
+/************************************************************************/
+/*>BOOL SendToClient(CLIENT *client, char *reply)
+   ----------------------------------------------
+*//**
+   \param[in]   client    Client to send to
+   \param[in]   reply     Text to send
+   \return                Was it sent?
+
+   Replies are short so they go straight into the socket buffer. A
+   client that isn't reading its replies is dropped rather than being
+   allowed to hold up the runner.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL SendToClient(CLIENT *client, char *reply)
+{
+   ssize_t len = (ssize_t)strlen(reply);
+   
+   if(client->fd < 0)
+      return(FALSE);
+   return(send(client->fd, reply, len, MSG_NOSIGNAL|MSG_DONTWAIT) == len);
+}
+
+
+/************************************************************************/
+/*>void DropClient(RUNNER *runner, int clientNum)
+   ----------------------------------------------
+*//**
+   \param[in,out] runner     The job runner
+   \param[in]     clientNum  Client to drop
+
+   Closes a connection. The last client takes its place.
+
+-  17.10.26  Original   By: agent
+*/
+void DropClient(RUNNER *runner, int clientNum)
+{
+   close(runner->clients[clientNum].fd);
+   runner->clients[clientNum] = runner->clients[--runner->nClients];
+}
+
+
+/************************************************************************/
+/*>void NotifyWaiters(RUNNER *runner)
+   -----------------------------------
+*//**
+   \param[in,out] runner     The job runner
+
+   Tells each client waiting for a job where it now is in the queue,
+   or that it is running. Clients are only sent a position when it has
+   changed. Clients whose job has gone are told so and stop waiting.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Takes the list of waiting jobs from PublishQueue()
+             By: agent
+-  17.10.26  Positions come from the heap   By: agent
+*/
+void NotifyWaiters(RUNNER *runner)
+{
+   int i;
+   
+   for(i=runner->nClients-1; i>=0; i--)
+   {
+      if(runner->clients[i].state != CLIENT_WAITING)
+         continue;
+
+      if(!TellWaiter(runner, &(runner->clients[i])))
+         DropClient(runner, i);
+   }
+}
+
+
+/************************************************************************/
+/*>BOOL TellWaiter(RUNNER *runner, CLIENT *client)
+   -----------------------------------------------
+*//**
+   \param[in]     runner    The job runner
+   \param[in,out] client    A client waiting for a job
+   \return                  Could the client be sent to?
+
+   Tells a client where its job is in the queue if this has changed,
+   or that it is running or can't be found.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The position comes from the heap   By: agent
+*/
+BOOL TellWaiter(RUNNER *runner, CLIENT *client)
+{
+   char reply[MAXBUFF];
+   int  i,
+        position;
+   
+   for(i=0; i<runner->nRunning; i++)
+   {
+      if(runner->running[i].jobID == client->waitJobID)
+      {
+         client->state = CLIENT_RUNNING;
+         return(SendToClient(client, "RUNNING\n"));
+      }
+   }
+
+   if((position = WaitingPosition(runner, client->waitJobID)) < 0)
+   {
+      client->state = CLIENT_IDLE;
+      return(SendToClient(client, "NOTFOUND\n"));
+   }
+
+   if(position != client->lastPosition)
+   {
+      client->lastPosition = position;
+      sprintf(reply, "POS %d\n", position);
+      return(SendToClient(client, reply));
+   }
+   
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>void NotifyJobDone(RUNNER *runner, int jobID, int status)
+   ---------------------------------------------------------
+*//**
+   \param[in,out] runner     The job runner
+   \param[in]     jobID      Job that has finished
+   \param[in]     status     Its exit status (-1 if killed)
+
+   Tells clients waiting for a job that it has finished.
+
+-  17.10.26  Original   By: agent
+*/
+void NotifyJobDone(RUNNER *runner, int jobID, int status)
+{
+   char reply[MAXBUFF];
+   int  i;
+
+   sprintf(reply, "DONE %d\n", status);
+   
+   for(i=runner->nClients-1; i>=0; i--)
+   {
+      CLIENT *client = &(runner->clients[i]);
+      
+      if((client->state != CLIENT_IDLE) && (client->waitJobID == jobID))
+      {
+         client->state = CLIENT_IDLE;
+         if(!SendToClient(client, reply))
+            DropClient(runner, i);
+      }
+   }
+}
+
+
+/************************************************************************/
+/*>int ListJobFiles(char *queueDir, int **jobIDs)
+   ----------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[out]  jobIDs      Sorted array of job IDs (malloc'd, NULL if
+                            there are none)
+   \return                  Number of job files
+
+   Lists the waiting job files in the queue directory and its 
+   subdirectories.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Renamed from ListWaitingJobs()   By: agent
+-  17.10.26  Reads subdirectories of job files   By: agent
+*/
+int ListJobFiles(char *queueDir, int **jobIDs)
+{
+   struct dirent *dirp;
+   JOBDIR        jobDir;
+   int           nJobs    = 0,
+                 maxJobs  = 0;
+
+   *jobIDs = NULL;
+   
+   if(!OpenJobDir(queueDir, &jobDir))
+      return(0);
+
+   while((dirp = ReadJobDir(&jobDir)) != NULL)
+   {
+      int jobID;
+      
+      if(IsJobFileName(dirp->d_name) && 
+         !IsRunningFileName(dirp->d_name) &&
+         (sscanf(dirp->d_name, "%d", &jobID) == 1) &&
+         !AddJobID(jobIDs, &nJobs, &maxJobs, jobID))
+         break;
+   }
+   
+   CloseJobDir(&jobDir);
+
+   if(nJobs)
+      qsort(*jobIDs, nJobs, sizeof(int), CompareInts);
+   
+   return(nJobs);
+}
+
+
+/************************************************************************/
+/*>int CompareInts(const void *a, const void *b)
+   ---------------------------------------------
+*//**
+   qsort() comparison function for integers
+
+-  17.10.26  Original   By: agent
+*/
+int CompareInts(const void *a, const void *b)
+{
+   int ia = *(const int *)a,
+       ib = *(const int *)b;
+   
+   return((ia > ib) - (ia < ib));
+}
+
+
+/************************************************************************/
+/*>void EscapeString(char *in, char *out, int outSize)
+   ---------------------------------------------------
+*//**
+   \param[in]   in          String to escape
+   \param[out]  out         Escaped string
+   \param[in]   outSize     Size of out
+
+   Escapes a string so that it contains no white space, = or %. These
+   are written as %XX in hex. out is left empty if it is too small.
+
+-  17.10.26  Original   By: agent
+*/
+void EscapeString(char *in, char *out, int outSize)
+{
+   int n = 0;
+   
+   for(; *in; in++)
+   {
+      if(n + 4 > outSize)
+      {
+         out[0] = '\0';
+         return;
+      }
+      
+      if(isspace((unsigned char)*in) || (*in == '=') || (*in == '%') ||
+         !isprint((unsigned char)*in))
+      {
+         sprintf(out+n, "%%%02X", (unsigned char)*in);
+         n += 3;
+      }
+      else
+      {
+         out[n++] = *in;
+      }
+   }
+   out[n] = '\0';
+}
+
+
+/************************************************************************/
+/*>void UnescapeString(char *string)
+   ---------------------------------
+*//**
+   \param[in,out] string    String to unescape in place
+
+   Reverses EscapeString()
+
+-  17.10.26  Original   By: agent
+*/
+void UnescapeString(char *string)
+{
+   char *out = string;
+   
+   for(; *string; string++)
+   {
+      unsigned int ch;
+      
+      if((*string == '%') && isxdigit((unsigned char)string[1]) &&
+         isxdigit((unsigned char)string[2]) && 
+         (sscanf(string+1, "%2x", &ch) == 1))
+      {
+         *(out++) = (char)ch;
+         string += 2;
+      }
+      else
+      {
+         *(out++) = *string;
+      }
+   }
+   *out = '\0';
+}
+
+
+/************************************************************************/
+/*>BOOL ReadReply(int sock, char *reply, int size, int timeout)
+   ------------------------------------------------------------
+*//**
+   \param[in]   sock        Connection to the runner
+   \param[out]  reply       Line read (without the newline)
+   \param[in]   size        Size of reply
+   \param[in]   timeout     Time to wait (s, -1 for ever)
+   \return                  Was a line read?
+
+   Reads one line from the runner. Replies are short and infrequent so
+   this simply reads a character at a time.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ReadReply(int sock, char *reply, int size, int timeout)
+{
+   int n = 0;
+   
+   while(n < size - 1)
+   {
+      struct pollfd pfd;
+      char          ch;
+      ssize_t       nRead;
+      
+      pfd.fd      = sock;
+      pfd.events  = POLLIN;
+      pfd.revents = 0;
+      if(poll(&pfd, 1, (timeout < 0) ? (-1) : timeout * 1000) <= 0)
+      {
+         if(errno == EINTR)
+            continue;
+         return(FALSE);
+      }
+      
+      if((nRead = read(sock, &ch, 1)) < 0)
+      {
+         if(errno == EINTR)
+            continue;
+         return(FALSE);
+      }
+      if(nRead == 0)
+         return(FALSE);
+      if(ch == '\n')
+         break;
+      reply[n++] = ch;
+   }
+   reply[n] = '\0';
+   
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL SendRequest(int sock, char *request, char *reply)
+   ------------------------------------------------------
+*//**
+   \param[in]   sock        Connection to the runner
+   \param[in]   request     Request line including the newline
+   \param[out]  reply       First line of the reply (MAXBUFF)
+   \return                  Was a reply received?
+
+-  17.10.26  Original   By: agent
+*/
+BOOL SendRequest(int sock, char *request, char *reply)
+{
+   size_t len = strlen(request);
+   
+   if(send(sock, request, len, MSG_NOSIGNAL) != (ssize_t)len)
+      return(FALSE);
+   return(ReadReply(sock, reply, MAXBUFF, SOCKTIMEOUT));
+}
+
+
+/************************************************************************/
+/*>BOOL SubmitViaDaemon(char *queueDir, char **progArgs, int nProgArgs,
+                        JOBINFO *job, int *jobID, int *nJobsWaiting)
+   --------------------------------------------------------------------
+*//**
+   \param[in]   queueDir      Queue directory
+   \param[in]   progArgs      Program and arguments in an array
+   \param[in]   nProgArgs     Number of items in progArgs
+   \param[in]   job           Options for the job
+   \param[out]  jobID         Job ID (-1 if the runner refused the job)
+   \param[out]  nJobsWaiting  Number of jobs in the queue
+   \return                    Was the request made? If not, the job 
+                              should be written to the queue directly
+
+   Asks the runner to queue a job. This saves the submitter creating
+   the job file itself and tells the runner about the job at once.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Sends the priority   By: agent
+-  17.10.26  Sends the tasks of a job array   By: agent
+-  17.10.26  Sends the run time   By: agent
+-  17.10.26  Sends the hash for -d and reports a job that was
+             already submitted   By: agent
+*/
+BOOL SubmitViaDaemon(char *queueDir, char **progArgs, int nProgArgs,
+                     JOBINFO *job, int *jobID, int *nJobsWaiting)
+{
+   char request[SOCKBUFF],
+        escaped[SOCKBUFF],
+        escapedPwd[3*MAXBUFF],
+        reply[MAXBUFF];
+   int  sock,
+        i;
+   BOOL ok;
+   
+   *jobID        = (-1);
+   *nJobsWaiting = 0;
+
+   /* Build the request                                                 */
+   EscapeString(job->pwd, escapedPwd, 3*MAXBUFF);
+   sprintf(request, "SUBMIT mem=%d login=%d pri=%d pwd=%s", 
+           job->mem, (job->login ? 1 : 0), job->priority, escapedPwd);
+   if(job->nTasks)
+   {
+      sprintf(escaped, " tasks=%d-%d", job->first, 
+              job->first + job->nTasks - 1);
+      strcat(request, escaped);
+   }
+   if(job->estimate)
+   {
+      sprintf(escaped, " time=%d", job->estimate);
+      strcat(request, escaped);
+   }
+   if(job->dedup)
+   {
+      sprintf(escaped, " dedup=%lx", job->dedup);
+      strcat(request, escaped);
+   }
+   for(i=0; i<nProgArgs; i++)
+   {
+      EscapeString(progArgs[i], escaped, SOCKBUFF);
+      if(!escaped[0] || 
+         (strlen(request) + strlen(escaped) + 7 >= SOCKBUFF))
+         return(FALSE);
+      strcat(request, " arg=");
+      strcat(request, escaped);
+   }
+   strcat(request, "\n");
+
+   if((sock = ConnectDaemon(queueDir)) < 0)
+      return(FALSE);
+
+   ok = SendRequest(sock, request, reply);
+   close(sock);
+
+   if(!ok)
+   {
+      /* The job may or may not have been queued so don't try again     */
+      Message(PROGNAME, MSG_ERROR, "No reply from the queue manager");
+   }
+   else if(sscanf(reply, "OK %d %d", jobID, nJobsWaiting) != 2)
+   {
+      char msg[MAXBUFF+16];
+      
+      *jobID = (-1);
+      sprintf(msg, "Queue manager: %s", 
+              (strncmp(reply, "ERR ", 4) ? reply : reply+4));
+      Message(PROGNAME, MSG_ERROR, msg);
+   }
+   else if(strstr(reply, " SAME") != NULL)
+   {
+      Message(PROGNAME, MSG_INFO, 
+              "The same job was already submitted - not run again");
+   }
+   
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL CountdownViaDaemon(char *queueDir, int jobInfoID)
+   ------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   jobInfoID   Job ID to monitor
+   \return                  Was the runner able to answer? If not, 
+                            use CountdownJob()
+
+   As CountdownJob(), but the runner tells us each time the number of 
+   jobs before ours changes rather than our polling the queue.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL CountdownViaDaemon(char *queueDir, int jobInfoID)
+{
+   char request[MAXBUFF],
+        reply[MAXBUFF];
+   int  sock,
+        position;
+   BOOL gotReply;
+   
+   if((sock = ConnectDaemon(queueDir)) < 0)
+      return(FALSE);
+
+   sprintf(request, "WAIT %d\n", jobInfoID);
+   for(gotReply = SendRequest(sock, request, reply);
+       gotReply;
+       gotReply = ReadReply(sock, reply, MAXBUFF, -1))
+   {
+      if(sscanf(reply, "POS %d", &position) == 1)
+      {
+         printf("Jobs before your job: %d\n", position);
+         fflush(stdout);
+      }
+      else if(!strcmp(reply, "RUNNING"))
+      {
+         printf("Running your job\n");
+         break;
+      }
+      else
+      {
+         printf("Job not found (completed?)\n");
+         break;
+      }
+   }
+
+   close(sock);
+   return(gotReply);
+}
+
+
+/************************************************************************/
+/*>void PublishQueue(RUNNER *runner)
+   ---------------------------------
+*//**
+   \param[in,out] runner     The job runner
+
+   Called when jobs have been added, started or finished. Tells 
+   everyone who is watching the queue: clients waiting on the socket
+   and readers of the snapshot.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The snapshot of a ring doesn't need the list of waiting 
+             jobs, so it is only made if a client is waiting   By: agent
+-  17.10.26  The waiting jobs are taken from the heap rather than read
+             from the queue   By: agent
+*/
+void PublishQueue(RUNNER *runner)
+{
+   runner->changed = FALSE;
+   NotifyWaiters(runner);
+   UpdateSnapshot(runner);
+}
+
+
+/************************************************************************/
+/*>size_t SnapshotSize(int capacity)
+   ---------------------------------
+*//**
+   \param[in]   capacity    Number of jobs
+   \return                  Size of a snapshot holding that many jobs
+
+-  17.10.26  Original   By: agent
+*/
+size_t SnapshotSize(int capacity)
+{
+   return(sizeof(SNAPSHOT) + (capacity - 1) * sizeof(SNAPJOB));
+}
+
+
+/************************************************************************/
+/*>SNAPSHOT *CreateSnapshot(char *queueDir, int capacity)
+   ------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   capacity    Number of jobs it must hold
+   \return                  The mapped snapshot (NULL on error)
+
+   Creates an empty snapshot file and moves it into place. It is 
+   readable by everyone but only the runner can change it.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Made in STATEDIR   By: agent
+*/
+SNAPSHOT *CreateSnapshot(char *queueDir, int capacity)
+{
+   char     tmpFile[MAXBUFF],
+            snapFile[MAXBUFF];
+   int      fh;
+   size_t   size = SnapshotSize(capacity);
+   SNAPSHOT *snapshot;
+   
+   StateFile(queueDir, SNAPTMPFILE, tmpFile);
+   StateFile(queueDir, SNAPFILE,    snapFile);
+
+   if((fh = open(tmpFile, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0)
+   {
+      Message(PROGNAME, MSG_WARNING, "Cannot create queue snapshot");
+      return(NULL);
+   }
+   
+   if((fchmod(fh, 0644) != 0) || (ftruncate(fh, (off_t)size) != 0) ||
+      ((snapshot = (SNAPSHOT *)mmap(NULL, size, PROT_READ|PROT_WRITE, 
+                                    MAP_SHARED, fh, 0)) == MAP_FAILED))
+   {
+      Message(PROGNAME, MSG_WARNING, "Cannot create queue snapshot");
+      close(fh);
+      unlink(tmpFile);
+      return(NULL);
+   }
+   close(fh);
+
+   snapshot->magic    = SNAPMAGIC;
+   snapshot->version  = 0;
+   snapshot->moved    = 0;
+   snapshot->capacity = capacity;
+   snapshot->nRunning = 0;
+   snapshot->nWaiting = 0;
+   snapshot->pid      = getpid();
+   snapshot->newStart = 0;
+
+   if(rename(tmpFile, snapFile) != 0)
+   {
+      Message(PROGNAME, MSG_WARNING, "Cannot create queue snapshot");
+      munmap(snapshot, size);
+      unlink(tmpFile);
+      return(NULL);
+   }
+
+   return(snapshot);
+}
+
+
+/************************************************************************/
+/*>void UpdateSnapshot(RUNNER *runner)
+   -----------------------------------
+*//**
+   \param[in,out] runner     The job runner
+
+   Writes the current state of the queue to the snapshot. This is a 
+   seqlock: the version is made odd while the snapshot is written and 
+   even again afterwards, so a reader knows to try again if the version
+   changed while it was reading. Anyone waiting for the version to 
+   change is then woken.
+
+   The waiting jobs are listed in the order they will run. Those that
+   were in the previous snapshot are still in order, so only the jobs
+   added to the heap since then need to be sorted, and the two lists 
+   are merged. If the snapshot is too small, a bigger one replaces it 
+   and readers of the old one are told to move.
+
+   A job array is listed once, with the number of its tasks running. It
+   is listed with the waiting jobs until its last task has started.
+
+   Each job is given the times it is expected to start and finish (see
+   PredictSnapshot()).
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Reads the ring if there is one   By: agent
+-  17.10.26  Takes the waiting jobs and their owners from the heap
+             By: agent
+-  17.10.26  Lists each job array once with its tasks   By: agent
+-  17.10.26  Predicts when jobs will start and finish   By: agent
+*/
+void UpdateSnapshot(RUNNER *runner)
+{
+   SNAPSHOT *old     = runner->snapshot,
+            *snapshot;
+   WAITING  *waiting = NULL,
+            *added   = NULL;
+   int      nJobs    = 0,
+            nKept    = 0,
+            nAdded   = 0,
+            i,
+            n;
+   
+   if(old == NULL)
+      return;
+
+   if(runner->nWaiting &&
+      (((waiting = (WAITING *)malloc(2 * runner->nWaiting * 
+                                     sizeof(WAITING))) == NULL)))
+   {
+      for(i=0; i<runner->nWaiting; i++)
+         runner->waiting[i].listed = FALSE;
+   }
+   else if(runner->nWaiting)
+   {
+      SNAPJOB *oldJobs = old->jobs + old->nRunning;
+      
+      /* The jobs still waiting from the last snapshot, in order        */
+      for(i=0; i<old->nWaiting; i++)
+      {
+         int pos;
+         
+         if(((pos = FindWaiting(runner, oldJobs[i].jobID)) >= 0) &&
+            runner->waiting[pos].listed)
+            waiting[nKept++] = runner->waiting[pos];
+      }
+      
+      /* The new jobs, sorted                                           */
+      added = waiting + runner->nWaiting;
+      for(i=0; i<runner->nWaiting; i++)
+      {
+         if(!runner->waiting[i].listed)
+         {
+            added[nAdded++] = runner->waiting[i];
+            runner->waiting[i].listed = TRUE;
+         }
+      }
+      qsort(added, nAdded, sizeof(WAITING), CompareWaiting);
+      
+      /* Merge them, working back from the end                          */
+      nJobs = nKept + nAdded;
+      for(i=nJobs-1; nAdded; i--)
+      {
+         if(nKept && RunsBefore(&(added[nAdded-1]), &(waiting[nKept-1])))
+            waiting[i] = waiting[--nKept];
+         else
+            waiting[i] = added[--nAdded];
+      }
+   }
+
+   snapshot = old;
+   if(runner->nRunning + nJobs > old->capacity)
+   {
+      if((snapshot = CreateSnapshot(runner->queueDir, 
+                                    2 * (runner->nRunning + nJobs)))
+         == NULL)
+      {
+         snapshot = old;
+
+         /* Those left out must be added next time                      */
+         for(i=old->capacity - runner->nRunning; i<nJobs; i++)
+            runner->waiting[FindWaiting(runner, 
+                                        waiting[i].jobID)].listed = FALSE;
+         nJobs = old->capacity - runner->nRunning;
+      }
+   }
+
+   __sync_add_and_fetch(&(snapshot->version), 1);
+
+   n = 0;
+   for(i=0; i<runner->nRunning; i++)
+   {
+      RUNNING   *job = &(runner->running[i]);
+      TASKARRAY *array;
+      
+      snapshot->jobs[n].jobID   = job->jobID;
+      snapshot->jobs[n].uid     = job->uid;
+      snapshot->jobs[n].running = 1;
+      snapshot->jobs[n].nTasks  = 0;
+      snapshot->jobs[n].nDone   = 0;
+      snapshot->jobs[n].priority = job->priority;
+      snapshot->jobs[n].queued   = job->queued;
+      if((job->task >= 0) && 
+         ((array = FindArray(runner, job->jobID)) != NULL))
+      {
+         int j;
+
+         /* Only the first task is listed                               */
+         for(j=0; j<i; j++)
+         {
+            if(runner->running[j].jobID == job->jobID)
+               break;
+         }
+         if((j < i) || (FindWaiting(runner, job->jobID) >= 0))
+            continue;
+         snapshot->jobs[n].running = array->nRunning;
+         snapshot->jobs[n].nTasks  = array->nTasks;
+         snapshot->jobs[n].nDone   = array->nDone;
+      }
+      n++;
+   }
+   snapshot->nRunning = n;
+   for(i=0; i<nJobs; i++)
+   {
+      TASKARRAY *array;
+
+      snapshot->jobs[n].jobID   = waiting[i].jobID;
+      snapshot->jobs[n].uid     = waiting[i].uid;
+      snapshot->jobs[n].running = 0;
+      snapshot->jobs[n].nTasks  = waiting[i].nTasks;
+      snapshot->jobs[n].nDone   = 0;
+      snapshot->jobs[n].priority = waiting[i].priority;
+      snapshot->jobs[n].queued   = waiting[i].queued;
+      if(waiting[i].nTasks && 
+         ((array = FindArray(runner, waiting[i].jobID)) != NULL))
+      {
+         snapshot->jobs[n].running = array->nRunning;
+         snapshot->jobs[n].nDone   = array->nDone;
+      }
+      n++;
+   }
+
+   snapshot->nWaiting = nJobs;
+   PredictSnapshot(runner, snapshot, waiting, nJobs);
+   
+   __sync_add_and_fetch(&(snapshot->version), 1);
+   syscall(SYS_futex, &(snapshot->version), FUTEX_WAKE, INT_MAX, 
+           NULL, NULL, 0);
+
+   if(snapshot != old)
+   {
+      old->moved = 1;
+      __sync_add_and_fetch(&(old->version), 2);
+      syscall(SYS_futex, &(old->version), FUTEX_WAKE, INT_MAX, 
+              NULL, NULL, 0);
+      munmap(old, SnapshotSize(old->capacity));
+      runner->snapshot = snapshot;
+   }
+
+   if(waiting != NULL)
+      free(waiting);
+}
+
+
+/************************************************************************/
+/*>SNAPSHOT *MapSnapshot(char *queueDir, size_t *size)
+   ---------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[out]  size        Size of the mapping
+   \return                  The snapshot mapped read-only (NULL if there
+                            isn't a valid one)
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Read from STATEDIR   By: agent
+*/
+SNAPSHOT *MapSnapshot(char *queueDir, size_t *size)
+{
+   char        snapFile[MAXBUFF];
+   int         fh;
+   struct stat statBuff;
+   SNAPSHOT    *snapshot;
+   
+   StateFile(queueDir, SNAPFILE, snapFile);
+   if((fh = open(snapFile, O_RDONLY|O_CLOEXEC)) < 0)
+      return(NULL);
+
+   if((fstat(fh, &statBuff) != 0) || 
+      (statBuff.st_size < (off_t)sizeof(SNAPSHOT)))
+   {
+      close(fh);
+      return(NULL);
+   }
+
+   *size    = (size_t)statBuff.st_size;
+   snapshot = (SNAPSHOT *)mmap(NULL, *size, PROT_READ, MAP_SHARED, fh, 0);
+   close(fh);
+   if(snapshot == MAP_FAILED)
+      return(NULL);
+
+   if((snapshot->magic != SNAPMAGIC) || (snapshot->capacity < 1) ||
+      (SnapshotSize(snapshot->capacity) > *size))
+   {
+      munmap(snapshot, *size);
+      return(NULL);
+   }
+   
+   return(snapshot);
+}
+
+
+/************************************************************************/
+/*>BOOL RunnerAlive(SNAPSHOT *snapshot)
+   ------------------------------------
+*//**
+   \param[in]   snapshot    A snapshot
+   \return                  Is the runner that wrote it still running?
+
+-  17.10.26  Original   By: agent
+*/
+BOOL RunnerAlive(SNAPSHOT *snapshot)
+{
+   if(snapshot->pid <= 0)
+      return(FALSE);
+   return((kill(snapshot->pid, 0) == 0) || (errno == EPERM));
+}
+
+
+/************************************************************************/
+/*>int CopySnapshot(SNAPSHOT *snapshot, SNAPJOB **jobs, int *nRunning,
+                    int *version)
+   -------------------------------------------------------------------
+*//**
+   \param[in]   snapshot    A mapped snapshot
+   \param[out]  jobs        Copy of the jobs (malloc'd)
+   \param[out]  nRunning    Number of running jobs at the start of jobs
+   \param[out]  version     Version of the snapshot copied
+   \return                  Number of jobs (-1 if a consistent copy 
+                            couldn't be made)
+
+   Copies the jobs from the snapshot, trying again if the runner 
+   updated it while it was being read.
+
+-  17.10.26  Original   By: agent
+*/
+int CopySnapshot(SNAPSHOT *snapshot, SNAPJOB **jobs, int *nRunning,
+                 int *version)
+{
+   volatile SNAPSHOT *snap = snapshot;
+   int               tries,
+                     maxJobs = 0;
+
+   *jobs = NULL;
+   
+   for(tries=0; tries<SNAPRETRIES; tries++)
+   {
+      int v1, n;
+      
+      if((v1 = snap->version) & 1)
+      {
+         sched_yield();
+         continue;
+      }
+      __sync_synchronize();
+
+      *nRunning = snap->nRunning;
+      n         = *nRunning + snap->nWaiting;
+      if((n < 0) || (n > snap->capacity) || (*nRunning < 0))
+         continue;
+      
+      if(n > maxJobs)
+      {
+         SNAPJOB *newJobs;
+         
+         if((newJobs = (SNAPJOB *)realloc(*jobs, n * sizeof(SNAPJOB)))
+            == NULL)
+            break;
+         *jobs   = newJobs;
+         maxJobs = n;
+      }
+      memcpy(*jobs, (SNAPJOB *)snap->jobs, n * sizeof(SNAPJOB));
+
+      __sync_synchronize();
+      if(snap->version == v1)
+      {
+         *version = v1;
+         return(n);
+      }
+   }
+
+   if(*jobs != NULL)
+   {
+      free(*jobs);
+      *jobs = NULL;
+   }
+   return(-1);
+}
+
+
+/************************************************************************/
+/*>BOOL CountdownFromSnapshot(char *queueDir, int jobInfoID, 
+                              int sleepTime)
+   ---------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   jobInfoID   Job ID to monitor
+   \param[in]   sleepTime   Longest time to wait between checks
+   \return                  Could the snapshot be used? If not, use 
+                            CountdownViaDaemon() or CountdownJob()
+
+   As CountdownJob(), but reads the runner's snapshot of the queue
+   rather than the queue directory, and sleeps until the runner changes
+   the snapshot rather than polling. A job array is running once any of
+   its tasks is.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Handles job arrays   By: agent
+-  17.10.26  Job files may be in subdirectories   By: agent
+-  17.10.26  Gives the predicted start and finish   By: agent
+-  17.10.26  Zeroes the job it copies from the snapshot   By: agent
+*/
+BOOL CountdownFromSnapshot(char *queueDir, int jobInfoID, 
+                           int sleepTime)
+{
+   SNAPSHOT *snapshot;
+   size_t   size;
+   int      prevJobCount = (-1),
+            running      = 0;
+   
+   if((snapshot = MapSnapshot(queueDir, &size)) == NULL)
+      return(FALSE);
+
+   while(TRUE)
+   {
+      SNAPJOB         *jobs,
+                      mine = {0};
+      int             nJobs,
+                      nRunning,
+                      version,
+                      i;
+      struct timespec timeout;
+      
+      if(!RunnerAlive(snapshot))
+      {
+         munmap(snapshot, size);
+         return(FALSE);
+      }
+
+      if(snapshot->moved)
+      {
+         munmap(snapshot, size);
+         if((snapshot = MapSnapshot(queueDir, &size)) == NULL)
+            return(FALSE);
+         continue;
+      }
+      
+      if((nJobs = CopySnapshot(snapshot, &jobs, &nRunning, &version)) 
+         < 0)
+      {
+         munmap(snapshot, size);
+         return(FALSE);
+      }
+
+      for(i=0; i<nJobs; i++)
+      {
+         if(jobs[i].jobID == jobInfoID)
+         {
+            running = jobs[i].running;
+            mine    = jobs[i];
+            break;
+         }
+      }
+      if(jobs != NULL)
+         free(jobs);
+
+      if((i < nRunning) || ((i < nJobs) && running))
+      {
+         printf("Running your job\n");
+         break;
+      }
+      else if(i < nJobs)
+      {
+         if(prevJobCount != i - nRunning)
+         {
+            prevJobCount = i - nRunning;
+            printf("Jobs before your job: %d", prevJobCount);
+            if(mine.start)
+            {
+               char start[MAXBUFF],
+                    finish[MAXBUFF],
+                    finishBy[MAXBUFF];
+               
+               FormatClock(mine.start,    start);
+               FormatClock(mine.finish,   finish);
+               FormatClock(mine.finishBy, finishBy);
+               printf(" (expected to start about %s, finish about %s, \
+by %s)", start, finish, finishBy);
+            }
+            printf("\n");
+            fflush(stdout);
+         }
+      }
+      else
+      {
+         char jobFile[MAXBUFF];
+
+         /* The runner may not have seen a new job yet                  */
+         if(!FindJobFile(queueDir, jobInfoID, "", jobFile))
+         {
+            printf("Job not found (completed?)\n");
+            break;
+         }
+      }
+
+      /* Sleep until the runner changes the snapshot                    */
+      timeout.tv_sec  = sleepTime;
+      timeout.tv_nsec = 0;
+      syscall(SYS_futex, &(snapshot->version), FUTEX_WAIT, version, 
+              &timeout, NULL, 0);
+   }
+
+   munmap(snapshot, size);
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL ListJobsFromSnapshot(char *queueDir)
+   -----------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \return                  Could the snapshot be used? 
+
+   Lists each job and its owner from the runner's snapshot of the queue.
+   Running jobs are listed first, then the waiting jobs in the order 
+   they will run.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Uses PrintJob()   By: agent
+-  17.10.26  Uses UserName()   By: agent
+-  17.10.26  Gives the expected wait for a new job   By: agent
+*/
+BOOL ListJobsFromSnapshot(char *queueDir)
+{
+   SNAPSHOT *snapshot;
+   SNAPJOB  *jobs;
+   size_t   size;
+   int      nJobs,
+            nRunning,
+            version,
+            i;
+   long     wait;
+   
+   if((snapshot = MapSnapshot(queueDir, &size)) == NULL)
+      return(FALSE);
+   if(!RunnerAlive(snapshot) || snapshot->moved ||
+      ((nJobs = CopySnapshot(snapshot, &jobs, &nRunning, &version)) < 0))
+   {
+      munmap(snapshot, size);
+      return(FALSE);
+   }
+   munmap(snapshot, size);
+
+   for(i=0; i<nJobs; i++)
+      PrintJob(&(jobs[i]), UserName(jobs[i].uid));
+
+   printf("Jobs waiting: %d\n", nJobs - nRunning);
+   if(nRunning)
+      printf("Jobs running: %d\n", nRunning);
+   if((wait = ExpectedWait(queueDir)) >= 0)
+   {
+      char waitText[MAXWAITTEXT];
+      FormatWait(wait, waitText);
+      printf("Expected wait for a new job: %s\n", waitText);
+   }
+
+   if(jobs != NULL)
+      free(jobs);
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL IsRingQueue(char *queueDir)
+   --------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \return                  Is the queue kept in a ring file?
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The ring is kept in STATEDIR   By: agent
+*/
+BOOL IsRingQueue(char *queueDir)
+{
+   char ringFile[MAXBUFF];
+   
+   StateFile(queueDir, RINGFILE, ringFile);
+   return(FileExists(ringFile));
+}
+
+
+/************************************************************************/
+/*>BOOL RingStep(char *data, int dataSize, int *offset, int *remaining,
+                 RINGRECORD **record)
+   --------------------------------------------------------------------
+*//**
+   \param[in]     data        Start of the ring's data area
+   \param[in]     dataSize    Size of the data area
+   \param[in,out] offset      Offset of the next record
+   \param[in,out] remaining   Bytes of the ring still to be walked
+   \param[out]    record      The record
+   \return                    Was there another record?
+
+   Steps through the records in a ring. Start with offset at the head
+   and remaining set to the bytes in use. A gap too small to hold a 
+   record at the end of the data area is skipped. Stops at anything 
+   that doesn't look like a record, so it is safe to use on a ring that
+   is being changed by the runner.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL RingStep(char *data, int dataSize, int *offset, int *remaining,
+              RINGRECORD **record)
+{
+   while(*remaining > 0)
+   {
+      RINGRECORD *rec;
+      
+      if((*offset < 0) || (*offset > dataSize))
+         return(FALSE);
+      
+      if(dataSize - *offset < (int)sizeof(RINGRECORD))
+      {
+         *remaining -= (dataSize - *offset);
+         *offset     = 0;
+         continue;
+      }
+
+      rec = (RINGRECORD *)(data + *offset);
+      if((rec->size < (int)sizeof(RINGRECORD)) || 
+         (rec->size > *remaining) ||
+         (rec->size > dataSize - *offset) ||
+         (rec->size % RINGALIGN))
+         return(FALSE);
+
+      *record     = rec;
+      *remaining -= rec->size;
+      *offset    += rec->size;
+      if(*offset == dataSize)
+         *offset = 0;
+      return(TRUE);
+   }
+   return(FALSE);
+}
+
+
+/************************************************************************/
+/*>RING *OpenRing(char *queueDir)
+   ------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \return                  The ring (NULL on error)
+
+   Called by the runner to open the queue's ring file, creating it if
+   needed. The ring is checked and anything after a damaged record is
+   dropped. Jobs that were running when the last runner stopped are
+   put back in the queue.
+
+   The file is kept in STATEDIR, where nobody else can make files, and
+   is only used if it belongs to the runner and can't be written by
+   anyone else. Only the runner writes to it, so the owner recorded for
+   each job can be trusted.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Kept in STATEDIR. Created with O_EXCL and refused unless 
+             it is the runner's own   By: agent
+*/
+RING *OpenRing(char *queueDir)
+{
+   char        ringFile[MAXBUFF];
+   struct stat statBuff;
+   RING        *ring;
+   RINGHEADER  *header;
+   RINGRECORD  *rec;
+   int         offset,
+               remaining,
+               valid     = 0;
+   
+   if((ring = (RING *)malloc(sizeof(RING))) == NULL)
+      return(NULL);
+   
+   ring->compacted = FALSE;
+   StateFile(queueDir, RINGFILE, ringFile);
+   if(((ring->fh = open(ringFile, O_RDWR|O_NOFOLLOW|O_CLOEXEC)) < 0) &&
+      (errno == ENOENT))
+   {
+      ring->fh = open(ringFile, 
+                      O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0644);
+   }
+   if((ring->fh < 0) ||
+      (fstat(ring->fh, &statBuff) != 0) ||
+      !S_ISREG(statBuff.st_mode) || (statBuff.st_nlink != 1) ||
+      (statBuff.st_uid != geteuid()) || (statBuff.st_mode & 022) ||
+      (fchmod(ring->fh, 0644) != 0))
+   {
+      if(ring->fh >= 0)
+         close(ring->fh);
+      free(ring);
+      return(NULL);
+   }
+
+   ring->size = (size_t)statBuff.st_size;
+   if(ring->size < sizeof(RINGHEADER) + RINGINITSIZE)
+   {
+      ring->size = sizeof(RINGHEADER) + RINGINITSIZE;
+      if(ftruncate(ring->fh, (off_t)ring->size) != 0)
+      {
+         close(ring->fh);
+         free(ring);
+         return(NULL);
+      }
+   }
+   
+   if((header = (RINGHEADER *)mmap(NULL, ring->size, 
+                                   PROT_READ|PROT_WRITE, MAP_SHARED, 
+                                   ring->fh, 0)) == MAP_FAILED)
+   {
+      close(ring->fh);
+      free(ring);
+      return(NULL);
+   }
+   ring->header = header;
+
+   if((header->magic != RINGMAGIC) ||
+      (header->dataSize != (int)(ring->size - sizeof(RINGHEADER))))
+   {
+      /* A new ring, or not one we can trust                            */
+      if(header->magic == RINGMAGIC)
+      {
+         Message(PROGNAME, MSG_WARNING, 
+                 "Queue file is damaged - starting a new queue");
+      }
+      memset(header, 0, sizeof(RINGHEADER));
+      header->magic    = RINGMAGIC;
+      header->dataSize = (int)(ring->size - sizeof(RINGHEADER));
+      return(ring);
+   }
+
+   /* Keep the records up to the first damaged one and requeue any
+      running jobs
+   */
+   RingBeginWrite(header);
+   header->nWaiting = 0;
+   header->nRunning = 0;
+   offset    = header->head;
+   remaining = header->used;
+   while(RingStep(RINGDATA(header), header->dataSize, &offset, 
+                  &remaining, &rec))
+   {
+      if(rec->state == RING_RUNNING)
+         rec->state = RING_WAITING;
+      if(rec->state == RING_WAITING)
+         header->nWaiting++;
+      valid = header->used - remaining;
+   }
+   if(remaining > 0)
+   {
+      Message(PROGNAME, MSG_WARNING, 
+              "Queue file is damaged - some jobs have been lost");
+      header->used = valid;
+      header->tail = (header->head + valid) % header->dataSize;
+   }
+   if(header->used == 0)
+   {
+      header->head = 0;
+      header->tail = 0;
+   }
+   RingEndWrite(header);
+
+   return(ring);
+}
+
+
+/************************************************************************/
+/*>void RingBeginWrite(RINGHEADER *header)
+   ---------------------------------------
+*//**
+   \param[in,out] header    Ring header
+
+   Marks the ring as being changed. The version is odd until 
+   RingEndWrite() is called, so readers know to try again.
+
+-  17.10.26  Original   By: agent
+*/
+void RingBeginWrite(RINGHEADER *header)
+{
+   if(!(header->version & 1))
+      __sync_add_and_fetch(&(header->version), 1);
+}
+
+
+/************************************************************************/
+/*>void RingEndWrite(RINGHEADER *header)
+   -------------------------------------
+*//**
+   \param[in,out] header    Ring header
+
+   Marks the end of a change to the ring.
+
+-  17.10.26  Original   By: agent
+*/
+void RingEndWrite(RINGHEADER *header)
+{
+   __sync_add_and_fetch(&(header->version), 1);
+}
+
+
+/************************************************************************/
+/*>BOOL GrowRing(RING *ring, int needed)
+   -------------------------------------
+*//**
+   \param[in,out] ring      The ring
+   \param[in]     needed    Bytes needed for a new record
+   \return                  Success?
+
+   Makes room in the ring. The records still in use are copied out, 
+   the file is extended if needed and they are written back from the 
+   start of the data area, dropping finished jobs and padding along 
+   the way. The file only ever grows, so readers with the old mapping 
+   can carry on until they notice the new size.
+
+   The ring is only made bigger if the records in use would fill more
+   than half of it. Otherwise the finished jobs stuck behind a job that
+   is still waiting would make it grow without limit.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Only grows the ring if compacting it doesn't free enough
+             space   By: agent
+*/
+BOOL GrowRing(RING *ring, int needed)
+{
+   RINGHEADER *header = ring->header;
+   RINGRECORD *rec;
+   char       *buffer;
+   int        offset,
+              remaining,
+              length    = 0,
+              dataSize;
+   size_t     size;
+
+   if((buffer = (char *)malloc(header->used + 1)) == NULL)
+      return(FALSE);
+
+   offset    = header->head;
+   remaining = header->used;
+   while(RingStep(RINGDATA(header), header->dataSize, &offset, 
+                  &remaining, &rec))
+   {
+      if((rec->state == RING_WAITING) || (rec->state == RING_RUNNING))
+      {
+         memcpy(buffer + length, rec, rec->size);
+         length += rec->size;
+      }
+   }
+
+   dataSize = header->dataSize;
+   while((dataSize - length < 2 * needed) || (length > dataSize / 2))
+      dataSize *= 2;
+   size = sizeof(RINGHEADER) + (size_t)dataSize;
+
+   if((size != ring->size) && (ftruncate(ring->fh, (off_t)size) != 0))
+   {
+      free(buffer);
+      return(FALSE);
+   }
+   
+   RingBeginWrite(header);
+   if(size != ring->size)
+   {
+      munmap(header, ring->size);
+      if((header = (RINGHEADER *)mmap(NULL, size, PROT_READ|PROT_WRITE, 
+                                      MAP_SHARED, ring->fh, 0)) 
+         == MAP_FAILED)
+      {
+         Message(PROGNAME, MSG_FATAL, "Cannot map the queue file");
+      }
+      ring->header = header;
+      ring->size   = size;
+   }
+   
+   memcpy(RINGDATA(header), buffer, length);
+   header->dataSize = dataSize;
+   header->head     = 0;
+   header->used     = length;
+   header->tail     = length;
+   RingEndWrite(header);
+   ring->compacted  = TRUE;
+
+   free(buffer);
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>int RingAppend(RING *ring, JOBINFO *job)
+   ----------------------------------------
+*//**
+   \param[in,out] ring      The ring
+   \param[in]     job       The job (with its ID and owner set)
+   \return                  Offset of its record (-1 on error)
+
+   Adds a job at the tail of the ring, growing it if there isn't room.
+   If the record won't fit before the end of the data area, the rest of
+   the area is padded and the record goes at the start.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Stores the priority and time queued. Returns the offset
+             By: agent
+-  17.10.26  Stores the tasks of a job array   By: agent
+-  17.10.26  Stores the run time   By: agent
+-  17.10.26  Stores the hash for -d   By: agent
+*/
+int RingAppend(RING *ring, JOBINFO *job)
+{
+   RINGHEADER *header;
+   RINGRECORD *rec;
+   int        pwdLen = (int)strlen(job->pwd),
+              cmdLen = (int)strlen(job->cmd),
+              size,
+              offset,
+              gap    = 0;
+   char       *extra;
+
+   size  = (int)sizeof(RINGRECORD) + pwdLen + cmdLen + 2;
+   if(job->nTasks)
+      size += (int)sizeof(int);
+   if(job->estimate)
+      size += (int)sizeof(int);
+   if(job->dedup)
+      size += (int)sizeof(unsigned long);
+   size += (RINGALIGN - (size % RINGALIGN)) % RINGALIGN;
+
+   while(TRUE)
+   {
+      header = ring->header;
+      
+      if(header->used == 0)
+      {
+         header->head = 0;
+         header->tail = 0;
+      }
+      
+      if(header->used + size <= header->dataSize)
+      {
+         if(header->tail >= header->head)
+         {
+            if(header->dataSize - header->tail >= size)
+            {
+               offset = header->tail;
+               break;
+            }
+            if(size <= header->head)
+            {
+               gap    = header->dataSize - header->tail;
+               offset = 0;
+               break;
+            }
+         }
+         else if(header->tail + size <= header->head)
+         {
+            offset = header->tail;
+            break;
+         }
+      }
+
+      if(!GrowRing(ring, size))
+      {
+         Message(PROGNAME, MSG_ERROR, "Cannot make the queue file bigger");
+         return(-1);
+      }
+   }
+
+   RingBeginWrite(header);
+   if(gap >= (int)sizeof(RINGRECORD))
+   {
+      rec = (RINGRECORD *)(RINGDATA(header) + header->tail);
+      memset(rec, 0, sizeof(RINGRECORD));
+      rec->size  = gap;
+      rec->state = RING_PAD;
+   }
+   header->used += gap;
+
+   rec = (RINGRECORD *)(RINGDATA(header) + offset);
+   rec->size   = size;
+   rec->jobID  = job->jobID;
+   rec->state  = RING_WAITING;
+   rec->mem    = job->mem;
+   rec->flags  = ((job->login ? RINGLOGIN : 0) |
+                  (job->estimate ? RINGESTIMATE : 0) |
+                  (job->dedup ? RINGDEDUP : 0));
+   rec->uid    = job->uid;
+   rec->pwdLen = pwdLen;
+   rec->cmdLen = cmdLen;
+   rec->priority = job->priority;
+   rec->queued   = job->queued;
+   rec->nTasks   = job->nTasks;
+   strcpy((char *)(rec+1), job->pwd);
+   strcpy((char *)(rec+1) + pwdLen + 1, job->cmd);
+   extra = (char *)(rec+1) + pwdLen + cmdLen + 2;
+   if(job->nTasks)
+   {
+      memcpy(extra, &(job->first), sizeof(int));
+      extra += sizeof(int);
+   }
+   if(job->estimate)
+   {
+      memcpy(extra, &(job->estimate), sizeof(int));
+      extra += sizeof(int);
+   }
+   if(job->dedup)
+      memcpy(extra, &(job->dedup), sizeof(unsigned long));
+
+   header->used += size;
+   header->tail  = (offset + size) % header->dataSize;
+   header->nWaiting++;
+   RingEndWrite(header);
+   
+   return(offset);
+}
+
+
+/************************************************************************/
+/*>RINGRECORD *RingFindJob(RING *ring, int jobID, int offset)
+   ----------------------------------------------------------
+*//**
+   \param[in]   ring        The ring
+   \param[in]   jobID       Job to find
+   \param[in]   offset      Where its record was last seen (-1 if not
+                            known)
+   \return                  Its record (NULL if it isn't waiting or 
+                            running)
+
+   The record is normally still at the offset it was added at, so the
+   ring only needs to be searched if it has been compacted since.
+
+-  17.10.26  Original   By: agent
+*/
+RINGRECORD *RingFindJob(RING *ring, int jobID, int offset)
+{
+   RINGHEADER *header = ring->header;
+   RINGRECORD *rec;
+   int        remaining;
+
+   if((offset >= 0) && !(offset % RINGALIGN) &&
+      (offset <= header->dataSize - (int)sizeof(RINGRECORD)))
+   {
+      rec = (RINGRECORD *)(RINGDATA(header) + offset);
+      if((rec->jobID == jobID) && 
+         ((rec->state == RING_WAITING) || (rec->state == RING_RUNNING)))
+         return(rec);
+   }
+
+   offset    = header->head;
+   remaining = header->used;
+   while(RingStep(RINGDATA(header), header->dataSize, &offset, 
+                  &remaining, &rec))
+   {
+      if((rec->jobID == jobID) && 
+         ((rec->state == RING_WAITING) || (rec->state == RING_RUNNING)))
+         return(rec);
+   }
+   return(NULL);
+}
+
+
+/************************************************************************/
+/*>void RingRecordJob(RINGRECORD *rec, JOBINFO *job)
+   -------------------------------------------------
+*//**
+   \param[in]   rec         A record from the ring
+   \param[out]  job         The job it holds
+
+-  17.10.26  Original - split out of RingNextWaiting()   By: agent
+-  17.10.26  Reads the tasks of a job array   By: agent
+-  17.10.26  Reads the run time   By: agent
+-  17.10.26  Reads the hash for -d   By: agent
+*/
+void RingRecordJob(RINGRECORD *rec, JOBINFO *job)
+{
+   char *extra = (char *)(rec+1) + rec->pwdLen + rec->cmdLen + 2;
+   
+   job->jobID    = rec->jobID;
+   job->mem      = rec->mem;
+   job->login    = (BOOL)(rec->flags & RINGLOGIN);
+   job->uid      = rec->uid;
+   job->priority = rec->priority;
+   job->queued   = rec->queued;
+   strncpy(job->pwd, (char *)(rec+1), MAXBUFF-1);
+   job->pwd[MAXBUFF-1] = '\0';
+   strncpy(job->cmd, (char *)(rec+1) + rec->pwdLen + 1, MAXBUFF-1);
+   job->cmd[MAXBUFF-1] = '\0';
+   job->nTasks   = rec->nTasks;
+   job->first    = 0;
+   job->task     = 0;
+   job->estimate = 0;
+   job->dedup    = 0;
+   if(rec->nTasks)
+   {
+      memcpy(&(job->first), extra, sizeof(int));
+      extra += sizeof(int);
+   }
+   if(rec->flags & RINGESTIMATE)
+   {
+      memcpy(&(job->estimate), extra, sizeof(int));
+      extra += sizeof(int);
+   }
+   if(rec->flags & RINGDEDUP)
+      memcpy(&(job->dedup), extra, sizeof(unsigned long));
+}
+
+
+/************************************************************************/
+/*>BOOL RingSetState(RING *ring, int jobID, int offset, int state)
+   ---------------------------------------------------------------
+*//**
+   \param[in,out] ring      The ring
+   \param[in]     jobID     Job to change
+   \param[in]     offset    Where its record was added (-1 if not known)
+   \param[in]     state     RING_WAITING, RING_RUNNING or RING_DONE
+   \return                  Was the job found?
+
+   Changes the state of a job. Finished jobs and padding at the head of
+   the ring are then released.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Uses RingFindJob()   By: agent
+*/
+BOOL RingSetState(RING *ring, int jobID, int offset, int state)
+{
+   RINGHEADER *header = ring->header;
+   RINGRECORD *rec;
+   int        remaining;
+
+   if((rec = RingFindJob(ring, jobID, offset)) == NULL)
+      return(FALSE);
+
+   RingBeginWrite(header);
+   if(rec->state == RING_WAITING) header->nWaiting--;
+   if(rec->state == RING_RUNNING) header->nRunning--;
+   rec->state = state;
+   if(state == RING_WAITING) header->nWaiting++;
+   if(state == RING_RUNNING) header->nRunning++;
+
+   /* Release finished jobs from the head                               */
+   offset    = header->head;
+   remaining = header->used;
+   while(RingStep(RINGDATA(header), header->dataSize, &offset, 
+                  &remaining, &rec))
+   {
+      if((rec->state != RING_DONE) && (rec->state != RING_PAD))
+         break;
+      header->head = offset;
+      header->used = remaining;
+   }
+   /* Skip a gap at the end of the data area                            */
+   if(header->used && 
+      (header->dataSize - header->head < (int)sizeof(RINGRECORD)))
+   {
+      header->used -= header->dataSize - header->head;
+      header->head  = 0;
+   }
+   if(header->used == 0)
+   {
+      header->head = 0;
+      header->tail = 0;
+   }
+   RingEndWrite(header);
+   
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>int CopyRingJobs(RINGHEADER *header, int dataSize, SNAPJOB **jobs, 
+                    int *nRunning)
+   -------------------------------------------------------------------
+*//**
+   \param[in]   header      Ring header
+   \param[in]   dataSize    Size of the data area that is mapped
+   \param[out]  jobs        The jobs (malloc'd): running jobs first, then
+                            waiting jobs in the order they will run
+   \param[out]  nRunning    Number of running jobs
+   \return                  Number of jobs (-1 if a consistent copy 
+                            couldn't be made)
+
+   Lists the jobs in a ring, trying again if the runner changes it 
+   while it is being read.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Lists the tasks of job arrays   By: agent
+-  17.10.26  Copies the priority and time queued   By: agent
+*/
+int CopyRingJobs(RINGHEADER *header, int dataSize, SNAPJOB **jobs, 
+                 int *nRunning)
+{
+   volatile RINGHEADER *hdr = header;
+   int                 tries;
+
+   *jobs = NULL;
+   
+   for(tries=0; tries<SNAPRETRIES; tries++)
+   {
+      RINGRECORD *rec;
+      int        version,
+                 offset,
+                 remaining,
+                 maxJobs,
+                 nWaiting = 0,
+                 n        = 0;
+      
+      if((version = hdr->version) & 1)
+      {
+         sched_yield();
+         continue;
+      }
+      __sync_synchronize();
+
+      if(hdr->dataSize != dataSize)
+         break;
+      offset    = hdr->head;
+      remaining = hdr->used;
+      if((offset < 0) || (offset >= dataSize) || (remaining < 0) ||
+         (remaining > dataSize))
+         continue;
+      maxJobs   = remaining / (int)sizeof(RINGRECORD) + 1;
+      
+      if(*jobs != NULL)
+         free(*jobs);
+      if((*jobs = (SNAPJOB *)malloc(2 * maxJobs * sizeof(SNAPJOB))) 
+         == NULL)
+         return(-1);
+
+      /* Running jobs go in the first half, waiting in the second        */
+      *nRunning = 0;
+      while(RingStep(RINGDATA(header), dataSize, &offset, &remaining, 
+                     &rec) && (n < maxJobs))
+      {
+         SNAPJOB *job;
+         
+         if(rec->state == RING_RUNNING)
+            job = *jobs + (*nRunning)++;
+         else if(rec->state == RING_WAITING)
+            job = *jobs + maxJobs + nWaiting++;
+         else
+            continue;
+         job->jobID   = rec->jobID;
+         job->uid     = rec->uid;
+         job->running = (rec->state == RING_RUNNING);
+         job->nTasks  = rec->nTasks;
+         job->nDone   = 0;
+         job->priority = rec->priority;
+         job->queued   = rec->queued;
+         job->start   = 0;
+         job->finish  = 0;
+         job->finishBy = 0;
+         n++;
+      }
+      
+      __sync_synchronize();
+      if(hdr->version == version)
+      {
+         memmove(*jobs + *nRunning, *jobs + maxJobs, 
+                 nWaiting * sizeof(SNAPJOB));
+         return(n);
+      }
+   }
+
+   if(*jobs != NULL)
+   {
+      free(*jobs);
+      *jobs = NULL;
+   }
+   return(-1);
+}
+
+
+/************************************************************************/
+/*>int ReadRing(char *queueDir, SNAPJOB **jobs, int *nRunning)
+   -----------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[out]  jobs        The jobs (malloc'd) as CopyRingJobs()
+   \param[out]  nRunning    Number of running jobs
+   \return                  Number of jobs (-1 if the ring can't be 
+                            read)
+
+   Lists the jobs in a queue's ring file. The file is mapped read-only.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The ring is kept in STATEDIR   By: agent
+*/
+int ReadRing(char *queueDir, SNAPJOB **jobs, int *nRunning)
+{
+   char        ringFile[MAXBUFF];
+   int         fh,
+               tries,
+               nJobs = (-1);
+
+   *jobs = NULL;
+   StateFile(queueDir, RINGFILE, ringFile);
+   
+   /* Map it again if the runner makes it bigger while we are reading   */
+   for(tries=0; (tries<SNAPRETRIES) && (nJobs < 0); tries++)
+   {
+      struct stat statBuff;
+      RINGHEADER  *header;
+      size_t      size;
+      int         dataSize;
+      
+      if((fh = open(ringFile, O_RDONLY|O_CLOEXEC)) < 0)
+         return(-1);
+      if((fstat(fh, &statBuff) != 0) ||
+         (statBuff.st_size < (off_t)sizeof(RINGHEADER)))
+      {
+         close(fh);
+         return(-1);
+      }
+      size   = (size_t)statBuff.st_size;
+      header = (RINGHEADER *)mmap(NULL, size, PROT_READ, MAP_SHARED, 
+                                  fh, 0);
+      close(fh);
+      if(header == MAP_FAILED)
+         return(-1);
+
+      dataSize = (int)(size - sizeof(RINGHEADER));
+      if(header->magic != RINGMAGIC)
+      {
+         munmap(header, size);
+         return(-1);
+      }
+      if(header->dataSize > dataSize)
+      {
+         munmap(header, size);
+         continue;
+      }
+      
+      nJobs = CopyRingJobs(header, header->dataSize, jobs, nRunning);
+      munmap(header, size);
+   }
+
+   return(nJobs);
+}
+
+
+/************************************************************************/
+/*>int RingQueueJob(RUNNER *runner, char **progArgs, int nProgArgs, 
+                    JOBINFO *job, int *nJobsWaiting)
+   ----------------------------------------------------------------
+*//**
+   \param[in,out] runner        The job runner
+   \param[in]     progArgs      Program and arguments
+   \param[in]     nProgArgs     Number of items in progArgs
+   \param[in,out] job           The job (pwd, owner and options set)
+   \param[out]    nJobsWaiting  Number of jobs in the queue
+   \return                      Job ID (-1 on error)
+
+   As QueueJob(), but adds the job to the ring rather than writing a
+   job file. The job is also added to the heap.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Adds the job to the heap   By: agent
+-  17.10.26  Uses ChangeCounters()   By: agent
+*/
+int RingQueueJob(RUNNER *runner, char **progArgs, int nProgArgs, 
+                 JOBINFO *job, int *nJobsWaiting)
+{
+   COUNTERS counters;
+   int      i,
+            offset,
+            length = 0;
+
+   *nJobsWaiting = 0;
+
+   /* Join the arguments as they would be in a job file                 */
+   job->cmd[0] = '\0';
+   for(i=0; i<nProgArgs; i++)
+   {
+      length += (int)strlen(progArgs[i]) + 1;
+      if(length >= MAXBUFF)
+      {
+         Message(PROGNAME, MSG_ERROR, "Command is too long");
+         return(-1);
+      }
+      strcat(job->cmd, progArgs[i]);
+      strcat(job->cmd, " ");
+   }
+   
+   if(!ChangeCounters(runner->queueDir, 1, 1, 0, &counters))
+   {
+      Message(PROGNAME, MSG_ERROR, "Cannot open queue counters");
+      return(-1);
+   }
+   job->jobID = counters.seq;
+   
+   if((offset = RingAppend(runner->ring, job)) < 0)
+   {
+      ChangeCounters(runner->queueDir, 0, -1, 0, &counters);
+      return(-1);
+   }
+   AddWaiting(runner, job, offset);
+
+   *nJobsWaiting = counters.depth + counters.running;
+   
+   return(job->jobID);
+}
+
+
+/************************************************************************/
+/*>void ImportJobFiles(RUNNER *runner)
+   -----------------------------------
+*//**
+   \param[in,out] runner   The job runner
+
+   Moves any job files in the queue directory into the ring, in job ID
+   order, and adds them to the heap. These are written by simq when the
+   runner isn't listening on its socket, and by -b. The owner of the 
+   job is the owner of the file. A job the runner can't run is left as
+   a job file.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Adds the jobs to the heap. ReadJobFile() now sets the 
+             owner   By: agent
+-  17.10.26  Job files may be in subdirectories   By: agent
+-  17.10.26  Leaves jobs it can't run as job files   By: agent
+*/
+void ImportJobFiles(RUNNER *runner)
+{
+   int *jobIDs = NULL,
+       nJobs,
+       offset,
+       i;
+
+   runner->newFiles = FALSE;
+   
+   nJobs = ListJobFiles(runner->queueDir, &jobIDs);
+   for(i=0; i<nJobs; i++)
+   {
+      char    jobFile[MAXBUFF];
+      JOBINFO job;
+      
+      FindJobFile(runner->queueDir, jobIDs[i], "", jobFile);
+      if(!ReadJobFile(runner->queueDir, jobIDs[i], &job) ||
+         !CanRunJob(job.uid))
+         continue;
+      
+      if((offset = RingAppend(runner->ring, &job)) >= 0)
+      {
+         unlink(jobFile);
+         AddWaiting(runner, &job, offset);
+         runner->changed = TRUE;
+      }
+   }
+   
+   if(nJobs && (runner->verbose >= 2))
+   {
+      char msg[MAXBUFF];
+      sprintf(msg, "Moved %d job files into the queue file", nJobs);
+      Message(PROGNAME, MSG_INFO, msg);
+   }
+   
+   if(jobIDs != NULL)
+      free(jobIDs);
+}
+
+
+/************************************************************************/
+/*>BOOL RunsBefore(WAITING *a, WAITING *b)
+   ---------------------------------------
+*//**
+   \param[in]   a           A waiting job
+   \param[in]   b           Another waiting job
+   \return                  Should a run before b?
+
+   Jobs with a higher priority run first. A job gains a priority level
+   for every gAgeTime seconds it has waited, so that low priority jobs
+   are not held up for ever. As every job ages at the same rate, this
+   is the same as comparing priority * gAgeTime - time queued, which 
+   doesn't change as time passes, so the heap never has to be 
+   reordered. Jobs that are otherwise equal run in job ID order.
+
+   With -F, each job's fair share time (see FairStart()) is used in 
+   place of the time it was queued.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Uses the start time, which is the fair share time with -F
+             By: agent
+*/
+BOOL RunsBefore(WAITING *a, WAITING *b)
+{
+   if(gAgeTime)
+   {
+      double rankA = (double)a->priority * gAgeTime - a->start,
+             rankB = (double)b->priority * gAgeTime - b->start;
+      
+      if(rankA != rankB)
+         return(rankA > rankB);
+   }
+   else if(a->priority != b->priority)
+   {
+      return(a->priority > b->priority);
+   }
+   else if(gFairShare && (a->start != b->start))
+   {
+      return(a->start < b->start);
+   }
+   return(a->jobID < b->jobID);
+}
+
+
+/************************************************************************/
+/*>int CompareWaiting(const void *a, const void *b)
+   ------------------------------------------------
+*//**
+   qsort() comparison function to put waiting jobs in the order they 
+   will run
+
+-  17.10.26  Original   By: agent
+*/
+int CompareWaiting(const void *a, const void *b)
+{
+   WAITING *wa = (WAITING *)a,
+           *wb = (WAITING *)b;
+   
+   if(RunsBefore(wa, wb))
+      return(-1);
+   if(RunsBefore(wb, wa))
+      return(1);
+   return(0);
+}
+
+
+/************************************************************************/
+/*>int IndexSlot(RUNNER *runner, int jobID)
+   ----------------------------------------
+*//**
+   \param[in]   runner      The job runner
+   \param[in]   jobID       Job to look for
+   \return                  Slot in the index holding the job, or the
+                            empty slot where it would go
+
+   The index is an open addressed hash table, so the heap position of
+   a job can be found without searching the heap.
+
+-  17.10.26  Original   By: agent
+*/
+int IndexSlot(RUNNER *runner, int jobID)
+{
+   unsigned int slot = JOBHASH(jobID, runner->indexSize);
+   
+   while(runner->index[slot] &&
+         (runner->waiting[runner->index[slot]-1].jobID != jobID))
+   {
+      slot = (slot + 1) & (runner->indexSize - 1);
+   }
+   return((int)slot);
+}
+
+
+/************************************************************************/
+/*>BOOL BuildIndex(RUNNER *runner, int indexSize)
+   ----------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     indexSize Number of slots (a power of 2)
+   \return                  Success?
+
+   Makes a new index of the jobs in the heap.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL BuildIndex(RUNNER *runner, int indexSize)
+{
+   int *index,
+       i;
+   
+   if((index = (int *)calloc(indexSize, sizeof(int))) == NULL)
+      return(FALSE);
+
+   if(runner->index != NULL)
+      free(runner->index);
+   runner->index     = index;
+   runner->indexSize = indexSize;
+
+   for(i=0; i<runner->nWaiting; i++)
+   {
+      runner->index[IndexSlot(runner, runner->waiting[i].jobID)] = i+1;
+   }
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>void SwapWaiting(RUNNER *runner, int a, int b)
+   ----------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     a         Position in the heap
+   \param[in]     b         Another position in the heap
+
+   Swaps two jobs in the heap and updates the index.
+
+-  17.10.26  Original   By: agent
+*/
+void SwapWaiting(RUNNER *runner, int a, int b)
+{
+   WAITING tmp;
+   int     slotA = IndexSlot(runner, runner->waiting[a].jobID),
+           slotB = IndexSlot(runner, runner->waiting[b].jobID);
+   
+   tmp                = runner->waiting[a];
+   runner->waiting[a] = runner->waiting[b];
+   runner->waiting[b] = tmp;
+   
+   runner->index[slotA] = b+1;
+   runner->index[slotB] = a+1;
+}
+
+
+/************************************************************************/
+/*>void SiftWaiting(RUNNER *runner, int pos)
+   -----------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     pos       Position of a job that may be out of place
+
+   Moves a job up or down the heap until it is in the right place.
+
+-  17.10.26  Original   By: agent
+*/
+void SiftWaiting(RUNNER *runner, int pos)
+{
+   WAITING *waiting = runner->waiting;
+   
+   while((pos > 0) && RunsBefore(&(waiting[pos]), &(waiting[(pos-1)/2])))
+   {
+      SwapWaiting(runner, pos, (pos-1)/2);
+      pos = (pos-1)/2;
+   }
+
+   while(TRUE)
+   {
+      int child = 2*pos + 1,
+          first = pos;
+      
+      if((child < runner->nWaiting) && 
+         RunsBefore(&(waiting[child]), &(waiting[first])))
+         first = child;
+      if((child+1 < runner->nWaiting) && 
+         RunsBefore(&(waiting[child+1]), &(waiting[first])))
+         first = child+1;
+      if(first == pos)
+         break;
+      SwapWaiting(runner, pos, first);
+      pos = first;
+   }
+}
+
+
+/************************************************************************/
+/*>BOOL AddWaiting(RUNNER *runner, JOBINFO *job, int offset)
+   ---------------------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     job       A waiting job (ID, owner, priority and time
+                            queued set)
+   \param[in]     offset    Offset of its record in the ring (-1 if 
+                            none)
+   \return                  Was it added? (FALSE if it was already in
+                            the heap)
+
+   Adds a job to the heap of waiting jobs.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Keeps the number of tasks of a job array   By: agent
+-  17.10.26  Gives the job its fair share time with -F   By: agent
+-  17.10.26  Records the job in the journal   By: agent
+-  17.10.26  Keeps the memory and run time for backfilling   By: agent
+-  17.10.26  Keeps the shape of the command for predicting its run 
+             time   By: agent
+-  17.10.26  Remembers jobs submitted with -d   By: agent
+*/
+BOOL AddWaiting(RUNNER *runner, JOBINFO *job, int offset)
+{
+   WAITING *entry;
+   int     pos;
+   
+   if(FindWaiting(runner, job->jobID) >= 0)
+      return(FALSE);
+   
+   if(runner->nWaiting == runner->maxWaiting)
+   {
+      WAITING *waiting;
+      int     maxWaiting = (runner->maxWaiting ? 
+                            2 * runner->maxWaiting : 64);
+      
+      if((waiting = (WAITING *)realloc(runner->waiting, 
+                                       maxWaiting * sizeof(WAITING)))
+         == NULL)
+      {
+         Message(PROGNAME, MSG_ERROR, "No memory for waiting job");
+         return(FALSE);
+      }
+      runner->waiting    = waiting;
+      runner->maxWaiting = maxWaiting;
+   }
+
+   pos             = runner->nWaiting++;
+   entry           = &(runner->waiting[pos]);
+   entry->jobID    = job->jobID;
+   entry->priority = job->priority;
+   entry->offset   = offset;
+   entry->mem      = job->mem;
+   entry->estimate = job->estimate;
+   entry->shape    = CommandShape(job->cmd, NULL);
+   if(job->dedup)
+      RememberJob(runner, job);
+   entry->uid      = job->uid;
+   entry->queued   = job->queued;
+   entry->start    = (runner->fairShare ? FairStart(runner, job) : 
+                      (double)job->queued);
+   entry->nTasks   = job->nTasks;
+   entry->listed   = FALSE;
+
+   /* Keep the index no more than half full                             */
+   if(2 * runner->nWaiting > runner->indexSize)
+   {
+      if(!BuildIndex(runner, (runner->indexSize ? 
+                              2 * runner->indexSize : 128)))
+      {
+         Message(PROGNAME, MSG_ERROR, "No memory for waiting job");
+         runner->nWaiting--;
+         return(FALSE);
+      }
+   }
+   else
+   {
+      runner->index[IndexSlot(runner, job->jobID)] = pos+1;
+   }
+   
+   SiftWaiting(runner, pos);
+   runner->changed = TRUE;
+   JournalJob(runner, JOURNAL_SUBMITTED, job->jobID, -1, 0, job);
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>int FindWaiting(RUNNER *runner, int jobID)
+   ------------------------------------------
+*//**
+   \param[in]   runner      The job runner
+   \param[in]   jobID       Job to look for
+   \return                  Its position in the heap (-1 if it isn't 
+                            there)
+
+-  17.10.26  Original   By: agent
+*/
+int FindWaiting(RUNNER *runner, int jobID)
+{
+   if(runner->indexSize == 0)
+      return(-1);
+   return(runner->index[IndexSlot(runner, jobID)] - 1);
+}
+
+
+/************************************************************************/
+/*>void RemoveWaiting(RUNNER *runner, int jobID)
+   ---------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     jobID     Job to remove
+
+   Removes a job from the heap. Its slot in the index is emptied and
+   any later entries that would no longer be found are moved back into
+   it. The last job in the heap then takes its place.
+
+-  17.10.26  Original   By: agent
+*/
+void RemoveWaiting(RUNNER *runner, int jobID)
+{
+   unsigned int mask = runner->indexSize - 1,
+                hole,
+                slot;
+   int          pos,
+                last;
+   
+   if((pos = FindWaiting(runner, jobID)) < 0)
+      return;
+
+   hole = slot = (unsigned int)IndexSlot(runner, jobID);
+   while(TRUE)
+   {
+      unsigned int home;
+      
+      slot = (slot + 1) & mask;
+      if(!runner->index[slot])
+         break;
+      
+      /* Leave the entry if its home slot is after the hole            */
+      home = JOBHASH(runner->waiting[runner->index[slot]-1].jobID,
+                     runner->indexSize);
+      if((hole <= slot) ? ((hole < home) && (home <= slot))
+                        : ((hole < home) || (home <= slot)))
+         continue;
+      
+      runner->index[hole] = runner->index[slot];
+      hole = slot;
+   }
+   runner->index[hole] = 0;
+
+   last = --runner->nWaiting;
+   if(pos != last)
+   {
+      runner->index[IndexSlot(runner, runner->waiting[last].jobID)] =
+         pos+1;
+      runner->waiting[pos] = runner->waiting[last];
+      SiftWaiting(runner, pos);
+   }
+}
+
+
+/************************************************************************/
+/*>int WaitingPosition(RUNNER *runner, int jobID)
+   ----------------------------------------------
+*//**
+   \param[in]   runner      The job runner
+   \param[in]   jobID       Job to look for
+   \return                  Number of jobs that will run before it (-1
+                            if it isn't waiting)
+
+-  17.10.26  Original   By: agent
+*/
+int WaitingPosition(RUNNER *runner, int jobID)
+{
+   int pos,
+       position = 0,
+       i;
+   
+   if((pos = FindWaiting(runner, jobID)) < 0)
+      return(-1);
+   
+   for(i=0; i<runner->nWaiting; i++)
+   {
+      if(RunsBefore(&(runner->waiting[i]), &(runner->waiting[pos])))
+         position++;
+   }
+   return(position);
+}
+
+
+/************************************************************************/
+/*>BOOL AddJobFile(RUNNER *runner, int jobID)
+   ------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     jobID     A job file that has appeared
+   \return                  Was the job added to the heap?
+
+   With -S, the subdirectory for the next range of job IDs is made
+   before it is needed. A job the runner can't run is left in the queue
+   for a runner that can.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Makes subdirectories for new job IDs   By: agent
+-  17.10.26  Leaves jobs it can't run in the queue   By: agent
+*/
+BOOL AddJobFile(RUNNER *runner, int jobID)
+{
+   JOBINFO job;
+   
+   if(runner->useShards)
+      MakeShards(runner, jobID);
+   if(FindWaiting(runner, jobID) >= 0)
+      return(FALSE);
+   if(!ReadJobFile(runner->queueDir, jobID, &job) || 
+      !CanRunJob(job.uid))
+      return(FALSE);
+   return(AddWaiting(runner, &job, -1));
+}
+
+
+/************************************************************************/
+/*>void ScanJobFiles(RUNNER *runner)
+   ---------------------------------
+*//**
+   \param[in,out] runner    The job runner
+
+   Brings the heap into line with the job files in the queue directory.
+   This is done when the runner starts and at the slow fallback poll, 
+   in case inotify events were lost or job files were removed by hand.
+   Only the new job files are read.
+
+   Subdirectories of job files are only read if they have changed since
+   they were last read, so a long queue doesn't have to be read in full
+   each time. Jobs in those that haven't changed are left alone.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Reads subdirectories of job files that have changed
+             By: agent
+-  17.10.26  Records jobs that have gone in the journal   By: agent
+*/
+void ScanJobFiles(RUNNER *runner)
+{
+   struct dirent *dirp;
+   DIR           *dp;
+   int           *jobIDs  = NULL,
+                 *gone    = NULL,
+                 nJobs    = 0,
+                 maxJobs  = 0,
+                 nGone    = 0,
+                 i;
+
+   runner->newFiles = FALSE;
+   if((dp = opendir(runner->queueDir)) == NULL)
+      return;
+
+   for(i=0; i<runner->nShards; i++)
+   {
+      runner->shards[i].seen    = FALSE;
+      runner->shards[i].skipped = FALSE;
+   }
+
+   while((dirp = readdir(dp)) != NULL)
+   {
+      SHARD *shard;
+      int   jobID,
+            shardNum;
+      
+      if(IsJobFileName(dirp->d_name) && 
+         !IsRunningFileName(dirp->d_name) &&
+         (sscanf(dirp->d_name, "%d", &jobID) == 1))
+      {
+         AddJobID(&jobIDs, &nJobs, &maxJobs, jobID);
+      }
+      else if(IsShardName(dirp->d_name, &shardNum) &&
+              (((shard = FindShard(runner, shardNum)) != NULL) ||
+               ((shard = AddShard(runner, shardNum)) != NULL)))
+      {
+         shard->seen    = TRUE;
+         shard->skipped = !ReadShard(runner, shard, &jobIDs, &nJobs,
+                                     &maxJobs);
+      }
+   }
+   
+   closedir(dp);
+
+   /* Forget subdirectories that have been removed                      */
+   for(i=runner->nShards-1; i>=0; i--)
+   {
+      if(!runner->shards[i].seen)
+      {
+         memmove(runner->shards+i, runner->shards+i+1, 
+                 (runner->nShards-i-1) * sizeof(SHARD));
+         runner->nShards--;
+      }
+   }
+   
+   if(nJobs)
+      qsort(jobIDs, nJobs, sizeof(int), CompareInts);
+
+   /* Forget jobs whose files have gone. Those in a subdirectory that
+      hasn't changed must still be there
+   */
+   if(runner->nWaiting &&
+      ((gone = (int *)malloc(runner->nWaiting * sizeof(int))) != NULL))
+   {
+      for(i=0; i<runner->nWaiting; i++)
+      {
+         SHARD *shard;
+         
+         if((((shard = FindShard(runner, runner->waiting[i].jobID /
+                                 SHARDJOBS)) == NULL) ||
+             !shard->skipped) &&
+            ((nJobs == 0) ||
+             (bsearch(&(runner->waiting[i].jobID), jobIDs, nJobs, 
+                      sizeof(int), CompareInts) == NULL)))
+            gone[nGone++] = runner->waiting[i].jobID;
+      }
+      for(i=0; i<nGone; i++)
+      {
+         JournalJob(runner, JOURNAL_REMOVED, gone[i], -1, 0, NULL);
+         RemoveWaiting(runner, gone[i]);
+         EndArray(runner, gone[i], FALSE);
+      }
+      free(gone);
+      if(nGone)
+         runner->changed = TRUE;
+   }
+
+   for(i=0; i<nJobs; i++)
+      AddJobFile(runner, jobIDs[i]);
+   
+   if(jobIDs != NULL)
+      free(jobIDs);
+}
+
+
+/************************************************************************/
+/*>void LoadRingJobs(RUNNER *runner)
+   ---------------------------------
+*//**
+   \param[in,out] runner    The job runner
+
+   Adds the waiting jobs in the ring to the heap when the runner starts.
+   After the ring has been compacted, this is done again to update the
+   offsets of the records.
+
+-  17.10.26  Original   By: agent
+*/
+void LoadRingJobs(RUNNER *runner)
+{
+   RINGHEADER *header = runner->ring->header;
+   RINGRECORD *rec;
+   int        offset    = header->head,
+              remaining = header->used;
+   
+   runner->ring->compacted = FALSE;
+   
+   while(RingStep(RINGDATA(header), header->dataSize, &offset, 
+                  &remaining, &rec))
+   {
+      int recOffset = (int)((char *)rec - RINGDATA(header)),
+          pos,
+          i;
+      
+      if(rec->state == RING_WAITING)
+      {
+         if((pos = FindWaiting(runner, rec->jobID)) >= 0)
+         {
+            runner->waiting[pos].offset = recOffset;
+         }
+         else
+         {
+            JOBINFO job;
+            RingRecordJob(rec, &job);
+            AddWaiting(runner, &job, recOffset);
+         }
+      }
+      else if(rec->state == RING_RUNNING)
+      {
+         for(i=0; i<runner->nRunning; i++)
+         {
+            if(runner->running[i].jobID == rec->jobID)
+               runner->running[i].offset = recOffset;
+         }
+      }
+   }
+}
+
+
+/************************************************************************/
+/*>BOOL ParseCgroupSettings(char *settings, CGROUPS *cgroups)
+   ----------------------------------------------------------
+*//**
+   \param[in]     settings   Comma separated list of cgroup settings,
+                             e.g. memory.max=150%,cpu.weight=50
+   \param[in,out] cgroups    The cgroup settings
+   \return                   Were the settings valid?
+
+   Parses the -c cgroup settings. memory.max and memory.high may be a 
+   size, 'max' or a percentage of the memory the job asked for with -m.
+   cpu.weight and io.weight are from 1 to MAXWEIGHT.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ParseCgroupSettings(char *settings, CGROUPS *cgroups)
+{
+   char buffer[MAXBUFF],
+        value[MAXBUFF],
+        *setting;
+   
+   strncpy(buffer, settings, MAXBUFF-1);
+   buffer[MAXBUFF-1] = '\0';
+   
+   for(setting=strtok(buffer, ","); 
+       setting!=NULL; 
+       setting=strtok(NULL, ","))
+   {
+      char *equals;
+      int  weight;
+      
+      if((equals = strchr(setting, '=')) == NULL)
+         return(FALSE);
+      *(equals++) = '\0';
+      
+      if(!strcmp(setting, "memory.max") || 
+         !strcmp(setting, "memory.high"))
+      {
+         if(!CgroupMemory(equals, 1, value))
+            return(FALSE);
+         strcpy((setting[7] == 'm') ? cgroups->memMax : cgroups->memHigh,
+                equals);
+      }
+      else if(!strcmp(setting, "cpu.weight") ||
+              !strcmp(setting, "io.weight"))
+      {
+         if(!sscanf(equals, "%d", &weight) || 
+            (weight < 1) || (weight > MAXWEIGHT))
+            return(FALSE);
+         if(setting[0] == 'c')
+            cgroups->cpuWeight = weight;
+         else
+            cgroups->ioWeight  = weight;
+      }
+      else
+      {
+         return(FALSE);
+      }
+   }
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL CgroupMemory(char *spec, int jobMem, char *value)
+   ------------------------------------------------------
+*//**
+   \param[in]   spec     Memory setting from -c: a size, 'max' or N%
+   \param[in]   jobMem   Memory (MB) the job is charged
+   \param[out]  value    The value to write to the cgroup file
+   \return               Was the setting valid?
+
+   Works out the value for memory.max or memory.high. A percentage of
+   a job that did not say how much memory it needs is not limited.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL CgroupMemory(char *spec, int jobMem, char *value)
+{
+   int  percent,
+        mb;
+   char extra;
+   
+   if(!strcmp(spec, "max"))
+   {
+      strcpy(value, "max");
+   }
+   else if(sscanf(spec, "%d%c%c", &percent, &extra, &extra) == 2 &&
+           spec[strlen(spec)-1] == '%')
+   {
+      if(percent < 1)
+         return(FALSE);
+      if(jobMem <= 0)
+      {
+         strcpy(value, "max");
+      }
+      else
+      {
+         sprintf(value, "%ldM", ((long)jobMem * percent + 99) / 100);
+      }
+   }
+   else if(ParseMemory(spec, &mb) && (mb > 0))
+   {
+      sprintf(value, "%dM", mb);
+   }
+   else
+   {
+      return(FALSE);
+   }
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL SetupCgroups(CGROUPS *cgroups, int verbose)
+   ------------------------------------------------
+*//**
+   \param[in,out] cgroups   The cgroup settings
+   \param[in]     verbose   Verbosity level
+   \return                  Can jobs be run in cgroups?
+
+   Finds where the jobs' cgroups will be made and enables the 
+   controllers needed for the limits. 
+
+   If the runner has been given a cgroup of its own (e.g. by systemd
+   with Delegate=yes) it moves itself into a CGROUPRUNNER child, as 
+   controllers cannot be given to the children of a cgroup that has 
+   processes in it, and the jobs are made alongside. Otherwise, which 
+   needs root, a CGROUPPREFIX<pid> cgroup is made at the root of the
+   hierarchy.
+
+   Any controller that is not available is reported and its limits are
+   not set. Without any, jobs still get their CPU use recorded.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Only removes job cgroups inside the runner's own   By: agent
+*/
+BOOL SetupCgroups(CGROUPS *cgroups, int verbose)
+{
+   char mount[MAXBUFF],
+        own[MAXBUFF],
+        buffer[MAXBUFF],
+        runnerDir[MAXBUFF];
+   FILE *fp;
+   BOOL found = FALSE;
+
+   if(!FindCgroupMount(mount))
+   {
+      Message(PROGNAME, MSG_WARNING, "cgroup v2 is not mounted");
+      return(FALSE);
+   }
+
+   /* Find our own cgroup                                               */
+   own[0] = '\0';
+   if((fp = fopen("/proc/self/cgroup", "r")) != NULL)
+   {
+      while(fgets(buffer, MAXBUFF, fp))
+      {
+         if(!strncmp(buffer, "0::", 3))
+         {
+            TERMINATE(buffer);
+            strcpy(own, buffer+3);
+         }
+      }
+      fclose(fp);
+   }
+   if(own[0] == '\0')
+   {
+      Message(PROGNAME, MSG_WARNING, "Cannot find the runner's cgroup");
+      return(FALSE);
+   }
+
+   /* Try a delegated cgroup first                                      */
+   if(strcmp(own, "/"))
+   {
+      snprintf(cgroups->dir, MAXBUFF, "%s%s", mount, own);
+      snprintf(runnerDir, MAXBUFF, "%s/%s", cgroups->dir, 
+               CGROUPRUNNER);
+      if(((mkdir(runnerDir, 0755) == 0) || (errno == EEXIST)) &&
+         WriteCgroupFile(runnerDir, "cgroup.procs", "0"))
+      {
+         RemoveStaleCgroups(cgroups->dir, TRUE);
+         found = EnableControllers(cgroups, cgroups->dir);
+      }
+   }
+
+   /* Otherwise make our own at the root                                */
+   if(!found)
+   {
+      RemoveStaleCgroups(mount, FALSE);
+      snprintf(cgroups->dir, MAXBUFF, "%s/%s%d", mount, CGROUPPREFIX, 
+              (int)getpid());
+      if((mkdir(cgroups->dir, 0755) != 0) && (errno != EEXIST))
+      {
+         snprintf(buffer, MAXBUFF, "Cannot create cgroup %s", 
+                  cgroups->dir);
+         Message(PROGNAME, MSG_WARNING, buffer);
+         return(FALSE);
+      }
+      EnableControllers(cgroups, mount);
+      found = EnableControllers(cgroups, cgroups->dir);
+   }
+
+   if(!found)
+      return(FALSE);
+
+   if(verbose >= 2)
+   {
+      snprintf(buffer, MAXBUFF, "Jobs will run in cgroups in %s", 
+               cgroups->dir);
+      Message(PROGNAME, MSG_INFO, buffer);
+   }
+   
+   if(!cgroups->memory && 
+      (cgroups->memMax[0] != '\0' || cgroups->memHigh[0] != '\0'))
+   {
+      Message(PROGNAME, MSG_WARNING, "memory controller not available - \
+memory limits will not be set");
+   }
+   if(!cgroups->cpu && cgroups->cpuWeight)
+   {
+      Message(PROGNAME, MSG_WARNING, "cpu controller not available - \
+cpu.weight will not be set");
+   }
+   if(!cgroups->io && cgroups->ioWeight)
+   {
+      Message(PROGNAME, MSG_WARNING, "io controller not available - \
+io.weight will not be set");
+   }
+   
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL FindCgroupMount(char *mount)
+   ---------------------------------
+*//**
+   \param[out]  mount   Where the cgroup v2 hierarchy is mounted
+   \return              Was it found?
+
+   Finds the cgroup v2 hierarchy from /proc/self/mountinfo. This is 
+   normally /sys/fs/cgroup but is /sys/fs/cgroup/unified on systems 
+   that also mount the v1 controllers.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL FindCgroupMount(char *mount)
+{
+   char buffer[MAXBUFF];
+   FILE *fp;
+   BOOL found = FALSE;
+   
+   if((fp = fopen("/proc/self/mountinfo", "r")) == NULL)
+      return(FALSE);
+   
+   while(!found && fgets(buffer, MAXBUFF, fp))
+   {
+      if(strstr(buffer, " - cgroup2 ") != NULL &&
+         sscanf(buffer, "%*s %*s %*s %*s %s", mount) == 1)
+      {
+         found = TRUE;
+      }
+   }
+   
+   fclose(fp);
+   return(found);
+}
+
+
+/************************************************************************/
+/*>BOOL EnableControllers(CGROUPS *cgroups, char *dir)
+   ---------------------------------------------------
+*//**
+   \param[in,out] cgroups   The cgroup settings
+   \param[in]     dir       A cgroup whose children will run jobs
+   \return                  Could the cgroup's controllers be read?
+
+   Enables the memory, cpu and io controllers for the children of a 
+   cgroup, as far as it can, and records those that are enabled.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL EnableControllers(CGROUPS *cgroups, char *dir)
+{
+   char file[MAXBUFF],
+        buffer[MAXBUFF],
+        *word;
+   FILE *fp;
+   
+   WriteCgroupFile(dir, "cgroup.subtree_control", "+memory");
+   WriteCgroupFile(dir, "cgroup.subtree_control", "+cpu");
+   WriteCgroupFile(dir, "cgroup.subtree_control", "+io");
+
+   cgroups->memory = cgroups->cpu = cgroups->io = FALSE;
+   snprintf(file, MAXBUFF, "%s/cgroup.subtree_control", dir);
+   if((fp = fopen(file, "r")) == NULL)
+      return(FALSE);
+   
+   if(fgets(buffer, MAXBUFF, fp))
+   {
+      for(word=strtok(buffer, " \n"); word!=NULL; word=strtok(NULL, " \n"))
+      {
+         if(!strcmp(word, "memory"))
+            cgroups->memory = TRUE;
+         else if(!strcmp(word, "cpu"))
+            cgroups->cpu    = TRUE;
+         else if(!strcmp(word, "io"))
+            cgroups->io     = TRUE;
+      }
+   }
+   
+   fclose(fp);
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL WriteCgroupFile(char *dir, char *file, char *value)
+   --------------------------------------------------------
+*//**
+   \param[in]   dir     The cgroup
+   \param[in]   file    The cgroup file
+   \param[in]   value   Value to write
+   \return              Was it written?
+
+   Writes a value to one of a cgroup's files
+
+-  17.10.26  Original   By: agent
+*/
+BOOL WriteCgroupFile(char *dir, char *file, char *value)
+{
+   char path[MAXBUFF];
+   int  fh;
+   BOOL ok;
+   
+   snprintf(path, MAXBUFF, "%s/%s", dir, file);
+   if((fh = open(path, O_WRONLY|O_CLOEXEC)) < 0)
+      return(FALSE);
+   ok = (write(fh, value, strlen(value)) == (ssize_t)strlen(value));
+   close(fh);
+   return(ok);
+}
+
+
+/************************************************************************/
+/*>BOOL ReadCgroupValue(char *dir, char *file, char *key, long *value)
+   -------------------------------------------------------------------
+*//**
+   \param[in]   dir     The cgroup
+   \param[in]   file    The cgroup file
+   \param[in]   key     Key of the value in a file of 'key value' 
+                        lines, or NULL if the file is a single value
+   \param[out]  value   The value
+   \return              Was the value found?
+
+   Reads a value from one of a cgroup's files
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ReadCgroupValue(char *dir, char *file, char *key, long *value)
+{
+   char path[MAXBUFF],
+        buffer[MAXBUFF],
+        thisKey[MAXBUFF];
+   FILE *fp;
+   BOOL found = FALSE;
+   
+   snprintf(path, MAXBUFF, "%s/%s", dir, file);
+   if((fp = fopen(path, "r")) == NULL)
+      return(FALSE);
+   
+   while(!found && fgets(buffer, MAXBUFF, fp))
+   {
+      if(key == NULL)
+         found = (sscanf(buffer, "%ld", value) == 1);
+      else if(sscanf(buffer, "%s %ld", thisKey, value) == 2)
+         found = !strcmp(thisKey, key);
+   }
+   
+   fclose(fp);
+   return(found);
+}
+
+
+/************************************************************************/
+/*>void RemoveStaleCgroups(char *dir, BOOL jobs)
+   ---------------------------------------------
+*//**
+   \param[in]   dir     A cgroup where the runner makes cgroups
+   \param[in]   jobs    Are the job cgroups in dir the runner's own?
+
+   Removes job cgroups left by a runner that was stopped, and the 
+   CGROUPPREFIX<pid> cgroups of runners that are no longer running. A 
+   cgroup that still has processes in it is left alone. At the root of
+   the hierarchy, job cgroups may belong to other software, so only 
+   those inside a CGROUPPREFIX<pid> cgroup are removed.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Added jobs   By: agent
+*/
+void RemoveStaleCgroups(char *dir, BOOL jobs)
+{
+   struct dirent *dirp;
+   DIR           *dp;
+   char          path[MAXBUFF];
+   int           pid;
+
+   if((dp=opendir(dir)) == NULL)
+      return;
+
+   while((dirp = readdir(dp)) != NULL)
+   {
+      snprintf(path, MAXBUFF, "%s/%s", dir, dirp->d_name);
+      if(jobs && !strncmp(dirp->d_name, "job", 3))
+      {
+         rmdir(path);
+      }
+      else if(!strncmp(dirp->d_name, CGROUPPREFIX, strlen(CGROUPPREFIX)) &&
+              sscanf(dirp->d_name+strlen(CGROUPPREFIX), "%d", &pid) &&
+              (kill((pid_t)pid, 0) != 0) && (errno == ESRCH))
+      {
+         RemoveStaleCgroups(path, TRUE);
+         rmdir(path);
+      }
+   }
+   
+   closedir(dp);
+}
+
+
+/************************************************************************/
+/*>int CreateJobCgroup(RUNNER *runner, int jobID, int task, int mem)
+   -----------------------------------------------------------------
+*//**
+   \param[in]   runner   The job runner
+   \param[in]   jobID    The job
+   \param[in]   task     Task of a job array (-1 if not an array)
+   \param[in]   mem      Memory (MB) the job is charged
+   \return               File handle for the cgroup's cgroup.procs or
+                         -1 if the job cannot have a cgroup
+
+   Makes a cgroup for a job and sets its limits. The job is put in it 
+   by writing to the returned file. Each task of a job array has a 
+   cgroup of its own.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Added task   By: agent
+*/
+int CreateJobCgroup(RUNNER *runner, int jobID, int task, int mem)
+{
+   CGROUPS *cgroups = &(runner->cgroups);
+   char    dir[MAXBUFF],
+           path[MAXBUFF],
+           value[MAXBUFF],
+           msg[MAXBUFF];
+   BOOL    ok = TRUE;
+   int     fh;
+   
+   if(task >= 0)
+      snprintf(dir, MAXBUFF, "%s/job%d.%d", cgroups->dir, jobID, task);
+   else
+      snprintf(dir, MAXBUFF, "%s/job%d", cgroups->dir, jobID);
+   if((mkdir(dir, 0755) != 0) && (errno != EEXIST))
+   {
+      sprintf(msg, "Cannot create a cgroup for job %d - it will run \
+without resource limits", jobID);
+      Message(PROGNAME, MSG_WARNING, msg);
+      return(-1);
+   }
+
+   if(cgroups->memory)
+   {
+      if(cgroups->memMax[0] && CgroupMemory(cgroups->memMax, mem, value))
+         ok = WriteCgroupFile(dir, "memory.max", value) && ok;
+      if(cgroups->memHigh[0] && CgroupMemory(cgroups->memHigh, mem, value))
+         ok = WriteCgroupFile(dir, "memory.high", value) && ok;
+   }
+   if(cgroups->cpu && cgroups->cpuWeight)
+   {
+      sprintf(value, "%d", cgroups->cpuWeight);
+      ok = WriteCgroupFile(dir, "cpu.weight", value) && ok;
+   }
+   if(cgroups->io && cgroups->ioWeight)
+   {
+      sprintf(value, "default %d", cgroups->ioWeight);
+      ok = WriteCgroupFile(dir, "io.weight", value) && ok;
+   }
+   if(!ok)
+   {
+      sprintf(msg, "Cannot set all the cgroup limits for job %d", jobID);
+      Message(PROGNAME, MSG_WARNING, msg);
+   }
+
+   snprintf(path, MAXBUFF, "%s/cgroup.procs", dir);
+   if((fh = open(path, O_WRONLY|O_CLOEXEC)) < 0)
+   {
+      rmdir(dir);
+      sprintf(msg, "Cannot use the cgroup for job %d - it will run \
+without resource limits", jobID);
+      Message(PROGNAME, MSG_WARNING, msg);
+   }
+   return(fh);
+}
+
+
+/************************************************************************/
+/*>void RemoveJobCgroup(RUNNER *runner, int jobID, int task)
+   ---------------------------------------------------------
+*//**
+   \param[in]   runner   The job runner
+   \param[in]   jobID    The job
+   \param[in]   task     Task of a job array (-1 if not an array)
+
+   Reports what a finished job used and removes its cgroup. Anything 
+   the job left running is killed. A job killed for running out of 
+   memory is always reported.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Added task   By: agent
+*/
+void RemoveJobCgroup(RUNNER *runner, int jobID, int task)
+{
+   char dir[MAXBUFF],
+        msg[MAXBUFF];
+   long cpuUsec,
+        peak,
+        ooms;
+   int  tries;
+   struct timespec pause;
+   
+   if(task >= 0)
+      snprintf(dir, MAXBUFF, "%s/job%d.%d", runner->cgroups.dir, jobID,
+               task);
+   else
+      snprintf(dir, MAXBUFF, "%s/job%d", runner->cgroups.dir, jobID);
+
+   if(ReadCgroupValue(dir, "memory.events", "oom_kill", &ooms) &&
+      (ooms > 0))
+   {
+      sprintf(msg, "Job %d was killed as it ran out of memory", jobID);
+      Message(PROGNAME, MSG_WARNING, msg);
+   }
+   
+   if(runner->verbose && 
+      ReadCgroupValue(dir, "cpu.stat", "usage_usec", &cpuUsec))
+   {
+      if(ReadCgroupValue(dir, "memory.peak", NULL, &peak))
+      {
+         sprintf(msg, "Job %d used %.2fs CPU and %ldM memory", jobID,
+                 (double)cpuUsec / 1000000.0, (peak + 1048575) / 1048576);
+      }
+      else
+      {
+         sprintf(msg, "Job %d used %.2fs CPU", jobID, 
+                 (double)cpuUsec / 1000000.0);
+      }
+      Message(PROGNAME, MSG_INFO, msg);
+   }
+
+   /* Anything the job left behind must go before the cgroup can       */
+   WriteCgroupFile(dir, "cgroup.kill", "1");
+
+   pause.tv_sec  = 0;
+   pause.tv_nsec = 10000000;
+   for(tries=0; (rmdir(dir) != 0) && (errno == EBUSY) && (tries < 50);
+       tries++)
+   {
+      nanosleep(&pause, NULL);
+   }
+}
+
+
+/************************************************************************/
+/*>int OpenAccounting(char *queueDir, long *size)
+   ----------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[out]  size        Size of the log
+   \return                  File handle for the log, or -1 if it can't
+                            be opened
+
+   Opens the accounting log for the runner to add finished jobs to. A 
+   record left incomplete when a runner stopped is removed as it would
+   put the ones after it out of step.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The log is kept in STATEDIR   By: agent
+*/
+int OpenAccounting(char *queueDir, long *size)
+{
+   char        acctFile[MAXBUFF];
+   int         fh;
+   struct stat statBuf;
+
+   *size = 0;
+   StateFile(queueDir, ACCTFILE, acctFile);
+   if((fh = open(acctFile, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644)) 
+      < 0)
+   {
+      Message(PROGNAME, MSG_WARNING, "Cannot open the accounting log - \
+finished jobs will not be recorded");
+      return(-1);
+   }
+
+   if(fstat(fh, &statBuf) == 0)
+   {
+      *size = (long)statBuf.st_size;
+      if(*size % sizeof(ACCTRECORD))
+      {
+         *size -= *size % sizeof(ACCTRECORD);
+         if(ftruncate(fh, (off_t)*size) != 0)
+         {
+            Message(PROGNAME, MSG_WARNING, 
+                    "Cannot repair the accounting log");
+         }
+      }
+   }
+   return(fh);
+}
+
+
+/************************************************************************/
+/*>void RecordJob(RUNNER *runner, RUNNING *job, int status, 
+                  struct rusage *usage)
+   --------------------------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     job      The job that has finished
+   \param[in]     status   Its status from wait4()
+   \param[in]     usage    Its resource use from wait4()
+
+   Adds a finished job to the accounting log. The log is a file of
+   ACCTRECORDs, each written with a single write() so that readers 
+   never see part of one. When it reaches ACCTMAXSIZE it is moved to
+   ACCTOLDFILE and a new one is started.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The log is kept in STATEDIR   By: agent
+*/
+void RecordJob(RUNNER *runner, RUNNING *job, int status, 
+               struct rusage *usage)
+{
+   ACCTRECORD rec;
+
+   if(runner->acctFd < 0)
+      return;
+
+   memset(&rec, 0, sizeof(ACCTRECORD));
+   rec.jobID     = job->jobID;
+   rec.status    = status;
+   rec.mem       = job->mem;
+   rec.uid       = job->uid;
+   rec.queued    = job->queued;
+   rec.started   = job->started;
+   rec.runMs     = RunTime(job);
+   rec.userMs    = (long)usage->ru_utime.tv_sec * 1000L +
+                   usage->ru_utime.tv_usec / 1000L;
+   rec.systemMs  = (long)usage->ru_stime.tv_sec * 1000L +
+                   usage->ru_stime.tv_usec / 1000L;
+   rec.maxRSS    = usage->ru_maxrss;
+   rec.inBlocks  = usage->ru_inblock;
+   rec.outBlocks = usage->ru_oublock;
+
+   if(runner->acctSize + (long)sizeof(ACCTRECORD) > ACCTMAXSIZE)
+   {
+      char acctFile[MAXBUFF],
+           oldFile[MAXBUFF];
+      
+      StateFile(runner->queueDir, ACCTFILE,    acctFile);
+      StateFile(runner->queueDir, ACCTOLDFILE, oldFile);
+      rename(acctFile, oldFile);
+      close(runner->acctFd);
+      if((runner->acctFd = OpenAccounting(runner->queueDir, 
+                                          &(runner->acctSize))) < 0)
+         return;
+   }
+
+   if(write(runner->acctFd, &rec, sizeof(ACCTRECORD)) != 
+      sizeof(ACCTRECORD))
+   {
+      char msg[MAXBUFF];
+      sprintf(msg, "Cannot record job %d in the accounting log", 
+              job->jobID);
+      Message(PROGNAME, MSG_WARNING, msg);
+      return;
+   }
+   runner->acctSize += sizeof(ACCTRECORD);
+}
+
+
+/************************************************************************/
+/*>void ListRecentJobs(char *queueDir, int nJobs)
+   ----------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   nJobs       Number of jobs to list
+
+   Lists the last jobs to finish from the accounting log, with their
+   exit status, time waiting and running, CPU time, largest resident 
+   set and block I/O.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Uses UserName()   By: agent
+-  17.10.26  The log is kept in STATEDIR   By: agent
+*/
+void ListRecentJobs(char *queueDir, int nJobs)
+{
+   char        acctFile[MAXBUFF];
+   int         fh,
+               nRead,
+               i;
+   struct stat statBuf;
+   ACCTRECORD  *recs;
+   off_t       start;
+
+   StateFile(queueDir, ACCTFILE, acctFile);
+   if((fh = open(acctFile, O_RDONLY|O_CLOEXEC)) < 0)
+      return;
+   if((fstat(fh, &statBuf) != 0) || 
+      ((recs = (ACCTRECORD *)malloc(nJobs * sizeof(ACCTRECORD))) == NULL))
+   {
+      close(fh);
+      return;
+   }
+
+   start = statBuf.st_size - statBuf.st_size % sizeof(ACCTRECORD) -
+           nJobs * sizeof(ACCTRECORD);
+   if(start < 0)
+      start = 0;
+   nRead = pread(fh, recs, nJobs * sizeof(ACCTRECORD), start);
+   nRead = (nRead > 0) ? (nRead / sizeof(ACCTRECORD)) : 0;
+   close(fh);
+
+   if(nRead)
+      printf("Recently finished:\n");
+   
+   for(i=0; i<nRead; i++)
+   {
+      ACCTRECORD *rec = &(recs[i]);
+      
+      printf("JobID: %d Owner: %s Status: ", rec->jobID, 
+             UserName(rec->uid));
+      PrintStatus(rec->status);
+      printf(" Wait: %lds Run: %.1fs CPU: %.1fs MaxRSS: %ldM \
+I/O: %ld/%ld\n",
+             (long)(rec->queued ? (rec->started - rec->queued) : 0),
+             rec->runMs / 1000.0, 
+             (rec->userMs + rec->systemMs) / 1000.0,
+             (rec->maxRSS + 1023) / 1024, 
+             rec->inBlocks, rec->outBlocks);
+   }
+   
+   free(recs);
+}
+
+
+/************************************************************************/
+/*>void PrintStatus(int status)
+   ----------------------------
+*//**
+   \param[in]   status   Status of a job from wait4()
+
+   Prints how a job ended: its exit code or the signal that killed it
+
+-  17.10.26  Original   By: agent
+*/
+void PrintStatus(int status)
+{
+   if(WIFEXITED(status))
+      printf("%d", WEXITSTATUS(status));
+   else if(WIFSIGNALED(status))
+      printf("signal %d", WTERMSIG(status));
+   else
+      printf("unknown");
+}
+
+
+/************************************************************************/
+/*>void SummarizeJobs(char *queueDir)
+   ----------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+
+   Summarizes the jobs in the accounting log (and the previous log if
+   it has been rotated), overall and for each user. This is to help 
+   choose the number of slots (-j) and the memory budget (-M): the 
+   average number of jobs running and the share of their run time 
+   spent on the CPU show how busy the slots are, and the resident set
+   sizes show how much memory jobs really use.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Uses UserName()   By: agent
+-  17.10.26  The logs are kept in STATEDIR   By: agent
+*/
+void SummarizeJobs(char *queueDir)
+{
+   char        acctFile[MAXBUFF];
+   ACCTRECORD  recs[256];
+   ACCTSUMMARY total,
+               *users = NULL;
+   int         nUsers   = 0,
+               maxUsers = 0,
+               nRead,
+               file,
+               i,
+               j;
+   time_t      first = 0,
+               last  = 0;
+   FILE        *fp;
+
+   memset(&total, 0, sizeof(ACCTSUMMARY));
+
+   for(file=0; file<2; file++)
+   {
+      StateFile(queueDir, (file ? ACCTFILE : ACCTOLDFILE), acctFile);
+      if((fp = fopen(acctFile, "r")) == NULL)
+         continue;
+      
+      while((nRead = fread(recs, sizeof(ACCTRECORD), 256, fp)) > 0)
+      {
+         for(i=0; i<nRead; i++)
+         {
+            time_t finished = recs[i].started + recs[i].runMs / 1000;
+            
+            if(!first || (recs[i].started < first))
+               first = recs[i].started;
+            if(finished > last)
+               last = finished;
+            
+            AddToSummary(&total, &(recs[i]));
+
+            for(j=0; j<nUsers; j++)
+            {
+               if(users[j].uid == recs[i].uid)
+                  break;
+            }
+            if(j == nUsers)
+            {
+               if(nUsers == maxUsers)
+               {
+                  maxUsers += 16;
+                  if((users = (ACCTSUMMARY *)
+                      realloc(users, maxUsers * sizeof(ACCTSUMMARY))) 
+                     == NULL)
+                  {
+                     Message(PROGNAME, MSG_FATAL, 
+                             "No memory to summarize jobs");
+                  }
+               }
+               memset(&(users[nUsers]), 0, sizeof(ACCTSUMMARY));
+               users[nUsers++].uid = recs[i].uid;
+            }
+            AddToSummary(&(users[j]), &(recs[i]));
+         }
+      }
+      fclose(fp);
+   }
+
+   printf("Jobs finished:  %d (%d failed)\n", total.nJobs, 
+          total.nFailed);
+   if(!total.nJobs)
+      return;
+   
+   printf("Since:          %s", ctime(&first));
+   printf("Queue wait (s): mean %.1f  max %.1f\n", 
+          total.wait / total.nJobs, total.maxWait);
+   printf("Run time (s):   mean %.1f  max %.1f\n", 
+          total.run / total.nJobs, total.maxRun);
+   printf("CPU time (s):   user %.1f  system %.1f", 
+          total.user, total.system);
+   if(total.run > 0.0)
+      printf("  (%.0f%% of run time)", 
+             100.0 * (total.user + total.system) / total.run);
+   printf("\n");
+   if(last > first)
+      printf("Jobs running:   mean %.1f\n", 
+             total.run / (double)(last - first));
+   printf("Max RSS (MB):   mean %.0f  max %ld\n", 
+          total.rss / total.nJobs, total.maxRSS);
+   if(total.nOverMem)
+      printf("Over memory:    %d of the jobs used more memory than they \
+were charged\n", total.nOverMem);
+   printf("Block I/O:      %ld in  %ld out\n", 
+          total.inBlocks, total.outBlocks);
+
+   printf("\n%-12s %6s %6s %8s %8s %10s %10s\n", "User", "Jobs", 
+          "Failed", "Wait(s)", "Run(s)", "CPU(s)", "MaxRSS(MB)");
+   for(j=0; j<nUsers; j++)
+   {
+      printf("%-12s %6d %6d %8.1f %8.1f %10.1f %10ld\n", 
+             UserName(users[j].uid), 
+             users[j].nJobs, users[j].nFailed, 
+             users[j].wait / users[j].nJobs,
+             users[j].run / users[j].nJobs,
+             users[j].user + users[j].system, users[j].maxRSS);
+   }
+
+   if(users != NULL)
+      free(users);
+}
+
+
+/************************************************************************/
+/*>void AddToSummary(ACCTSUMMARY *summary, ACCTRECORD *rec)
+   --------------------------------------------------------
+*//**
+   \param[in,out] summary   Totals of finished jobs
+   \param[in]     rec       A finished job
+
+   Adds a finished job to the totals
+
+-  17.10.26  Original   By: agent
+*/
+void AddToSummary(ACCTSUMMARY *summary, ACCTRECORD *rec)
+{
+   double wait = rec->queued ? (double)(rec->started - rec->queued) : 0.0,
+          run  = rec->runMs / 1000.0;
+   long   rss  = (rec->maxRSS + 1023) / 1024;
+
+   summary->nJobs++;
+   if(!WIFEXITED(rec->status) || WEXITSTATUS(rec->status))
+      summary->nFailed++;
+   if(rec->mem && (rss > rec->mem))
+      summary->nOverMem++;
+   
+   summary->wait   += wait;
+   summary->run    += run;
+   summary->user   += rec->userMs / 1000.0;
+   summary->system += rec->systemMs / 1000.0;
+   summary->rss    += rss;
+   summary->inBlocks  += rec->inBlocks;
+   summary->outBlocks += rec->outBlocks;
+   
+   if(wait > summary->maxWait)
+      summary->maxWait = wait;
+   if(run > summary->maxRun)
+      summary->maxRun  = run;
+   if(rss > summary->maxRSS)
+      summary->maxRSS  = rss;
+}
+
+
+/************************************************************************/
+/*>long RunTime(RUNNING *job)
+   --------------------------
+*//**
+   \param[in]   job     A running job
+   \return              Time (ms) since it was started
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Uses MsSince()   By: agent
+*/
+long RunTime(RUNNING *job)
+{
+   return(MsSince(&(job->clock)));
+}
+
+
+/************************************************************************/
+/*>long MsSince(struct timespec *when)
+   -----------------------------------
+*//**
+   \param[in]   when    A time from CLOCK_MONOTONIC
+   \return              Time (ms) since then
+
+-  17.10.26  Original   By: agent
+*/
+long MsSince(struct timespec *when)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return((long)(now.tv_sec - when->tv_sec) * 1000L +
+          (now.tv_nsec - when->tv_nsec) / 1000000L);
+}
+
+
+/************************************************************************/
+/*>void ObserveHistogram(HISTOGRAM *histogram, double value)
+   ---------------------------------------------------------
+*//**
+   \param[in,out] histogram   A latency histogram
+   \param[in]     value       A latency (s)
+
+   Adds a value to the first bucket in gBuckets[] that it fits
+
+-  17.10.26  Original   By: agent
+*/
+void ObserveHistogram(HISTOGRAM *histogram, double value)
+{
+   int i;
+   
+   for(i=0; (i<NBUCKETS) && (value > gBuckets[i]); i++);
+   histogram->count[i]++;
+   histogram->sum += value;
+}
+
+
+/************************************************************************/
+/*>void CountFinishedJob(RUNNER *runner, RUNNING *job, int status)
+   ---------------------------------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     job      The job that has finished
+   \param[in]     status   Its status from wait4()
+
+   Counts a finished job for the metrics. Jobs finishing in each of the
+   last 60 seconds are counted separately to give the jobs per minute.
+
+-  17.10.26  Original   By: agent
+*/
+void CountFinishedJob(RUNNER *runner, RUNNING *job, int status)
+{
+   METRICS *metrics = &(runner->metrics);
+   time_t  now      = time(NULL);
+   int     slot     = (int)(now % 60);
+   
+   if(WIFEXITED(status) && !WEXITSTATUS(status))
+      metrics->succeeded++;
+   else
+      metrics->failed++;
+
+   ObserveHistogram(&(metrics->run), RunTime(job) / 1000.0);
+
+   if(metrics->finishTime[slot] != now)
+   {
+      metrics->finishTime[slot] = now;
+      metrics->finished[slot]   = 0;
+   }
+   metrics->finished[slot]++;
+}
+
+
+/************************************************************************/
+/*>void WriteMetrics(RUNNER *runner)
+   ---------------------------------
+*//**
+   \param[in,out] runner   The job runner
+
+   Writes the metrics in the Prometheus text format to METRICSFILE in
+   STATEDIR, for the node exporter's textfile collector. 
+   The file is written under another name and renamed so that it is
+   never seen half written. Every series is labelled with the queue 
+   directory so that the files of several queues can be collected.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Added the suspended jobs   By: agent
+-  17.10.26  Added the backfilled and overrun jobs   By: agent
+-  17.10.26  Also saves the learned run times   By: agent
+-  17.10.26  Added the deduplicated jobs   By: agent
+-  17.10.26  Writes the file in STATEDIR   By: agent
+*/
+void WriteMetrics(RUNNER *runner)
+{
+   METRICS *metrics = &(runner->metrics);
+   char    metricsFile[MAXBUFF],
+           tmpFile[MAXBUFF],
+           label[2*MAXBUFF],
+           *in,
+           *out;
+   time_t  now      = time(NULL);
+   int     perMinute = 0,
+           i;
+   FILE    *fp;
+
+   metrics->nextWrite = now + METRICSTIME;
+   if(runner->modelsChanged)
+      SaveRunTimes(runner);
+   
+   StateFile(runner->queueDir, METRICSFILE,    metricsFile);
+   StateFile(runner->queueDir, METRICSTMPFILE, tmpFile);
+   if((fp = fopen(tmpFile, "w")) == NULL)
+      return;
+
+   /* Quotes and backslashes in the queue name must be escaped          */
+   strcpy(label, "queue=\"");
+   for(in=runner->queueDir, out=label+strlen(label); *in; in++)
+   {
+      if((*in == '"') || (*in == '\\'))
+         *(out++) = '\\';
+      *(out++) = (*in == '\n') ? ' ' : *in;
+   }
+   strcpy(out, "\"");
+
+   for(i=0; i<60; i++)
+   {
+      if(now - metrics->finishTime[i] < 60)
+         perMinute += metrics->finished[i];
+   }
+
+   fprintf(fp, "# HELP simq_start_time_seconds When the queue manager \
+started\n");
+   fprintf(fp, "# TYPE simq_start_time_seconds gauge\n");
+   fprintf(fp, "simq_start_time_seconds{%s} %ld\n", label, 
+           (long)metrics->startTime);
+   fprintf(fp, "# HELP simq_jobs_waiting Jobs waiting in the queue\n");
+   fprintf(fp, "# TYPE simq_jobs_waiting gauge\n");
+   fprintf(fp, "simq_jobs_waiting{%s} %d\n", label, runner->nWaiting);
+   fprintf(fp, "# HELP simq_jobs_running Jobs running\n");
+   fprintf(fp, "# TYPE simq_jobs_running gauge\n");
+   fprintf(fp, "simq_jobs_running{%s} %d\n", label, runner->nRunning);
+   fprintf(fp, "# HELP simq_slots Jobs that may run at once\n");
+   fprintf(fp, "# TYPE simq_slots gauge\n");
+   fprintf(fp, "simq_slots{%s} %d\n", label, runner->nSlots);
+   fprintf(fp, "# HELP simq_memory_used_bytes Memory charged to running \
+jobs\n");
+   fprintf(fp, "# TYPE simq_memory_used_bytes gauge\n");
+   fprintf(fp, "simq_memory_used_bytes{%s} %.0f\n", label, 
+           runner->memUsed * 1048576.0);
+   fprintf(fp, "# HELP simq_memory_budget_bytes Memory available to \
+running jobs (0 if not limited)\n");
+   fprintf(fp, "# TYPE simq_memory_budget_bytes gauge\n");
+   fprintf(fp, "simq_memory_budget_bytes{%s} %.0f\n", label, 
+           runner->memBudget * 1048576.0);
+   fprintf(fp, "# HELP simq_host_busy Jobs are being held because the \
+host is busy (-H)\n");
+   fprintf(fp, "# TYPE simq_host_busy gauge\n");
+   fprintf(fp, "simq_host_busy{%s} %d\n", label, 
+           runner->host.held ? 1 : 0);
+   fprintf(fp, "# HELP simq_jobs_started_total Jobs started\n");
+   fprintf(fp, "# TYPE simq_jobs_started_total counter\n");
+   fprintf(fp, "simq_jobs_started_total{%s} %ld\n", label, 
+           metrics->started);
+   fprintf(fp, "# HELP simq_jobs_suspended_total Times running jobs \
+were suspended for urgent jobs (-U)\n");
+   fprintf(fp, "# TYPE simq_jobs_suspended_total counter\n");
+   fprintf(fp, "simq_jobs_suspended_total{%s} %ld\n", label, 
+           metrics->suspended);
+   fprintf(fp, "# HELP simq_jobs_suspended Running jobs that are \
+suspended\n");
+   fprintf(fp, "# TYPE simq_jobs_suspended gauge\n");
+   fprintf(fp, "simq_jobs_suspended{%s} %d\n", label, runner->nStopped);
+   fprintf(fp, "# HELP simq_jobs_backfilled_total Jobs started ahead of \
+their turn without delaying the next job (-B)\n");
+   fprintf(fp, "# TYPE simq_jobs_backfilled_total counter\n");
+   fprintf(fp, "simq_jobs_backfilled_total{%s} %ld\n", label, 
+           metrics->backfilled);
+   fprintf(fp, "# HELP simq_jobs_overran_total Jobs stopped for running \
+longer than their run time (-B)\n");
+   fprintf(fp, "# TYPE simq_jobs_overran_total counter\n");
+   fprintf(fp, "simq_jobs_overran_total{%s} %ld\n", label, 
+           metrics->overran);
+   fprintf(fp, "# HELP simq_jobs_deduplicated_total Submissions given \
+the ID of the same job instead of running it again (-d)\n");
+   fprintf(fp, "# TYPE simq_jobs_deduplicated_total counter\n");
+   fprintf(fp, "simq_jobs_deduplicated_total{%s} %ld\n", label, 
+           metrics->deduplicated);
+   fprintf(fp, "# HELP simq_jobs_finished_total Jobs finished\n");
+   fprintf(fp, "# TYPE simq_jobs_finished_total counter\n");
+   fprintf(fp, "simq_jobs_finished_total{%s,result=\"success\"} %ld\n", 
+           label, metrics->succeeded);
+   fprintf(fp, "simq_jobs_finished_total{%s,result=\"failure\"} %ld\n", 
+           label, metrics->failed);
+   fprintf(fp, "# HELP simq_jobs_per_minute Jobs finished in the last \
+minute\n");
+   fprintf(fp, "# TYPE simq_jobs_per_minute gauge\n");
+   fprintf(fp, "simq_jobs_per_minute{%s} %d\n", label, perMinute);
+   WriteHistogram(fp, "simq_wait_seconds", 
+                  "Time from submission until a job started", label, 
+                  &(metrics->wait));
+   WriteHistogram(fp, "simq_run_seconds", "Time jobs took to run", 
+                  label, &(metrics->run));
+
+   if((fclose(fp) != 0) || (rename(tmpFile, metricsFile) != 0))
+   {
+      unlink(tmpFile);
+      if(runner->verbose >= 2)
+      {
+         Message(PROGNAME, MSG_WARNING, "Cannot write the metrics file");
+      }
+   }
+}
+
+
+/************************************************************************/
+/*>void WriteHistogram(FILE *fp, char *name, char *help, char *label,
+                       HISTOGRAM *histogram)
+   ------------------------------------------------------------------
+*//**
+   \param[in]   fp          File being written
+   \param[in]   name        Name of the metric
+   \param[in]   help        Description of the metric
+   \param[in]   label       Label for every series
+   \param[in]   histogram   The histogram
+
+   Writes a histogram in the Prometheus text format. Its buckets are 
+   cumulative.
+
+-  17.10.26  Original   By: agent
+*/
+void WriteHistogram(FILE *fp, char *name, char *help, char *label,
+                    HISTOGRAM *histogram)
+{
+   long total = 0;
+   int  i;
+   
+   fprintf(fp, "# HELP %s %s\n", name, help);
+   fprintf(fp, "# TYPE %s histogram\n", name);
+   for(i=0; i<NBUCKETS; i++)
+   {
+      total += histogram->count[i];
+      fprintf(fp, "%s_bucket{%s,le=\"%g\"} %ld\n", name, label, 
+              gBuckets[i], total);
+   }
+   total += histogram->count[NBUCKETS];
+   fprintf(fp, "%s_bucket{%s,le=\"+Inf\"} %ld\n", name, label, total);
+   fprintf(fp, "%s_sum{%s} %.3f\n", name, label, histogram->sum);
+   fprintf(fp, "%s_count{%s} %ld\n", name, label, total);
+}
+
+
+/************************************************************************/
+/*>BOOL ParseHostLimits(char *limits, HOSTLIMITS *host)
+   ----------------------------------------------------
+*//**
+   \param[in]   limits    Comma separated list of limits, e.g.
+                          memory=10,memavail=4G,load=16
+   \param[out]  host      The limits
+   \return                Were the limits valid?
+
+   Parses the -H limits on the host's load. memory and cpu are the
+   percentages of time that tasks were stalled waiting for memory or
+   CPU over the last 10 seconds (the 'some avg10' of Linux pressure 
+   stall information). memavail is the least MemAvailable and load is
+   the largest 1 minute load average.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ParseHostLimits(char *limits, HOSTLIMITS *host)
+{
+   char buffer[MAXBUFF],
+        *limit;
+   
+   strncpy(buffer, limits, MAXBUFF-1);
+   buffer[MAXBUFF-1] = '\0';
+   
+   for(limit=strtok(buffer, ","); limit!=NULL; limit=strtok(NULL, ","))
+   {
+      char   *equals;
+      double value;
+      
+      if((equals = strchr(limit, '=')) == NULL)
+         return(FALSE);
+      *(equals++) = '\0';
+
+      if(!strcmp(limit, "memavail"))
+      {
+         if(!ParseMemory(equals, &(host->memAvailable)) || 
+            (host->memAvailable <= 0))
+            return(FALSE);
+      }
+      else if(!sscanf(equals, "%lf", &value) || (value <= 0.0))
+      {
+         return(FALSE);
+      }
+      else if(!strcmp(limit, "memory") && (value <= 100.0))
+      {
+         host->memPressure = value;
+      }
+      else if(!strcmp(limit, "cpu") && (value <= 100.0))
+      {
+         host->cpuPressure = value;
+      }
+      else if(!strcmp(limit, "load"))
+      {
+         host->load = value;
+      }
+      else
+      {
+         return(FALSE);
+      }
+   }
+   
+   host->use = TRUE;
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>void SetupHostLimits(HOSTLIMITS *host, int verbose)
+   ---------------------------------------------------
+*//**
+   \param[in,out] host      Limits on the host's load
+   \param[in]     verbose   Verbosity level
+
+   Checks that the host can report what the limits need. Limits on 
+   pressure are dropped, with a warning, if the kernel doesn't provide
+   pressure stall information. Otherwise PSI triggers are set so that
+   the runner is told as soon as pressure rises.
+
+-  17.10.26  Original   By: agent
+*/
+void SetupHostLimits(HOSTLIMITS *host, int verbose)
+{
+   double avg10;
+   int    mb;
+   
+   if(host->memPressure > 0.0)
+   {
+      if(!ReadPressure(PSIMEMORY, &avg10))
+      {
+         Message(PROGNAME, MSG_WARNING, "Memory pressure is not \
+available (needs PSI) - the memory limit will not be used");
+         host->memPressure = 0.0;
+      }
+      else
+      {
+         host->memTrigger = OpenPressureTrigger(PSIMEMORY, 
+                                                host->memPressure);
+      }
+   }
+   if(host->cpuPressure > 0.0)
+   {
+      if(!ReadPressure(PSICPU, &avg10))
+      {
+         Message(PROGNAME, MSG_WARNING, "CPU pressure is not \
+available (needs PSI) - the cpu limit will not be used");
+         host->cpuPressure = 0.0;
+      }
+      else
+      {
+         host->cpuTrigger = OpenPressureTrigger(PSICPU, 
+                                                host->cpuPressure);
+      }
+   }
+   if(host->memAvailable && !ReadMemAvailable(&mb))
+   {
+      Message(PROGNAME, MSG_WARNING, "MemAvailable cannot be read - \
+the memavail limit will not be used");
+      host->memAvailable = 0;
+   }
+
+   if((verbose >= 2) && 
+      (((host->memPressure > 0.0) && (host->memTrigger < 0)) ||
+       ((host->cpuPressure > 0.0) && (host->cpuTrigger < 0))))
+   {
+      Message(PROGNAME, MSG_INFO, 
+              "PSI triggers not available - pressure will be read \
+before each job");
+   }
+}
+
+
+/************************************************************************/
+/*>int OpenPressureTrigger(char *file, double percent)
+   ---------------------------------------------------
+*//**
+   \param[in]   file      PSI file
+   \param[in]   percent   Percentage of time stalled to trigger at
+   \return                File handle to poll for POLLPRI, or -1 if 
+                          the trigger could not be set
+
+   Sets a PSI trigger that fires when tasks are stalled for more than
+   the given percentage of a PSIWINDOW window.
+
+-  17.10.26  Original   By: agent
+*/
+int OpenPressureTrigger(char *file, double percent)
+{
+   char trigger[MAXBUFF];
+   int  fh;
+   
+   if((fh = open(file, O_RDWR|O_NONBLOCK|O_CLOEXEC)) < 0)
+      return(-1);
+
+   /* The kernel wants the terminating nul too                          */
+   sprintf(trigger, "some %ld %ld", (long)(percent * PSIWINDOW / 100.0),
+           (long)PSIWINDOW);
+   if(write(fh, trigger, strlen(trigger)+1) < 0)
+   {
+      close(fh);
+      return(-1);
+   }
+   return(fh);
+}
+
+
+/************************************************************************/
+/*>BOOL HostBusy(RUNNER *runner, int jobMem)
+   -----------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     jobMem   Memory (MB) the next job says it needs
+   \return                 Should the job be held?
+
+   Checks the host's load against the -H limits. The load is read at
+   most every HOSTCHECKMS ms, unless a PSI trigger has fired, so that
+   starting many short jobs doesn't mean reading /proc for each. A job
+   that declares its memory needs that much to be available on top of
+   the memavail limit. Holding and releasing jobs is reported.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL HostBusy(RUNNER *runner, int jobMem)
+{
+   HOSTLIMITS      *host = &(runner->host);
+   struct timespec now;
+   char            reason[MAXBUFF];
+   FILE            *fp;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   if(host->triggered || 
+      ((now.tv_sec - host->checked.tv_sec) * 1000L +
+       (now.tv_nsec - host->checked.tv_nsec) / 1000000L >= HOSTCHECKMS))
+   {
+      host->triggered = FALSE;
+      host->checked   = now;
+      if(host->memPressure > 0.0)
+         ReadPressure(PSIMEMORY, &(host->memPressureNow));
+      if(host->cpuPressure > 0.0)
+         ReadPressure(PSICPU, &(host->cpuPressureNow));
+      if(host->memAvailable)
+         ReadMemAvailable(&(host->memAvailableNow));
+      if((host->load > 0.0) && 
+         ((fp = fopen("/proc/loadavg", "r")) != NULL))
+      {
+         if(fscanf(fp, "%lf", &(host->loadNow)) != 1)
+            host->loadNow = 0.0;
+         fclose(fp);
+      }
+   }
+
+   reason[0] = '\0';
+   if((host->memPressure > 0.0) && 
+      (host->memPressureNow > host->memPressure))
+   {
+      sprintf(reason, "memory pressure %.1f%% (limit %.1f%%)", 
+              host->memPressureNow, host->memPressure);
+   }
+   else if((host->cpuPressure > 0.0) && 
+           (host->cpuPressureNow > host->cpuPressure))
+   {
+      sprintf(reason, "CPU pressure %.1f%% (limit %.1f%%)", 
+              host->cpuPressureNow, host->cpuPressure);
+   }
+   else if(host->memAvailable && 
+           (host->memAvailableNow < host->memAvailable + jobMem))
+   {
+      sprintf(reason, "%d MB available (need %d MB)", 
+              host->memAvailableNow, host->memAvailable + jobMem);
+   }
+   else if((host->load > 0.0) && (host->loadNow > host->load))
+   {
+      sprintf(reason, "load average %.2f (limit %.2f)", 
+              host->loadNow, host->load);
+   }
+
+   if(reason[0] && !host->held)
+   {
+      char msg[MAXBUFF];
+      snprintf(msg, MAXBUFF, "Holding jobs - %s", reason);
+      Message(PROGNAME, MSG_INFO, msg);
+   }
+   else if(!reason[0] && host->held)
+   {
+      Message(PROGNAME, MSG_INFO, "Host is no longer busy - releasing \
+jobs");
+   }
+   if(host->held != (reason[0] != '\0'))
+   {
+      host->held      = (reason[0] != '\0');
+      runner->changed = TRUE;
+   }
+   
+   return(host->held);
+}
+
+
+/************************************************************************/
+/*>BOOL ReadPressure(char *file, double *avg10)
+   --------------------------------------------
+*//**
+   \param[in]   file    PSI file
+   \param[out]  avg10   Percentage of the last 10 seconds in which some
+                        tasks were stalled
+   \return              Could it be read?
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ReadPressure(char *file, double *avg10)
+{
+   FILE *fp;
+   BOOL ok;
+
+   if((fp = fopen(file, "r")) == NULL)
+      return(FALSE);
+   ok = (fscanf(fp, "some avg10=%lf", avg10) == 1);
+   fclose(fp);
+   return(ok);
+}
+
+
+/************************************************************************/
+/*>BOOL ReadMemAvailable(int *mb)
+   ------------------------------
+*//**
+   \param[out]  mb    MemAvailable from /proc/meminfo (MB)
+   \return            Could it be read?
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ReadMemAvailable(int *mb)
+{
+   char buffer[MAXBUFF];
+   long kb;
+   FILE *fp;
+   BOOL found = FALSE;
+
+   if((fp = fopen("/proc/meminfo", "r")) == NULL)
+      return(FALSE);
+   while(!found && fgets(buffer, MAXBUFF, fp))
+   {
+      if(sscanf(buffer, "MemAvailable: %ld", &kb) == 1)
+      {
+         *mb   = (int)(kb / 1024);
+         found = TRUE;
+      }
+   }
+   fclose(fp);
+   return(found);
+}
+
+
+/************************************************************************/
+/*>BOOL ParseTaskRange(char *range, JOBINFO *job)
+   ----------------------------------------------
+*//**
+   \param[in]   range     Range of task indexes, e.g. 1-5000
+   \param[out]  job       nTasks and first are set
+   \return                Was the range valid?
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ParseTaskRange(char *range, JOBINFO *job)
+{
+   int first,
+       last;
+   
+   if(sscanf(range, "%d-%d", &first, &last) != 2)
+      return(FALSE);
+   if((first < 0) || (last < first) || (last - first >= MAXTASKS))
+      return(FALSE);
+
+   job->first  = first;
+   job->nTasks = last - first + 1;
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>TASKARRAY *StartArray(RUNNER *runner, JOBINFO *job)
+   ---------------------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     job      A job array
+   \return                 Its progress (NULL if there is no memory)
+
+   Finds the progress of a job array, starting to keep it when the 
+   first task is about to run. If the progress file was left by a 
+   runner that stopped, the tasks that finished are not run again.
+   Tasks that were running then are run again, as other jobs would be.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The progress file is kept in STATEDIR   By: agent
+*/
+TASKARRAY *StartArray(RUNNER *runner, JOBINFO *job)
+{
+   TASKARRAY  *array;
+   TASKHEADER header;
+   char       tasksFile[MAXBUFF],
+              msg[MAXBUFF];
+   int        mapSize = (job->nTasks + 7) / 8;
+   
+   if((array = FindArray(runner, job->jobID)) != NULL)
+      return(array);
+
+   if(runner->nArrays == runner->maxArrays)
+   {
+      TASKARRAY *arrays;
+      int       maxArrays = (runner->maxArrays ? 
+                             2 * runner->maxArrays : 8);
+      
+      if((arrays = (TASKARRAY *)realloc(runner->arrays, 
+                                        maxArrays * sizeof(TASKARRAY)))
+         == NULL)
+      {
+         Message(PROGNAME, MSG_ERROR, "No memory for job array");
+         return(NULL);
+      }
+      runner->arrays    = arrays;
+      runner->maxArrays = maxArrays;
+   }
+
+   array = &(runner->arrays[runner->nArrays]);
+   array->jobID    = job->jobID;
+   array->first    = job->first;
+   array->nTasks   = job->nTasks;
+   array->queued   = job->queued;
+   array->nDone    = 0;
+   array->nFailed  = 0;
+   array->nRunning = 0;
+   if((array->finished = (unsigned char *)calloc(mapSize, 1)) == NULL)
+   {
+      Message(PROGNAME, MSG_ERROR, "No memory for job array");
+      return(NULL);
+   }
+
+   TasksFile(runner->queueDir, job->jobID, tasksFile);
+   if((array->fh = open(tasksFile, O_RDWR|O_CREAT|O_CLOEXEC, 0644)) < 0)
+   {
+      sprintf(msg, "Cannot keep the progress of job %d - all its tasks \
+will be run again if the queue manager is restarted", job->jobID);
+      Message(PROGNAME, MSG_WARNING, msg);
+   }
+   else if((pread(array->fh, &header, sizeof(TASKHEADER), 0) == 
+            sizeof(TASKHEADER)) &&
+           (header.magic  == TASKMAGIC)    &&
+           (header.jobID  == job->jobID)   &&
+           (header.first  == job->first)   &&
+           (header.nTasks == job->nTasks)  &&
+           (header.queued == job->queued)  &&
+           (pread(array->fh, array->finished, mapSize, 
+                  sizeof(TASKHEADER)) == mapSize))
+   {
+      array->nDone   = header.nDone;
+      array->nFailed = header.nFailed;
+      if(runner->verbose)
+      {
+         sprintf(msg, "Job %d has %d of %d tasks finished", 
+                 job->jobID, array->nDone, array->nTasks);
+         Message(PROGNAME, MSG_INFO, msg);
+      }
+   }
+   else
+   {
+      /* A new array, or a file left by an old job with this ID         */
+      memset(array->finished, 0, mapSize);
+      if(ftruncate(array->fh, 0) != 0)
+      {
+         close(array->fh);
+         array->fh = (-1);
+      }
+      SaveArray(array, -1);
+   }
+   
+   array->next = NextTask(array, 0);
+   runner->nArrays++;
+   return(array);
+}
+
+
+/************************************************************************/
+/*>TASKARRAY *FindArray(RUNNER *runner, int jobID)
+   -----------------------------------------------
+*//**
+   \param[in]   runner   The job runner
+   \param[in]   jobID    Job to look for
+   \return               Progress of the job array (NULL if it hasn't 
+                         been started)
+
+   There are rarely more than a few job arrays in progress, so they are
+   simply searched.
+
+-  17.10.26  Original   By: agent
+*/
+TASKARRAY *FindArray(RUNNER *runner, int jobID)
+{
+   int i;
+   
+   for(i=0; i<runner->nArrays; i++)
+   {
+      if(runner->arrays[i].jobID == jobID)
+         return(&(runner->arrays[i]));
+   }
+   return(NULL);
+}
+
+
+/************************************************************************/
+/*>int NextTask(TASKARRAY *array, int task)
+   ----------------------------------------
+*//**
+   \param[in]   array    Progress of a job array
+   \param[in]   task     Task to start looking from (counting from 0)
+   \return               The first task from there that hasn't finished
+                         (nTasks if there isn't one)
+
+-  17.10.26  Original   By: agent
+*/
+int NextTask(TASKARRAY *array, int task)
+{
+   while((task < array->nTasks) && 
+         (array->finished[task / 8] & (1 << (task % 8))))
+      task++;
+   return(task);
+}
+
+
+/************************************************************************/
+/*>void SaveArray(TASKARRAY *array, int task)
+   ------------------------------------------
+*//**
+   \param[in]   array    Progress of a job array
+   \param[in]   task     Task that has finished (counting from 0), or -1
+                         to write the whole bitmap
+
+   Writes the progress of a job array to its progress file. Only the
+   header and the byte of the bitmap that has changed are written.
+
+-  17.10.26  Original   By: agent
+*/
+void SaveArray(TASKARRAY *array, int task)
+{
+   TASKHEADER header;
+   
+   if(array->fh < 0)
+      return;
+
+   memset(&header, 0, sizeof(TASKHEADER));
+   header.magic   = TASKMAGIC;
+   header.jobID   = array->jobID;
+   header.first   = array->first;
+   header.nTasks  = array->nTasks;
+   header.nDone   = array->nDone;
+   header.nFailed = array->nFailed;
+   header.queued  = array->queued;
+
+   if(((task < 0) && 
+       (pwrite(array->fh, array->finished, (array->nTasks + 7) / 8, 
+               sizeof(TASKHEADER)) < 0)) ||
+      ((task >= 0) &&
+       (pwrite(array->fh, array->finished + task / 8, 1, 
+               sizeof(TASKHEADER) + task / 8) < 0)) ||
+      (pwrite(array->fh, &header, sizeof(TASKHEADER), 0) < 0))
+   {
+      char msg[MAXBUFF];
+      sprintf(msg, "Cannot save the progress of job %d", array->jobID);
+      Message(PROGNAME, MSG_WARNING, msg);
+   }
+}
+
+
+/************************************************************************/
+/*>BOOL FinishTask(RUNNER *runner, RUNNING *job, int status)
+   ---------------------------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     job      A task of a job array that has finished
+   \param[in]     status   Its status from wait4()
+   \return                 Has the whole array now finished?
+
+   Records that a task has finished. If the job array was removed from
+   the queue while the task was running, it is forgotten once none of 
+   its tasks are running.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL FinishTask(RUNNER *runner, RUNNING *job, int status)
+{
+   TASKARRAY *array;
+   int       task;
+   
+   if((array = FindArray(runner, job->jobID)) == NULL)
+      return(FALSE);
+
+   task = job->task - array->first;
+   array->nRunning--;
+   if(!(array->finished[task / 8] & (1 << (task % 8))))
+   {
+      array->finished[task / 8] |= (1 << (task % 8));
+      array->nDone++;
+      if(status != 0)
+         array->nFailed++;
+   }
+   SaveArray(array, task);
+
+   if(array->nRunning)
+      return(FALSE);
+   if(array->nDone >= array->nTasks)
+      return(TRUE);
+   if(FindWaiting(runner, job->jobID) < 0)
+      EndArray(runner, job->jobID, FALSE);
+   return(FALSE);
+}
+
+
+/************************************************************************/
+/*>void EndArray(RUNNER *runner, int jobID, BOOL finished)
+   -------------------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     jobID     A job that has left the queue
+   \param[in]     finished  Have all its tasks finished? If not, the job
+                            was removed and is only forgotten once none
+                            of its tasks are running
+
+   Stops keeping the progress of a job array and removes its progress 
+   file. Nothing is done if the job isn't an array that has started.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The progress file is kept in STATEDIR   By: agent
+*/
+void EndArray(RUNNER *runner, int jobID, BOOL finished)
+{
+   TASKARRAY *array;
+   char      tasksFile[MAXBUFF];
+   
+   if((array = FindArray(runner, jobID)) == NULL)
+      return;
+   if(!finished && array->nRunning)
+      return;
+
+   if(array->fh >= 0)
+      close(array->fh);
+   TasksFile(runner->queueDir, jobID, tasksFile);
+   unlink(tasksFile);
+   free(array->finished);
+   
+   *array = runner->arrays[--runner->nArrays];
+}
+
+
+/************************************************************************/
+/*>int TasksDone(char *queueDir, int jobID)
+   ----------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   jobID       A job array
+   \return                  Number of its tasks that have finished
+
+   Reads the progress file of a job array, for listing the queue when
+   the runner isn't running.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The progress file is kept in STATEDIR   By: agent
+*/
+int TasksDone(char *queueDir, int jobID)
+{
+   TASKHEADER header;
+   char       tasksFile[MAXBUFF];
+   int        fh,
+              nDone = 0;
+
+   TasksFile(queueDir, jobID, tasksFile);
+   if((fh = open(tasksFile, O_RDONLY|O_CLOEXEC)) < 0)
+      return(0);
+   if((read(fh, &header, sizeof(TASKHEADER)) == sizeof(TASKHEADER)) &&
+      (header.magic == TASKMAGIC) && (header.jobID == jobID))
+      nDone = header.nDone;
+   close(fh);
+   return(nDone);
+}
+
+
+/************************************************************************/
+/*>void PrintJob(SNAPJOB *job, char *username)
+   -------------------------------------------
+*//**
+   \param[in]   job         A job in the queue
+   \param[in]   username    Its owner
+
+   Prints a job for -l -v. A job array is shown with the number of 
+   tasks waiting, running and done. The predicted start and finish are
+   given if they are known.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Prints the predicted start and finish   By: agent
+*/
+void PrintJob(SNAPJOB *job, char *username)
+{
+   if(job->nTasks)
+   {
+      printf("JobID: %d Owner: %s%s Tasks: %d waiting, %d running, \
+%d done", job->jobID, username, (job->running?" (running)":""),
+             job->nTasks - job->running - job->nDone, job->running,
+             job->nDone);
+   }
+   else
+   {
+      printf("JobID: %d Owner: %s%s", job->jobID, username,
+             (job->running?" (running)":""));
+   }
+   
+   if(job->start)
+   {
+      char start[MAXBUFF],
+           finish[MAXBUFF];
+      
+      FormatClock(job->start,  start);
+      FormatClock(job->finish, finish);
+      printf(" Start: %s Finish: %s", start, finish);
+   }
+   printf("\n");
+}
+
+
+/************************************************************************/
+/*>void ShardDir(char *queueDir, int shard, char *dir)
+   ---------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   shard       Subdirectory number (job ID / SHARDJOBS)
+   \param[out]  dir         Its path
+
+   Gives the path of a subdirectory of job files.
+
+-  17.10.26  Original   By: agent
+*/
+void ShardDir(char *queueDir, int shard, char *dir)
+{
+   sprintf(dir, "%s/%s%d", queueDir, SHARDPREFIX, shard);
+}
+
+
+/************************************************************************/
+/*>BOOL IsShardName(char *name, int *shard)
+   ----------------------------------------
+*//**
+   \param[in]   name        A file name from the queue directory
+   \param[out]  shard       Subdirectory number
+   \return                  Is it a subdirectory of job files?
+
+-  17.10.26  Original   By: agent
+*/
+BOOL IsShardName(char *name, int *shard)
+{
+   int prefixLen = strlen(SHARDPREFIX);
+   
+   if(strncmp(name, SHARDPREFIX, prefixLen))
+      return(FALSE);
+   return(sscanf(name + prefixLen, "%d", shard) == 1);
+}
+
+
+/************************************************************************/
+/*>BOOL ShardJobFile(char *queueDir, int jobID, char *jobFile)
+   -----------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   jobID       Job number
+   \param[out]  jobFile     Where a new job file should go
+   \return                  Is it in a subdirectory?
+
+   A new job file goes in the subdirectory for its job ID if the runner
+   has made one, and otherwise in the queue directory itself. A 
+   subdirectory made by anyone else, who could then remove the jobs put
+   in it, is not used.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Checks that the runner made the subdirectory   By: agent
+*/
+BOOL ShardJobFile(char *queueDir, int jobID, char *jobFile)
+{
+   char        dir[MAXBUFF];
+   struct stat statBuff;
+   
+   ShardDir(queueDir, jobID / SHARDJOBS, dir);
+   if((lstat(dir, &statBuff) == 0) && S_ISDIR(statBuff.st_mode) &&
+      ((statBuff.st_mode & 07777) == 01777) &&
+      QueueOwner(queueDir, statBuff.st_uid))
+   {
+      snprintf(jobFile, MAXBUFF, "%s/%d", dir, jobID);
+      return(TRUE);
+   }
+   sprintf(jobFile, "%s/%d", queueDir, jobID);
+   return(FALSE);
+}
+
+
+/************************************************************************/
+/*>BOOL FindJobFile(char *queueDir, int jobID, char *suffix, 
+                    char *jobFile)
+   ---------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   jobID       Job number
+   \param[in]   suffix      "" for a waiting job or RUNSUFFIX
+   \param[out]  jobFile     The job file (in the queue directory itself
+                            if it wasn't found)
+   \return                  Was it found?
+
+   Finds a job file, which may be in the subdirectory for its job ID or,
+   if it was submitted before there was one, in the queue directory.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL FindJobFile(char *queueDir, int jobID, char *suffix, char *jobFile)
+{
+   char dir[MAXBUFF];
+   
+   ShardDir(queueDir, jobID / SHARDJOBS, dir);
+   snprintf(jobFile, MAXBUFF, "%s/%d%s", dir, jobID, suffix);
+   if(FileExists(jobFile))
+      return(TRUE);
+   sprintf(jobFile, "%s/%d%s", queueDir, jobID, suffix);
+   return(FileExists(jobFile));
+}
+
+
+/************************************************************************/
+/*>BOOL OpenJobDir(char *queueDir, JOBDIR *jobDir)
+   -----------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[out]  jobDir      For reading the job files
+   \return                  Was the queue directory opened?
+
+   Opens the queue directory for ReadJobDir()
+
+-  17.10.26  Original   By: agent
+*/
+BOOL OpenJobDir(char *queueDir, JOBDIR *jobDir)
+{
+   jobDir->queueDir = queueDir;
+   jobDir->shard    = NULL;
+   strncpy(jobDir->dir, queueDir, MAXBUFF-1);
+   jobDir->dir[MAXBUFF-1] = '\0';
+   
+   return((jobDir->top = opendir(queueDir)) != NULL);
+}
+
+
+/************************************************************************/
+/*>struct dirent *ReadJobDir(JOBDIR *jobDir)
+   -----------------------------------------
+*//**
+   \param[in,out] jobDir    Opened by OpenJobDir()
+   \return                  The next entry (NULL at the end)
+
+   As readdir(), but reads the entries in each subdirectory of job 
+   files in place of the subdirectory itself. jobDir->dir is the
+   directory holding the entry returned.
+
+-  17.10.26  Original   By: agent
+*/
+struct dirent *ReadJobDir(JOBDIR *jobDir)
+{
+   struct dirent *dirp;
+   int           shard;
+   
+   while(TRUE)
+   {
+      if(jobDir->shard != NULL)
+      {
+         if((dirp = readdir(jobDir->shard)) != NULL)
+            return(dirp);
+         closedir(jobDir->shard);
+         jobDir->shard = NULL;
+         strcpy(jobDir->dir, jobDir->queueDir);
+      }
+
+      if((dirp = readdir(jobDir->top)) == NULL)
+         return(NULL);
+      if(!IsShardName(dirp->d_name, &shard))
+         return(dirp);
+
+      ShardDir(jobDir->queueDir, shard, jobDir->dir);
+      if((jobDir->shard = opendir(jobDir->dir)) == NULL)
+         strcpy(jobDir->dir, jobDir->queueDir);
+   }
+}
+
+
+/************************************************************************/
+/*>void CloseJobDir(JOBDIR *jobDir)
+   --------------------------------
+*//**
+   \param[in,out] jobDir    Opened by OpenJobDir()
+
+-  17.10.26  Original   By: agent
+*/
+void CloseJobDir(JOBDIR *jobDir)
+{
+   if(jobDir->shard != NULL)
+      closedir(jobDir->shard);
+   closedir(jobDir->top);
+}
+
+
+/************************************************************************/
+/*>BOOL AddJobID(int **jobIDs, int *nJobs, int *maxJobs, int jobID)
+   ----------------------------------------------------------------
+*//**
+   \param[in,out] jobIDs    Array of job IDs (malloc'd)
+   \param[in,out] nJobs     Number in the array
+   \param[in,out] maxJobs   Space in the array
+   \param[in]     jobID     Job ID to add
+   \return                  Was there memory to add it?
+
+-  17.10.26  Original   By: agent
+*/
+BOOL AddJobID(int **jobIDs, int *nJobs, int *maxJobs, int jobID)
+{
+   if(*nJobs == *maxJobs)
+   {
+      int *newIDs,
+          newMax = (*maxJobs ? 2 * *maxJobs : 64);
+      
+      if((newIDs = (int *)realloc(*jobIDs, newMax * sizeof(int))) 
+         == NULL)
+         return(FALSE);
+      *jobIDs  = newIDs;
+      *maxJobs = newMax;
+   }
+   (*jobIDs)[(*nJobs)++] = jobID;
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>int CompareShards(const void *a, const void *b)
+   -----------------------------------------------
+*//**
+   bsearch() comparison function for SHARDs
+
+-  17.10.26  Original   By: agent
+*/
+int CompareShards(const void *a, const void *b)
+{
+   int shardA = ((SHARD *)a)->shard,
+       shardB = ((SHARD *)b)->shard;
+   
+   return((shardA > shardB) - (shardA < shardB));
+}
+
+
+/************************************************************************/
+/*>SHARD *FindShard(RUNNER *runner, int shard)
+   -------------------------------------------
+*//**
+   \param[in]   runner      The job runner
+   \param[in]   shard       Subdirectory number
+   \return                  The runner's record of it (NULL if none)
+
+-  17.10.26  Original   By: agent
+*/
+SHARD *FindShard(RUNNER *runner, int shard)
+{
+   SHARD key;
+
+   if(!runner->nShards)
+      return(NULL);
+   key.shard = shard;
+   return((SHARD *)bsearch(&key, runner->shards, runner->nShards, 
+                           sizeof(SHARD), CompareShards));
+}
+
+
+/************************************************************************/
+/*>SHARD *AddShard(RUNNER *runner, int shard)
+   ------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     shard     Subdirectory number
+   \return                  The runner's record of it (NULL if there 
+                            was no memory)
+
+   Starts keeping track of a subdirectory of job files, which is watched
+   for new jobs in the same way as the queue directory. It is read at 
+   the next scan.
+
+-  17.10.26  Original   By: agent
+*/
+SHARD *AddShard(RUNNER *runner, int shard)
+{
+   int  pos;
+   char dir[MAXBUFF];
+   
+   if(runner->nShards == runner->maxShards)
+   {
+      SHARD *newShards;
+      int   newMax = (runner->maxShards ? 2 * runner->maxShards : 16);
+      
+      if((newShards = (SHARD *)realloc(runner->shards, 
+                                       newMax * sizeof(SHARD))) == NULL)
+         return(NULL);
+      runner->shards    = newShards;
+      runner->maxShards = newMax;
+   }
+
+   /* Keep them in order                                                */
+   for(pos=runner->nShards; pos>0; pos--)
+   {
+      if(runner->shards[pos-1].shard < shard)
+         break;
+   }
+   memmove(runner->shards+pos+1, runner->shards+pos, 
+           (runner->nShards-pos) * sizeof(SHARD));
+   runner->nShards++;
+
+   runner->shards[pos].shard         = shard;
+   runner->shards[pos].seen          = TRUE;
+   runner->shards[pos].skipped       = FALSE;
+   runner->shards[pos].mtime.tv_sec  = 0;
+   runner->shards[pos].mtime.tv_nsec = 0;
+   if(shard > runner->topShard)
+      runner->topShard = shard;
+
+   if(runner->watchFd >= 0)
+   {
+      ShardDir(runner->queueDir, shard, dir);
+      inotify_add_watch(runner->watchFd, dir, WATCHEVENTS);
+   }
+   
+   return(runner->shards+pos);
+}
+
+
+/************************************************************************/
+/*>BOOL ReadShard(RUNNER *runner, SHARD *shard, int **jobIDs, 
+                  int *nJobs, int *maxJobs)
+   ----------------------------------------------------------
+*//**
+   \param[in]     runner    The job runner
+   \param[in,out] shard     A subdirectory of job files
+   \param[in,out] jobIDs    Array of waiting job IDs (malloc'd)
+   \param[in,out] nJobs     Number in the array
+   \param[in,out] maxJobs   Space in the array
+   \return                  Was it read? (FALSE if it hasn't changed)
+
+   Adds the waiting jobs in a subdirectory to a list, unless it hasn't
+   changed since it was last read. The time it was changed is only 
+   trusted once it is SHARDSETTLE seconds old, as something changed in
+   the same clock tick wouldn't change it.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ReadShard(RUNNER *runner, SHARD *shard, int **jobIDs, int *nJobs,
+               int *maxJobs)
+{
+   struct dirent *dirp;
+   DIR           *dp;
+   struct stat   statBuf;
+   char          dir[MAXBUFF];
+   
+   ShardDir(runner->queueDir, shard->shard, dir);
+   if(stat(dir, &statBuf) != 0)
+      return(FALSE);
+   if(shard->mtime.tv_sec &&
+      (statBuf.st_mtim.tv_sec  == shard->mtime.tv_sec) &&
+      (statBuf.st_mtim.tv_nsec == shard->mtime.tv_nsec))
+      return(FALSE);
+   if((dp = opendir(dir)) == NULL)
+      return(FALSE);
+
+   while((dirp = readdir(dp)) != NULL)
+   {
+      int jobID;
+      
+      if(IsJobFileName(dirp->d_name) && 
+         !IsRunningFileName(dirp->d_name) &&
+         (sscanf(dirp->d_name, "%d", &jobID) == 1))
+         AddJobID(jobIDs, nJobs, maxJobs, jobID);
+   }
+   
+   closedir(dp);
+
+   if(time(NULL) - statBuf.st_mtime > SHARDSETTLE)
+   {
+      shard->mtime = statBuf.st_mtim;
+   }
+   else
+   {
+      shard->mtime.tv_sec  = 0;
+      shard->mtime.tv_nsec = 0;
+   }
+   
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>void MakeShards(RUNNER *runner, int jobID)
+   ------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     jobID     A new job ID
+
+   With -S, makes sure there are subdirectories for the range of job IDs
+   holding jobID and for the next range, so that the next one is there 
+   before any job needs it. Like the queue directory, anyone may write
+   to them and the sticky bit stops people deleting other people's 
+   jobs. Submitters that find no subdirectory for a job ID put the job
+   in the queue directory itself. A subdirectory that someone else made
+   first is not used, and submitters don't use it either.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Refuses a subdirectory made by someone else   By: agent
+*/
+void MakeShards(RUNNER *runner, int jobID)
+{
+   while(runner->topShard < jobID / SHARDJOBS + 1)
+   {
+      int    shard = runner->topShard + 1;
+      char   dir[MAXBUFF];
+      BOOL   made;
+      
+      ShardDir(runner->queueDir, shard, dir);
+      made = OwnDirectory(dir, 01777);
+      
+      if(made && (FindShard(runner, shard) == NULL) && 
+         (AddShard(runner, shard) != NULL))
+      {
+         /* A job may have been put in it before it was watched         */
+         runner->newFiles = TRUE;
+      }
+      else if(!made)
+      {
+         char msg[MAXBUFF+80];
+         sprintf(msg, "Cannot create directory or it was not made by \
+the queue manager: %s", dir);
+         Message(PROGNAME, MSG_WARNING, msg);
+      }
+      
+      if(runner->topShard < shard)
+         runner->topShard = shard;
+   }
+}
+
+
+/************************************************************************/
+/*>void RemoveShard(RUNNER *runner, int jobID)
+   -------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     jobID     A job whose file has been removed
+
+   Removes the subdirectory for a job's ID once it is empty. New job IDs
+   are never lower than the range of the highest subdirectory but one,
+   so no job can be put into a subdirectory once it is removed.
+
+-  17.10.26  Original   By: agent
+*/
+void RemoveShard(RUNNER *runner, int jobID)
+{
+   int   shardNum = jobID / SHARDJOBS;
+   SHARD *shard;
+   char  dir[MAXBUFF];
+   
+   if((shardNum >= runner->topShard - 1) ||
+      ((shard = FindShard(runner, shardNum)) == NULL))
+      return;
+
+   ShardDir(runner->queueDir, shardNum, dir);
+   if(rmdir(dir) == 0)
+   {
+      int pos = (int)(shard - runner->shards);
+      
+      memmove(runner->shards+pos, runner->shards+pos+1, 
+              (runner->nShards-pos-1) * sizeof(SHARD));
+      runner->nShards--;
+
+      if(runner->verbose >= 2)
+      {
+         char msg[MAXBUFF+32];
+         sprintf(msg, "Removed empty directory: %s", dir);
+         Message(PROGNAME, MSG_INFO, msg);
+      }
+   }
+}
+
+
+/************************************************************************/
+/*>FAIRUSER *FindUser(FAIRUSER **users, int *nUsers, int *maxUsers, 
+                      uid_t uid)
+   ----------------------------------------------------------------
+*//**
+   \param[in,out] users     Array of users (malloc'd)
+   \param[in,out] nUsers    Number in the array
+   \param[in,out] maxUsers  Space in the array
+   \param[in]     uid       User to find
+   \return                  The user's record, added if there wasn't one
+                            (NULL if there was no memory)
+
+-  17.10.26  Original   By: agent
+*/
+FAIRUSER *FindUser(FAIRUSER **users, int *nUsers, int *maxUsers, 
+                   uid_t uid)
+{
+   FAIRUSER *user;
+   int      i;
+   
+   for(i=0; i<*nUsers; i++)
+   {
+      if((*users)[i].uid == uid)
+         return(&((*users)[i]));
+   }
+
+   if(*nUsers == *maxUsers)
+   {
+      FAIRUSER *newUsers;
+      int      newMax = (*maxUsers ? 2 * *maxUsers : 16);
+      
+      if((newUsers = (FAIRUSER *)realloc(*users, 
+                                         newMax * sizeof(FAIRUSER))) 
+         == NULL)
+         return(NULL);
+      *users    = newUsers;
+      *maxUsers = newMax;
+   }
+
+   user          = &((*users)[(*nUsers)++]);
+   user->uid     = uid;
+   user->usage   = 0.0;
+   user->jobs    = 0.0;
+   user->finish  = 0.0;
+   user->decayed = time(NULL);
+   return(user);
+}
+
+
+/************************************************************************/
+/*>void DecayUsage(FAIRUSER *user, time_t now)
+   -------------------------------------------
+*//**
+   \param[in,out] user      A user's recent use
+   \param[in]     now       The time now
+
+   Decays a user's use of the slots to the present time, halving it 
+   every FAIRHALFLIFE seconds.
+
+-  17.10.26  Original   By: agent
+*/
+void DecayUsage(FAIRUSER *user, time_t now)
+{
+   if(now > user->decayed)
+   {
+      double factor = pow(0.5, (double)(now - user->decayed) / 
+                               FAIRHALFLIFE);
+      user->usage  *= factor;
+      user->jobs   *= factor;
+      user->decayed = now;
+   }
+}
+
+
+/************************************************************************/
+/*>double UserCost(FAIRUSER *user)
+   -------------------------------
+*//**
+   \param[in]   user        A user's recent use
+   \return                  Slot time (s) a job of theirs is expected
+                            to take
+
+   The recent mean for the user's jobs, or FAIRDEFCOST if none have 
+   finished recently. Never less than a second.
+
+-  17.10.26  Original   By: agent
+*/
+double UserCost(FAIRUSER *user)
+{
+   double cost = FAIRDEFCOST;
+   
+   if(user->jobs > 0.01)
+      cost = user->usage / user->jobs;
+   return((cost < 1.0) ? 1.0 : cost);
+}
+
+
+/************************************************************************/
+/*>double SlotTime(long runMs, long cpuMs)
+   ---------------------------------------
+*//**
+   \param[in]   runMs       Run time of a job (ms)
+   \param[in]   cpuMs       Its CPU time (ms)
+   \return                  Slot time (s) it is charged for
+
+   A job is charged for the longer of its run time and its CPU time, so
+   that it pays for holding a slot while it waits and for using more 
+   than one CPU.
+
+-  17.10.26  Original   By: agent
+*/
+double SlotTime(long runMs, long cpuMs)
+{
+   return((double)((runMs > cpuMs) ? runMs : cpuMs) / 1000.0);
+}
+
+
+/************************************************************************/
+/*>void ReadUsage(char *queueDir, FAIRUSER **users, int *nUsers, 
+                  int *maxUsers)
+   -------------------------------------------------------------
+*//**
+   \param[in]     queueDir  Queue directory
+   \param[in,out] users     Array of users (malloc'd)
+   \param[in,out] nUsers    Number in the array
+   \param[in,out] maxUsers  Space in the array
+
+   Adds up each user's recent use of the slots from the accounting log,
+   decayed to the present time. The log is read backwards, FAIRCHUNK
+   records at a time, until the jobs finished more than FAIRWINDOW 
+   half-lives ago.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The log is kept in STATEDIR   By: agent
+*/
+void ReadUsage(char *queueDir, FAIRUSER **users, int *nUsers, 
+               int *maxUsers)
+{
+   char        acctFile[MAXBUFF];
+   int         fh,
+               nRecs,
+               i;
+   struct stat statBuf;
+   ACCTRECORD  *recs;
+   off_t       end;
+   time_t      now    = time(NULL),
+               oldest = now - FAIRWINDOW * FAIRHALFLIFE;
+   BOOL        done   = FALSE;
+
+   StateFile(queueDir, ACCTFILE, acctFile);
+   if((fh = open(acctFile, O_RDONLY|O_CLOEXEC)) < 0)
+      return;
+   if((fstat(fh, &statBuf) != 0) || 
+      ((recs = (ACCTRECORD *)malloc(FAIRCHUNK * sizeof(ACCTRECORD))) 
+       == NULL))
+   {
+      close(fh);
+      return;
+   }
+
+   end = statBuf.st_size - statBuf.st_size % sizeof(ACCTRECORD);
+   while(!done && (end > 0))
+   {
+      off_t start = end - FAIRCHUNK * (off_t)sizeof(ACCTRECORD);
+
+      if(start < 0)
+         start = 0;
+      if((nRecs = pread(fh, recs, (size_t)(end - start), start)) <= 0)
+         break;
+      nRecs /= sizeof(ACCTRECORD);
+      
+      for(i=nRecs-1; i>=0; i--)
+      {
+         ACCTRECORD *rec     = &(recs[i]);
+         time_t     finished = rec->started + rec->runMs / 1000;
+         FAIRUSER   *user;
+         double     weight   = 1.0;
+         
+         if(finished < oldest)
+         {
+            done = TRUE;
+            break;
+         }
+         if((user = FindUser(users, nUsers, maxUsers, rec->uid)) == NULL)
+            continue;
+         if(finished < now)
+            weight = pow(0.5, (double)(now - finished) / FAIRHALFLIFE);
+         user->usage += weight * SlotTime(rec->runMs, 
+                                          rec->userMs + rec->systemMs);
+         user->jobs  += weight;
+      }
+      end = start;
+   }
+   
+   free(recs);
+   close(fh);
+}
+
+
+/************************************************************************/
+/*>double FairStart(RUNNER *runner, JOBINFO *job)
+   ----------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     job       A job being added to the heap
+   \return                  Its fair share time
+
+   With -F, jobs are run in order of a fair share time rather than the
+   time they were queued. Each user's jobs are spaced out by the slot 
+   time their jobs usually take, shared over the slots, and a user's 
+   first job starts from the fair share time of the last job started, 
+   put back by the user's recent use. So someone who submits many jobs
+   at once takes turns with everyone else, and those who have used the
+   queue least recently go first. The times don't change once given,
+   so the heap stays in order.
+
+-  17.10.26  Original   By: agent
+*/
+double FairStart(RUNNER *runner, JOBINFO *job)
+{
+   FAIRUSER *user;
+   double   start;
+   
+   if((user = FindUser(&(runner->users), &(runner->nUsers), 
+                       &(runner->maxUsers), job->uid)) == NULL)
+      return((double)job->queued);
+   DecayUsage(user, time(NULL));
+
+   start = runner->fairClock + user->usage / runner->nSlots;
+   if(user->finish > start)
+      start = user->finish;
+   user->finish = start + UserCost(user) / runner->nSlots;
+   
+   return(start);
+}
+
+
+/************************************************************************/
+/*>void FairStarted(RUNNER *runner, int jobID, double start)
+   ---------------------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     jobID     A job that has been started
+   \param[in]     start     Its fair share time
+
+   Moves the fair share clock on to the job's time. A job array stays 
+   in the heap until its last task has started, so it is then given a
+   new time as if the next task were another job from the same user.
+
+-  17.10.26  Original   By: agent
+*/
+void FairStarted(RUNNER *runner, int jobID, double start)
+{
+   FAIRUSER *user;
+   WAITING  *entry;
+   int      pos;
+   
+   if(start > runner->fairClock)
+      runner->fairClock = start;
+
+   if(((pos = FindWaiting(runner, jobID)) < 0) ||
+      ((user = FindUser(&(runner->users), &(runner->nUsers), 
+                        &(runner->maxUsers), 
+                        runner->waiting[pos].uid)) == NULL))
+      return;
+
+   entry        = &(runner->waiting[pos]);
+   entry->start = ((user->finish > runner->fairClock) ? user->finish : 
+                   runner->fairClock);
+   user->finish = entry->start + UserCost(user) / runner->nSlots;
+
+   /* It has moved, so it must be listed again in the snapshot          */
+   entry->listed   = FALSE;
+   runner->changed = TRUE;
+   SiftWaiting(runner, pos);
+}
+
+
+/************************************************************************/
+/*>void ChargeUser(RUNNER *runner, RUNNING *job, struct rusage *usage)
+   -------------------------------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     job       A job that has finished
+   \param[in]     usage     Its resource use from wait4()
+
+   Adds a finished job's slot time to its owner's recent use.
+
+-  17.10.26  Original   By: agent
+*/
+void ChargeUser(RUNNER *runner, RUNNING *job, struct rusage *usage)
+{
+   FAIRUSER *user;
+   long     cpuMs;
+   
+   if((user = FindUser(&(runner->users), &(runner->nUsers), 
+                       &(runner->maxUsers), job->uid)) == NULL)
+      return;
+
+   cpuMs = (long)(usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 
+           1000L + (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) /
+           1000L;
+   DecayUsage(user, time(NULL));
+   user->usage += SlotTime(RunTime(job), cpuMs);
+   user->jobs  += 1.0;
+}
+
+
+/************************************************************************/
+/*>void ListUsage(char *queueDir)
+   ------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+
+   Lists each user's share of the recent use of the job slots, as used 
+   by -F, for -l -v.
+
+-  17.10.26  Original   By: agent
+*/
+void ListUsage(char *queueDir)
+{
+   FAIRUSER *users   = NULL;
+   int      nUsers   = 0,
+            maxUsers = 0,
+            i;
+   double   total    = 0.0;
+
+   ReadUsage(queueDir, &users, &nUsers, &maxUsers);
+   for(i=0; i<nUsers; i++)
+      total += users[i].usage;
+
+   if(total > 0.0)
+   {
+      printf("Recent use (half-life %d minutes):\n", FAIRHALFLIFE / 60);
+      for(i=0; i<nUsers; i++)
+      {
+         printf("Owner: %s Share: %.0f%% Slot time: %.0fs\n", 
+                UserName(users[i].uid), 100.0 * users[i].usage / total,
+                users[i].usage);
+      }
+   }
+   
+   if(users != NULL)
+      free(users);
+}
+
+
+/************************************************************************/
+/*>char *UserName(uid_t uid)
+   -------------------------
+*//**
+   \param[in]   uid         A user ID
+   \return                  The user's name, or the ID if there is no
+                            such user
+
+   Looks up a user's name, remembering the last NAMECACHE looked up, so
+   that listing a queue makes one lookup per user rather than one per 
+   job. The name returned is only good until the next NAMECACHE other
+   users have been looked up.
+
+-  17.10.26  Original   By: agent
+*/
+char *UserName(uid_t uid)
+{
+   static USERNAME names[NAMECACHE];
+   static int      nNames = 0,
+                   next   = 0;
+   USERNAME        *name;
+   struct passwd   *pwd;
+   int             i;
+   
+   for(i=0; i<nNames; i++)
+   {
+      if(names[i].uid == uid)
+         return(names[i].name);
+   }
+
+   if(nNames < NAMECACHE)
+   {
+      name = &(names[nNames++]);
+   }
+   else
+   {
+      name = &(names[next]);
+      next = (next + 1) % NAMECACHE;
+   }
+
+   name->uid = uid;
+   if(((pwd = getpwuid(uid)) != NULL) && (pwd->pw_name != NULL))
+      strncpy(name->name, pwd->pw_name, MAXNAME-1);
+   else
+      sprintf(name->name, "%d", (int)uid);
+   name->name[MAXNAME-1] = '\0';
+   
+   return(name->name);
+}
+
+
+/************************************************************************/
+/*>int JobDirFd(JOBDIR *jobDir)
+   ----------------------------
+*//**
+   \param[in]   jobDir      Opened by OpenJobDir()
+   \return                  File descriptor of the directory holding
+                            the entry last returned by ReadJobDir()
+
+-  17.10.26  Original   By: agent
+*/
+int JobDirFd(JOBDIR *jobDir)
+{
+   return(dirfd((jobDir->shard != NULL) ? jobDir->shard : jobDir->top));
+}
+
+
+/************************************************************************/
+/*>BOOL AddListJob(LISTJOB **jobs, int *nJobs, int *maxJobs, int jobID)
+   --------------------------------------------------------------------
+*//**
+   \param[in,out] jobs      Array of jobs (malloc'd)
+   \param[in,out] nJobs     Number in the array
+   \param[in,out] maxJobs   Space in the array
+   \param[in]     jobID     Job ID to add
+   \return                  Was there memory?
+
+   Adds a job with no details to a listing.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL AddListJob(LISTJOB **jobs, int *nJobs, int *maxJobs, int jobID)
+{
+   LISTJOB *job;
+   
+   if(*nJobs == *maxJobs)
+   {
+      LISTJOB *newJobs;
+      int     newMax = (*maxJobs ? 2 * *maxJobs : 256);
+      
+      if((newJobs = (LISTJOB *)realloc(*jobs, newMax * sizeof(LISTJOB)))
+         == NULL)
+         return(FALSE);
+      *jobs    = newJobs;
+      *maxJobs = newMax;
+   }
+
+   job = &((*jobs)[(*nJobs)++]);
+   job->jobID    = jobID;
+   job->order    = (-1);
+   job->position = 0;
+   job->running  = 0;
+   job->nTasks   = 0;
+   job->nDone    = 0;
+   job->priority = 0;
+   job->started  = FALSE;
+   job->fromFile = FALSE;
+   job->uid      = (uid_t)(-1);
+   job->queued   = 0;
+   job->start    = 0;
+   job->finish   = 0;
+   job->finishBy = 0;
+   job->pwd[0]   = '\0';
+   job->cmd[0]   = '\0';
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>int CompareListJobIDs(const void *a, const void *b)
+   ---------------------------------------------------
+*//**
+   qsort() and bsearch() comparison function to put jobs being listed
+   in job ID order
+
+-  17.10.26  Original   By: agent
+*/
+int CompareListJobIDs(const void *a, const void *b)
+{
+   int idA = ((LISTJOB *)a)->jobID,
+       idB = ((LISTJOB *)b)->jobID;
+
+   return((idA > idB) - (idA < idB));
+}
+
+
+/************************************************************************/
+/*>int CompareListJobs(const void *a, const void *b)
+   -------------------------------------------------
+*//**
+   qsort() comparison function to put jobs being listed in the order
+   they will run. Running jobs come first. Jobs are kept in the order 
+   the runner or the ring gives. Any others are ordered as RunsBefore()
+   would without -F.
+
+-  17.10.26  Original   By: agent
+*/
+int CompareListJobs(const void *a, const void *b)
+{
+   LISTJOB *ja = (LISTJOB *)a,
+           *jb = (LISTJOB *)b;
+   WAITING wa,
+           wb;
+
+   if(ja->started != jb->started)
+      return(ja->started ? -1 : 1);
+   if((ja->order >= 0) && (jb->order >= 0))
+      return((ja->order > jb->order) - (ja->order < jb->order));
+   if((ja->order >= 0) != (jb->order >= 0))
+      return((ja->order >= 0) ? -1 : 1);
+
+   wa.jobID    = ja->jobID;
+   wa.priority = ja->priority;
+   wa.start    = (double)ja->queued;
+   wb.jobID    = jb->jobID;
+   wb.priority = jb->priority;
+   wb.start    = (double)jb->queued;
+   
+   if(RunsBefore(&wa, &wb))
+      return(-1);
+   if(RunsBefore(&wb, &wa))
+      return(1);
+   return(0);
+}
+
+
+/************************************************************************/
+/*>int ReadJobList(char *queueDir, LISTJOB **jobs, int *nRunning)
+   --------------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[out]  jobs        The jobs (malloc'd) in the order they will 
+                            run, running jobs first
+   \param[out]  nRunning    Number of running jobs
+   \return                  Number of jobs (-1 if the queue directory
+                            can't be read)
+
+   Lists the jobs in a queue with their details. The queue directory 
+   is read once and each job file is opened relative to its directory,
+   which also gives its owner and the time it was queued. If the runner
+   is running, its snapshot gives the order the jobs will run in and 
+   how many tasks of each job array are running. Jobs kept in a ring 
+   are listed with their priority and time queued but without their 
+   directory and command.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Gives the priority and time queued of jobs in a ring
+             By: agent
+*/
+int ReadJobList(char *queueDir, LISTJOB **jobs, int *nRunning)
+{
+   struct dirent *dirp;
+   JOBDIR        jobDir;
+   SNAPSHOT      *snapshot;
+   SNAPJOB       *order   = NULL;
+   size_t        size;
+   int           nJobs    = 0,
+                 maxJobs  = 0,
+                 nOrder   = 0,
+                 nStarted = 0,
+                 position = 0,
+                 version,
+                 i;
+
+   *jobs     = NULL;
+   *nRunning = 0;
+
+   /* Jobs in the ring are already in the order they will run           */
+   if(IsRingQueue(queueDir))
+   {
+      SNAPJOB *ring;
+      int     nRing,
+              nRingRunning;
+      
+      if((nRing = ReadRing(queueDir, &ring, &nRingRunning)) > 0)
+      {
+         for(i=0; i<nRing; i++)
+         {
+            if(!AddListJob(jobs, &nJobs, &maxJobs, ring[i].jobID))
+               break;
+            (*jobs)[nJobs-1].order    = i;
+            (*jobs)[nJobs-1].uid      = ring[i].uid;
+            (*jobs)[nJobs-1].started  = (i < nRingRunning);
+            (*jobs)[nJobs-1].running  = ring[i].running;
+            (*jobs)[nJobs-1].nTasks   = ring[i].nTasks;
+            (*jobs)[nJobs-1].priority = ring[i].priority;
+            (*jobs)[nJobs-1].queued   = ring[i].queued;
+            if(ring[i].nTasks)
+               (*jobs)[nJobs-1].nDone = TasksDone(queueDir, 
+                                                  ring[i].jobID);
+         }
+         free(ring);
+      }
+   }
+
+   if(!OpenJobDir(queueDir, &jobDir))
+   {
+      if(*jobs != NULL)
+         free(*jobs);
+      *jobs = NULL;
+      return(-1);
+   }
+
+   while((dirp = ReadJobDir(&jobDir)) != NULL)
+   {
+      JOBINFO info;
+      FILE    *fp;
+      int     fd,
+              len;
+      
+      if(!IsJobFileName(dirp->d_name) || 
+         !sscanf(dirp->d_name, "%d", &(info.jobID)))
+         continue;
+
+      /* Skip a job that has started or finished since it was listed    */
+      if((fd = openat(JobDirFd(&jobDir), dirp->d_name, 
+                      O_RDONLY|O_CLOEXEC)) < 0)
+         continue;
+      if((fp = fdopen(fd, "r")) == NULL)
+      {
+         close(fd);
+         continue;
+      }
+      if(!ReadJobStream(fp, &info) ||
+         !AddListJob(jobs, &nJobs, &maxJobs, info.jobID))
+         continue;
+      
+      (*jobs)[nJobs-1].fromFile = TRUE;
+      (*jobs)[nJobs-1].uid      = info.uid;
+      (*jobs)[nJobs-1].queued   = info.queued;
+      (*jobs)[nJobs-1].priority = info.priority;
+      (*jobs)[nJobs-1].nTasks   = info.nTasks;
+      (*jobs)[nJobs-1].started  = IsRunningFileName(dirp->d_name);
+      (*jobs)[nJobs-1].running  = ((*jobs)[nJobs-1].started ? 1 : 0);
+      strcpy((*jobs)[nJobs-1].pwd, info.pwd);
+      strcpy((*jobs)[nJobs-1].cmd, info.cmd);
+      
+      /* The arguments are each followed by a space                     */
+      len = strlen(info.cmd);
+      while((len > 0) && ((*jobs)[nJobs-1].cmd[len-1] == ' '))
+         (*jobs)[nJobs-1].cmd[--len] = '\0';
+      if(info.nTasks)
+         (*jobs)[nJobs-1].nDone = TasksDone(queueDir, info.jobID);
+   }
+   CloseJobDir(&jobDir);
+
+   /* Take the order from the runner's snapshot                         */
+   if(((snapshot = MapSnapshot(queueDir, &size)) != NULL))
+   {
+      if(RunnerAlive(snapshot) && !snapshot->moved &&
+         ((nOrder = CopySnapshot(snapshot, &order, &nStarted, &version))
+          > 0))
+      {
+         qsort(*jobs, nJobs, sizeof(LISTJOB), CompareListJobIDs);
+         for(i=0; i<nOrder; i++)
+         {
+            LISTJOB key,
+                    *job;
+
+            key.jobID = order[i].jobID;
+            if((job = (LISTJOB *)bsearch(&key, *jobs, nJobs, 
+                                         sizeof(LISTJOB), 
+                                         CompareListJobIDs)) != NULL)
+            {
+               job->order   = i;
+               job->started = (i < nStarted);
+               job->running = order[i].running;
+               job->nDone   = order[i].nDone;
+               job->start   = order[i].start;
+               job->finish  = order[i].finish;
+               job->finishBy = order[i].finishBy;
+            }
+         }
+      }
+      munmap(snapshot, size);
+      if(order != NULL)
+         free(order);
+   }
+
+   qsort(*jobs, nJobs, sizeof(LISTJOB), CompareListJobs);
+   for(i=0; i<nJobs; i++)
+   {
+      if((*jobs)[i].started)
+         (*nRunning)++;
+      else
+         (*jobs)[i].position = ++position;
+   }
+   
+   return(nJobs);
+}
+
+
+/************************************************************************/
+/*>void PrintEscaped(char *string, int format)
+   -------------------------------------------
+*//**
+   \param[in]   string      A string to print
+   \param[in]   format      LIST_JSON or LIST_TSV
+
+   Prints a string as the body of a JSON string, or as a TSV field 
+   with backslash, tab, newline and carriage return escaped.
+
+-  17.10.26  Original   By: agent
+*/
+void PrintEscaped(char *string, int format)
+{
+   unsigned char *ch;
+   
+   for(ch=(unsigned char *)string; *ch; ch++)
+   {
+      switch(*ch)
+      {
+      case '\\':
+         fputs("\\\\", stdout);
+         break;
+      case '\t':
+         fputs("\\t", stdout);
+         break;
+      case '\n':
+         fputs("\\n", stdout);
+         break;
+      case '\r':
+         fputs("\\r", stdout);
+         break;
+      case '"':
+         fputs((format == LIST_JSON) ? "\\\"" : "\"", stdout);
+         break;
+      default:
+         if((format == LIST_JSON) && (*ch < 0x20))
+            printf("\\u%04x", *ch);
+         else
+            putchar(*ch);
+         break;
+      }
+   }
+}
+
+
+/************************************************************************/
+/*>void ListJobDetails(char *queueDir, int format)
+   -----------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   format      LIST_JSON or LIST_TSV
+
+   Lists each job for -l -o, with its ID, owner, state, position in 
+   the queue (0 if running), submit time (UTC), priority, tasks, 
+   working directory, command, and predicted start and finish (UTC), 
+   in the order they will run. JSON is
+   an array with an object for each job on its own line. TSV has a 
+   header line. A detail that isn't known is null in JSON and empty in
+   TSV.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Added the predicted start and finish   By: agent
+-  17.10.26  The directory and command are null for jobs in a ring,
+             which now have their submit time   By: agent
+*/
+void ListJobDetails(char *queueDir, int format)
+{
+   LISTJOB *jobs;
+   int     nJobs,
+           nRunning,
+           i;
+
+   if((nJobs = ReadJobList(queueDir, &jobs, &nRunning)) < 0)
+   {
+      char msg[MAXBUFF];
+      sprintf(msg, "Can't read directory: %s", queueDir);
+      Message(PROGNAME, MSG_FATAL, msg);
+   }
+
+   if(format == LIST_JSON)
+      printf("[");
+   else
+      printf("id\towner\tstate\tposition\tsubmitted\tpriority\ttasks\t\
+done\tcwd\tcommand\texpected_start\texpected_finish\tfinish_by\n");
+
+   for(i=0; i<nJobs; i++)
+   {
+      LISTJOB *job = &(jobs[i]);
+      char    submitted[MAXBUFF],
+              predicted[3][MAXBUFF];
+      time_t  *times[3];
+      int     j;
+      
+      submitted[0] = '\0';
+      if(job->queued)
+      {
+         struct tm tmBuff;
+         strftime(submitted, MAXBUFF, "%Y-%m-%dT%H:%M:%SZ", 
+                  gmtime_r(&(job->queued), &tmBuff));
+      }
+      times[0] = &(job->start);
+      times[1] = &(job->finish);
+      times[2] = &(job->finishBy);
+      for(j=0; j<3; j++)
+      {
+         predicted[j][0] = '\0';
+         if(*times[j])
+         {
+            struct tm tmBuff;
+            strftime(predicted[j], MAXBUFF, "%Y-%m-%dT%H:%M:%SZ", 
+                     gmtime_r(times[j], &tmBuff));
+         }
+      }
+      
+      if(format == LIST_JSON)
+      {
+         printf("%s\n{\"id\": %d, \"owner\": \"", (i ? "," : ""), 
+                job->jobID);
+         PrintEscaped(UserName(job->uid), format);
+         printf("\", \"state\": \"%s\", \"position\": %d, ",
+                (job->started ? "running" : "waiting"), job->position);
+         if(submitted[0])
+            printf("\"submitted\": \"%s\", ", submitted);
+         else
+            printf("\"submitted\": null, ");
+         printf("\"priority\": %d, \"tasks\": %d, \"done\": %d, ",
+                job->priority, job->nTasks, job->nDone);
+         if(job->fromFile)
+         {
+            printf("\"cwd\": \"");
+            PrintEscaped(job->pwd, format);
+            printf("\", \"command\": \"");
+            PrintEscaped(job->cmd, format);
+            printf("\"");
+         }
+         else
+         {
+            printf("\"cwd\": null, \"command\": null");
+         }
+         for(j=0; j<3; j++)
+         {
+            static char *names[3] = {"expected_start", "expected_finish",
+                                     "finish_by"};
+            if(predicted[j][0])
+               printf(", \"%s\": \"%s\"", names[j], predicted[j]);
+            else
+               printf(", \"%s\": null", names[j]);
+         }
+         printf("}");
+      }
+      else
+      {
+         printf("%d\t", job->jobID);
+         PrintEscaped(UserName(job->uid), format);
+         printf("\t%s\t%d\t%s\t%d\t%d\t%d\t", 
+                (job->started ? "running" : "waiting"), job->position,
+                submitted, job->priority, job->nTasks, job->nDone);
+         PrintEscaped(job->pwd, format);
+         putchar('\t');
+         PrintEscaped(job->cmd, format);
+         printf("\t%s\t%s\t%s\n", predicted[0], predicted[1], 
+                predicted[2]);
+      }
+   }
+
+   if(format == LIST_JSON)
+      printf("%s]\n", (nJobs ? "\n" : ""));
+
+   if(jobs != NULL)
+      free(jobs);
+}
+
+
+/************************************************************************/
+/*>BOOL ParseDurability(char *string, int *commitMs)
+   -------------------------------------------------
+*//**
+   \param[in]   string    Durability given with -D
+   \param[out]  commitMs  Longest wait (ms) to fsync the journal: 0 to
+                          fsync every record, JOURNAL_NONE for never
+   \return                Was it valid?
+
+   Parses "sync", "none" or a number of milliseconds. A number lets 
+   the records written in that time share one fsync.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ParseDurability(char *string, int *commitMs)
+{
+   char *end;
+   long ms;
+   
+   if(!strcmp(string, "sync"))
+   {
+      *commitMs = 0;
+      return(TRUE);
+   }
+   if(!strcmp(string, "none"))
+   {
+      *commitMs = JOURNAL_NONE;
+      return(TRUE);
+   }
+   
+   ms = strtol(string, &end, 10);
+   if((end == string) || *end || (ms < 0) || (ms > 60000))
+      return(FALSE);
+   *commitMs = (int)ms;
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>int OpenJournal(char *queueDir, char *name)
+   -------------------------------------------
+*//**
+   \param[in]   queueDir   Queue directory
+   \param[in]   name       JOURNALFILE or JOURNALTMPFILE
+   \return                 File handle (-1 on error)
+
+   Creates an empty journal, replacing any that is there. Records are
+   always appended. Only the runner reads or writes the journal, which
+   is kept in STATEDIR.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Kept in STATEDIR   By: agent
+*/
+int OpenJournal(char *queueDir, char *name)
+{
+   char journalFile[MAXBUFF];
+   int  fh;
+   
+   StateFile(queueDir, name, journalFile);
+   if((fh = open(journalFile, 
+                 O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_NOFOLLOW|O_CLOEXEC,
+                 0600)) < 0)
+      return(-1);
+   if(fsync(fh) != 0)
+   {
+      close(fh);
+      return(-1);
+   }
+   return(fh);
+}
+
+
+/************************************************************************/
+/*>void JournalJob(RUNNER *runner, int type, int jobID, int task, 
+                   int status, JOBINFO *job)
+   --------------------------------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     type     JOURNAL_SUBMITTED etc.
+   \param[in]     jobID    The job
+   \param[in]     task     Task of a job array (-1 for the whole job)
+   \param[in]     status   Exit status of a finished job
+   \param[in]     job      The job's details (only needed when it is
+                           submitted, otherwise may be NULL)
+
+   Appends a record to the journal. With -D sync it is fsynced at once;
+   otherwise it is left for CommitJournal() to fsync along with the 
+   other records written in the next few ms.
+
+-  17.10.26  Original   By: agent
+*/
+void JournalJob(RUNNER *runner, int type, int jobID, int task, 
+                int status, JOBINFO *job)
+{
+   char          buffer[sizeof(JOURNALRECORD) + 2*MAXBUFF + JOURNALALIGN];
+   JOURNALRECORD *rec = (JOURNALRECORD *)buffer;
+   int           size = (int)sizeof(JOURNALRECORD);
+
+   if(runner->journalFd < 0)
+      return;
+
+   memset(buffer, 0, sizeof(buffer));
+   rec->magic  = JOURNALMAGIC;
+   rec->type   = type;
+   rec->seq    = ++runner->journalSeq;
+   rec->jobID  = jobID;
+   rec->task   = task;
+   rec->status = status;
+   if(job != NULL)
+   {
+      rec->mem      = job->mem;
+      rec->login    = job->login;
+      rec->priority = job->priority;
+      rec->nTasks   = job->nTasks;
+      rec->first    = job->first;
+      rec->estimate = job->estimate;
+      rec->uid      = job->uid;
+      rec->queued   = job->queued;
+      if(type == JOURNAL_SUBMITTED)
+      {
+         strcpy(buffer + size, job->pwd);
+         size += (int)strlen(job->pwd) + 1;
+         strcpy(buffer + size, job->cmd);
+         size += (int)strlen(job->cmd) + 1;
+      }
+   }
+   size += (JOURNALALIGN - (size % JOURNALALIGN)) % JOURNALALIGN;
+   rec->size = size;
+   
+   if((write(runner->journalFd, buffer, size) != size) ||
+      ((runner->commitMs == 0) && (fdatasync(runner->journalFd) != 0)))
+   {
+      Message(PROGNAME, MSG_WARNING, "Cannot write the journal - jobs \
+running if the host fails will be run again");
+      close(runner->journalFd);
+      runner->journalFd    = (-1);
+      runner->journalDirty = FALSE;
+      return;
+   }
+   runner->journalSize += size;
+
+   if((runner->commitMs > 0) && !runner->journalDirty)
+   {
+      runner->journalDirty = TRUE;
+      clock_gettime(CLOCK_MONOTONIC, &(runner->dirtySince));
+   }
+}
+
+
+/************************************************************************/
+/*>void CommitJournal(RUNNER *runner)
+   ----------------------------------
+*//**
+   \param[in,out] runner   The job runner
+
+   Makes the journal records written since the last commit durable with
+   a single fsync, then lets the jobs that were waiting for their 
+   records start. Called when the oldest record has waited the time 
+   given with -D, and before the runner waits for anything to happen.
+   The journal is checkpointed when it has grown too big.
+
+-  17.10.26  Original   By: agent
+*/
+void CommitJournal(RUNNER *runner)
+{
+   if(runner->journalDirty)
+   {
+      runner->journalDirty = FALSE;
+      if(fdatasync(runner->journalFd) != 0)
+      {
+         Message(PROGNAME, MSG_WARNING, "Cannot fsync the journal");
+      }
+   }
+   ReleaseStartedJobs(runner);
+   
+   if((runner->journalFd >= 0) && 
+      (runner->journalSize >= runner->checkpointSize))
+      CheckpointJournal(runner);
+}
+
+
+/************************************************************************/
+/*>void ReleaseStartedJobs(RUNNER *runner)
+   ---------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+
+   Jobs started since the last commit wait to read from the gate pipe.
+   Closing it lets them all run.
+
+-  17.10.26  Original   By: agent
+*/
+void ReleaseStartedJobs(RUNNER *runner)
+{
+   if(runner->gate[0] >= 0)
+   {
+      close(runner->gate[0]);
+      close(runner->gate[1]);
+      runner->gate[0] = runner->gate[1] = (-1);
+   }
+}
+
+
+/************************************************************************/
+/*>void CheckpointJournal(RUNNER *runner)
+   --------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+
+   Stops the journal growing for ever. Once everything in the queue 
+   directory has been synced, the only records still needed are those
+   for the running jobs, so a new journal is written holding just 
+   those and renamed over the old one.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The journal is kept in STATEDIR   By: agent
+*/
+void CheckpointJournal(RUNNER *runner)
+{
+   char journalFile[MAXBUFF],
+        tmpFile[MAXBUFF];
+   int  fh,
+        oldFh = runner->journalFd,
+        i;
+   
+   SyncQueue(runner->queueDir);
+   
+   if((fh = OpenJournal(runner->queueDir, JOURNALTMPFILE)) < 0)
+   {
+      Message(PROGNAME, MSG_WARNING, "Cannot checkpoint the journal");
+      runner->checkpointSize *= 2;
+      return;
+   }
+
+   runner->journalFd   = fh;
+   runner->journalSize = 0;
+   for(i=0; i<runner->nRunning; i++)
+   {
+      JournalJob(runner, JOURNAL_STARTED, runner->running[i].jobID, 
+                 runner->running[i].task, 0, NULL);
+   }
+   if(runner->journalFd < 0)
+   {
+      runner->journalFd = oldFh;
+      return;
+   }
+   runner->journalDirty = FALSE;
+
+   StateFile(runner->queueDir, JOURNALFILE,    journalFile);
+   StateFile(runner->queueDir, JOURNALTMPFILE, tmpFile);
+   if((fdatasync(fh) != 0) || (rename(tmpFile, journalFile) != 0))
+   {
+      Message(PROGNAME, MSG_WARNING, "Cannot checkpoint the journal");
+      close(fh);
+      unlink(tmpFile);
+      runner->journalFd       = oldFh;
+      runner->checkpointSize *= 2;
+      return;
+   }
+   close(oldFh);
+   SyncQueue(runner->queueDir);
+
+   runner->checkpointSize = 2 * runner->journalSize;
+   if(runner->checkpointSize < JOURNALMAXSIZE)
+      runner->checkpointSize = JOURNALMAXSIZE;
+   if(runner->verbose >= 2)
+   {
+      Message(PROGNAME, MSG_INFO, "Checkpointed the journal");
+   }
+}
+
+
+/************************************************************************/
+/*>int ReadJournal(char *queueDir, char **buffer, 
+                   JOURNALRECORD ***records)
+   ----------------------------------------------
+*//**
+   \param[in]   queueDir   Queue directory
+   \param[out]  buffer     The journal (malloc'd)
+   \param[out]  records    The records in it (malloc'd)
+   \return                 Number of records (-1 if there is no journal)
+
+   Reads the journal up to the first record that is incomplete or 
+   damaged, which must have been being written when the host failed.
+
+   The journal gives the owners of the jobs it restores, so it is only
+   read if it is a plain file that belongs to the runner and that nobody
+   else can write to.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Read from STATEDIR. Checks who owns the journal   By: agent
+*/
+int ReadJournal(char *queueDir, char **buffer, JOURNALRECORD ***records)
+{
+   char        journalFile[MAXBUFF];
+   struct stat statBuff;
+   int         fh,
+               nRecords = 0;
+   off_t       offset   = 0,
+               length;
+
+   *buffer  = NULL;
+   *records = NULL;
+   
+   StateFile(queueDir, JOURNALFILE, journalFile);
+   if((fh = open(journalFile, O_RDONLY|O_NOFOLLOW|O_CLOEXEC)) < 0)
+      return(-1);
+   if((fstat(fh, &statBuff) != 0) || !S_ISREG(statBuff.st_mode) ||
+      (statBuff.st_uid != geteuid()) || (statBuff.st_mode & 022))
+   {
+      Message(PROGNAME, MSG_WARNING, "The journal was not written by the \
+queue manager - not replaying it");
+      close(fh);
+      return(-1);
+   }
+   if(((*buffer = (char *)malloc(statBuff.st_size + 1)) == NULL) ||
+      ((*records = (JOURNALRECORD **)
+        malloc((statBuff.st_size / sizeof(JOURNALRECORD) + 1) *
+               sizeof(JOURNALRECORD *))) == NULL) ||
+      ((length = read(fh, *buffer, statBuff.st_size)) < 0))
+   {
+      Message(PROGNAME, MSG_WARNING, "Cannot read the journal");
+      close(fh);
+      return(-1);
+   }
+   close(fh);
+
+   while(length - offset >= (off_t)sizeof(JOURNALRECORD))
+   {
+      JOURNALRECORD *rec = (JOURNALRECORD *)(*buffer + offset);
+      char          *text = (char *)(rec + 1);
+      int           textLen = rec->size - (int)sizeof(JOURNALRECORD);
+      
+      if((rec->magic != JOURNALMAGIC) ||
+         (rec->size < (int)sizeof(JOURNALRECORD)) ||
+         (rec->size % JOURNALALIGN) ||
+         (rec->size > length - offset) ||
+         (rec->type < JOURNAL_SUBMITTED) || 
+         (rec->type > JOURNAL_REMOVED))
+         break;
+      if((rec->type == JOURNAL_SUBMITTED) &&
+         ((memchr(text, '\0', textLen) == NULL) ||
+          (memchr(text + strlen(text) + 1, '\0', 
+                  textLen - strlen(text) - 1) == NULL)))
+         break;
+
+      (*records)[nRecords++] = rec;
+      offset += rec->size;
+   }
+   
+   if(offset < length)
+   {
+      Message(PROGNAME, MSG_WARNING, 
+              "The end of the journal was not written completely");
+   }
+   return(nRecords);
+}
+
+
+/************************************************************************/
+/*>int CompareJournalRecords(const void *a, const void *b)
+   -------------------------------------------------------
+*//**
+   \param[in]   a   Pointer to a JOURNALRECORD pointer
+   \param[in]   b   Pointer to a JOURNALRECORD pointer
+   \return          Sort order
+
+   Puts the records for each job (and each task of a job array) 
+   together, in the order they were written.
+
+-  17.10.26  Original   By: agent
+*/
+int CompareJournalRecords(const void *a, const void *b)
+{
+   JOURNALRECORD *recA = *(JOURNALRECORD **)a,
+                 *recB = *(JOURNALRECORD **)b;
+   
+   if(recA->jobID != recB->jobID)
+      return((recA->jobID < recB->jobID) ? -1 : 1);
+   if(recA->task != recB->task)
+      return((recA->task < recB->task) ? -1 : 1);
+   if(recA->seq != recB->seq)
+      return((recA->seq < recB->seq) ? -1 : 1);
+   return(0);
+}
+
+
+/************************************************************************/
+/*>void ReplayJournal(char *queueDir, int verbose)
+   -----------------------------------------------
+*//**
+   \param[in]   queueDir   Queue directory
+   \param[in]   verbose    Verbosity
+
+   Called when the runner starts, before the jobs marked as running are
+   put back in the queue. The last record for each job says what state
+   it was in when the previous runner stopped:
+
+   - A job that had started is not run again; it may have done its work
+     or may be unsafe to repeat. Its job file is kept as 
+     INTERRUPTEDPREFIX and the job ID, so that the owner can rename it 
+     back to the job ID to queue it again. A task of a job array is 
+     counted as finished and failed.
+   - A job that had finished, but whose job file survived the failure,
+     is removed.
+   - A waiting job whose file was damaged is written again from the
+     journal. A job whose file has gone is taken to have been removed 
+     by hand.
+
+   Everything is then synced, so the old journal is no longer needed.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Progress files are kept in STATEDIR   By: agent
+*/
+void ReplayJournal(char *queueDir, int verbose)
+{
+   char          *buffer,
+                 jobFile[MAXBUFF],
+                 msg[MAXBUFF];
+   JOURNALRECORD **records;
+   RING          *ring = NULL;
+   int           nRecords,
+                 i;
+   
+   if((nRecords = ReadJournal(queueDir, &buffer, &records)) < 0)
+   {
+      if(buffer != NULL)  free(buffer);
+      if(records != NULL) free(records);
+      return;
+   }
+   
+   if(verbose)
+   {
+      sprintf(msg, "Replaying %d journal records", nRecords);
+      Message(PROGNAME, MSG_INFO, msg);
+   }
+   
+   qsort(records, nRecords, sizeof(JOURNALRECORD *), 
+         CompareJournalRecords);
+   if(IsRingQueue(queueDir))
+      ring = OpenRing(queueDir);
+   
+   for(i=0; i<nRecords; i++)
+   {
+      JOURNALRECORD *rec = records[i];
+      RINGRECORD    *ringRec = NULL;
+      
+      /* Only the last record for the job or task matters               */
+      if((i < nRecords-1) && 
+         (records[i+1]->jobID == rec->jobID) &&
+         (records[i+1]->task  == rec->task))
+         continue;
+
+      if(ring != NULL)
+         ringRec = RingFindJob(ring, rec->jobID, -1);
+      
+      if(rec->task >= 0)
+      {
+         if(rec->type == JOURNAL_STARTED)
+         {
+            sprintf(msg, "Job %d task %d was running when the queue \
+manager stopped and has not been run again", rec->jobID, rec->task);
+            Message(PROGNAME, MSG_WARNING, msg);
+            MarkTaskDone(queueDir, rec->jobID, rec->task, TRUE);
+         }
+         else if(rec->type == JOURNAL_FINISHED)
+         {
+            MarkTaskDone(queueDir, rec->jobID, rec->task, 
+                         (rec->status != 0));
+         }
+      }
+      else if(rec->type == JOURNAL_STARTED)
+      {
+         if(FindJobFile(queueDir, rec->jobID, RUNSUFFIX, jobFile) ||
+            FindJobFile(queueDir, rec->jobID, "", jobFile))
+         {
+            KeepInterruptedJob(queueDir, rec->jobID, jobFile, NULL);
+         }
+         else if(ringRec != NULL)
+         {
+            JOBINFO job;
+            
+            RingRecordJob(ringRec, &job);
+            KeepInterruptedJob(queueDir, rec->jobID, NULL, &job);
+            RingSetState(ring, rec->jobID, -1, RING_DONE);
+         }
+         else
+         {
+            KeepInterruptedJob(queueDir, rec->jobID, NULL, NULL);
+         }
+      }
+      else if(rec->type == JOURNAL_FINISHED)
+      {
+         if(FindJobFile(queueDir, rec->jobID, RUNSUFFIX, jobFile) ||
+            FindJobFile(queueDir, rec->jobID, "", jobFile))
+         {
+            unlink(jobFile);
+            if(verbose)
+            {
+               sprintf(msg, "Removed finished job %d", rec->jobID);
+               Message(PROGNAME, MSG_INFO, msg);
+            }
+         }
+         if(ringRec != NULL)
+            RingSetState(ring, rec->jobID, -1, RING_DONE);
+         TasksFile(queueDir, rec->jobID, jobFile);
+         unlink(jobFile);
+      }
+      else if(rec->type == JOURNAL_SUBMITTED)
+      {
+         JOBINFO job;
+
+         if(ring != NULL ? (ringRec == NULL) :
+            (FindJobFile(queueDir, rec->jobID, "", jobFile) &&
+             !ReadJobFile(queueDir, rec->jobID, &job)))
+            RestoreJob(queueDir, ring, rec);
+      }
+   }
+
+   if(ring != NULL)
+   {
+      munmap(ring->header, ring->size);
+      close(ring->fh);
+      free(ring);
+   }
+   free(records);
+   free(buffer);
+   
+   SyncQueue(queueDir);
+}
+
+
+/************************************************************************/
+/*>BOOL RestoreJob(char *queueDir, RING *ring, JOURNALRECORD *rec)
+   ---------------------------------------------------------------
+*//**
+   \param[in]   queueDir   Queue directory
+   \param[in]   ring       The ring (NULL if job files are used)
+   \param[in]   rec        JOURNAL_SUBMITTED record for the job
+   \return                 Was the job restored?
+
+   Puts back a waiting job that was lost or damaged when the host 
+   failed, with its original job ID, owner and time queued.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The hash for -d isn't journalled   By: agent
+*/
+BOOL RestoreJob(char *queueDir, RING *ring, JOURNALRECORD *rec)
+{
+   JOBINFO job;
+   char    jobFile[MAXBUFF],
+           tmpFile[MAXBUFF],
+           msg[MAXBUFF],
+           *progArgs[1];
+   int     fh,
+           length;
+   BOOL    restored;
+   
+   job.jobID    = rec->jobID;
+   job.mem      = rec->mem;
+   job.login    = (BOOL)rec->login;
+   job.uid      = rec->uid;
+   job.priority = rec->priority;
+   job.queued   = rec->queued;
+   job.nTasks   = rec->nTasks;
+   job.first    = rec->first;
+   job.estimate = rec->estimate;
+   job.task     = 0;
+   job.dedup    = 0;
+   strncpy(job.pwd, (char *)(rec+1), MAXBUFF-1);
+   job.pwd[MAXBUFF-1] = '\0';
+   strncpy(job.cmd, (char *)(rec+1) + strlen((char *)(rec+1)) + 1, 
+           MAXBUFF-1);
+   job.cmd[MAXBUFF-1] = '\0';
+
+   if(ring != NULL)
+   {
+      restored = (RingAppend(ring, &job) >= 0);
+   }
+   else
+   {
+      /* WriteJobFile() adds the space after the command again          */
+      for(length=(int)strlen(job.cmd); 
+          (length > 0) && (job.cmd[length-1] == ' '); 
+          length--)
+         job.cmd[length-1] = '\0';
+      progArgs[0] = job.cmd;
+
+      if((fh = WriteJobFile(queueDir, tmpFile, progArgs, 1, &job)) < 0)
+         return(FALSE);
+      if(job.queued)
+      {
+         struct timespec times[2];
+         times[0].tv_sec  = times[1].tv_sec  = job.queued;
+         times[0].tv_nsec = times[1].tv_nsec = 0;
+         futimens(fh, times);
+      }
+      FindJobFile(queueDir, job.jobID, "", jobFile);
+      unlink(jobFile);
+      restored = PublishJobFile(queueDir, fh, tmpFile, job.jobID);
+      close(fh);
+      if(tmpFile[0])
+         unlink(tmpFile);
+   }
+
+   sprintf(msg, (restored ? "Job %d was lost or damaged and has been \
+restored from the journal" : "Job %d was lost or damaged and cannot be \
+restored"), job.jobID);
+   Message(PROGNAME, MSG_WARNING, msg);
+   return(restored);
+}
+
+
+/************************************************************************/
+/*>void KeepInterruptedJob(char *queueDir, int jobID, char *jobFile, 
+                           JOBINFO *job)
+   ------------------------------------------------------------------
+*//**
+   \param[in]   queueDir   Queue directory
+   \param[in]   jobID      A job that was running when the runner 
+                           stopped
+   \param[in]   jobFile    Its job file (NULL if there isn't one)
+   \param[in]   job        Its details if there is no job file (NULL if
+                           they aren't known)
+
+   Moves the job out of the queue so that it isn't run again, keeping
+   its job file as INTERRUPTEDPREFIX and the job ID, and warns about it.
+
+-  17.10.26  Original   By: agent
+*/
+void KeepInterruptedJob(char *queueDir, int jobID, char *jobFile, 
+                        JOBINFO *job)
+{
+   char keptFile[MAXBUFF],
+        msg[MAXBUFF];
+   BOOL kept = FALSE;
+   
+   snprintf(keptFile, MAXBUFF, "%s/%s%d", queueDir, INTERRUPTEDPREFIX, 
+            jobID);
+   if(jobFile != NULL)
+   {
+      kept = (rename(jobFile, keptFile) == 0);
+   }
+   else if(job != NULL)
+   {
+      char tmpFile[MAXBUFF],
+           *progArgs[1];
+      int  fh,
+           length;
+
+      for(length=(int)strlen(job->cmd); 
+          (length > 0) && (job->cmd[length-1] == ' '); 
+          length--)
+         job->cmd[length-1] = '\0';
+      progArgs[0] = job->cmd;
+      
+      if((fh = WriteJobFile(queueDir, tmpFile, progArgs, 1, job)) >= 0)
+      {
+         unlink(keptFile);
+         if(tmpFile[0])
+         {
+            kept = (link(tmpFile, keptFile) == 0);
+            unlink(tmpFile);
+         }
+         else
+         {
+            char procFile[MAXBUFF];
+            sprintf(procFile, "/proc/self/fd/%d", fh);
+            kept = (linkat(AT_FDCWD, procFile, AT_FDCWD, keptFile,
+                           AT_SYMLINK_FOLLOW) == 0);
+         }
+         close(fh);
+      }
+   }
+
+   if(kept)
+      snprintf(msg, MAXBUFF, "Job %d was running when the queue manager \
+stopped and has not been run again. It is kept in %s", jobID, keptFile);
+   else
+      sprintf(msg, "Job %d was running when the queue manager stopped \
+and has not been run again", jobID);
+   Message(PROGNAME, MSG_WARNING, msg);
+}
+
+
+/************************************************************************/
+/*>void MarkTaskDone(char *queueDir, int jobID, int task, BOOL failed)
+   -------------------------------------------------------------------
+*//**
+   \param[in]   queueDir   Queue directory
+   \param[in]   jobID      A job array
+   \param[in]   task       One of its tasks
+   \param[in]   failed     Did the task fail?
+
+   Records in the progress file of a job array that a task has finished,
+   as SaveArray() would have done had the runner not stopped.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The progress file is kept in STATEDIR   By: agent
+*/
+void MarkTaskDone(char *queueDir, int jobID, int task, BOOL failed)
+{
+   TASKHEADER    header;
+   char          tasksFile[MAXBUFF];
+   unsigned char bits;
+   int           fh,
+                 bit;
+   
+   TasksFile(queueDir, jobID, tasksFile);
+   if((fh = open(tasksFile, O_RDWR|O_CLOEXEC)) < 0)
+      return;
+   
+   if((pread(fh, &header, sizeof(TASKHEADER), 0) == sizeof(TASKHEADER))&&
+      (header.magic == TASKMAGIC) &&
+      (header.jobID == jobID)     &&
+      ((bit = task - header.first) >= 0) &&
+      (bit < header.nTasks) &&
+      (pread(fh, &bits, 1, sizeof(TASKHEADER) + bit / 8) == 1) &&
+      !(bits & (1 << (bit % 8))))
+   {
+      bits |= (unsigned char)(1 << (bit % 8));
+      header.nDone++;
+      if(failed)
+         header.nFailed++;
+      if((pwrite(fh, &bits, 1, sizeof(TASKHEADER) + bit / 8) < 0) ||
+         (pwrite(fh, &header, sizeof(TASKHEADER), 0) < 0))
+      {
+         char msg[MAXBUFF];
+         sprintf(msg, "Cannot save the progress of job %d", jobID);
+         Message(PROGNAME, MSG_WARNING, msg);
+      }
+   }
+   close(fh);
+}
+
+
+/************************************************************************/
+/*>void SyncQueue(char *queueDir)
+   ------------------------------
+*//**
+   \param[in]   queueDir   Queue directory
+
+   Flushes everything on the queue directory's filesystem to disk, 
+   including job files written by other users and the ring.
+
+-  17.10.26  Original   By: agent
+*/
+void SyncQueue(char *queueDir)
+{
+   int fh;
+   
+   if((fh = open(queueDir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0)
+      return;
+   if(syncfs(fh) != 0)
+      Message(PROGNAME, MSG_WARNING, "Cannot sync the queue directory");
+   close(fh);
+}
+
+
+/************************************************************************/
+/*>void JobLogName(char *queueDir, int jobID, int task, char *logFile)
+   -------------------------------------------------------------------
+*//**
+   \param[in]   queueDir   Queue directory
+   \param[in]   jobID      The job
+   \param[in]   task       Task of a job array (-1 if none)
+   \param[out]  logFile    The log of its output
+
+   Each job's output is logged in LOGDIR as the job ID, or the job ID
+   and task for a task of a job array.
+
+-  17.10.26  Original   By: agent
+*/
+void JobLogName(char *queueDir, int jobID, int task, char *logFile)
+{
+   if(task >= 0)
+      snprintf(logFile, MAXBUFF, "%s/%s/%d.%d", queueDir, LOGDIR, jobID, 
+               task);
+   else
+      snprintf(logFile, MAXBUFF, "%s/%s/%d", queueDir, LOGDIR, jobID);
+}
+
+
+/************************************************************************/
+/*>int OpenJobLog(RUNNER *runner, JOBINFO *job, int task)
+   ------------------------------------------------------
+*//**
+   \param[in]   runner    The job runner
+   \param[in]   job       A job about to start
+   \param[in]   task      Task of a job array (-1 if none)
+   \return                File handle of its log (-1 on error)
+
+   Creates the log for a job's output, belonging to the job's owner.
+   The job is given it as its stdout and stderr, so the output goes 
+   straight to the file without passing through the runner. If it 
+   can't be made, the output goes wherever the runner's does.
+
+   It is made in the directory opened by OpenLogDir() rather than by 
+   its path, and only its owner can read it.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Made with openat() in the checked directory, mode 0600   By: agent
+*/
+int OpenJobLog(RUNNER *runner, JOBINFO *job, int task)
+{
+   char logFile[MAXBUFF];
+   int  fh = (-1);
+   
+   if(task >= 0)
+      snprintf(logFile, MAXBUFF, "%d.%d", job->jobID, task);
+   else
+      snprintf(logFile, MAXBUFF, "%d", job->jobID);
+
+   if((runner->logDirFd < 0) ||
+      ((fh = openat(runner->logDirFd, logFile, 
+                    O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_NOFOLLOW|
+                    O_CLOEXEC, 0600)) < 0) ||
+      ((job->uid != geteuid()) && (fchown(fh, job->uid, -1) != 0)))
+   {
+      char msg[MAXBUFF];
+      sprintf(msg, "Cannot log the output of job %d", job->jobID);
+      Message(PROGNAME, MSG_WARNING, msg);
+      if(fh >= 0)
+         close(fh);
+      return(-1);
+   }
+   return(fh);
+}
+
+
+/************************************************************************/
+/*>BOOL JobInQueue(char *queueDir, int jobID)
+   ------------------------------------------
+*//**
+   \param[in]   queueDir   Queue directory
+   \param[in]   jobID      The job
+   \return                 Is the job waiting or running?
+
+   The job file is looked for before the running file, since a job 
+   that starts is renamed from one to the other, and the files before
+   the ring, since job files are moved into it.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL JobInQueue(char *queueDir, int jobID)
+{
+   char    jobFile[MAXBUFF];
+   SNAPJOB *jobs;
+   int     nJobs,
+           nRunning,
+           i;
+   BOOL    found = FALSE;
+   
+   if(FindJobFile(queueDir, jobID, "", jobFile) ||
+      FindJobFile(queueDir, jobID, RUNSUFFIX, jobFile))
+      return(TRUE);
+
+   if(IsRingQueue(queueDir) &&
+      ((nJobs = ReadRing(queueDir, &jobs, &nRunning)) > 0))
+   {
+      for(i=0; i<nJobs; i++)
+      {
+         if(jobs[i].jobID == jobID)
+         {
+            found = TRUE;
+            break;
+         }
+      }
+      free(jobs);
+   }
+   return(found);
+}
+
+
+/************************************************************************/
+/*>void FollowJobOutput(char *queueDir, int jobID, int task)
+   ---------------------------------------------------------
+*//**
+   \param[in]   queueDir   Queue directory
+   \param[in]   jobID      The job
+   \param[in]   task       Task of a job array (-1 if none)
+
+   Prints a job's output as it is written, as tail -f does, until the 
+   job (or for a task, the whole job array) has left the queue. The 
+   log directory is watched with inotify; the queue is checked again
+   every FOLLOWCHECK seconds.
+
+-  17.10.26  Original   By: agent
+*/
+void FollowJobOutput(char *queueDir, int jobID, int task)
+{
+   char    logDir[MAXBUFF],
+           logFile[MAXBUFF],
+           buffer[BUFSIZ];
+   int     watchFd,
+           fh     = (-1);
+   ssize_t nRead;
+   BOOL    inQueue;
+   
+   snprintf(logDir, MAXBUFF, "%s/%s", queueDir, LOGDIR);
+   JobLogName(queueDir, jobID, task, logFile);
+   
+   if(((watchFd = inotify_init1(IN_CLOEXEC)) >= 0) &&
+      (inotify_add_watch(watchFd, logDir, 
+                         IN_CREATE|IN_MODIFY|IN_CLOSE_WRITE) < 0))
+   {
+      close(watchFd);
+      watchFd = (-1);
+   }
+   
+   do
+   {
+      /* Check the job first so that all it wrote is printed            */
+      inQueue = JobInQueue(queueDir, jobID);
+      
+      if(fh < 0)
+         fh = open(logFile, O_RDONLY|O_CLOEXEC);
+      if(fh >= 0)
+      {
+         while((nRead = read(fh, buffer, sizeof(buffer))) > 0)
+         {
+            if(fwrite(buffer, 1, nRead, stdout) != (size_t)nRead)
+               inQueue = FALSE;
+         }
+         fflush(stdout);
+      }
+
+      if(inQueue)
+      {
+         if(watchFd >= 0)
+         {
+            struct pollfd pfd;
+            
+            pfd.fd      = watchFd;
+            pfd.events  = POLLIN;
+            pfd.revents = 0;
+            if((poll(&pfd, 1, FOLLOWCHECK * 1000) > 0) &&
+               (read(watchFd, buffer, sizeof(buffer)) < 0))
+            {
+               /* Events are only used to wake up                       */
+            }
+         }
+         else
+         {
+            sleep(FOLLOWCHECK);
+         }
+      }
+   }  while(inQueue);
+
+   if(fh >= 0)
+      close(fh);
+   if(watchFd >= 0)
+      close(watchFd);
+}
+
+
+/************************************************************************/
+/*>BOOL ParsePreempt(char *settings, PREEMPT *preempt)
+   ---------------------------------------------------
+*//**
+   \param[in]     settings   Comma separated list of settings, e.g.
+                             priority=80,stops=2,stoptime=1800
+   \param[in,out] preempt    The settings (defaults filled in)
+   \return                   Were the settings valid?
+
+   Parses the -U settings. Jobs submitted with a priority (-P) of at
+   least priority are urgent. stops is the number of times a job may
+   be suspended and stoptime the total time (s) it may spend 
+   suspended.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ParsePreempt(char *settings, PREEMPT *preempt)
+{
+   char buffer[MAXBUFF],
+        *setting;
+   
+   strncpy(buffer, settings, MAXBUFF-1);
+   buffer[MAXBUFF-1] = '\0';
+   
+   for(setting=strtok(buffer, ","); setting!=NULL; 
+       setting=strtok(NULL, ","))
+   {
+      char *equals;
+      int  value;
+      
+      if(((equals = strchr(setting, '=')) == NULL) ||
+         (sscanf(equals+1, "%d", &value) != 1))
+         return(FALSE);
+      *equals = '\0';
+
+      if(!strcmp(setting, "priority") && 
+         (value >= -MAXPRIORITY) && (value <= MAXPRIORITY))
+      {
+         preempt->priority = value;
+      }
+      else if(!strcmp(setting, "stops") && (value > 0))
+      {
+         preempt->maxStops = value;
+      }
+      else if(!strcmp(setting, "stoptime") && (value > 0))
+      {
+         preempt->maxStopTime = value;
+      }
+      else
+      {
+         return(FALSE);
+      }
+   }
+   
+   preempt->use = TRUE;
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL SuspendForJob(RUNNER *runner, JOBINFO *job, int mem)
+   ---------------------------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     job      An urgent job with no free slot
+   \param[in]     mem      Memory (MB) it will be charged
+   \return                 Was a job suspended to make room?
+
+   Stops a running job with SIGSTOP to its process group so that the
+   urgent job can have its slot. Only jobs that are not urgent 
+   themselves, and haven't used up their -U limits, are suspended; of
+   those, the one with the lowest priority is chosen and then the one
+   that has run longest.
+
+   A suspended job keeps its memory, so it is only suspended if its
+   resident set and the urgent job fit together: within the memory 
+   budget, which is charged the resident set instead while it is 
+   suspended, or without a budget, within MemAvailable.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL SuspendForJob(RUNNER *runner, JOBINFO *job, int mem)
+{
+   RUNNING *victim = NULL;
+   int     i,
+           rss     = 0,
+           memAvailable;
+   char    msg[MAXBUFF];
+   
+   if(!runner->memBudget && job->mem && 
+      (!ReadMemAvailable(&memAvailable) || (job->mem > memAvailable)))
+      return(FALSE);
+   
+   for(i=0; i<runner->nRunning; i++)
+   {
+      RUNNING *slot = &(runner->running[i]);
+      int     slotRss;
+      
+      if(slot->stopped ||
+         (slot->priority >= runner->preempt.priority) ||
+         (slot->nStops >= runner->preempt.maxStops) ||
+         (slot->stoppedTime >= runner->preempt.maxStopTime))
+         continue;
+      if((victim != NULL) &&
+         ((slot->priority > victim->priority) ||
+          ((slot->priority == victim->priority) && 
+           (slot->started >= victim->started))))
+         continue;
+
+      /* The urgent job must fit beside what it leaves in memory        */
+      if(runner->memBudget)
+      {
+         slotRss = JobResidentMB(slot->pid);
+         if(runner->memUsed - slot->mem + slotRss + mem > 
+            runner->memBudget)
+            continue;
+      }
+      else
+      {
+         slotRss = slot->mem;
+      }
+      
+      victim = slot;
+      rss    = slotRss;
+   }
+
+   if(victim == NULL)
+   {
+      if(runner->verbose >= 2)
+      {
+         sprintf(msg, "Urgent job %d waiting - no job can be suspended",
+                 job->jobID);
+         Message(PROGNAME, MSG_INFO, msg);
+      }
+      return(FALSE);
+   }
+
+   if(kill(-(victim->pid), SIGSTOP) != 0)
+   {
+      sprintf(msg, "Cannot suspend job %d", victim->jobID);
+      Message(PROGNAME, MSG_WARNING, msg);
+      return(FALSE);
+   }
+   
+   victim->stopped    = TRUE;
+   victim->stoppedAt  = time(NULL);
+   victim->stoppedMem = rss;
+   victim->nStops++;
+   runner->memUsed   += rss - victim->mem;
+   runner->nStopped++;
+   runner->metrics.suspended++;
+   
+   if(runner->verbose)
+   {
+      sprintf(msg, "Suspended job %d for urgent job %d", victim->jobID,
+              job->jobID);
+      Message(PROGNAME, MSG_INFO, msg);
+   }
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>void ResumeJobs(RUNNER *runner)
+   -------------------------------
+*//**
+   \param[in,out] runner   The job runner
+
+   Continues suspended jobs with SIGCONT. A job is resumed once a slot
+   and its memory are free, unless an urgent job is waiting for them,
+   and always once it has been suspended for as long as -U allows.
+   Suspended jobs are resumed before any other job is started.
+
+-  17.10.26  Original   By: agent
+*/
+void ResumeJobs(RUNNER *runner)
+{
+   time_t now = time(NULL);
+   BOOL   urgentWaiting;
+   int    i;
+   
+   urgentWaiting = (runner->nWaiting && 
+                    (runner->waiting[0].priority >= 
+                     runner->preempt.priority));
+
+   for(i=0; i<runner->nRunning; i++)
+   {
+      RUNNING *slot = &(runner->running[i]);
+      BOOL    overdue;
+
+      if(!slot->stopped)
+         continue;
+      
+      overdue = (slot->stoppedTime + (long)(now - slot->stoppedAt) >= 
+                 runner->preempt.maxStopTime);
+      if(!overdue &&
+         (urgentWaiting ||
+          (runner->nRunning - runner->nStopped >= runner->nSlots) ||
+          (runner->memBudget && 
+           (runner->memUsed - slot->stoppedMem + slot->mem > 
+            runner->memBudget))))
+         continue;
+
+      if((kill(-(slot->pid), SIGCONT) != 0) && (errno != ESRCH))
+      {
+         char msg[MAXBUFF];
+         sprintf(msg, "Cannot resume job %d", slot->jobID);
+         Message(PROGNAME, MSG_WARNING, msg);
+      }
+      slot->stopped      = FALSE;
+      slot->stoppedTime += (long)(now - slot->stoppedAt);
+      runner->memUsed   += slot->mem - slot->stoppedMem;
+      runner->nStopped--;
+      
+      if(runner->verbose)
+      {
+         char msg[MAXBUFF];
+         sprintf(msg, "Resumed job %d", slot->jobID);
+         Message(PROGNAME, MSG_INFO, msg);
+      }
+   }
+}
+
+
+/************************************************************************/
+/*>time_t ResumeDeadline(RUNNER *runner)
+   -------------------------------------
+*//**
+   \param[in]   runner   The job runner
+   \return               When the first suspended job must be resumed
+                         (0 if none are suspended)
+
+-  17.10.26  Original   By: agent
+*/
+time_t ResumeDeadline(RUNNER *runner)
+{
+   time_t deadline = 0;
+   int    i;
+   
+   for(i=0; i<runner->nRunning; i++)
+   {
+      RUNNING *slot = &(runner->running[i]);
+      time_t  due;
+      
+      if(!slot->stopped)
+         continue;
+      due = slot->stoppedAt + 
+            (time_t)(runner->preempt.maxStopTime - slot->stoppedTime);
+      if(!deadline || (due < deadline))
+         deadline = due;
+   }
+   return(deadline);
+}
+
+
+/************************************************************************/
+/*>int JobResidentMB(pid_t pgrp)
+   -----------------------------
+*//**
+   \param[in]   pgrp     Process group of a job
+   \return               Resident set (MB) of all its processes
+
+   Adds up the resident sets in /proc of every process in the job's 
+   process group. Shared pages are counted once for each process, so
+   this errs on the large side.
+
+-  17.10.26  Original   By: agent
+*/
+int JobResidentMB(pid_t pgrp)
+{
+   DIR           *dp;
+   struct dirent *dirp;
+   long          pageKB = sysconf(_SC_PAGESIZE) / 1024,
+                 kb     = 0;
+   
+   if((dp = opendir("/proc")) == NULL)
+      return(0);
+   
+   while((dirp = readdir(dp)) != NULL)
+   {
+      char statFile[MAXBUFF],
+           buffer[1024],
+           *fields;
+      FILE *fp;
+      int  group;
+      long rss;
+      
+      if(!isdigit(dirp->d_name[0]))
+         continue;
+      
+      snprintf(statFile, MAXBUFF, "/proc/%s/stat", dirp->d_name);
+      if((fp = fopen(statFile, "r")) == NULL)
+         continue;
+      fields = fgets(buffer, sizeof(buffer), fp);
+      fclose(fp);
+
+      /* The command name may contain spaces, so start after it. rss is
+         the 22nd field after the name
+      */
+      if((fields == NULL) || ((fields = strrchr(buffer, ')')) == NULL))
+         continue;
+      if((sscanf(fields+1, " %*s %*s %d %*s %*s %*s %*s %*s %*s %*s %*s"
+                 " %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %ld",
+                 &group, &rss) == 2) &&
+         (group == (int)pgrp))
+         kb += rss * pageKB;
+   }
+   
+   closedir(dp);
+   return((int)((kb + 1023) / 1024));
+}
+
+
+/************************************************************************/
+/*>BOOL ParseDuration(char *string, int *seconds)
+   ----------------------------------------------
+*//**
+   \param[in]   string    A time, e.g. 90, 90s, 30m, 2h or 1d
+   \param[out]  seconds   The time in seconds
+   \return                Was it valid?
+
+   Parses a time given with -t. A plain number is in seconds.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ParseDuration(char *string, int *seconds)
+{
+   char *end;
+   long value;
+   
+   value = strtol(string, &end, 10);
+   if((end == string) || (value <= 0))
+      return(FALSE);
+   
+   switch(*end)
+   {
+   case 'd':
+   case 'D':
+      value *= 24;
+      /* Fall through                                                   */
+   case 'h':
+   case 'H':
+      value *= 60;
+      /* Fall through                                                   */
+   case 'm':
+   case 'M':
+      value *= 60;
+      /* Fall through                                                   */
+   case 's':
+   case 'S':
+      end++;
+      break;
+   }
+   
+   if(*end || (value > INT_MAX / 2))
+      return(FALSE);
+   *seconds = (int)value;
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>BOOL BackfillJob(RUNNER *runner, int headMem)
+   ---------------------------------------------
+*//**
+   \param[in,out] runner    The job runner
+   \param[in]     headMem   Memory (MB) the job at the top of the heap
+                            is waiting for
+   \return                  Was a job started (or dropped)?
+
+   Called with -B when the job at the top of the heap is waiting for 
+   memory. Works out when it can start (see ReservedStart()) and 
+   starts the first waiting job, in the order they would run, that fits
+   in the free memory now and will finish by then from its run time;
+   or that will leave enough memory and a slot for it if it doesn't.
+
+   Only jobs that give their memory (-m) and run time (-t) can be 
+   backfilled. Every waiting job is looked at, as the heap is not in 
+   order.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL BackfillJob(RUNNER *runner, int headMem)
+{
+   JOBINFO   job;
+   TASKARRAY *array;
+   time_t    now = time(NULL),
+             reserved;
+   int       extraMem,
+             extraSlots,
+             best = (-1),
+             jobID,
+             i;
+   double    start;
+   
+   if((reserved = ReservedStart(runner, headMem, &extraMem, 
+                                &extraSlots)) == 0)
+      return(FALSE);
+   
+   for(i=1; i<runner->nWaiting; i++)
+   {
+      WAITING *entry = &(runner->waiting[i]);
+      
+      if(!entry->estimate || !entry->mem ||
+         (runner->memUsed + entry->mem > runner->memBudget))
+         continue;
+      if((now + entry->estimate > reserved) &&
+         ((entry->mem > extraMem) || (extraSlots < 1)))
+         continue;
+      if((best < 0) || RunsBefore(entry, &(runner->waiting[best])))
+         best = i;
+   }
+   
+   if(best < 0)
+      return(FALSE);
+
+   jobID = runner->waiting[best].jobID;
+   start = runner->waiting[best].start;
+   if(runner->ring)
+   {
+      RINGRECORD *rec;
+      
+      if(((rec = RingFindJob(runner->ring, jobID, 
+                             runner->waiting[best].offset)) != NULL) &&
+         (rec->state == RING_WAITING))
+         RingRecordJob(rec, &job);
+      else
+         jobID = (-1);
+   }
+   else if(!ReadJobFile(runner->queueDir, jobID, &job))
+   {
+      jobID = (-1);
+   }
+
+   /* Drop a job that has been removed by hand                          */
+   if(jobID < 0)
+   {
+      jobID = runner->waiting[best].jobID;
+      JournalJob(runner, JOURNAL_REMOVED, jobID, -1, 0, NULL);
+      RemoveWaiting(runner, jobID);
+      EndArray(runner, jobID, FALSE);
+      runner->changed = TRUE;
+      return(TRUE);
+   }
+
+   if(job.nTasks)
+   {
+      if(((array = StartArray(runner, &job)) == NULL) ||
+         (array->next >= array->nTasks))
+         return(FALSE);
+      job.task = array->first + array->next;
+   }
+   
+   if(runner->host.use && HostBusy(runner, job.mem))
+      return(FALSE);
+   
+   if(runner->verbose)
+   {
+      char msg[MAXBUFF];
+      sprintf(msg, "Backfilling job %d while job %d waits (%d s)",
+              jobID, runner->waiting[0].jobID, (int)(reserved - now));
+      Message(PROGNAME, MSG_INFO, msg);
+   }
+   
+   if(!RunJob(runner, &job, job.mem))
+      return(FALSE);
+   runner->metrics.backfilled++;
+   if(runner->fairShare)
+      FairStarted(runner, jobID, start);
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>time_t ReservedStart(RUNNER *runner, int headMem, int *extraMem, 
+                        int *extraSlots)
+   ----------------------------------------------------------------
+*//**
+   \param[in]   runner      The job runner
+   \param[in]   headMem     Memory (MB) the job at the top of the heap
+                            needs
+   \param[out]  extraMem    Memory (MB) that will be left over when it 
+                            starts
+   \param[out]  extraSlots  Slots that will be left over when it starts
+   \return                  When it can start (0 if this isn't known)
+
+   Works out when the job at the top of the heap will have the memory 
+   it needs, from the run times of the running jobs, taking the jobs in
+   the order they will finish. A job without a run time may never 
+   finish, so the time is only known if the job can start before any
+   such job has to finish.
+
+-  17.10.26  Original   By: agent
+*/
+time_t ReservedStart(RUNNER *runner, int headMem, int *extraMem, 
+                     int *extraSlots)
+{
+   time_t now = time(NULL),
+          ends[MAXSLOTS],
+          reserved = 0;
+   int    mems[MAXSLOTS],
+          nEnds    = 0,
+          freeMem  = runner->memBudget - runner->memUsed,
+          freeSlots = runner->nSlots - runner->nRunning,
+          i;
+   
+   /* Insertion sort of the running jobs with run times by when they 
+      will finish
+   */
+   for(i=0; i<runner->nRunning; i++)
+   {
+      RUNNING *slot = &(runner->running[i]);
+      time_t  end;
+      int     j;
+      
+      if(!slot->estimate)
+         continue;
+      if(slot->overrun)
+         end = slot->overrunAt + OVERRUNGRACE;
+      else
+         end = now + (time_t)(slot->estimate - TimeRunning(slot, now));
+      
+      for(j=nEnds; (j > 0) && (ends[j-1] > end); j--)
+      {
+         ends[j] = ends[j-1];
+         mems[j] = mems[j-1];
+      }
+      ends[j] = end;
+      mems[j] = slot->mem;
+      nEnds++;
+   }
+
+   for(i=0; (i < nEnds) && (freeMem < headMem); i++)
+   {
+      freeMem += mems[i];
+      freeSlots++;
+      reserved = ends[i];
+   }
+   if(freeMem < headMem)
+      return(0);
+
+   *extraMem   = freeMem - headMem;
+   *extraSlots = freeSlots - 1;
+   return(reserved);
+}
+
+
+/************************************************************************/
+/*>long TimeRunning(RUNNING *slot, time_t now)
+   -------------------------------------------
+*//**
+   \param[in]   slot    A running job
+   \param[in]   now     The time
+   \return              Time (s) it has run, not counting any time it
+                        was suspended
+
+-  17.10.26  Original   By: agent
+*/
+long TimeRunning(RUNNING *slot, time_t now)
+{
+   long running = (long)(now - slot->started) - slot->stoppedTime;
+   
+   if(slot->stopped)
+      running -= (long)(now - slot->stoppedAt);
+   return(running);
+}
+
+
+/************************************************************************/
+/*>void StopOverrunJobs(RUNNER *runner)
+   ------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+
+   With -B, a job that runs for longer than its run time could hold up
+   the job that was promised its memory, so it is sent SIGTERM, and
+   SIGKILL if it is still running OVERRUNGRACE seconds later. A job 
+   doesn't overrun while it is suspended.
+
+-  17.10.26  Original   By: agent
+*/
+void StopOverrunJobs(RUNNER *runner)
+{
+   time_t now = time(NULL);
+   int    i;
+   
+   for(i=0; i<runner->nRunning; i++)
+   {
+      RUNNING *slot = &(runner->running[i]);
+      char    msg[MAXBUFF];
+      
+      if(!slot->estimate || slot->stopped)
+         continue;
+
+      if(!slot->overrun && (TimeRunning(slot, now) >= slot->estimate))
+      {
+         sprintf(msg, "Job %d has run for longer than its %d s - \
+stopping it", slot->jobID, slot->estimate);
+         Message(PROGNAME, MSG_WARNING, msg);
+         kill(-(slot->pid), SIGTERM);
+         slot->overrun   = SIGTERM;
+         slot->overrunAt = now;
+         runner->metrics.overran++;
+      }
+      else if((slot->overrun == SIGTERM) && 
+              (now - slot->overrunAt >= OVERRUNGRACE))
+      {
+         sprintf(msg, "Job %d did not stop - killing it", slot->jobID);
+         Message(PROGNAME, MSG_WARNING, msg);
+         kill(-(slot->pid), SIGKILL);
+         slot->overrun = SIGKILL;
+      }
+   }
+}
+
+
+/************************************************************************/
+/*>time_t OverrunDeadline(RUNNER *runner)
+   --------------------------------------
+*//**
+   \param[in]   runner   The job runner
+   \return               When StopOverrunJobs() next has something to
+                         do (0 if never)
+
+-  17.10.26  Original   By: agent
+*/
+time_t OverrunDeadline(RUNNER *runner)
+{
+   time_t now      = time(NULL),
+          deadline = 0;
+   int    i;
+   
+   for(i=0; i<runner->nRunning; i++)
+   {
+      RUNNING *slot = &(runner->running[i]);
+      time_t  due;
+      
+      if(!slot->estimate || slot->stopped || 
+         (slot->overrun == SIGKILL))
+         continue;
+      if(slot->overrun)
+         due = slot->overrunAt + OVERRUNGRACE;
+      else
+         due = now + (time_t)(slot->estimate - TimeRunning(slot, now));
+      if(!deadline || (due < deadline))
+         deadline = due;
+   }
+   return(deadline);
+}
+
+
+/************************************************************************/
+/*>unsigned long CommandShape(char *cmd, char *text)
+   -------------------------------------------------
+*//**
+   \param[in]   cmd    A job's command
+   \param[out]  text   The normalized command (MAXSHAPE, may be NULL)
+   \return             Hash of the normalized command (never 0)
+
+   Normalizes a command so that runs of the same program with different
+   data share their run times. The program is reduced to its basename,
+   options are kept (with any =value replaced by =*), numbers become #
+   and other arguments become *. Thus
+      /usr/bin/blast -evalue=1e-5 -n 10 query.fa
+   becomes
+      blast -evalue=* -n # *
+   A shape longer than MAXBUFF is cut short at a word.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Uses HashString()   By: agent
+-  17.10.26  Bounded the shape and words to MAXBUFF   By: agent
+*/
+unsigned long CommandShape(char *cmd, char *text)
+{
+   char          shape[MAXBUFF],
+                 word[MAXBUFF],
+                 *piece,
+                 *chp;
+   unsigned long hash   = 5381;
+   int           nWords = 0,
+                 used   = 0,
+                 len;
+
+   shape[0] = '\0';
+   while(*cmd)
+   {
+      while(isspace(*cmd))
+         cmd++;
+      if(!*cmd)
+         break;
+      /* Leave room for =* to replace a trailing =                      */
+      for(len=0; *cmd && !isspace(*cmd); cmd++)
+      {
+         if(len < MAXBUFF-2)
+            word[len++] = *cmd;
+      }
+      word[len] = '\0';
+
+      if(++nWords == 1)
+      {
+         piece = ((chp = strrchr(word, '/')) != NULL) ? chp+1 : word;
+      }
+      else if((word[0] == '-') && (word[1] != '\0') && 
+              !isdigit(word[1]) && (word[1] != '.'))
+      {
+         if((chp = strchr(word, '=')) != NULL)
+            strcpy(chp, "=*");
+         piece = word;
+      }
+      else
+      {
+         strtod(word, &chp);
+         piece = (*chp == '\0') ? "#" : "*";
+      }
+
+      /* Normalizing can lengthen the command, so stop when the shape is
+         full - a prefix is enough to tell commands apart
+      */
+      len = strlen(piece);
+      if(used + (nWords > 1) + len >= MAXBUFF)
+         break;
+      if(nWords > 1)
+         shape[used++] = ' ';
+      strcpy(shape+used, piece);
+      used += len;
+   }
+
+   hash = HashString(hash, shape);
+   if(text != NULL)
+   {
+      strncpy(text, shape, MAXSHAPE-1);
+      text[MAXSHAPE-1] = '\0';
+   }
+   return(hash ? hash : 1);
+}
+
+
+/************************************************************************/
+/*>int CompareModels(const void *a, const void *b)
+   -----------------------------------------------
+*//**
+   Orders run time models by shape then owner
+
+-  17.10.26  Original   By: agent
+*/
+int CompareModels(const void *a, const void *b)
+{
+   const RUNMODEL *ma = (const RUNMODEL *)a,
+                  *mb = (const RUNMODEL *)b;
+
+   if(ma->shape != mb->shape)
+      return((ma->shape < mb->shape) ? (-1) : 1);
+   if(ma->uid != mb->uid)
+      return((ma->uid < mb->uid) ? (-1) : 1);
+   return(0);
+}
+
+
+/************************************************************************/
+/*>RUNMODEL *FindModel(RUNNER *runner, unsigned long shape, uid_t uid, 
+                       char *text)
+   --------------------------------------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     shape    Hash of the normalized command (0 for all
+                           jobs)
+   \param[in]     uid      Owner (ALLUSERS for everyone)
+   \param[in]     text     The normalized command, or NULL if the model
+                           should not be added
+   \return                 The model, or NULL if there isn't one
+
+   Finds the run times of a command. If the model is added when there 
+   are already MAXMODELS, the one that was updated longest ago is 
+   dropped. The pointer is only good until the next model is added.
+
+-  17.10.26  Original   By: agent
+*/
+RUNMODEL *FindModel(RUNNER *runner, unsigned long shape, uid_t uid, 
+                    char *text)
+{
+   RUNMODEL key,
+            *model;
+   int      lo = 0,
+            hi = runner->nModels,
+            i;
+
+   key.shape = shape;
+   key.uid   = uid;
+   while(lo < hi)
+   {
+      int mid = (lo + hi) / 2;
+      if(CompareModels(&(runner->models[mid]), &key) < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   if((lo < runner->nModels) && 
+      !CompareModels(&(runner->models[lo]), &key))
+      return(&(runner->models[lo]));
+   if(text == NULL)
+      return(NULL);
+
+   if(runner->nModels >= MAXMODELS)
+   {
+      int oldest = 0;
+      
+      for(i=1; i<runner->nModels; i++)
+      {
+         if(runner->models[i].used < runner->models[oldest].used)
+            oldest = i;
+      }
+      memmove(runner->models + oldest, runner->models + oldest + 1,
+              (runner->nModels - oldest - 1) * sizeof(RUNMODEL));
+      runner->nModels--;
+      if(oldest < lo)
+         lo--;
+   }
+   else if(runner->nModels >= runner->maxModels)
+   {
+      int      maxModels = runner->maxModels ? 2 * runner->maxModels : 64;
+      RUNMODEL *models;
+
+      if((models = (RUNMODEL *)realloc(runner->models, 
+                                       maxModels * sizeof(RUNMODEL)))
+         == NULL)
+         return(NULL);
+      runner->models    = models;
+      runner->maxModels = maxModels;
+   }
+
+   memmove(runner->models + lo + 1, runner->models + lo,
+           (runner->nModels - lo) * sizeof(RUNMODEL));
+   runner->nModels++;
+   
+   model = &(runner->models[lo]);
+   memset(model, 0, sizeof(RUNMODEL));
+   model->shape = shape;
+   model->uid   = uid;
+   strncpy(model->text, text, MAXSHAPE-1);
+   return(model);
+}
+
+
+/************************************************************************/
+/*>void UpdateModel(RUNMODEL *model, double run, time_t now)
+   ---------------------------------------------------------
+*//**
+   \param[in,out] model   Run times of a command
+   \param[in]     run     A run time (s)
+   \param[in]     now     Current time
+
+   Adds a run time to the mean and to the histogram
+
+-  17.10.26  Original   By: agent
+*/
+void UpdateModel(RUNMODEL *model, double run, time_t now)
+{
+   int bucket,
+       i;
+
+   for(bucket=0; 
+       (bucket < RUNBUCKETS-1) && (run >= (double)(2L << bucket)); 
+       bucket++);
+
+   if(!model->n)
+   {
+      model->mean = run;
+      for(i=0; i<RUNBUCKETS; i++)
+         model->hist[i] = 0.0;
+      model->hist[bucket] = 1.0;
+   }
+   else
+   {
+      model->mean += RUNALPHA * (run - model->mean);
+      for(i=0; i<RUNBUCKETS; i++)
+         model->hist[i] *= (1.0 - RUNALPHA);
+      model->hist[bucket] += RUNALPHA;
+   }
+   model->n++;
+   model->used = now;
+}
+
+
+/************************************************************************/
+/*>double ModelQuantile(RUNMODEL *model, double q)
+   -----------------------------------------------
+*//**
+   \param[in]   model   Run times of a command
+   \param[in]   q       Quantile (0-1)
+   \return              Run time (s) at that quantile
+
+   Interpolates within the histogram bucket that holds the quantile
+
+-  17.10.26  Original   By: agent
+*/
+double ModelQuantile(RUNMODEL *model, double q)
+{
+   double sum = 0.0;
+   int    i;
+
+   for(i=0; i<RUNBUCKETS; i++)
+   {
+      double lo = i ? (double)(1L << i) : 0.0,
+             hi = (double)(2L << i);
+      
+      if((model->hist[i] > 0.0) && (sum + model->hist[i] >= q))
+         return(lo + (hi - lo) * (q - sum) / model->hist[i]);
+      sum += model->hist[i];
+   }
+   return((double)(1L << RUNBUCKETS));
+}
+
+
+/************************************************************************/
+/*>void LearnRunTime(RUNNER *runner, RUNNING *job, int status)
+   -----------------------------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     job      A job that has finished
+   \param[in]     status   Its status from waitpid()
+
+   Adds the run time of a job that succeeded to the models of its 
+   command for its owner and for all users, and to the model of all 
+   jobs. Failed jobs are left out as they often stop early. Time spent
+   suspended (-U) doesn't count.
+
+-  17.10.26  Original   By: agent
+*/
+void LearnRunTime(RUNNER *runner, RUNNING *job, int status)
+{
+   RUNMODEL *model;
+   time_t   now = time(NULL);
+   double   run;
+
+   if(!WIFEXITED(status) || WEXITSTATUS(status) || job->overrun)
+      return;
+   if((run = RunTime(job) / 1000.0 - job->stoppedTime) < 0.0)
+      run = 0.0;
+
+   if((model = FindModel(runner, job->shape, job->uid, 
+                         job->shapeText)) != NULL)
+      UpdateModel(model, run, now);
+   if((model = FindModel(runner, job->shape, ALLUSERS, 
+                         job->shapeText)) != NULL)
+      UpdateModel(model, run, now);
+   if((model = FindModel(runner, 0, ALLUSERS, "")) != NULL)
+      UpdateModel(model, run, now);
+   runner->modelsChanged = TRUE;
+}
+
+
+/************************************************************************/
+/*>double PredictRunTime(RUNNER *runner, unsigned long shape, uid_t uid, 
+                         int estimate, double *late)
+   ---------------------------------------------------------------------
+*//**
+   \param[in]   runner     The job runner
+   \param[in]   shape      Hash of the job's normalized command
+   \param[in]   uid        Its owner
+   \param[in]   estimate   Its declared run time (s, 0 if none)
+   \param[out]  late       Run time it should finish within (the 
+                           RUNLATE quantile)
+   \return                 Expected run time (s), or 0 if not known
+
+   Uses the owner's run times of the command, or else everyone's. 
+   Without either, the declared run time (-t) is used, or else the 
+   run times of all jobs. A declared run time caps the prediction as 
+   the job is stopped when it overruns (-B).
+
+-  17.10.26  Original   By: agent
+*/
+double PredictRunTime(RUNNER *runner, unsigned long shape, uid_t uid, 
+                      int estimate, double *late)
+{
+   RUNMODEL *model;
+   double   mean;
+
+   if(((model = FindModel(runner, shape, uid, NULL)) == NULL) &&
+      ((model = FindModel(runner, shape, ALLUSERS, NULL)) == NULL) &&
+      (estimate || 
+       ((model = FindModel(runner, 0, ALLUSERS, NULL)) == NULL)))
+   {
+      *late = (double)estimate;
+      return((double)estimate);
+   }
+
+   mean  = model->mean;
+   *late = ModelQuantile(model, RUNLATE);
+   if(*late < mean)
+      *late = mean;
+   if(estimate)
+   {
+      if(mean > estimate)
+         mean = (double)estimate;
+      if(*late > estimate)
+         *late = (double)estimate;
+   }
+   return(mean);
+}
+
+
+/************************************************************************/
+/*>void ReplaceEarliest(double *heap, int n, double when)
+   ------------------------------------------------------
+*//**
+   \param[in,out] heap   Min-heap of when each slot is free
+   \param[in]     n      Number of slots
+   \param[in]     when   When the earliest slot will be free again
+
+-  17.10.26  Original   By: agent
+*/
+void ReplaceEarliest(double *heap, int n, double when)
+{
+   int pos = 0;
+
+   for(;;)
+   {
+      int child = 2 * pos + 1;
+      
+      if(child >= n)
+         break;
+      if((child + 1 < n) && (heap[child+1] < heap[child]))
+         child++;
+      if(heap[child] >= when)
+         break;
+      heap[pos] = heap[child];
+      pos       = child;
+   }
+   heap[pos] = when;
+}
+
+
+/************************************************************************/
+/*>int CompareTimes(const void *a, const void *b)
+   ----------------------------------------------
+*//**
+   Orders times for qsort()
+
+-  17.10.26  Original   By: agent
+*/
+int CompareTimes(const void *a, const void *b)
+{
+   double ta = *(const double *)a,
+          tb = *(const double *)b;
+
+   return((ta < tb) ? (-1) : ((ta > tb) ? 1 : 0));
+}
+
+
+/************************************************************************/
+/*>void PredictSnapshot(RUNNER *runner, SNAPSHOT *snapshot, 
+                        WAITING *waiting, int nJobs)
+   --------------------------------------------------------
+*//**
+   \param[in]     runner     The job runner
+   \param[in,out] snapshot   Snapshot being written
+   \param[in]     waiting    The waiting jobs in the snapshot, in order
+   \param[in]     nJobs      Number of waiting jobs
+
+   Predicts when each job in the snapshot will start and finish, and 
+   when a job submitted now would start. The running jobs are given 
+   their expected ends and the waiting jobs are then run in order, each
+   (or each task of an array) taking the slot that is free first. The 
+   memory budget is not taken into account. Times are left at 0 from 
+   the first job whose run time can't be predicted.
+
+-  17.10.26  Original   By: agent
+*/
+void PredictSnapshot(RUNNER *runner, SNAPSHOT *snapshot, 
+                     WAITING *waiting, int nJobs)
+{
+   double ends[MAXSLOTS],
+          lateEnds[MAXSLOTS],
+          freeAt[MAXSLOTS],
+          sorted[MAXSLOTS];
+   time_t now    = time(NULL);
+   BOOL   known  = TRUE;
+   int    nSlots = runner->nSlots,
+          i,
+          j;
+
+   for(i=0; i<snapshot->nRunning + nJobs; i++)
+   {
+      snapshot->jobs[i].start    = 0;
+      snapshot->jobs[i].finish   = 0;
+      snapshot->jobs[i].finishBy = 0;
+   }
+   snapshot->newStart = 0;
+   runner->newStart   = 0;
+
+   /* When each running job should finish                               */
+   for(i=0; i<runner->nRunning; i++)
+   {
+      RUNNING *slot = &(runner->running[i]);
+      double  mean,
+              late,
+              ran   = (double)TimeRunning(slot, now);
+      
+      if((mean = PredictRunTime(runner, slot->shape, slot->uid, 
+                                slot->estimate, &late)) <= 0.0)
+      {
+         known = FALSE;
+         break;
+      }
+      ends[i]     = now + ((mean > ran) ? (mean - ran) : 1.0);
+      lateEnds[i] = now + ((late > ran) ? (late - ran) : 1.0);
+      if(slot->overrun)
+         ends[i] = lateEnds[i] = slot->overrunAt + OVERRUNGRACE;
+   }
+   if(!known)
+      return;
+
+   for(i=0; i<snapshot->nRunning; i++)
+   {
+      SNAPJOB *job = &(snapshot->jobs[i]);
+      
+      for(j=0; j<runner->nRunning; j++)
+      {
+         if(runner->running[j].jobID != job->jobID)
+            continue;
+         if(!job->start || (runner->running[j].started < job->start))
+            job->start = runner->running[j].started;
+         if(ends[j] > job->finish)
+            job->finish = (time_t)ends[j];
+         if(lateEnds[j] > job->finishBy)
+            job->finishBy = (time_t)lateEnds[j];
+      }
+   }
+
+   /* When each slot will be free. If jobs were started beyond the 
+      slots (-U) the first of them to finish don't free a slot
+   */
+   memcpy(sorted, ends, runner->nRunning * sizeof(double));
+   qsort(sorted, runner->nRunning, sizeof(double), CompareTimes);
+   for(i=0; i<nSlots; i++)
+   {
+      j = runner->nRunning - nSlots + i;
+      freeAt[i] = (j < 0) ? (double)now : sorted[j];
+   }
+
+   for(i=0; i<nJobs; i++)
+   {
+      SNAPJOB *job   = &(snapshot->jobs[snapshot->nRunning + i]);
+      double  mean,
+              late,
+              start  = 0.0,
+              finish = 0.0,
+              finishBy = 0.0;
+      int     nTasks = 1,
+              t;
+      
+      if((mean = PredictRunTime(runner, waiting[i].shape, waiting[i].uid,
+                                waiting[i].estimate, &late)) <= 0.0)
+         return;
+      if(waiting[i].nTasks)
+         nTasks = waiting[i].nTasks - job->running - job->nDone;
+      
+      for(t=0; (t < nTasks) && (t < MAXSIMTASKS); t++)
+      {
+         double taskStart = freeAt[0];
+
+         if(!t)
+            start = taskStart;
+         if(taskStart + mean > finish)
+            finish = taskStart + mean;
+         if(taskStart + late > finishBy)
+            finishBy = taskStart + late;
+         ReplaceEarliest(freeAt, nSlots, taskStart + mean);
+      }
+      if(nTasks > MAXSIMTASKS)
+      {
+         /* The rest of a large array run in rounds on every slot       */
+         double rounds = ceil((double)(nTasks - MAXSIMTASKS) / nSlots);
+         
+         for(t=0; t<nSlots; t++)
+            freeAt[t] += rounds * mean;
+         finish   += rounds * mean;
+         finishBy += rounds * mean;
+      }
+
+      job->start    = (time_t)start;
+      for(j=0; job->running && (j<runner->nRunning); j++)
+      {
+         /* An array with tasks running has already started             */
+         if((runner->running[j].jobID == job->jobID) &&
+            (runner->running[j].started < job->start))
+            job->start = runner->running[j].started;
+      }
+      job->finish   = (time_t)finish;
+      job->finishBy = (time_t)finishBy;
+   }
+
+   snapshot->newStart = runner->newStart = (time_t)freeAt[0];
+}
+
+
+/************************************************************************/
+/*>long ExpectedStart(RUNNER *runner)
+   ----------------------------------
+*//**
+   \param[in]   runner   The job runner
+   \return               Expected wait (s) of a job submitted now, or
+                         -1 if not known
+
+-  17.10.26  Original   By: agent
+*/
+long ExpectedStart(RUNNER *runner)
+{
+   time_t now = time(NULL);
+
+   if(!runner->newStart)
+      return(-1L);
+   return((runner->newStart > now) ? (long)(runner->newStart - now) : 0L);
+}
+
+
+/************************************************************************/
+/*>long ExpectedWait(char *queueDir)
+   ---------------------------------
+*//**
+   \param[in]   queueDir  Queue directory
+   \return                Expected wait (s) of a job submitted now, from
+                          the runner's snapshot, or -1 if not known
+
+-  17.10.26  Original   By: agent
+*/
+long ExpectedWait(char *queueDir)
+{
+   SNAPSHOT *snapshot;
+   size_t   size;
+   time_t   newStart = 0,
+            now      = time(NULL);
+
+   if((snapshot = MapSnapshot(queueDir, &size)) == NULL)
+      return(-1L);
+   if(RunnerAlive(snapshot) && !snapshot->moved)
+      newStart = snapshot->newStart;
+   munmap(snapshot, size);
+
+   if(!newStart)
+      return(-1L);
+   return((newStart > now) ? (long)(newStart - now) : 0L);
+}
+
+
+/************************************************************************/
+/*>void SaveRunTimes(RUNNER *runner)
+   ---------------------------------
+*//**
+   \param[in,out] runner   The job runner
+
+   Writes the learned run times to RUNTIMESFILE so that they survive a
+   restart of the runner. Each line is the shape, owner (-1 for all),
+   number of runs, mean, when last updated and histogram, followed by a
+   tab and the normalized command.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The file is kept in STATEDIR   By: agent
+-  17.10.26  So is the temporary file   By: agent
+*/
+void SaveRunTimes(RUNNER *runner)
+{
+   char runFile[MAXBUFF],
+        tmpFile[MAXBUFF];
+   FILE *fp;
+   int  i,
+        j;
+
+   StateFile(runner->queueDir, RUNTIMESFILE, runFile);
+   StateFile(runner->queueDir, RUNTIMESTMPFILE, tmpFile);
+   if((fp = fopen(tmpFile, "w")) == NULL)
+      return;
+
+   for(i=0; i<runner->nModels; i++)
+   {
+      RUNMODEL *model = &(runner->models[i]);
+      
+      fprintf(fp, "%lu %ld %ld %.3f %ld", model->shape, 
+              ((model->uid == ALLUSERS) ? (-1L) : (long)model->uid),
+              model->n, model->mean, (long)model->used);
+      for(j=0; j<RUNBUCKETS; j++)
+         fprintf(fp, " %.4g", model->hist[j]);
+      fprintf(fp, "\t%s\n", model->text);
+   }
+
+   if((fclose(fp) != 0) || (rename(tmpFile, runFile) != 0))
+   {
+      unlink(tmpFile);
+      if(runner->verbose >= 2)
+      {
+         Message(PROGNAME, MSG_WARNING, 
+                 "Cannot write the run times file");
+      }
+      return;
+   }
+   runner->modelsChanged = FALSE;
+}
+
+
+/************************************************************************/
+/*>void LoadRunTimes(RUNNER *runner)
+   ---------------------------------
+*//**
+   \param[in,out] runner   The job runner
+
+   Reads the run times saved by SaveRunTimes(). Bad lines are skipped.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  The file is kept in STATEDIR   By: agent
+*/
+void LoadRunTimes(RUNNER *runner)
+{
+   char runFile[MAXBUFF],
+        buffer[2*MAXBUFF],
+        *text;
+   FILE *fp;
+
+   StateFile(runner->queueDir, RUNTIMESFILE, runFile);
+   if((fp = fopen(runFile, "r")) == NULL)
+      return;
+
+   while(fgets(buffer, 2*MAXBUFF, fp))
+   {
+      RUNMODEL      *model,
+                    loaded;
+      unsigned long shape;
+      long          uid,
+                    used;
+      char          *chp;
+      int           nChars,
+                    i;
+      
+      TERMINATE(buffer);
+      if(((text = strchr(buffer, '\t')) == NULL) ||
+         (sscanf(buffer, "%lu %ld %ld %lf %ld%n", &shape, &uid, 
+                 &(loaded.n), &(loaded.mean), &used, &nChars) != 5))
+         continue;
+      *(text++) = '\0';
+      
+      for(i=0, chp=buffer+nChars; i<RUNBUCKETS; i++, chp+=nChars)
+      {
+         if(sscanf(chp, "%lf%n", &(loaded.hist[i]), &nChars) != 1)
+            break;
+      }
+      if((i < RUNBUCKETS) || (loaded.n <= 0) ||
+         ((model = FindModel(runner, shape, 
+                             ((uid < 0) ? ALLUSERS : (uid_t)uid), 
+                             text)) == NULL))
+         continue;
+
+      model->n    = loaded.n;
+      model->mean = loaded.mean;
+      model->used = (time_t)used;
+      memcpy(model->hist, loaded.hist, sizeof(loaded.hist));
+   }
+   fclose(fp);
+}
+
+
+/************************************************************************/
+/*>void FormatClock(time_t when, char *buffer)
+   -------------------------------------------
+*//**
+   \param[in]   when     A time
+   \param[out]  buffer   The time of day, with the day if it isn't 
+                         today (MAXBUFF)
+
+-  17.10.26  Original   By: agent
+*/
+void FormatClock(time_t when, char *buffer)
+{
+   struct tm whenTm,
+             nowTm;
+   time_t    now = time(NULL);
+
+   localtime_r(&when, &whenTm);
+   localtime_r(&now,  &nowTm);
+   if((whenTm.tm_year == nowTm.tm_year) && 
+      (whenTm.tm_yday == nowTm.tm_yday))
+      strftime(buffer, MAXBUFF, "%H:%M", &whenTm);
+   else if((when > now) && (when - now < 6 * 24 * 3600))
+      strftime(buffer, MAXBUFF, "%a %H:%M", &whenTm);
+   else
+      strftime(buffer, MAXBUFF, "%d %b %H:%M", &whenTm);
+}
+
+
+/************************************************************************/
+/*>void FormatWait(long seconds, char *buffer)
+   -------------------------------------------
+*//**
+   \param[in]   seconds  A wait (s)
+   \param[out]  buffer   The wait, roughly (MAXWAITTEXT)
+
+-  17.10.26  Original   By: agent
+*/
+void FormatWait(long seconds, char *buffer)
+{
+   if(seconds < 60)
+      strcpy(buffer, "under a minute");
+   else if(seconds < 3600)
+      sprintf(buffer, "about %ld min", (seconds + 30) / 60);
+   else if(seconds < 24 * 3600)
+      sprintf(buffer, "about %ld h %ld min", seconds / 3600, 
+              (seconds % 3600) / 60);
+   else
+      sprintf(buffer, "about %ld d %ld h", seconds / (24 * 3600),
+              (seconds % (24 * 3600)) / 3600);
+}
+
+
+/************************************************************************/
+/*>unsigned long HashString(unsigned long hash, char *string)
+   ----------------------------------------------------------
+*//**
+   \param[in]   hash     Hash so far (5381 to start)
+   \param[in]   string   String to add to it
+   \return               The new hash
+
+   Adds a string to a djb2 hash
+
+-  17.10.26  Original - split out of CommandShape()   By: agent
+*/
+unsigned long HashString(unsigned long hash, char *string)
+{
+   for(; *string; string++)
+      hash = hash * 33 + (unsigned char)*string;
+   return(hash);
+}
+
+
+/************************************************************************/
+/*>BOOL DedupKey(JOBINFO *job, char **progArgs, int nProgArgs, 
+                 char *inputs)
+   -----------------------------------------------------------
+*//**
+   \param[in,out] job        The job being submitted. dedup is set
+   \param[in]     progArgs   Program and parameters
+   \param[in]     nProgArgs  Number of them
+   \param[in]     inputs     Comma separated input files (-I)
+   \return                   Were the input files all found?
+
+   Hashes what a job does for -d: its owner, task range, working 
+   directory and command, and the full path, modification time and
+   size of each input file, so the job is different once an input has
+   changed.
+
+-  17.10.26  Original   By: agent
+-  17.10.26  Rejects an input list too long to copy   By: agent
+*/
+BOOL DedupKey(JOBINFO *job, char **progArgs, int nProgArgs, 
+              char *inputs)
+{
+   char          buffer[MAXBUFF],
+                 files[MAXBUFF],
+                 path[PATH_MAX],
+                 *file;
+   unsigned long hash = 5381;
+   struct stat   statBuf;
+   int           i;
+
+   /* Each field is followed by a 0 so they can't run together         */
+   sprintf(buffer, "%ld %d %d", (long)job->uid, job->first, 
+           job->nTasks);
+   hash = HashString(hash, buffer) * 33;
+   hash = HashString(hash, job->pwd) * 33;
+   for(i=0; i<nProgArgs; i++)
+      hash = HashString(hash, progArgs[i]) * 33;
+
+   if(strlen(inputs) >= MAXBUFF)
+   {
+      Message(PROGNAME, MSG_ERROR, "Too many input files for -I");
+      return(FALSE);
+   }
+   strncpy(files, inputs, MAXBUFF);
+   files[MAXBUFF-1] = '\0';
+   for(file=strtok(files, ","); file!=NULL; file=strtok(NULL, ","))
+   {
+      if((realpath(file, path) == NULL) || (stat(path, &statBuf) != 0))
+      {
+         char msg[MAXBUFF+32];
+         sprintf(msg, "Cannot find input file: %s", file);
+         Message(PROGNAME, MSG_ERROR, msg);
+         return(FALSE);
+      }
+      sprintf(buffer, "%ld.%09ld %ld", (long)statBuf.st_mtim.tv_sec,
+              (long)statBuf.st_mtim.tv_nsec, (long)statBuf.st_size);
+      hash = HashString(hash, path) * 33;
+      hash = HashString(hash, buffer) * 33;
+   }
+
+   job->dedup = (hash ? hash : 1);
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>int CompareDedups(const void *a, const void *b)
+   -----------------------------------------------
+*//**
+   Orders jobs submitted with -d by hash then owner
+
+-  17.10.26  Original   By: agent
+*/
+int CompareDedups(const void *a, const void *b)
+{
+   const DEDUPJOB *da = (const DEDUPJOB *)a,
+                  *db = (const DEDUPJOB *)b;
+
+   if(da->key != db->key)
+      return((da->key < db->key) ? (-1) : 1);
+   if(da->uid != db->uid)
+      return((da->uid < db->uid) ? (-1) : 1);
+   return(0);
+}
+
+
+/************************************************************************/
+/*>DEDUPJOB *FindDedup(RUNNER *runner, unsigned long key, uid_t uid, 
+                       BOOL add)
+   ------------------------------------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     key      Hash from DedupKey()
+   \param[in]     uid      Owner
+   \param[in]     add      Add it if it isn't there
+   \return                 The job, or NULL if there isn't one
+
+   Finds a job submitted with -d. If one is added when there are 
+   already MAXDEDUP, the finished job used longest ago is dropped (or
+   the job used longest ago if none has finished). The pointer is only
+   good until the next one is added or dropped.
+
+-  17.10.26  Original   By: agent
+*/
+DEDUPJOB *FindDedup(RUNNER *runner, unsigned long key, uid_t uid, 
+                    BOOL add)
+{
+   DEDUPJOB search,
+            *dedup;
+   int      lo = 0,
+            hi = runner->nDedups;
+
+   search.key = key;
+   search.uid = uid;
+   while(lo < hi)
+   {
+      int mid = (lo + hi) / 2;
+      if(CompareDedups(&(runner->dedups[mid]), &search) < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   if((lo < runner->nDedups) && 
+      !CompareDedups(&(runner->dedups[lo]), &search))
+      return(&(runner->dedups[lo]));
+   if(!add)
+      return(NULL);
+
+   if(runner->nDedups >= MAXDEDUP)
+   {
+      int oldest = 0,
+          i;
+      
+      for(i=1; i<runner->nDedups; i++)
+      {
+         DEDUPJOB *entry = &(runner->dedups[i]),
+                  *old  = &(runner->dedups[oldest]);
+         
+         if((entry->done && !old->done) ||
+            ((entry->done == old->done) && (entry->used < old->used)))
+            oldest = i;
+      }
+      DropDedup(runner, &(runner->dedups[oldest]));
+      if(oldest < lo)
+         lo--;
+   }
+   else if(runner->nDedups >= runner->maxDedups)
+   {
+      int      maxDedups = runner->maxDedups ? 2 * runner->maxDedups : 64;
+      DEDUPJOB *dedups;
+
+      if((dedups = (DEDUPJOB *)realloc(runner->dedups, 
+                                       maxDedups * sizeof(DEDUPJOB)))
+         == NULL)
+         return(NULL);
+      runner->dedups    = dedups;
+      runner->maxDedups = maxDedups;
+   }
+
+   memmove(runner->dedups + lo + 1, runner->dedups + lo,
+           (runner->nDedups - lo) * sizeof(DEDUPJOB));
+   runner->nDedups++;
+
+   dedup = &(runner->dedups[lo]);
+   dedup->key   = key;
+   dedup->uid   = uid;
+   dedup->jobID = (-1);
+   dedup->done  = FALSE;
+   dedup->used  = time(NULL);
+   return(dedup);
+}
+
+
+/************************************************************************/
+/*>void DropDedup(RUNNER *runner, DEDUPJOB *dedup)
+   -----------------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     dedup    A job submitted with -d, to be forgotten
+
+-  17.10.26  Original   By: agent
+*/
+void DropDedup(RUNNER *runner, DEDUPJOB *dedup)
+{
+   int pos = (int)(dedup - runner->dedups);
+
+   memmove(dedup, dedup + 1, 
+           (runner->nDedups - pos - 1) * sizeof(DEDUPJOB));
+   runner->nDedups--;
+}
+
+
+/************************************************************************/
+/*>int SameJob(RUNNER *runner, JOBINFO *job)
+   -----------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     job      A job being submitted with -d
+   \return                 ID of the same job if it is waiting, running
+                           or finished successfully, else -1
+
+   A job that is no longer in the queue without having finished (e.g. 
+   it was lost in a restart) is forgotten.
+
+-  17.10.26  Original   By: agent
+*/
+int SameJob(RUNNER *runner, JOBINFO *job)
+{
+   DEDUPJOB *dedup;
+   int      i;
+
+   if((dedup = FindDedup(runner, job->dedup, job->uid, FALSE)) == NULL)
+      return(-1);
+
+   if(!dedup->done)
+   {
+      BOOL queued = ((FindWaiting(runner, dedup->jobID) >= 0) ||
+                     (FindArray(runner, dedup->jobID) != NULL));
+      
+      for(i=0; !queued && (i<runner->nRunning); i++)
+         queued = (runner->running[i].jobID == dedup->jobID);
+      if(!queued)
+      {
+         DropDedup(runner, dedup);
+         return(-1);
+      }
+   }
+
+   dedup->used = time(NULL);
+   return(dedup->jobID);
+}
+
+
+/************************************************************************/
+/*>void RememberJob(RUNNER *runner, JOBINFO *job)
+   ----------------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     job      A job submitted with -d that has been queued
+
+-  17.10.26  Original   By: agent
+*/
+void RememberJob(RUNNER *runner, JOBINFO *job)
+{
+   DEDUPJOB *dedup;
+
+   if((dedup = FindDedup(runner, job->dedup, job->uid, TRUE)) != NULL)
+   {
+      dedup->jobID = job->jobID;
+      dedup->done  = FALSE;
+      dedup->used  = time(NULL);
+   }
+}
+
+
+/************************************************************************/
+/*>void DedupFinished(RUNNER *runner, RUNNING *job, BOOL succeeded)
+   ----------------------------------------------------------------
+*//**
+   \param[in,out] runner     The job runner
+   \param[in]     job        A job submitted with -d that has finished
+                             (the last task of a job array)
+   \param[in]     succeeded  Did it (and all its tasks) succeed?
+
+   Keeps a job that succeeded so the same job is not run again. A job
+   that failed is forgotten so that it can be run again.
+
+-  17.10.26  Original   By: agent
+*/
+void DedupFinished(RUNNER *runner, RUNNING *job, BOOL succeeded)
+{
+   DEDUPJOB *dedup;
+
+   if(((dedup = FindDedup(runner, job->dedup, job->uid, FALSE)) == NULL)
+      || (dedup->jobID != job->jobID))
+      return;
+
+   if(succeeded)
+   {
+      dedup->done = TRUE;
+      dedup->used = time(NULL);
+   }
+   else
+   {
+      DropDedup(runner, dedup);
+   }
+}
+
+
+/************************************************************************/
+/*>void StateFile(char *queueDir, char *name, char *file)
+   ------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   name        Name of one of the runner's files
+   \param[out]  file        Its full path
+
+   Gives the path of a file in the runner's state directory.
+
+-  17.10.26  Original   By: agent
+*/
+void StateFile(char *queueDir, char *name, char *file)
+{
+   snprintf(file, MAXBUFF, "%s/%s/%s", queueDir, STATEDIR, name);
+}
+
+
+/************************************************************************/
+/*>void TasksFile(char *queueDir, int jobID, char *tasksFile)
+   ----------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   jobID       A job array
+   \param[out]  tasksFile   The path of its progress file
+
+-  17.10.26  Original   By: agent
+*/
+void TasksFile(char *queueDir, int jobID, char *tasksFile)
+{
+   snprintf(tasksFile, MAXBUFF, "%s/%s/%s%d", queueDir, STATEDIR, 
+            TASKSPREFIX, jobID);
+}
+
+
+/************************************************************************/
+/*>BOOL OwnDirectory(char *dir, mode_t mode)
+   -----------------------------------------
+*//**
+   \param[in]   dir         A directory
+   \param[in]   mode        The permissions it must have
+   \return                  Is it the runner's own?
+
+   Makes a directory if it doesn't exist. Whether it was made now or 
+   was already there, it is only used if it is a real directory (not a
+   link to one) owned by the runner with exactly the given permissions,
+   so that one made first by someone else is refused.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL OwnDirectory(char *dir, mode_t mode)
+{
+   struct stat statBuff;
+   mode_t      oldMask;
+   int         made;
+
+   oldMask = umask((mode_t)0000);
+   made    = mkdir(dir, mode);
+   umask(oldMask);
+   if((made != 0) && (errno != EEXIST))
+      return(FALSE);
+
+   if((lstat(dir, &statBuff) != 0) || !S_ISDIR(statBuff.st_mode) ||
+      (statBuff.st_uid != geteuid()) || 
+      ((statBuff.st_mode & 07777) != mode))
+      return(FALSE);
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>void MakeStateDir(char *queueDir)
+   ---------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+
+   Makes the directory for the files that only the runner writes (the
+   snapshot, accounting log, metrics and so on). The queue directory is
+   writable by everyone, so a file there could have been made by 
+   anyone and then fed to the runner. Nobody else can make files in the
+   state directory. One that the runner doesn't own is moved aside.
+
+-  17.10.26  Original   By: agent
+*/
+void MakeStateDir(char *queueDir)
+{
+   char stateDir[MAXBUFF],
+        badDir[MAXBUFF];
+
+   snprintf(stateDir, MAXBUFF, "%s/%s", queueDir, STATEDIR);
+   if(OwnDirectory(stateDir, 0755))
+      return;
+
+   snprintf(badDir, MAXBUFF, "%s/%s.bad.%d", queueDir, STATEDIR, 
+            (int)getpid());
+   if((rename(stateDir, badDir) != 0) || !OwnDirectory(stateDir, 0755))
+   {
+      Message(PROGNAME, MSG_FATAL, 
+              "Cannot make the queue manager's state directory");
+   }
+   Message(PROGNAME, MSG_WARNING, "Moved aside a state directory not \
+made by the queue manager");
+}
+
+
+/************************************************************************/
+/*>void OwnCounters(char *queueDir)
+   --------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+
+   Submitters update the counters as well as the runner, so the file is
+   kept in the queue directory. If it is missing, is not a plain file 
+   or was made by someone else, the runner replaces it with its own 
+   (which is then rebuilt from the queue), so that its owner can't take
+   it away from everyone else.
+
+-  17.10.26  Original   By: agent
+*/
+void OwnCounters(char *queueDir)
+{
+   char        counterFile[MAXBUFF],
+               newFile[MAXBUFF];
+   struct stat statBuff;
+   int         fh;
+
+   sprintf(counterFile, "%s/%s", queueDir, COUNTERFILE);
+   if((lstat(counterFile, &statBuff) == 0) && 
+      S_ISREG(statBuff.st_mode) && (statBuff.st_nlink == 1) &&
+      (statBuff.st_uid == geteuid()))
+      return;
+
+   StateFile(queueDir, COUNTERTMPFILE, newFile);
+   if((fh = open(newFile, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC,
+                 0666)) < 0)
+   {
+      Message(PROGNAME, MSG_WARNING, "Cannot replace the counters file");
+      return;
+   }
+   fchmod(fh, 0666);
+   close(fh);
+   if(rename(newFile, counterFile) != 0)
+   {
+      Message(PROGNAME, MSG_WARNING, "Cannot replace the counters file");
+      unlink(newFile);
+   }
+}
+
+
+/************************************************************************/
+/*>BOOL CanRunJob(uid_t uid)
+   -------------------------
+*//**
+   \param[in]   uid     Owner of a job
+   \return              Can the runner run the job?
+
+   A runner that isn't root can only run its owner's jobs. Other users'
+   jobs are left in the queue rather than being taken and failed.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL CanRunJob(uid_t uid)
+{
+   return((geteuid() == 0) || (uid == geteuid()));
+}
+
+
+/************************************************************************/
+/*>BOOL QueueOwner(char *queueDir, uid_t uid)
+   ------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   uid         A user
+   \return                  Could the user be running the queue's 
+                            runner?
+
+   The runner is run by root or by the owner of the queue directory, so
+   only files and sockets made by them are trusted by submitters.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL QueueOwner(char *queueDir, uid_t uid)
+{
+   struct stat statBuff;
+
+   return((uid == 0) || 
+          ((stat(queueDir, &statBuff) == 0) && (statBuff.st_uid == uid)));
+}
+
+
+/************************************************************************/
+/*>int OpenLogDir(char *queueDir)
+   ------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \return                  File handle of LOGDIR (-1 if it can't be
+                            used)
+
+   Makes the directory for the jobs' output and opens it, so that the 
+   logs are made with openat() in the directory that was checked. 
+   Submitters follow a job's output from it, so it stays in the queue
+   directory, but as anyone can make files there, one not made by the
+   runner (which could be a link, or let its owner replace the logs) is
+   moved aside like the state directory.
+
+-  17.10.26  Original   By: agent
+*/
+int OpenLogDir(char *queueDir)
+{
+   char logDir[MAXBUFF],
+        badDir[MAXBUFF];
+   int  fh;
+
+   snprintf(logDir, MAXBUFF, "%s/%s", queueDir, LOGDIR);
+   if(!OwnDirectory(logDir, 0755))
+   {
+      snprintf(badDir, MAXBUFF, "%s/%s.bad.%d", queueDir, LOGDIR, 
+               (int)getpid());
+      if((rename(logDir, badDir) != 0) || !OwnDirectory(logDir, 0755))
+      {
+         Message(PROGNAME, MSG_WARNING, "Cannot make the directory for \
+the jobs' output");
+         return(-1);
+      }
+      Message(PROGNAME, MSG_WARNING, "Moved aside a log directory not \
+made by the queue manager");
+   }
+
+   if((fh = open(logDir, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) < 0)
+      Message(PROGNAME, MSG_WARNING, "Cannot open the directory for \
+the jobs' output");
+   return(fh);
+}
+
+
+/************************************************************************/
+/*>void DropJob(RUNNER *runner, int jobID)
+   ---------------------------------------
+*//**
+   \param[in,out] runner   The job runner
+   \param[in]     jobID    A waiting job that can't be run
+
+   Takes a job that can't be run out of the queue, as if it had been
+   removed, so that the jobs behind it can run. Its job file is moved
+   to BADPREFIX and its ID in the queue directory, so that its owner
+   can see what it was; a job in the ring is marked as done.
+
+-  17.10.26  Original   By: agent
+*/
+void DropJob(RUNNER *runner, int jobID)
+{
+   char jobFile[MAXBUFF],
+        badFile[MAXBUFF],
+        msg[MAXBUFF+80];
+   int  pos;
+
+   sprintf(msg, "Removed job %d from the queue", jobID);
+   if(runner->ring)
+   {
+      pos = FindWaiting(runner, jobID);
+      RingSetState(runner->ring, jobID, 
+                   ((pos >= 0) ? runner->waiting[pos].offset : -1), 
+                   RING_DONE);
+   }
+   else if(FindJobFile(runner->queueDir, jobID, "", jobFile))
+   {
+      snprintf(badFile, MAXBUFF, "%s/%s%d", runner->queueDir, BADPREFIX,
+               jobID);
+      if(rename(jobFile, badFile) == 0)
+      {
+         sprintf(msg, "Moved job %d out of the queue to %s", jobID, 
+                 badFile);
+         RemoveShard(runner, jobID);
+      }
+   }
+   Message(PROGNAME, MSG_WARNING, msg);
+
+   JournalJob(runner, JOURNAL_REMOVED, jobID, -1, 0, NULL);
+   RemoveWaiting(runner, jobID);
+   UpdateCounters(runner->queueDir, -1, 0);
+   EndArray(runner, jobID, FALSE);
+   runner->changed = TRUE;
+}
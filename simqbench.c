@@ -0,0 +1,1051 @@
+/************************************************************************/
+/**
+
+   Program:    simqbench
+   \file       simqbench.c
+
+   \version    V1.0
+   \date       17.10.26
+   \brief      Benchmark for the simq submit and dispatch paths
+
+   \copyright  (c) agent 2026
+   \author     agent
+               agent@local
+
+**************************************************************************
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2, as 
+   given in the accompanying file LICENSE. It includes simq.c, which 
+   is (c) 2015 UCL, Dr. Andrew C.R. Martin.
+
+**************************************************************************
+
+   Description:
+   ============
+   Measures the costs of the queueing paths of simq against a queue in
+   a temporary directory:
+
+   - QueueJob() with a number of submitters running at once and no
+     runner, checking that no job IDs are lost or duplicated
+   - The time from submission until a runner starts each job, using
+     simqbench itself as a stand-in job that records when it started,
+     checking that every job runs once
+   - The cost of -l, -l -v and -i at queue depths from 10 up to
+     maxdepth, reading the queue directory and the runner's snapshot
+
+   simq.c is included so that its functions can be timed directly;
+   the runner is the simq program. Neither needs root: a runner may be
+   run by the owner of the queue directory.
+
+**************************************************************************
+
+   Usage:
+   ======
+   simqbench [-p submitters] [-n jobs] [-j slots] [-d maxdepth] [-R]
+             [-s simq] [-k] [-v]
+
+**************************************************************************
+
+   Revision History:
+   =================
+-  V1.0    17.10.26  Original   By: agent
+-  V1.0    17.10.26  Gave the file its own copyright notice   By: agent
+
+*************************************************************************/
+/* Includes
+*/
+#define main SimqMain
+#include "simq.c"
+#undef main
+#include <sys/prctl.h>
+
+/************************************************************************/
+/* Defines and macros
+*/
+#define BENCHNAME "simqbench"
+#define DEF_SUBMITTERS 8
+#define DEF_BENCHJOBS 200   /* Jobs per submitter                       */
+#define DEF_BENCHSLOTS 4
+#define DEF_MAXDEPTH 100000
+#define STAMPFILE "stamps"  /* Written by the stand-in jobs             */
+#define IDLETIMEOUT 10      /* Give up if no job starts for this (s)    */
+#define MINTIMING 0.2       /* Repeat a listing for at least this (s)   */
+#define MAXREPEATS 1000
+
+typedef struct
+{
+   int  nSubmitters,
+        nJobs,              /* Per submitter                            */
+        nSlots,
+        maxDepth,
+        verbose;
+   BOOL useRing,
+        keep;
+   char simq[MAXBUFF],      /* The simq program, for the runner         */
+        self[MAXBUFF],      /* This program, for the stand-in job       */
+        tmpDir[32];         /* Holds the queues; made by mkdtemp()      */
+}  BENCH;
+
+/************************************************************************/
+/* Prototypes
+*/
+int main(int argc, char **argv);
+BOOL ParseBenchCmdLine(int argc, char **argv, BENCH *bench);
+void BenchUsage(void);
+int StandInJob(int argc, char **argv);
+double Now(void);
+void Percentiles(double *values, int nValues, double *p50, double *p99,
+                 double *max);
+void PrintLatency(char *title, double *values, int nValues);
+void Submit(BENCH *bench, char *queueDir, BOOL stamp, double *submitted,
+            double *latency, int *jobIDs);
+void BenchSubmit(BENCH *bench);
+void BenchDispatch(BENCH *bench);
+void BenchListing(BENCH *bench);
+pid_t StartRunner(BENCH *bench, char *queueDir, int nSlots);
+void StopRunner(pid_t pid);
+BOOL WaitForSnapshot(char *queueDir, int nJobs, int nRunning);
+double TimeListing(char *queueDir, int what, int jobID);
+int FillQueue(char *queueDir, int nJobs);
+void RemoveTree(char *dir);
+int CompareDoubles(const void *a, const void *b);
+
+
+/************************************************************************/
+/*>int main(int argc, char **argv)
+   -------------------------------
+*//**
+   Main program for the benchmark. Also runs as the stand-in job when
+   given -x or -w.
+
+-  17.10.26  Original   By: agent
+*/
+int main(int argc, char **argv)
+{
+   BENCH bench;
+
+   if((argc > 1) && (!strcmp(argv[1], "-x") || !strcmp(argv[1], "-w")))
+      return(StandInJob(argc, argv));
+
+   if(!ParseBenchCmdLine(argc, argv, &bench))
+   {
+      BenchUsage();
+      return(1);
+   }
+
+   if(realpath(argv[0], bench.self) == NULL)
+   {
+      Message(BENCHNAME, MSG_FATAL, "Cannot find this program");
+   }
+   if(access(bench.simq, X_OK) != 0)
+   {
+      Message(BENCHNAME, MSG_FATAL, "Cannot find simq - use -s");
+   }
+   strcpy(bench.tmpDir, "/tmp/simqbench.XXXXXX");
+   if(mkdtemp(bench.tmpDir) == NULL)
+   {
+      Message(BENCHNAME, MSG_FATAL, "Cannot create temporary directory");
+   }
+
+   /* The runner must not kill us when its jobs finish                  */
+   signal(SIGPIPE, SIG_IGN);
+
+   printf("%s: %d submitters x %d jobs, %d slots%s, queues in %s\n\n",
+          BENCHNAME, bench.nSubmitters, bench.nJobs, bench.nSlots,
+          (bench.useRing ? ", ring" : ""), bench.tmpDir);
+   fflush(stdout);
+
+   BenchSubmit(&bench);
+   BenchDispatch(&bench);
+   BenchListing(&bench);
+
+   if(!bench.keep)
+      RemoveTree(bench.tmpDir);
+   return(0);
+}
+
+
+/************************************************************************/
+/*>BOOL ParseBenchCmdLine(int argc, char **argv, BENCH *bench)
+   -----------------------------------------------------------
+*//**
+   \param[in]   argc    Argument count
+   \param[in]   argv    Arguments
+   \param[out]  bench   Benchmark settings
+   \return              OK?
+
+-  17.10.26  Original   By: agent
+*/
+BOOL ParseBenchCmdLine(int argc, char **argv, BENCH *bench)
+{
+   bench->nSubmitters = DEF_SUBMITTERS;
+   bench->nJobs       = DEF_BENCHJOBS;
+   bench->nSlots      = DEF_BENCHSLOTS;
+   bench->maxDepth    = DEF_MAXDEPTH;
+   bench->verbose     = 0;
+   bench->useRing     = FALSE;
+   bench->keep        = FALSE;
+   strcpy(bench->simq, "./simq");
+
+   argc--;
+   argv++;
+
+   while(argc)
+   {
+      if(argv[0][0] != '-')
+         return(FALSE);
+
+      switch(argv[0][1])
+      {
+      case 'p':
+         argc--;
+         argv++;
+         if(!argc || !sscanf(argv[0], "%d", &(bench->nSubmitters)))
+            return(FALSE);
+         break;
+      case 'n':
+         argc--;
+         argv++;
+         if(!argc || !sscanf(argv[0], "%d", &(bench->nJobs)))
+            return(FALSE);
+         break;
+      case 'j':
+         argc--;
+         argv++;
+         if(!argc || !sscanf(argv[0], "%d", &(bench->nSlots)))
+            return(FALSE);
+         break;
+      case 'd':
+         argc--;
+         argv++;
+         if(!argc || !sscanf(argv[0], "%d", &(bench->maxDepth)))
+            return(FALSE);
+         break;
+      case 's':
+         argc--;
+         argv++;
+         if(!argc)
+            return(FALSE);
+         strncpy(bench->simq, argv[0], MAXBUFF-1);
+         bench->simq[MAXBUFF-1] = '\0';
+         break;
+      case 'R':
+         bench->useRing = TRUE;
+         break;
+      case 'k':
+         bench->keep = TRUE;
+         break;
+      case 'v':
+         bench->verbose = strlen(argv[0]) - 1;
+         break;
+      default:
+         return(FALSE);
+      }
+      argc--;
+      argv++;
+   }
+
+   return((bench->nSubmitters > 0) && (bench->nJobs > 0) &&
+          (bench->nSlots > 0) && (bench->nSlots <= MAXSLOTS) &&
+          (bench->maxDepth >= 10));
+}
+
+
+/************************************************************************/
+/*>void BenchUsage(void)
+   ---------------------
+*//**
+   Prints a usage message
+
+-  17.10.26  Original   By: agent
+*/
+void BenchUsage(void)
+{
+   fprintf(stderr,"\n%s V1.0 (c) 2026 agent\n", BENCHNAME);
+   fprintf(stderr,"\n");
+   fprintf(stderr,"Usage:   %s [-p submitters] [-n jobs] [-j slots] \
+[-d maxdepth] [-R]\n", BENCHNAME);
+   fprintf(stderr,"                   [-s simq] [-k] [-v]\n");
+   fprintf(stderr,"         -p   Number of submitters running at once \
+[%d]\n", DEF_SUBMITTERS);
+   fprintf(stderr,"         -n   Jobs submitted by each submitter \
+[%d]\n", DEF_BENCHJOBS);
+   fprintf(stderr,"         -j   Slots given to the runner [%d]\n",
+           DEF_BENCHSLOTS);
+   fprintf(stderr,"         -d   Deepest queue to list [%d]\n",
+           DEF_MAXDEPTH);
+   fprintf(stderr,"         -R   Run the runner with -R\n");
+   fprintf(stderr,"         -s   The simq program [./simq]\n");
+   fprintf(stderr,"         -k   Keep the temporary queues\n");
+   fprintf(stderr,"         -v   Show the runner's messages\n");
+   fprintf(stderr,"\n");
+   fprintf(stderr,"Measures the time taken to submit jobs, the time \
+until the runner starts\n");
+   fprintf(stderr,"them, and the cost of listing the queue at a range \
+of depths.\n");
+   fprintf(stderr,"Checks that no job is lost or run twice.\n");
+}
+
+
+/************************************************************************/
+/*>int StandInJob(int argc, char **argv)
+   -------------------------------------
+*//**
+   \param[in]   argc    Argument count
+   \param[in]   argv    Arguments
+   \return              Exit status
+
+   The job run by the runner. With -x stampfile index it adds a line
+   giving the index and the time it started to the stamp file, with a
+   single write so that lines from jobs running at once are not mixed.
+   With -w it waits until the runner that started it goes away, to
+   keep a slot busy.
+
+-  17.10.26  Original   By: agent
+*/
+int StandInJob(int argc, char **argv)
+{
+   char line[MAXBUFF];
+   int  fh,
+        len;
+
+   if(!strcmp(argv[1], "-w"))
+   {
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      while(getppid() != 1)
+         pause();
+      return(0);
+   }
+
+   if((argc != 4) ||
+      ((fh = open(argv[2], O_WRONLY|O_APPEND|O_CREAT, 0644)) < 0))
+      return(1);
+   len = sprintf(line, "%s %.6f\n", argv[3], Now());
+   if(write(fh, line, len) != len)
+      return(1);
+   close(fh);
+   return(0);
+}
+
+
+/************************************************************************/
+/*>double Now(void)
+   ----------------
+*//**
+   \return     Monotonic time in seconds
+
+   The monotonic clock is shared by all processes, so times taken by
+   the submitters and the jobs can be compared.
+
+-  17.10.26  Original   By: agent
+*/
+double Now(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return((double)now.tv_sec + now.tv_nsec / 1.0e9);
+}
+
+
+/************************************************************************/
+/*>void Percentiles(double *values, int nValues, double *p50,
+                    double *p99, double *max)
+   ------------------------------------------------------------
+*//**
+   \param[in,out] values    Values (sorted on return)
+   \param[in]     nValues   Number of values
+   \param[out]    p50       Median
+   \param[out]    p99       99th percentile
+   \param[out]    max       Largest
+
+-  17.10.26  Original   By: agent
+*/
+void Percentiles(double *values, int nValues, double *p50, double *p99,
+                 double *max)
+{
+   *p50 = *p99 = *max = 0.0;
+   if(nValues <= 0)
+      return;
+
+   qsort(values, nValues, sizeof(double), CompareDoubles);
+   *p50 = values[(nValues - 1) * 50 / 100];
+   *p99 = values[(nValues - 1) * 99 / 100];
+   *max = values[nValues - 1];
+}
+
+
+/************************************************************************/
+/*>void PrintLatency(char *title, double *values, int nValues)
+   -----------------------------------------------------------
+*//**
+   \param[in]     title     What was measured
+   \param[in,out] values    Latencies (s). Sorted on return
+   \param[in]     nValues   Number of latencies
+
+   Prints the median, 99th percentile and largest latency in ms
+
+-  17.10.26  Original   By: agent
+*/
+void PrintLatency(char *title, double *values, int nValues)
+{
+   double p50, p99, max;
+
+   Percentiles(values, nValues, &p50, &p99, &max);
+   printf("   %-24s p50 %9.3f  p99 %9.3f  max %9.3f\n", title,
+          p50 * 1000.0, p99 * 1000.0, max * 1000.0);
+}
+
+
+/************************************************************************/
+/*>void Submit(BENCH *bench, char *queueDir, BOOL stamp,
+               double *submitted, double *latency, int *jobIDs)
+   -------------------------------------------------------------
+*//**
+   \param[in]   bench       Benchmark settings
+   \param[in]   queueDir    Queue directory
+   \param[in]   stamp       Submit the stand-in job rather than 'true'
+   \param[out]  submitted   When each job was submitted
+   \param[out]  latency     Time taken by QueueJob() for each job
+   \param[out]  jobIDs      ID of each job (-1 if not queued)
+
+   Runs the submitters, each in its own process, and waits for them all
+   to finish. The output arrays must be in shared memory, as the
+   submitters fill in their own part of them.
+
+-  17.10.26  Original   By: agent
+*/
+void Submit(BENCH *bench, char *queueDir, BOOL stamp, double *submitted,
+            double *latency, int *jobIDs)
+{
+   int   s;
+   pid_t pid;
+
+   for(s=0; s<bench->nSubmitters; s++)
+   {
+      if((pid = fork()) == 0)
+      {
+         JOBINFO job;
+         char    stampFile[MAXBUFF],
+                 index[16],
+                 *args[4];
+         int     nArgs,
+                 nWaiting,
+                 i;
+
+         memset(&job, 0, sizeof(JOBINFO));
+         job.uid = getuid();
+         if(getcwd(job.pwd, MAXBUFF) == NULL)
+            strcpy(job.pwd, "/");
+
+         sprintf(stampFile, "%s/%s", bench->tmpDir, STAMPFILE);
+         if(stamp)
+         {
+            args[0] = bench->self;
+            args[1] = "-x";
+            args[2] = stampFile;
+            args[3] = index;
+            nArgs   = 4;
+         }
+         else
+         {
+            args[0] = "true";
+            nArgs   = 1;
+         }
+
+         for(i=s*bench->nJobs; i<(s+1)*bench->nJobs; i++)
+         {
+            sprintf(index, "%d", i);
+            submitted[i] = Now();
+            jobIDs[i]    = QueueJob(queueDir, args, nArgs, &job,
+                                    &nWaiting);
+            latency[i]   = Now() - submitted[i];
+         }
+         _exit(0);
+      }
+      else if(pid < 0)
+      {
+         Message(BENCHNAME, MSG_FATAL, "Cannot start submitter");
+      }
+   }
+
+   for(s=0; s<bench->nSubmitters; s++)
+      wait(NULL);
+}
+
+
+/************************************************************************/
+/*>void BenchSubmit(BENCH *bench)
+   ------------------------------
+*//**
+   \param[in]   bench    Benchmark settings
+
+   Times QueueJob() with no runner and checks the job files against
+   the job IDs that were returned.
+
+-  17.10.26  Original   By: agent
+*/
+void BenchSubmit(BENCH *bench)
+{
+   char   queueDir[MAXBUFF];
+   int    nTotal = bench->nSubmitters * bench->nJobs,
+          *jobIDs,
+          *fileIDs = NULL,
+          nFiles,
+          nFailed = 0,
+          nDups   = 0,
+          nLost   = 0,
+          i,
+          j;
+   double *submitted,
+          *latency,
+          start,
+          elapsed;
+
+   sprintf(queueDir, "%s/submit", bench->tmpDir);
+   MakeDirectory(queueDir);
+
+   submitted = (double *)mmap(NULL, nTotal * sizeof(double),
+                              PROT_READ|PROT_WRITE,
+                              MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+   latency   = (double *)mmap(NULL, nTotal * sizeof(double),
+                              PROT_READ|PROT_WRITE,
+                              MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+   jobIDs    = (int *)mmap(NULL, nTotal * sizeof(int),
+                           PROT_READ|PROT_WRITE,
+                           MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+   if((submitted == MAP_FAILED) || (latency == MAP_FAILED) ||
+      (jobIDs == MAP_FAILED))
+   {
+      Message(BENCHNAME, MSG_FATAL, "No memory for results");
+   }
+
+   start = Now();
+   Submit(bench, queueDir, FALSE, submitted, latency, jobIDs);
+   elapsed = Now() - start;
+
+   /* Every ID returned must be unique and have a job file              */
+   qsort(jobIDs, nTotal, sizeof(int), CompareInts);
+   nFiles = ListJobFiles(queueDir, &fileIDs);
+   for(i=0, j=0; i<nTotal; i++)
+   {
+      if(jobIDs[i] < 0)
+      {
+         nFailed++;
+         continue;
+      }
+      if((i > 0) && (jobIDs[i] == jobIDs[i-1]))
+      {
+         nDups++;
+         continue;
+      }
+      while((j < nFiles) && (fileIDs[j] < jobIDs[i]))
+         j++;
+      if((j == nFiles) || (fileIDs[j] != jobIDs[i]))
+         nLost++;
+   }
+
+   printf("Submit (QueueJob() with no runner)\n");
+   printf("   %d jobs in %.2fs (%.0f jobs/s)\n", nTotal, elapsed,
+          nTotal / elapsed);
+   PrintLatency("QueueJob() (ms)", latency, nTotal);
+   printf("   Job IDs: %d failed, %d lost, %d duplicated, %d files for \
+%d jobs\n\n", nFailed, nLost, nDups, nFiles, nTotal);
+   fflush(stdout);
+
+   if(fileIDs != NULL)
+      free(fileIDs);
+   munmap(submitted, nTotal * sizeof(double));
+   munmap(latency,   nTotal * sizeof(double));
+   munmap(jobIDs,    nTotal * sizeof(int));
+}
+
+
+/************************************************************************/
+/*>void BenchDispatch(BENCH *bench)
+   --------------------------------
+*//**
+   \param[in]   bench    Benchmark settings
+
+   Submits stand-in jobs to a running runner and times how long each
+   takes to start. Checks that every job ran exactly once.
+
+-  17.10.26  Original   By: agent
+*/
+void BenchDispatch(BENCH *bench)
+{
+   char   queueDir[MAXBUFF],
+          stampFile[MAXBUFF],
+          line[MAXBUFF];
+   int    nTotal = bench->nSubmitters * bench->nJobs,
+          *jobIDs,
+          *nRuns,
+          nStarted = 0,
+          nLost    = 0,
+          nDups    = 0,
+          i;
+   double *submitted,
+          *latency,
+          *dispatch,
+          lastStart,
+          start,
+          elapsed;
+   pid_t  runner;
+   FILE   *fp;
+   long   offset = 0;
+
+   sprintf(queueDir,  "%s/dispatch", bench->tmpDir);
+   sprintf(stampFile, "%s/%s", bench->tmpDir, STAMPFILE);
+   MakeDirectory(queueDir);
+
+   submitted = (double *)mmap(NULL, nTotal * sizeof(double),
+                              PROT_READ|PROT_WRITE,
+                              MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+   latency   = (double *)mmap(NULL, nTotal * sizeof(double),
+                              PROT_READ|PROT_WRITE,
+                              MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+   jobIDs    = (int *)mmap(NULL, nTotal * sizeof(int),
+                           PROT_READ|PROT_WRITE,
+                           MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+   dispatch  = (double *)malloc(nTotal * sizeof(double));
+   nRuns     = (int *)calloc(nTotal, sizeof(int));
+   if((submitted == MAP_FAILED) || (latency == MAP_FAILED) ||
+      (jobIDs == MAP_FAILED) || (dispatch == NULL) || (nRuns == NULL))
+   {
+      Message(BENCHNAME, MSG_FATAL, "No memory for results");
+   }
+
+   runner = StartRunner(bench, queueDir, bench->nSlots);
+   if(!WaitForSnapshot(queueDir, 0, 0))
+   {
+      StopRunner(runner);
+      Message(BENCHNAME, MSG_FATAL, "The runner did not start");
+   }
+
+   start = Now();
+   Submit(bench, queueDir, TRUE, submitted, latency, jobIDs);
+
+   /* Collect the stamps until every job has started or none have for
+      IDLETIMEOUT seconds
+   */
+   lastStart = Now();
+   while((nStarted < nTotal) && (Now() - lastStart < IDLETIMEOUT))
+   {
+      if((fp = fopen(stampFile, "r")) != NULL)
+      {
+         fseek(fp, offset, SEEK_SET);
+         while(fgets(line, MAXBUFF, fp) && (line[strlen(line)-1] == '\n'))
+         {
+            double when;
+
+            offset = ftell(fp);
+            if((sscanf(line, "%d %lf", &i, &when) == 2) &&
+               (i >= 0) && (i < nTotal))
+            {
+               if(nRuns[i]++)
+               {
+                  nDups++;
+               }
+               else
+               {
+                  dispatch[nStarted++] = when - submitted[i];
+                  lastStart = Now();
+               }
+            }
+         }
+         fclose(fp);
+      }
+      if(nStarted < nTotal)
+         usleep(10000);
+   }
+   elapsed = lastStart - start;
+   StopRunner(runner);
+
+   for(i=0; i<nTotal; i++)
+   {
+      if((jobIDs[i] >= 0) && !nRuns[i])
+         nLost++;
+   }
+
+   printf("Submit to dispatch (runner with %d slots%s)\n",
+          bench->nSlots, (bench->useRing ? " and -R" : ""));
+   printf("   %d jobs started in %.2fs (%.0f jobs/s)\n", nStarted,
+          elapsed, (elapsed > 0.0) ? nStarted / elapsed : 0.0);
+   PrintLatency("QueueJob() (ms)", latency, nTotal);
+   PrintLatency("Submit to start (ms)", dispatch, nStarted);
+   printf("   Jobs: %d lost, %d run more than once\n\n", nLost, nDups);
+   fflush(stdout);
+
+   free(dispatch);
+   free(nRuns);
+   munmap(submitted, nTotal * sizeof(double));
+   munmap(latency,   nTotal * sizeof(double));
+   munmap(jobIDs,    nTotal * sizeof(int));
+}
+
+
+/************************************************************************/
+/*>void BenchListing(BENCH *bench)
+   -------------------------------
+*//**
+   \param[in]   bench    Benchmark settings
+
+   Times -l, -l -v and -i at depths of 10, 100, ... up to maxDepth
+   jobs. Each is timed reading the queue directory with no runner, and
+   then with a runner that is kept busy by a waiting stand-in job so
+   that the queue stays full. -i is asked about a job that is not in
+   the queue, which costs the same as each of its updates.
+
+-  17.10.26  Original   By: agent
+*/
+void BenchListing(BENCH *bench)
+{
+   int depth;
+
+   printf("Listing (ms per call)     depth        -l     -l -v        \
+-i\n");
+   fflush(stdout);
+
+   for(depth=10; depth<=bench->maxDepth; depth*=10)
+   {
+      char    queueDir[MAXBUFF],
+              *args[2];
+      JOBINFO job;
+      int     nWaiting;
+      pid_t   runner;
+
+      sprintf(queueDir, "%s/list%d", bench->tmpDir, depth);
+      MakeDirectory(queueDir);
+      if(FillQueue(queueDir, depth) != depth)
+      {
+         Message(BENCHNAME, MSG_ERROR, "Cannot fill the queue");
+         return;
+      }
+
+      printf("   Queue directory   %9d %9.3f %9.3f %9.3f\n", depth,
+             TimeListing(queueDir, 0, 0), TimeListing(queueDir, 1, 0),
+             TimeListing(queueDir, 2, 2*depth));
+      fflush(stdout);
+
+      /* The stand-in job has the highest priority so it takes the
+         only slot
+      */
+      memset(&job, 0, sizeof(JOBINFO));
+      job.uid      = getuid();
+      job.priority = MAXPRIORITY;
+      strcpy(job.pwd, "/");
+      args[0] = bench->self;
+      args[1] = "-w";
+      if(QueueJob(queueDir, args, 2, &job, &nWaiting) < 0)
+      {
+         Message(BENCHNAME, MSG_ERROR, "Cannot queue the waiting job");
+         return;
+      }
+
+      runner = StartRunner(bench, queueDir, 1);
+      if(WaitForSnapshot(queueDir, depth + 1, 1))
+      {
+         printf("   Runner snapshot   %9d %9.3f %9.3f %9.3f\n", depth,
+                TimeListing(queueDir, 0, 0),
+                TimeListing(queueDir, 1, 0),
+                TimeListing(queueDir, 2, 2*depth));
+      }
+      else
+      {
+         printf("   Runner snapshot   %9d (runner did not load the \
+queue)\n", depth);
+      }
+      fflush(stdout);
+      StopRunner(runner);
+
+      if(!bench->keep)
+         RemoveTree(queueDir);
+   }
+}
+
+
+/************************************************************************/
+/*>pid_t StartRunner(BENCH *bench, char *queueDir, int nSlots)
+   -----------------------------------------------------------
+*//**
+   \param[in]   bench      Benchmark settings
+   \param[in]   queueDir   Queue directory
+   \param[in]   nSlots     Slots for the runner
+   \return                 Process ID of the runner
+
+   Starts simq -run on a queue. Its messages are discarded unless -v
+   was given.
+
+-  17.10.26  Original   By: agent
+*/
+pid_t StartRunner(BENCH *bench, char *queueDir, int nSlots)
+{
+   pid_t pid;
+   char  slots[16],
+         verbose[16],
+         *args[12];
+   int   nArgs = 0;
+
+   sprintf(slots, "%d", nSlots);
+   strcpy(verbose, "-vvv");
+   verbose[(bench->verbose > 3) ? 4 : bench->verbose + 1] = '\0';
+
+   args[nArgs++] = bench->simq;
+   args[nArgs++] = "-j";
+   args[nArgs++] = slots;
+   args[nArgs++] = "-p";
+   args[nArgs++] = "1";
+   if(bench->useRing)
+      args[nArgs++] = "-R";
+   if(bench->verbose)
+      args[nArgs++] = verbose;
+   args[nArgs++] = "-run";
+   args[nArgs++] = queueDir;
+   args[nArgs]   = NULL;
+
+   if((pid = fork()) == 0)
+   {
+      int fh;
+
+      if(!bench->verbose && ((fh = open("/dev/null", O_WRONLY)) >= 0))
+      {
+         dup2(fh, 2);
+         close(fh);
+      }
+      execv(bench->simq, args);
+      _exit(127);
+   }
+   else if(pid < 0)
+   {
+      Message(BENCHNAME, MSG_FATAL, "Cannot start the runner");
+   }
+   return(pid);
+}
+
+
+/************************************************************************/
+/*>void StopRunner(pid_t pid)
+   --------------------------
+*//**
+   \param[in]   pid    Process ID of the runner
+
+   Stops a runner. Any waiting stand-in job goes with it.
+
+-  17.10.26  Original   By: agent
+*/
+void StopRunner(pid_t pid)
+{
+   kill(pid, SIGTERM);
+   waitpid(pid, NULL, 0);
+}
+
+
+/************************************************************************/
+/*>BOOL WaitForSnapshot(char *queueDir, int nJobs, int nRunning)
+   -------------------------------------------------------------
+*//**
+   \param[in]   queueDir    Queue directory
+   \param[in]   nJobs       Jobs the snapshot should hold
+   \param[in]   nRunning    How many of those should be running
+   \return                  Did the snapshot reach that state?
+
+   Waits for a runner to publish a snapshot of the queue with the given
+   numbers of jobs.
+
+-  17.10.26  Original   By: agent
+*/
+BOOL WaitForSnapshot(char *queueDir, int nJobs, int nRunning)
+{
+   double lastChange = Now();
+   int    lastJobs   = (-1);
+
+   while(Now() - lastChange < IDLETIMEOUT)
+   {
+      SNAPSHOT *snapshot;
+      SNAPJOB  *jobs;
+      size_t   size;
+      int      nSnapJobs,
+               nSnapRunning,
+               version;
+
+      if((snapshot = MapSnapshot(queueDir, &size)) != NULL)
+      {
+         nSnapJobs = (-1);
+         if(RunnerAlive(snapshot) && !snapshot->moved &&
+            ((nSnapJobs = CopySnapshot(snapshot, &jobs, &nSnapRunning,
+                                       &version)) >= 0) &&
+            (jobs != NULL))
+         {
+            free(jobs);
+         }
+         munmap(snapshot, size);
+
+         if((nSnapJobs == nJobs) && (nSnapRunning == nRunning))
+            return(TRUE);
+         if(nSnapJobs != lastJobs)
+         {
+            lastJobs   = nSnapJobs;
+            lastChange = Now();
+         }
+      }
+      usleep(10000);
+   }
+   return(FALSE);
+}
+
+
+/************************************************************************/
+/*>double TimeListing(char *queueDir, int what, int jobID)
+   -------------------------------------------------------
+*//**
+   \param[in]   queueDir   Queue directory
+   \param[in]   what       0: -l, 1: -l -v, 2: -i
+   \param[in]   jobID      Job for -i
+   \return                 Mean time (ms) per call
+
+   Times a listing as simq would do it, repeating it for at least
+   MINTIMING seconds. Its output is discarded.
+
+-  17.10.26  Original   By: agent
+*/
+double TimeListing(char *queueDir, int what, int jobID)
+{
+   int    savedStdout,
+          devNull,
+          nCalls = 0;
+   double start,
+          elapsed;
+
+   fflush(stdout);
+   savedStdout = dup(1);
+   if((devNull = open("/dev/null", O_WRONLY)) >= 0)
+   {
+      dup2(devNull, 1);
+      close(devNull);
+   }
+
+   start = Now();
+   do
+   {
+      switch(what)
+      {
+      case 0:
+         ListJobs(queueDir, 0);
+         break;
+      case 1:
+         ListJobs(queueDir, 1);
+         break;
+      default:
+         if(!CountdownFromSnapshot(queueDir, jobID, 1) &&
+            !CountdownViaDaemon(queueDir, jobID))
+         {
+            CountdownJob(queueDir, jobID, 1);
+         }
+         break;
+      }
+      fflush(stdout);
+      nCalls++;
+      elapsed = Now() - start;
+   }  while((elapsed < MINTIMING) && (nCalls < MAXREPEATS));
+
+   dup2(savedStdout, 1);
+   close(savedStdout);
+   return(1000.0 * elapsed / nCalls);
+}
+
+
+/************************************************************************/
+/*>int FillQueue(char *queueDir, int nJobs)
+   ----------------------------------------
+*//**
+   \param[in]   queueDir   Queue directory
+   \param[in]   nJobs      Number of jobs
+   \return                 Number of jobs queued
+
+   Fills a queue with jobs that do nothing, in batches through
+   QueueJobs()
+
+-  17.10.26  Original   By: agent
+*/
+int FillQueue(char *queueDir, int nJobs)
+{
+   JOBINFO job;
+   char    *cmds[1000];
+   int     jobIDs[1000],
+           nQueued = 0,
+           nWaiting,
+           i;
+
+   memset(&job, 0, sizeof(JOBINFO));
+   job.uid = getuid();
+   strcpy(job.pwd, "/");
+   for(i=0; i<1000; i++)
+      cmds[i] = "true";
+
+   while(nQueued < nJobs)
+   {
+      int nBatch = ((nJobs - nQueued) < 1000) ? (nJobs - nQueued) : 1000,
+          nDone;
+
+      if((nDone = QueueJobs(queueDir, cmds, nBatch, &job, jobIDs,
+                            &nWaiting)) <= 0)
+         break;
+      nQueued += nDone;
+   }
+   return(nQueued);
+}
+
+
+/************************************************************************/
+/*>void RemoveTree(char *dir)
+   --------------------------
+*//**
+   \param[in]   dir     Directory
+
+   Removes a directory and everything in it
+
+-  17.10.26  Original   By: agent
+*/
+void RemoveTree(char *dir)
+{
+   struct dirent *dirp;
+   DIR           *dp;
+
+   if((dp = opendir(dir)) != NULL)
+   {
+      while((dirp = readdir(dp)) != NULL)
+      {
+         char        path[MAXBUFF+NAME_MAX];
+         struct stat statBuf;
+
+         if(!strcmp(dirp->d_name, ".") || !strcmp(dirp->d_name, ".."))
+            continue;
+         sprintf(path, "%s/%s", dir, dirp->d_name);
+         if((lstat(path, &statBuf) == 0) && S_ISDIR(statBuf.st_mode))
+            RemoveTree(path);
+         else
+            unlink(path);
+      }
+      closedir(dp);
+   }
+   rmdir(dir);
+}
+
+
+/************************************************************************/
+/*>int CompareDoubles(const void *a, const void *b)
+   ------------------------------------------------
+*//**
+   qsort() comparison of doubles
+
+-  17.10.26  Original   By: agent
+*/
+int CompareDoubles(const void *a, const void *b)
+{
+   double da = *(const double *)a,
+          db = *(const double *)b;
+
+   return((da < db) ? (-1) : ((da > db) ? 1 : 0));
+}
+